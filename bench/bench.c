@@ -0,0 +1,233 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * bench.c - Helpers shared by the benchmark programs
+ *
+ * Each benchmark brackets a loop with bench_begin()/bench_end() and
+ * prints the per-operation averages. The counters are process wide,
+ * so the cost of sampling them is measured once and subtracted.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+// System headers
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+// Local headers
+#include "bench.h"
+
+static struct bench_sample overhead;
+static bool have_overhead;
+
+/* -------------------------------------------------------------------------- */
+
+static void bench_read_counters(struct bench_sample *s) {
+	struct timespec ts;
+	struct rusage ru;
+	char line[128];
+	FILE *fp;
+
+	s->bytes = 0;
+	s->syscalls = 0;
+	fp = fopen("/proc/self/io", "r");
+	if (fp) {
+		while (fgets(line, sizeof(line), fp)) {
+			unsigned long long v;
+			if (sscanf(line, "rchar: %llu", &v) == 1)
+				s->bytes = v;
+			else if (sscanf(line, "syscr: %llu", &v) == 1)
+				s->syscalls += v;
+			else if (sscanf(line, "syscw: %llu", &v) == 1)
+				s->syscalls += v;
+		}
+		fclose(fp);
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	s->faults = (uint64_t)ru.ru_minflt + (uint64_t)ru.ru_majflt;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	s->ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_diff(const struct bench_sample *a, const struct bench_sample *b,
+    struct bench_sample *delta) {
+	delta->ns = b->ns - a->ns;
+	delta->bytes = b->bytes - a->bytes;
+	delta->syscalls = b->syscalls - a->syscalls;
+	delta->faults = b->faults - a->faults;
+}
+
+static uint64_t bench_sub(uint64_t v, uint64_t cost) {
+	return v > cost ? v - cost : 0;
+}
+
+void bench_begin(struct bench_sample *start) {
+	if (!have_overhead) {
+		struct bench_sample a, b;
+		bench_read_counters(&a);
+		bench_read_counters(&b);
+		bench_diff(&a, &b, &overhead);
+		overhead.ns = 0; /* the clock is read last, nothing to subtract */
+		have_overhead = true;
+	}
+	bench_read_counters(start);
+}
+
+void bench_end(const struct bench_sample *start, struct bench_sample *delta) {
+	struct bench_sample now;
+
+	bench_read_counters(&now);
+	bench_diff(start, &now, delta);
+	delta->bytes = bench_sub(delta->bytes, overhead.bytes);
+	delta->syscalls = bench_sub(delta->syscalls, overhead.syscalls);
+	delta->faults = bench_sub(delta->faults, overhead.faults);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void bench_print_header(void) {
+	printf("%-24s %-6s %12s %12s %10s %10s\n", "name", "mode", "ns/op", "bytes/op", "sysc/op",
+	    "faults/op");
+}
+
+void bench_print_row(
+    const char *name, const char *mode, const struct bench_sample *delta, size_t ops) {
+	if (ops == 0)
+		ops = 1;
+	printf("%-24s %-6s %12llu %12llu %10.1f %10.1f\n", name, mode,
+	    (unsigned long long)(delta->ns / ops), (unsigned long long)(delta->bytes / ops),
+	    (double)delta->syscalls / (double)ops, (double)delta->faults / (double)ops);
+	fflush(stdout);
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t bench_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int bench_compare_ns(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t bench_percentile(const uint64_t *sorted, size_t count, int percent) {
+	return sorted[(count - 1) * (size_t)percent / 100];
+}
+
+void bench_print_latency_header(void) {
+	printf("%-24s %9s %12s %10s %10s %10s\n", "name", "rows", "ops/s", "p50 us", "p95 us",
+	    "p99 us");
+}
+
+/* rows is the size of the library, total_ns the wall time of all count operations */
+void bench_print_latency(
+    const char *name, size_t rows, uint64_t *ns, size_t count, uint64_t total_ns) {
+	if (count == 0)
+		return;
+	qsort(ns, count, sizeof(*ns), bench_compare_ns);
+	printf("%-24s %9zu %12.1f %10.1f %10.1f %10.1f\n", name, rows,
+	    total_ns ? (double)count * 1e9 / (double)total_ns : 0.0,
+	    (double)bench_percentile(ns, count, 50) / 1e3,
+	    (double)bench_percentile(ns, count, 95) / 1e3,
+	    (double)bench_percentile(ns, count, 99) / 1e3);
+	fflush(stdout);
+}
+
+/* Start VmHWM over from the current RSS, Linux 4.0 and later */
+bool bench_reset_peak_rss(void) {
+	FILE *fp = fopen("/proc/self/clear_refs", "w");
+	bool ok;
+
+	if (!fp)
+		return false;
+	ok = fputs("5", fp) >= 0;
+	return fclose(fp) == 0 && ok;
+}
+
+/* Peak resident set size in kB, -1 when /proc is not there */
+long bench_peak_rss_kb(void) {
+	char line[128];
+	long kb = -1;
+	FILE *fp = fopen("/proc/self/status", "r");
+
+	if (!fp)
+		return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+			break;
+	}
+	fclose(fp);
+	return kb;
+}
+
+/* -------------------------------------------------------------------------- */
+
+bool bench_make_tempdir(char *dir, size_t size) {
+	const char *tmp = getenv("TMPDIR");
+
+	snprintf(dir, size, "%s/glaciera-bench-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return false;
+	}
+	return true;
+}
+
+/* Benchmarks keep their files in one flat directory */
+void bench_remove_dir(const char *dir) {
+	char path[1024];
+	struct dirent *de;
+	DIR *d = opendir(dir);
+
+	if (!d)
+		return;
+	while ((de = readdir(d))) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		unlink(path);
+	}
+	closedir(d);
+	rmdir(dir);
+}
+
+/*
+ * Files are synced right away, so bench_drop_cache() can evict them.
+ * POSIX_FADV_DONTNEED leaves dirty pages alone.
+ */
+bool bench_write_file(const char *path, const void *data, size_t len) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool ok;
+
+	if (fd == -1) {
+		perror(path);
+		return false;
+	}
+	ok = write(fd, data, len) == (ssize_t)len;
+	fdatasync(fd);
+	close(fd);
+	return ok;
+}
+
+void bench_drop_cache(const char *path) {
+	int fd = open(path, O_RDONLY);
+
+	if (fd == -1)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+// System headers
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Process counters sampled around a benchmark loop.
+ * bytes and syscalls come from /proc/self/io (rchar, syscr + syscw),
+ * so they cover read/write style calls only: a parser that mmap()s
+ * its file shows up under faults (from getrusage()) instead.
+ */
+struct bench_sample {
+	uint64_t ns;
+	uint64_t bytes;
+	uint64_t syscalls;
+	uint64_t faults;
+};
+
+void bench_begin(struct bench_sample *start);
+void bench_end(const struct bench_sample *start, struct bench_sample *delta);
+void bench_print_header(void);
+void bench_print_row(
+    const char *name, const char *mode, const struct bench_sample *delta, size_t ops);
+
+/* Per-operation latencies, sorted in place to print p50/p95/p99 */
+uint64_t bench_now_ns(void);
+void bench_print_latency_header(void);
+void bench_print_latency(
+    const char *name, size_t rows, uint64_t *ns, size_t count, uint64_t total_ns);
+bool bench_reset_peak_rss(void);
+long bench_peak_rss_kb(void);
+
+bool bench_make_tempdir(char *dir, size_t size);
+void bench_remove_dir(const char *dir);
+bool bench_write_file(const char *path, const void *data, size_t len);
+void bench_drop_cache(const char *path);
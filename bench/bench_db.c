@@ -0,0 +1,363 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * bench_db.c - Database benchmark on synthetic libraries
+ *
+ * Builds libraries of the given sizes in a temporary directory through
+ * the db.c API, with the statements glaciera-indexer and glaciera run,
+ * and prints the latency of each operation as p50/p95/p99 next to the
+ * operations per second:
+ *
+ *   insert/autocommit   db_insert_track() outside a transaction
+ *   insert/batched      the same in transactions of COMMIT_EVERY rows
+ *   upsert/rescan       the indexer's exists, fetch and update of a path
+ *   load/all            db_get_all_tracks(), and the peak RSS it takes
+ *   lookup/path, /id    db_get_track_by_filepath(), db_get_track_by_id()
+ *   search/short, /long db_search_tracks() with 2 and 15 or so characters
+ *
+ * Paths, tags and the order of the lookups are functions of the row
+ * number, and the SQLite settings are the defaults of config.c rather
+ * than the user's, so runs before and after a change are comparable.
+ *
+ * usage: bench-db [-n rows,...] [-a autocommit rows] [-l lookups]
+ *                 [-s searches] [-r loads]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+// System headers
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Local headers
+#include "bench.h"
+#include "config.h"
+#include "db.h"
+#include "music.h"
+
+#define TRACKS_PER_ALBUM 10
+#define ALBUMS_PER_ARTIST 10
+#define COMMIT_EVERY 512 /* as INDEXER_COMMIT_EVERY in glaciera-indexer.c */
+#define MAX_UPSERTS 100000
+
+struct bench_track {
+	char path[256];
+	char display[256];
+	char search[256];
+	struct tuneinfo ti;
+};
+
+static const char *words[] = {
+	"Amber", "Black", "Cold", "Dawn", "Echo", "Fire", "Ghost", "Harbor", "Iron", "Jade",
+	"Kings", "Light", "Moon", "Night", "Ocean", "Paper", "Quiet", "River", "Silver", "Thunder",
+	"Under", "Velvet", "Winter", "Yellow", "Zero", "Atlas", "Bloom", "Crystal", "Desert",
+	"Ember", "Forest", "Glass",
+};
+
+#define WORD_COUNT (sizeof(words) / sizeof(words[0]))
+
+static config_t config;
+static unsigned int picks;
+
+/* -------------------------------------------------------------------------- */
+
+/* A 32 bit integer hash, the library is a function of the row number */
+static unsigned int mix(unsigned int x) {
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+static const char *word(unsigned int key, unsigned int salt) {
+	return words[mix(key * 8 + salt) % WORD_COUNT];
+}
+
+/* The same sequence of rows in every run */
+static size_t pick(size_t rows) {
+	return mix(++picks) % rows;
+}
+
+/* Row i, changed gives the tags a rescan would find after a retag */
+static void make_track(size_t i, bool changed, struct bench_track *t) {
+	unsigned int album = (unsigned int)(i / TRACKS_PER_ALBUM);
+	unsigned int artist = album / ALBUMS_PER_ARTIST;
+	unsigned int number = (unsigned int)(i % TRACKS_PER_ALBUM) + 1;
+	char *p;
+
+	snprintf(t->path, sizeof(t->path), "/music/%s %s %u/%s %s %u/%02u - %s %s.mp3",
+	    word(artist, 0), word(artist, 1), artist, word(album, 2), word(album, 3), album, number,
+	    word((unsigned int)i, 4), word((unsigned int)i, 5));
+	snprintf(t->display, sizeof(t->display), "%s %s - %s %s - %02u %s %s%s", word(artist, 0),
+	    word(artist, 1), word(album, 2), word(album, 3), number, word((unsigned int)i, 4),
+	    word((unsigned int)i, 5), changed ? " (Remastered)" : "");
+	snprintf(t->search, sizeof(t->search), "%s", t->display);
+	for (p = t->search; *p; p++)
+		*p = (char)tolower((unsigned char)*p);
+
+	t->ti.filesize = 2000000 + (int)(mix((unsigned int)i) % 8000000);
+	t->ti.filedate = 1600000000 + (time_t)(mix((unsigned int)i * 3) % 100000000);
+	t->ti.duration = (short)(120 + mix((unsigned int)i * 5) % 400);
+	t->ti.bitrate = 320;
+	t->ti.genre = (unsigned char)(mix(album) % 148);
+	t->ti.rating = 0;
+	t->ti.format = MUSIC_FORMAT_MP3;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static bool insert_rows(const char *name, size_t from, size_t to, size_t rows, bool batched) {
+	struct bench_track t;
+	uint64_t *ns = malloc((to - from + 1) * sizeof(*ns));
+	uint64_t start = bench_now_ns();
+	bool ok = ns != NULL;
+
+	for (size_t i = from; ok && i < to; i++) {
+		uint64_t begin;
+
+		make_track(i, false, &t);
+		begin = bench_now_ns();
+		if (batched && (i - from) % COMMIT_EVERY == 0)
+			ok = db_begin_transaction();
+		ok = ok && db_insert_track(t.path, t.display, t.search, &t.ti);
+		if (batched && ok && ((i - from) % COMMIT_EVERY == COMMIT_EVERY - 1 || i + 1 == to))
+			ok = db_commit_transaction();
+		ns[i - from] = bench_now_ns() - begin;
+	}
+	if (ok)
+		bench_print_latency(name, rows, ns, to - from, bench_now_ns() - start);
+	free(ns);
+	return ok;
+}
+
+/* What glaciera-indexer does for a file it has seen before, see process_one_file() */
+static bool upsert_rows(size_t rows) {
+	size_t count = rows < MAX_UPSERTS ? rows : MAX_UPSERTS;
+	uint64_t *ns = malloc(count * sizeof(*ns));
+	uint64_t start = bench_now_ns();
+	struct bench_track t;
+	bool ok = ns != NULL;
+
+	for (size_t n = 0; ok && n < count; n++) {
+		size_t i = pick(rows);
+		struct db_track *existing;
+		uint64_t begin;
+
+		/* Every other file was retagged */
+		make_track(i, n % 2, &t);
+		begin = bench_now_ns();
+		if (n % COMMIT_EVERY == 0)
+			ok = db_begin_transaction();
+		if (ok && db_track_exists(t.path)) {
+			existing = db_get_track_by_filepath(t.path);
+			if (existing && strcmp(existing->display_name, t.display) != 0)
+				ok = db_update_track(
+				    existing->id, t.path, t.display, t.search, &t.ti);
+			db_free_track(existing);
+		}
+		if (ok && (n % COMMIT_EVERY == COMMIT_EVERY - 1 || n + 1 == count))
+			ok = db_commit_transaction();
+		ns[n] = bench_now_ns() - begin;
+	}
+	if (ok)
+		bench_print_latency("upsert/rescan", rows, ns, count, bench_now_ns() - start);
+	free(ns);
+	return ok;
+}
+
+static bool lookup_rows(size_t rows, size_t count, bool by_path) {
+	uint64_t *ns = malloc(count * sizeof(*ns));
+	uint64_t start = bench_now_ns();
+	struct bench_track t;
+	bool ok = ns != NULL;
+
+	for (size_t n = 0; ok && n < count; n++) {
+		size_t i = pick(rows);
+		struct db_track *track;
+		uint64_t begin;
+
+		make_track(i, false, &t);
+		begin = bench_now_ns();
+		/* The rows were inserted in order into an empty database */
+		track = by_path ? db_get_track_by_filepath(t.path) : db_get_track_by_id((int)i + 1);
+		ns[n] = bench_now_ns() - begin;
+		ok = track != NULL;
+		db_free_track(track);
+	}
+	if (ok)
+		bench_print_latency(by_path ? "lookup/path" : "lookup/id", rows, ns, count,
+		    bench_now_ns() - start);
+	else
+		fprintf(stderr, "bench-db: a lookup found nothing\n");
+	free(ns);
+	return ok;
+}
+
+/* Short queries match a large part of the library, long ones an album */
+static bool search_rows(size_t rows, size_t count, bool long_query) {
+	uint64_t *ns = malloc(count * sizeof(*ns));
+	uint64_t start = bench_now_ns();
+	char query[64];
+	bool ok = ns != NULL;
+
+	for (size_t n = 0; ok && n < count; n++) {
+		unsigned int album = (unsigned int)(pick(rows) / TRACKS_PER_ALBUM);
+		struct db_track **tracks;
+		int found;
+		uint64_t begin;
+
+		if (long_query)
+			snprintf(query, sizeof(query), "%s %s", word(album, 2), word(album, 3));
+		else
+			snprintf(query, sizeof(query), "%.2s", word(album, 2) + 1);
+		begin = bench_now_ns();
+		tracks = db_search_tracks(query, &found);
+		ns[n] = bench_now_ns() - begin;
+		ok = tracks != NULL;
+		db_free_track_list(tracks, found);
+	}
+	if (ok)
+		bench_print_latency(long_query ? "search/long" : "search/short", rows, ns, count,
+		    bench_now_ns() - start);
+	free(ns);
+	return ok;
+}
+
+static bool load_rows(size_t rows, size_t count) {
+	uint64_t *ns = malloc(count * sizeof(*ns));
+	uint64_t start = bench_now_ns();
+	long peak = 0;
+	long grown = 0;
+	bool ok = ns != NULL;
+
+	for (size_t n = 0; ok && n < count; n++) {
+		struct db_track **tracks;
+		int found;
+		uint64_t begin;
+		long before;
+		long after;
+
+		bench_reset_peak_rss();
+		before = bench_peak_rss_kb();
+		begin = bench_now_ns();
+		tracks = db_get_all_tracks(&found);
+		ns[n] = bench_now_ns() - begin;
+		after = bench_peak_rss_kb();
+		if (after > peak)
+			peak = after;
+		if (after - before > grown)
+			grown = after - before;
+		ok = tracks != NULL && (size_t)found == rows;
+		db_free_track_list(tracks, found);
+	}
+	if (ok) {
+		bench_print_latency("load/all", rows, ns, count, bench_now_ns() - start);
+		printf("%-24s %9zu %12ld kB peak, %ld kB for the load\n", "load/rss", rows, peak,
+		    grown);
+	} else {
+		fprintf(stderr, "bench-db: loaded the wrong number of tracks\n");
+	}
+	free(ns);
+	return ok;
+}
+
+/* -------------------------------------------------------------------------- */
+
+struct bench_options {
+	size_t autocommit;
+	size_t lookups;
+	size_t searches;
+	size_t loads;
+};
+
+static bool bench_library(size_t rows, const struct bench_options *o) {
+	size_t autocommit = o->autocommit < rows ? o->autocommit : rows;
+	char dir[1024];
+	char path[1100];
+	struct stat st;
+	bool ok;
+
+	if (!bench_make_tempdir(dir, sizeof(dir)))
+		return false;
+	snprintf(path, sizeof(path), "%s/glaciera.db", dir);
+	picks = 0;
+
+	/* Written the way the indexer writes */
+	ok = db_init(path, &config.db_indexer)
+	    && insert_rows("insert/autocommit", 0, autocommit, rows, false)
+	    && insert_rows("insert/batched", autocommit, rows, rows, true) && upsert_rows(rows)
+	    && db_maintain(rows);
+	db_close();
+	if (ok && stat(path, &st) == 0)
+		printf("%-24s %9zu %12lld kB\n", "file size", rows, (long long)st.st_size / 1024);
+
+	/* and read the way the player reads */
+	ok = ok && db_init(path, &config.db_player) && load_rows(rows, o->loads)
+	    && lookup_rows(rows, o->lookups, true) && lookup_rows(rows, o->lookups, false)
+	    && search_rows(rows, o->searches, false) && search_rows(rows, o->searches, true);
+	db_close();
+	bench_remove_dir(dir);
+	return ok;
+}
+
+int main(int argc, char *argv[]) {
+	struct bench_options o = {
+		.autocommit = 1000,
+		.lookups = 10000,
+		.searches = 20,
+		.loads = 3,
+	};
+	char sizes[256] = "10000,100000,1000000";
+	char *save;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:a:l:s:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			snprintf(sizes, sizeof(sizes), "%s", optarg);
+			break;
+		case 'a':
+			o.autocommit = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			o.lookups = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			o.searches = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			o.loads = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || o.lookups < 1 || o.searches < 1 || o.loads < 1)
+		goto usage;
+
+	config_set_defaults(&config);
+	bench_print_latency_header();
+	for (char *s = strtok_r(sizes, ",", &save); s; s = strtok_r(NULL, ",", &save)) {
+		size_t rows = strtoul(s, NULL, 10);
+
+		if (rows < 1 || rows > INT32_MAX)
+			goto usage;
+		if (!bench_library(rows, &o)) {
+			fprintf(stderr, "bench-db: the library of %zu rows failed\n", rows);
+			return 1;
+		}
+	}
+	return 0;
+
+usage:
+	fprintf(stderr,
+	    "usage: %s [-n rows,...] [-a autocommit rows] [-l lookups] [-s searches] [-r loads]\n",
+	    argv[0]);
+	return 1;
+}
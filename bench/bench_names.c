@@ -0,0 +1,484 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * bench_names.c - Display name normalization benchmark
+ *
+ * Runs display_from_filename() and display_from_metadata() over a
+ * generated corpus of paths and tags, next to a copy of the
+ * multi-pass code they replaced, and checks that both produce the
+ * same bytes. Exits non-zero on the first mismatches.
+ *
+ * usage: bench-names <rippers file> [-n names] [-r rounds]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+// System headers
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Local headers
+#include "bench.h"
+#include "common.h"
+#include "display.h"
+#include "rippers.h"
+
+static struct rippers *rippers;
+
+/* --------------------------------------------------------------------------
+ * The multi-pass implementation, as it was in glaciera-indexer.c,
+ * kept as the reference output.
+ */
+
+static void legacy_strip_ripper(char *s) {
+	rippers_strip(rippers, s);
+}
+
+static char *legacy_massage_full_path(char *buf, char *fullpath);
+
+static void legacy_trim_display_path(char *src) {
+	char *dst;
+
+	dst = src;
+	while (*src) {
+		switch (*src) {
+		case '_':
+			*dst++ = ' ';
+			break;
+		case '[':
+			*dst++ = '(';
+			break;
+		case ']':
+			*dst++ = ')';
+			break;
+		default:
+			*dst++ = *src;
+			break;
+		}
+		src++;
+	}
+}
+
+static void legacy_trim_double_spaces(char *src) {
+	char *dst;
+
+	dst = src;
+	while (*src) {
+		while (' ' == *src && ' ' == *(src + 1))
+			src++;
+		*dst++ = *src++;
+	}
+	*dst = 0;
+}
+
+static void legacy_trim_double_minuses(char *src) {
+	char *dst;
+
+	dst = src;
+	while (*src) {
+		while ('-' == *src && '-' == *(src + 1))
+			src++;
+		*dst++ = *src++;
+	}
+	*dst = 0;
+}
+
+static void legacy_trim_minus_space_minus(char *src) {
+	char *dst;
+
+	dst = src;
+	while (*src) {
+		if (('-' == *(src + 0) || '.' == *(src + 0)) && ' ' == *(src + 1)
+		    && '-' == *(src + 2)) {
+			*dst++ = '.';
+			src++;
+			src++;
+			src++;
+		} else
+			*dst++ = *src++;
+	}
+	*dst = 0;
+}
+
+static void legacy_trim_space_dot_space(char *src) {
+	char *dst;
+
+	dst = src;
+	while (*src) {
+		if ((' ' == *(src + 0)) && '.' == *(src + 1) && ' ' == *(src + 2)) {
+			*dst++ = '.';
+			*dst++ = ' ';
+			src++;
+			src++;
+			src++;
+		} else
+			*dst++ = *src++;
+	}
+	*dst = 0;
+}
+
+/*
+ * Get the length of a UTF-8 character sequence starting at the given byte
+ * Returns 1-4 for valid sequences, 1 for invalid bytes
+ */
+static int legacy_utf8_char_len(unsigned char c) {
+	if ((c & 0x80) == 0x00)
+		return 1; /* 0xxxxxxx - ASCII */
+	if ((c & 0xE0) == 0xC0)
+		return 2; /* 110xxxxx - 2-byte */
+	if ((c & 0xF0) == 0xE0)
+		return 3; /* 1110xxxx - 3-byte */
+	if ((c & 0xF8) == 0xF0)
+		return 4; /* 11110xxx - 4-byte */
+	return 1; /* Invalid UTF-8, treat as single byte */
+}
+
+static void legacy_build_display_from_filename(
+    const char *dir, const char *filename, BITS keepers[], char *out, size_t out_size) {
+	char fullpath[1024 * 4];
+	char gbuf[1024 * 4];
+	size_t dir_len = strlen(dir);
+
+	if (dir_len >= sizeof(fullpath)) {
+		snprintf(out, out_size, "%s", filename);
+		return;
+	}
+
+	strncpy(fullpath, dir, sizeof(fullpath));
+	fullpath[sizeof(fullpath) - 1] = '\0';
+	legacy_trim_display_path(fullpath);
+	legacy_strip_ripper(fullpath);
+	strncat(fullpath, "/", sizeof(fullpath) - strlen(fullpath) - 1);
+
+	/* UTF-8 aware copying using keepers bitmap */
+	char *p = fullpath + strlen(fullpath);
+	for (int i = 0; filename[i] && (size_t)(p - fullpath) < sizeof(fullpath) - 1;) {
+		/* Determine UTF-8 character length */
+		int char_len = legacy_utf8_char_len((unsigned char)filename[i]);
+
+		/* Check if first byte of character should be kept */
+		if (bittest(keepers, i)) {
+			/* Copy entire UTF-8 character */
+			for (int j = 0; j < char_len && filename[i + j]
+			    && (size_t)(p - fullpath) < sizeof(fullpath) - 1;
+			    j++) {
+				*p++ = filename[i + j];
+			}
+		}
+
+		/* Advance by full character length */
+		i += char_len;
+	}
+	*p = '\0';
+
+	safe_strcpy(gbuf, legacy_massage_full_path(gbuf, fullpath), sizeof(gbuf));
+	legacy_trim_display_path(gbuf);
+	legacy_strip_ripper(gbuf);
+	legacy_trim_double_spaces(gbuf);
+	legacy_trim_double_minuses(gbuf);
+	legacy_trim_minus_space_minus(gbuf);
+	legacy_trim_space_dot_space(gbuf);
+
+	/* Skip leading non-alphanumeric ASCII, but preserve Unicode */
+	p = gbuf;
+	while (*p && (unsigned char)*p < 128 && !isalnum((unsigned char)*p))
+		p++;
+
+	snprintf(out, out_size, "%s", p);
+}
+
+static void legacy_build_display_from_metadata(
+    const struct track_metadata *meta, char *out, size_t out_size) {
+	out[0] = '\0';
+	if (!meta)
+		return;
+
+	/* Format: <artist> - <album> - <tracknum> <title> */
+	if (meta->artist && meta->album && meta->title) {
+		if (meta->track_number > 0)
+			snprintf(out, out_size, "%s - %s - %02d %s", meta->artist, meta->album,
+			    meta->track_number, meta->title);
+		else
+			snprintf(
+			    out, out_size, "%s - %s - %s", meta->artist, meta->album, meta->title);
+	}
+	/* Fallback formats when some metadata is missing */
+	else if (meta->artist && meta->title) {
+		if (meta->track_number > 0)
+			snprintf(out, out_size, "%s - %02d %s", meta->artist, meta->track_number,
+			    meta->title);
+		else
+			snprintf(out, out_size, "%s - %s", meta->artist, meta->title);
+	} else if (meta->album && meta->title) {
+		if (meta->track_number > 0)
+			snprintf(out, out_size, "%s - %02d %s", meta->album, meta->track_number,
+			    meta->title);
+		else
+			snprintf(out, out_size, "%s - %s", meta->album, meta->title);
+	} else if (meta->title) {
+		if (meta->track_number > 0)
+			snprintf(out, out_size, "%02d %s", meta->track_number, meta->title);
+		else
+			snprintf(out, out_size, "%s", meta->title);
+	} else if (meta->artist && meta->album) {
+		snprintf(out, out_size, "%s - %s", meta->artist, meta->album);
+	} else if (meta->artist) {
+		snprintf(out, out_size, "%s", meta->artist);
+	} else if (meta->album) {
+		snprintf(out, out_size, "%s", meta->album);
+	} else if (meta->track) {
+		snprintf(out, out_size, "%s", meta->track);
+	}
+
+	legacy_trim_double_spaces(out);
+	legacy_trim_double_minuses(out);
+	legacy_trim_minus_space_minus(out);
+	legacy_trim_space_dot_space(out);
+}
+
+static char *legacy_fix_01_to_fullname(int offset, char *s) {
+	int i;
+	int slashcnt;
+
+	slashcnt = 0;
+	for (i = strlen(s); i; i--) {
+		if (s[i] == '/') {
+			slashcnt++;
+			if (offset == slashcnt) {
+				return s + i + 1;
+			}
+		}
+	}
+
+	return s;
+}
+
+static char *legacy_massage_full_path(char *buf, char *fullpath) {
+	char *p, *r;
+
+	safe_strcpy(buf, fullpath, 1024 * 4);
+
+	/*
+	 * Find the actual filename
+	 */
+	r = strrchr(buf, '/');
+	if (r)
+		r++;
+	else
+		r = buf;
+
+	/*
+	 * "songtitle"    => "path - songtitle"
+	 * "10.Songtitle" => "path - 10.songtitle"
+	 */
+	if ((NULL == strchr(r, '-') || (isdigit(r[0]) && isdigit(r[1])))) {
+		r = legacy_fix_01_to_fullname(2, fullpath);
+	}
+
+	if ((r[0] == 'c' || r[0] == 'C') && (r[1] == 'd' || r[1] == 'D')
+	    && (r[2] == ' ' || isdigit(r[2]))
+	    && (r[3] == '-' || r[3] == ' ' || r[3] == '/' || isdigit(r[3]))) {
+		r = legacy_fix_01_to_fullname(3, fullpath);
+	}
+
+	/*
+	 * Strip the .mp3 / .ogg part
+	 */
+	p = strrchr(r, '.');
+	if (p)
+		*p = 0;
+
+	return r;
+}
+
+/* -------------------------------------------------------------------------- */
+
+struct name_case {
+	char dir[256];
+	char filename[256];
+	BITS keepers[8];
+	struct track_metadata meta;
+};
+
+/*
+ * Fragments chosen to hit every rule: separators, runs of spaces and
+ * minuses, "- -", ". -", " . ", brackets, underscores, "cdN" folders,
+ * leading punctuation, UTF-8 and ripper suffixes.
+ */
+static const char *fragments[] = {
+	"Artist", "Album", "Song", "01", "12", "cd1", "CD2", "cd 3", " ", "  ", "-", "--", " - ",
+	"- -", ". -", " . ", ".", "_", "__", "[", "]", "(live)", "!!", "...", "\xc3\xa9t\xc3\xa9",
+	"\xe6\x97\xa5\xe6\x9c\xac", "-xmr", " (320 Kbps)", "-psycz-vbr", "(@192)", "Remix",
+};
+
+static unsigned int seed = 12345;
+
+static unsigned int next_random(void) {
+	seed = seed * 1103515245U + 12345U;
+	return (seed >> 16) & 0x7fff;
+}
+
+static void random_text(char *out, size_t size, int parts) {
+	size_t len = 0;
+
+	out[0] = '\0';
+	for (int i = 0; i < parts; i++) {
+		size_t n = sizeof(fragments) / sizeof(fragments[0]);
+		const char *f = fragments[next_random() % n];
+		size_t flen = strlen(f);
+		if (len + flen + 1 >= size)
+			break;
+		memcpy(out + len, f, flen + 1);
+		len += flen;
+	}
+}
+
+static char *random_tag(void) {
+	char buf[128];
+
+	if (next_random() % 4 == 0)
+		return NULL;
+	random_text(buf, sizeof(buf), 1 + (int)(next_random() % 5));
+	return strdup(buf);
+}
+
+static void make_case(struct name_case *c) {
+	char part[128];
+	static const char *exts[] = { ".mp3", ".flac", ".ogg", "" };
+
+	c->dir[0] = '\0';
+	for (int depth = 1 + (int)(next_random() % 4); depth > 0; depth--) {
+		random_text(part, sizeof(part), 1 + (int)(next_random() % 4));
+		if (strlen(c->dir) + strlen(part) + 2 < sizeof(c->dir)) {
+			strcat(c->dir, "/");
+			strcat(c->dir, part);
+		}
+	}
+
+	random_text(c->filename, sizeof(c->filename) - 8, 1 + (int)(next_random() % 8));
+	strcat(c->filename, exts[next_random() % 4]);
+
+	/* Mostly keep everything, sometimes drop a common prefix */
+	memset(c->keepers, 0xff, sizeof(c->keepers));
+	if (next_random() % 3 == 0) {
+		int drop = (int)(next_random() % 8);
+		for (int i = 0; i < drop; i++)
+			bitclr(c->keepers, i);
+	}
+
+	track_metadata_init(&c->meta);
+	c->meta.title = random_tag();
+	c->meta.artist = random_tag();
+	c->meta.album = random_tag();
+	if (next_random() % 2)
+		c->meta.track_number = (int)(next_random() % 30);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int compare(struct name_case *cases, int count) {
+	char want[1024 * 4];
+	char got[1024 * 4];
+	int mismatches = 0;
+
+	for (int i = 0; i < count; i++) {
+		struct name_case *c = &cases[i];
+
+		legacy_build_display_from_filename(
+		    c->dir, c->filename, c->keepers, want, sizeof(want));
+		display_from_filename(rippers, c->dir, c->filename, c->keepers, got, sizeof(got));
+		if (strcmp(want, got) != 0 && mismatches++ < 10)
+			fprintf(stderr, "path mismatch: '%s' + '%s'\n  old '%s'\n  new '%s'\n",
+			    c->dir, c->filename, want, got);
+
+		legacy_build_display_from_metadata(&c->meta, want, sizeof(want));
+		display_from_metadata(&c->meta, got, sizeof(got));
+		if (strcmp(want, got) != 0 && mismatches++ < 10)
+			fprintf(stderr, "tag mismatch:\n  old '%s'\n  new '%s'\n", want, got);
+	}
+	return mismatches;
+}
+
+int main(int argc, char *argv[]) {
+	struct bench_sample start, delta;
+	struct name_case *cases;
+	char out[1024 * 4];
+	int count = 20000;
+	int rounds = 5;
+	int mismatches;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind >= argc || count < 1 || rounds < 1)
+		goto usage;
+
+	rippers = rippers_load(argv[optind]);
+	if (!rippers) {
+		fprintf(stderr, "%s: cannot load rippers from '%s'\n", argv[0], argv[optind]);
+		return 1;
+	}
+
+	cases = calloc((size_t)count, sizeof(*cases));
+	if (!cases)
+		return 1;
+	for (int i = 0; i < count; i++)
+		make_case(&cases[i]);
+
+	mismatches = compare(cases, count);
+	printf("%d names, %d mismatches\n", count, mismatches);
+	bench_print_header();
+
+	bench_begin(&start);
+	for (int r = 0; r < rounds; r++)
+		for (int i = 0; i < count; i++)
+			legacy_build_display_from_filename(
+			    cases[i].dir, cases[i].filename, cases[i].keepers, out, sizeof(out));
+	bench_end(&start, &delta);
+	bench_print_row("path/multi-pass", "warm", &delta, (size_t)count * (size_t)rounds);
+
+	bench_begin(&start);
+	for (int r = 0; r < rounds; r++)
+		for (int i = 0; i < count; i++)
+			display_from_filename(rippers, cases[i].dir, cases[i].filename,
+			    cases[i].keepers, out, sizeof(out));
+	bench_end(&start, &delta);
+	bench_print_row("path/fused", "warm", &delta, (size_t)count * (size_t)rounds);
+
+	bench_begin(&start);
+	for (int r = 0; r < rounds; r++)
+		for (int i = 0; i < count; i++)
+			legacy_build_display_from_metadata(&cases[i].meta, out, sizeof(out));
+	bench_end(&start, &delta);
+	bench_print_row("tags/multi-pass", "warm", &delta, (size_t)count * (size_t)rounds);
+
+	bench_begin(&start);
+	for (int r = 0; r < rounds; r++)
+		for (int i = 0; i < count; i++)
+			display_from_metadata(&cases[i].meta, out, sizeof(out));
+	bench_end(&start, &delta);
+	bench_print_row("tags/fused", "warm", &delta, (size_t)count * (size_t)rounds);
+
+	for (int i = 0; i < count; i++)
+		track_metadata_clear(&cases[i].meta);
+	free(cases);
+	rippers_free(rippers);
+	return mismatches ? 1 : 0;
+
+usage:
+	fprintf(stderr, "usage: %s <rippers file> [-n names] [-r rounds]\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,612 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * bench_parsers.c - Per-format parser microbenchmark
+ *
+ * Writes synthetic corpora into a temporary directory, then runs each
+ * module's probe over them the way the indexer does (music_info()
+ * followed by music_metadata()) and prints time, bytes read, syscalls
+ * and page faults per file:
+ *
+ *   cold  page cache dropped for every file before the timed pass
+ *   warm  same files again, after one untimed pass
+ *
+ * usage: bench-parsers [-n files] [-r rounds] [-k]
+ *   -n  files per corpus (default 32)
+ *   -r  timed warm passes (default 5)
+ *   -k  keep the corpus directory and print its path
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+// System headers
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Local headers
+#include "bench.h"
+#include "common.h"
+#include "config.h"
+#include "music.h"
+
+struct buf {
+	unsigned char *p;
+	size_t len;
+	size_t cap;
+};
+
+struct corpus {
+	const char *name;
+	const char *ext;
+	void (*generate)(struct buf *b, int seq);
+};
+
+/* -------------------------------------------------------------------------- */
+
+static void buf_reserve(struct buf *b, size_t extra) {
+	if (b->len + extra <= b->cap)
+		return;
+	while (b->len + extra > b->cap)
+		b->cap = b->cap ? b->cap * 2 : 4096;
+	b->p = realloc(b->p, b->cap);
+	if (!b->p) {
+		perror("realloc");
+		exit(1);
+	}
+}
+
+static void put(struct buf *b, const void *data, size_t len) {
+	buf_reserve(b, len);
+	memcpy(b->p + b->len, data, len);
+	b->len += len;
+}
+
+static void put_fill(struct buf *b, int c, size_t len) {
+	buf_reserve(b, len);
+	memset(b->p + b->len, c, len);
+	b->len += len;
+}
+
+static void put_str(struct buf *b, const char *s) {
+	put(b, s, strlen(s));
+}
+
+static void put_be(struct buf *b, uint64_t v, int bytes) {
+	unsigned char tmp[8];
+
+	assert(bytes <= 8);
+	for (int i = 0; i < bytes; i++)
+		tmp[i] = (unsigned char)(v >> (8 * (bytes - 1 - i)));
+	put(b, tmp, (size_t)bytes);
+}
+
+static void put_le(struct buf *b, uint64_t v, int bytes) {
+	unsigned char tmp[8];
+
+	assert(bytes <= 8);
+	for (int i = 0; i < bytes; i++)
+		tmp[i] = (unsigned char)(v >> (8 * i));
+	put(b, tmp, (size_t)bytes);
+}
+
+static void set_be32(struct buf *b, size_t at, uint32_t v) {
+	b->p[at] = (unsigned char)(v >> 24);
+	b->p[at + 1] = (unsigned char)(v >> 16);
+	b->p[at + 2] = (unsigned char)(v >> 8);
+	b->p[at + 3] = (unsigned char)v;
+}
+
+/* Pseudo random payload, so nothing looks like a sync word by accident */
+static void put_noise(struct buf *b, size_t len, uint32_t seed) {
+	buf_reserve(b, len);
+	for (size_t i = 0; i < len; i++) {
+		seed = seed * 1103515245U + 12345U;
+		b->p[b->len++] = (unsigned char)((seed >> 16) & 0x7f);
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+
+/*
+ * MPEG-1 Layer III, 44.1 kHz, joint stereo. A 128 kbps frame is
+ * 144 * 128000 / 44100 = 417 bytes.
+ */
+#define MP3_FRAMES 600
+#define MP3_FRAME_LEN 417
+
+static void put_mp3_frames(struct buf *b, int frames, bool xing) {
+	for (int i = 0; i < frames; i++) {
+		size_t start = b->len;
+		put_be(b, 0xFFFB9064, 4);
+		if (i == 0 && xing) {
+			/* 32 bytes of side info, then the Xing header */
+			put_fill(b, 0, 32);
+			put_str(b, "Xing");
+			put_be(b, 0x0001, 4);
+			put_be(b, (uint64_t)frames, 4);
+		}
+		put_noise(b, MP3_FRAME_LEN - (b->len - start), (uint32_t)i);
+	}
+}
+
+static void put_id3v1(struct buf *b, int seq) {
+	char tag[128];
+
+	memset(tag, 0, sizeof(tag));
+	memcpy(tag, "TAG", 3);
+	snprintf(tag + 3, 30, "Title %d", seq);
+	snprintf(tag + 33, 30, "Artist %d", seq % 7);
+	snprintf(tag + 63, 30, "Album %d", seq % 3);
+	tag[126] = (char)(seq % 20 + 1);
+	tag[127] = 17;
+	put(b, tag, sizeof(tag));
+}
+
+static void put_id3v2_frame(struct buf *b, const char *id, const void *data, size_t len) {
+	put(b, id, 4);
+	put_be(b, len, 4);
+	put_be(b, 0, 2);
+	put(b, data, len);
+}
+
+static void put_id3v2_text(struct buf *b, const char *id, const char *text) {
+	struct buf frame = { 0 };
+	put_fill(&frame, 0, 1); /* ISO-8859-1 */
+	put_str(&frame, text);
+	put_id3v2_frame(b, id, frame.p, frame.len);
+	free(frame.p);
+}
+
+static void put_synchsafe(struct buf *b, size_t v) {
+	unsigned char tmp[4] = { (unsigned char)((v >> 21) & 0x7f),
+		(unsigned char)((v >> 14) & 0x7f), (unsigned char)((v >> 7) & 0x7f),
+		(unsigned char)(v & 0x7f) };
+	put(b, tmp, 4);
+}
+
+static void gen_mp3_cbr(struct buf *b, int seq) {
+	put_mp3_frames(b, MP3_FRAMES, false);
+	put_id3v1(b, seq);
+}
+
+static void gen_mp3_vbr_xing(struct buf *b, int seq) {
+	put_mp3_frames(b, MP3_FRAMES, true);
+	put_id3v1(b, seq);
+}
+
+/* ID3v2.3 with text frames followed by 512 KB of cover art */
+static void gen_mp3_id3v2_apic(struct buf *b, int seq) {
+	struct buf tag = { 0 };
+	struct buf apic = { 0 };
+	char text[64];
+
+	snprintf(text, sizeof(text), "Title %d", seq);
+	put_id3v2_text(&tag, "TIT2", text);
+	snprintf(text, sizeof(text), "Artist %d", seq % 7);
+	put_id3v2_text(&tag, "TPE1", text);
+	snprintf(text, sizeof(text), "Album %d", seq % 3);
+	put_id3v2_text(&tag, "TALB", text);
+	snprintf(text, sizeof(text), "%d", seq % 20 + 1);
+	put_id3v2_text(&tag, "TRCK", text);
+
+	put_fill(&apic, 0, 1);
+	put(&apic, "image/jpeg", 11);
+	put_fill(&apic, 3, 1); /* front cover */
+	put_fill(&apic, 0, 1); /* empty description */
+	put_noise(&apic, 512 * 1024, (uint32_t)seq);
+	put_id3v2_frame(&tag, "APIC", apic.p, apic.len);
+
+	put(b, "ID3\x03\x00\x00", 6);
+	put_synchsafe(b, tag.len);
+	put(b, tag.p, tag.len);
+	put_mp3_frames(b, MP3_FRAMES, false);
+
+	free(tag.p);
+	free(apic.p);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Vorbis comment block as used by FLAC, Vorbis and Opus: the four
+ * tags the indexer looks for, then extra filler comments.
+ */
+static void put_comment_block(struct buf *b, int seq, int extra) {
+	char text[128];
+	const char *fixed[4];
+	char title[64], artist[64], album[64], track[32];
+
+	snprintf(title, sizeof(title), "TITLE=Title %d", seq);
+	snprintf(artist, sizeof(artist), "ARTIST=Artist %d", seq % 7);
+	snprintf(album, sizeof(album), "ALBUM=Album %d", seq % 3);
+	snprintf(track, sizeof(track), "TRACKNUMBER=%d", seq % 20 + 1);
+	fixed[0] = title;
+	fixed[1] = artist;
+	fixed[2] = album;
+	fixed[3] = track;
+
+	put_le(b, 9, 4);
+	put_str(b, "glaciera ");
+	put_le(b, (uint64_t)(4 + extra), 4);
+	for (int i = 0; i < 4; i++) {
+		put_le(b, strlen(fixed[i]), 4);
+		put_str(b, fixed[i]);
+	}
+	for (int i = 0; i < extra; i++) {
+		snprintf(
+		    text, sizeof(text), "COMMENT%d=Lorem ipsum dolor sit amet, entry %d", i, i);
+		put_le(b, strlen(text), 4);
+		put_str(b, text);
+	}
+}
+
+/*
+ * FLAC: STREAMINFO, a VORBIS_COMMENT block with a few hundred
+ * comments, then noise instead of audio frames.
+ */
+static void gen_flac_comments(struct buf *b, int seq) {
+	struct buf comments = { 0 };
+	uint64_t samples = 44100ULL * 180;
+
+	put_str(b, "fLaC");
+
+	/* STREAMINFO */
+	put_be(b, 0x00000022, 4);
+	put_be(b, 4096, 2);
+	put_be(b, 4096, 2);
+	put_be(b, 0, 3);
+	put_be(b, 0, 3);
+	/* 20 bits rate, 3 bits channels-1, 5 bits bps-1, 36 bits samples */
+	put_be(b, (44100ULL << 44) | (1ULL << 41) | (15ULL << 36) | samples, 8);
+	put_fill(b, 0, 16); /* MD5 */
+
+	put_comment_block(&comments, seq, 300);
+	put_be(b, 0x84000000 | comments.len, 4); /* last block, VORBIS_COMMENT */
+	put(b, comments.p, comments.len);
+	free(comments.p);
+
+	put_be(b, 0xFFF8, 2);
+	put_noise(b, 256 * 1024, (uint32_t)seq);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static uint32_t ogg_crc_table[256];
+
+static void ogg_crc_init(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t r = i << 24;
+		for (int j = 0; j < 8; j++)
+			r = (r & 0x80000000U) ? (r << 1) ^ 0x04c11db7U : r << 1;
+		ogg_crc_table[i] = r;
+	}
+}
+
+/*
+ * Append packet as a run of pages of at most 255 segments each.
+ * The last page of the packet gets granule, the others -1.
+ */
+static void put_ogg_packet(struct buf *b, const unsigned char *data, size_t len, int64_t granule,
+    unsigned char flags, uint32_t *seq) {
+	size_t pos = 0;
+	bool done = false;
+
+	while (!done) {
+		unsigned char lacing[255];
+		int segments = 0;
+		size_t body = 0;
+		size_t start = b->len;
+		uint32_t crc = 0;
+
+		while (segments < 255) {
+			size_t left = len - pos - body;
+			unsigned char lace = left >= 255 ? 255 : (unsigned char)left;
+			lacing[segments++] = lace;
+			body += lace;
+			if (lace < 255) {
+				done = true;
+				break;
+			}
+		}
+
+		put_str(b, "OggS");
+		put_fill(b, 0, 1);
+		put_fill(b, pos ? flags | 0x01 : flags, 1);
+		put_le(b, done ? (uint64_t)granule : UINT64_MAX, 8);
+		put_le(b, 0x1234, 4);
+		put_le(b, (*seq)++, 4);
+		put_le(b, 0, 4);
+		put_fill(b, segments, 1);
+		put(b, lacing, (size_t)segments);
+		put(b, data + pos, body);
+		pos += body;
+
+		for (size_t i = start; i < b->len; i++)
+			crc = (crc << 8) ^ ogg_crc_table[((crc >> 24) ^ b->p[i]) & 0xff];
+		b->p[start + 22] = (unsigned char)crc;
+		b->p[start + 23] = (unsigned char)(crc >> 8);
+		b->p[start + 24] = (unsigned char)(crc >> 16);
+		b->p[start + 25] = (unsigned char)(crc >> 24);
+	}
+}
+
+static void put_ogg_audio(struct buf *b, uint64_t total, uint32_t *seq, int seed) {
+	struct buf packet = { 0 };
+	const int pages = 64;
+
+	put_noise(&packet, 4000, (uint32_t)seed);
+	for (int i = 0; i < pages; i++) {
+		int64_t granule = (int64_t)(total * (uint64_t)(i + 1) / pages);
+		put_ogg_packet(b, packet.p, packet.len, granule, i == pages - 1 ? 0x04 : 0, seq);
+	}
+	free(packet.p);
+}
+
+/* Vorbis with a comment header of several pages */
+static void gen_ogg_comments(struct buf *b, int seq) {
+	struct buf packet = { 0 };
+	uint32_t page = 0;
+
+	put(&packet, "\x01vorbis", 7);
+	put_le(&packet, 0, 4);
+	put_fill(&packet, 2, 1);
+	put_le(&packet, 44100, 4);
+	put_le(&packet, 0, 4);
+	put_le(&packet, 128000, 4);
+	put_le(&packet, 0, 4);
+	put_fill(&packet, 0xb8, 1);
+	put_fill(&packet, 1, 1);
+	put_ogg_packet(b, packet.p, packet.len, 0, 0x02, &page);
+
+	packet.len = 0;
+	put(&packet, "\x03vorbis", 7);
+	put_comment_block(&packet, seq, 2000);
+	put_fill(&packet, 1, 1);
+	put_ogg_packet(b, packet.p, packet.len, 0, 0, &page);
+	free(packet.p);
+
+	put_ogg_audio(b, 44100ULL * 180, &page, seq);
+}
+
+static void gen_opus(struct buf *b, int seq) {
+	struct buf packet = { 0 };
+	uint32_t page = 0;
+
+	put_str(&packet, "OpusHead");
+	put_fill(&packet, 1, 1);
+	put_fill(&packet, 2, 1);
+	put_le(&packet, 312, 2);
+	put_le(&packet, 44100, 4);
+	put_le(&packet, 0, 3);
+	put_ogg_packet(b, packet.p, packet.len, 0, 0x02, &page);
+
+	packet.len = 0;
+	put_str(&packet, "OpusTags");
+	put_comment_block(&packet, seq, 20);
+	put_ogg_packet(b, packet.p, packet.len, 0, 0, &page);
+	free(packet.p);
+
+	put_ogg_audio(b, 48000ULL * 180 + 312, &page, seq);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static size_t begin_atom(struct buf *b, const char *type) {
+	size_t at = b->len;
+	put_be(b, 0, 4);
+	put(b, type, 4);
+	return at;
+}
+
+static void end_atom(struct buf *b, size_t at) {
+	set_be32(b, at, (uint32_t)(b->len - at));
+}
+
+static void put_ilst_text(struct buf *b, const char *type, const char *text) {
+	size_t item = begin_atom(b, type);
+	size_t data = begin_atom(b, "data");
+	put_be(b, 1, 4);
+	put_be(b, 0, 4);
+	put_str(b, text);
+	end_atom(b, data);
+	end_atom(b, item);
+}
+
+/* M4A with 'moov' after 'mdat', the layout that needs a seek */
+static void gen_m4a(struct buf *b, int seq) {
+	size_t moov, trak, mdia, atom, udta, meta, ilst;
+	char text[64];
+
+	atom = begin_atom(b, "ftyp");
+	put_str(b, "M4A ");
+	put_be(b, 0, 4);
+	put_str(b, "M4A mp42isom");
+	end_atom(b, atom);
+
+	atom = begin_atom(b, "mdat");
+	put_noise(b, 256 * 1024, (uint32_t)seq);
+	end_atom(b, atom);
+
+	moov = begin_atom(b, "moov");
+	atom = begin_atom(b, "mvhd");
+	put_fill(b, 0, 12);
+	put_be(b, 1000, 4);
+	put_be(b, 180000, 4);
+	put_fill(b, 0, 80);
+	end_atom(b, atom);
+
+	trak = begin_atom(b, "trak");
+	mdia = begin_atom(b, "mdia");
+	atom = begin_atom(b, "mdhd");
+	put_fill(b, 0, 12);
+	put_be(b, 44100, 4);
+	put_be(b, 44100 * 180, 4);
+	put_be(b, 0, 4);
+	end_atom(b, atom);
+	atom = begin_atom(b, "hdlr");
+	put_be(b, 0, 8);
+	put_str(b, "soun");
+	put_fill(b, 0, 13);
+	end_atom(b, atom);
+	atom = begin_atom(b, "minf");
+	put_fill(b, 0, 4096); /* stand-in for the sample tables */
+	end_atom(b, atom);
+	end_atom(b, mdia);
+	end_atom(b, trak);
+
+	udta = begin_atom(b, "udta");
+	meta = begin_atom(b, "meta");
+	put_be(b, 0, 4);
+	ilst = begin_atom(b, "ilst");
+	snprintf(text, sizeof(text), "Title %d", seq);
+	put_ilst_text(b, "\xa9nam", text);
+	snprintf(text, sizeof(text), "Artist %d", seq % 7);
+	put_ilst_text(b, "\xa9" "ART", text);
+	snprintf(text, sizeof(text), "Album %d", seq % 3);
+	put_ilst_text(b, "\xa9" "alb", text);
+	end_atom(b, ilst);
+	end_atom(b, meta);
+	end_atom(b, udta);
+	end_atom(b, moov);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void gen_pls(struct buf *b, int seq) {
+	char line[128];
+
+	put_str(b, "[playlist]\n");
+	for (int i = 1; i <= 20; i++) {
+		snprintf(line, sizeof(line), "File%d=http://stream%d.example.org/live\n", i, seq);
+		put_str(b, line);
+		snprintf(line, sizeof(line), "Title%d=Stream %d\n", i, i);
+		put_str(b, line);
+	}
+	put_str(b, "NumberOfEntries=20\nVersion=2\n");
+}
+
+static const struct corpus corpora[] = {
+	{ "mp3-cbr", "mp3", gen_mp3_cbr },
+	{ "mp3-vbr-xing", "mp3", gen_mp3_vbr_xing },
+	{ "mp3-id3v2-apic", "mp3", gen_mp3_id3v2_apic },
+	{ "flac-comments", "flac", gen_flac_comments },
+	{ "ogg-long-comments", "ogg", gen_ogg_comments },
+	{ "opus", "opus", gen_opus },
+	{ "m4a-moov-last", "m4a", gen_m4a },
+	{ "pls", "pls", gen_pls },
+};
+
+/* -------------------------------------------------------------------------- */
+
+static int probe_all(char **paths, int count) {
+	int failures = 0;
+
+	for (int i = 0; i < count; i++) {
+		struct filetype *ft = music_handler(music_format(paths[i]));
+		struct tuneinfo ti;
+		struct track_metadata meta;
+
+		memset(&ti, 0, sizeof(ti));
+		track_metadata_init(&meta);
+		if (!music_info(ft, paths[i], &ti))
+			failures++;
+		music_metadata(ft, paths[i], &meta);
+		track_metadata_clear(&meta);
+	}
+	return failures;
+}
+
+static bool run_corpus(const struct corpus *c, const char *dir, int files, int rounds) {
+	struct bench_sample start, delta;
+	struct buf b = { 0 };
+	char **paths;
+	char path[1024];
+	int failures;
+
+	paths = calloc((size_t)files, sizeof(*paths));
+	if (!paths)
+		return false;
+
+	for (int i = 0; i < files; i++) {
+		b.len = 0;
+		c->generate(&b, i);
+		snprintf(path, sizeof(path), "%s/%s-%03d.%s", dir, c->name, i, c->ext);
+		if (!bench_write_file(path, b.p, b.len))
+			return false;
+		paths[i] = strdup(path);
+	}
+	free(b.p);
+
+	for (int i = 0; i < files; i++)
+		bench_drop_cache(paths[i]);
+	bench_begin(&start);
+	failures = probe_all(paths, files);
+	bench_end(&start, &delta);
+	bench_print_row(c->name, "cold", &delta, (size_t)files);
+
+	bench_begin(&start);
+	for (int r = 0; r < rounds; r++)
+		failures += probe_all(paths, files);
+	bench_end(&start, &delta);
+	bench_print_row(c->name, "warm", &delta, (size_t)files * (size_t)rounds);
+
+	for (int i = 0; i < files; i++)
+		free(paths[i]);
+	free(paths);
+
+	if (failures)
+		fprintf(stderr, "%s: %d probes failed\n", c->name, failures);
+	return failures == 0;
+}
+
+int main(int argc, char *argv[]) {
+	char dir[512];
+	int files = 32;
+	int rounds = 5;
+	bool keep = false;
+	bool ok = true;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:k")) != -1) {
+		switch (opt) {
+		case 'n':
+			files = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'k':
+			keep = true;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n files] [-r rounds] [-k]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (files < 1 || rounds < 1) {
+		fprintf(stderr, "%s: -n and -r must be positive\n", argv[0]);
+		return 1;
+	}
+
+	config_set_defaults(&global_config);
+	music_register_all_modules();
+	ogg_crc_init();
+
+	if (!bench_make_tempdir(dir, sizeof(dir)))
+		return 1;
+
+	printf("%d files per corpus, %d warm rounds\n", files, rounds);
+	bench_print_header();
+	for (size_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++)
+		ok &= run_corpus(&corpora[i], dir, files, rounds);
+
+	if (keep)
+		printf("corpus kept in %s\n", dir);
+	else
+		bench_remove_dir(dir);
+	return ok ? 0 : 1;
+}
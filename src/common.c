@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <wordexp.h>
@@ -203,6 +204,7 @@ inline static int NGramMatch(
 
 	if (!haystack || !needle || !MaxMatch)
 		return 0;
+	*MaxMatch = 0;
 	if (NGramLen <= 0 || NGramLen >= (int)sizeof(NGram))
 		return 0;
 	if (needlelen < NGramLen)
@@ -210,7 +212,6 @@ inline static int NGramMatch(
 
 	NGram[NGramLen] = '\0';
 	NGramCount = needlelen - NGramLen + 1;
-	*MaxMatch = 0;
 	Count = 0;
 
 	/* Suchstring in n-Gramme zerlegen und diese im Text suchen */
@@ -225,7 +226,7 @@ inline static int NGramMatch(
 	return Count * NGramLen; /* gewichten nach n-Gramm-Laenge */
 }
 
-int fuzzy(char *haystack, char *needle) {
+int fuzzy(const char *haystack, const char *needle) {
 	int needlelen;
 	int MatchCount1;
 	int MatchCount2;
@@ -239,7 +240,9 @@ int fuzzy(char *haystack, char *needle) {
 	MatchCount1 = NGramMatch(haystack, needle, needlelen, 3, &MaxMatch1);
 	MatchCount2 = NGramMatch(haystack, needle, needlelen, (needlelen < 7) ? 2 : 5, &MaxMatch2);
 
-	/* calc hit rate */
+	/* calc hit rate, needles shorter than two characters have no n-grams */
+	if (MaxMatch1 + MaxMatch2 == 0)
+		return 0;
 	Similarity = 100.0 * (double)(MatchCount1 + MatchCount2) / (double)(MaxMatch1 + MaxMatch2);
 
 	return Similarity;
@@ -314,6 +317,7 @@ void track_metadata_init(struct track_metadata *meta) {
 	meta->album = NULL;
 	meta->track = NULL;
 	meta->track_number = -1;
+	meta->genre = NULL;
 }
 
 void track_metadata_clear(struct track_metadata *meta) {
@@ -323,11 +327,103 @@ void track_metadata_clear(struct track_metadata *meta) {
 	free(meta->artist);
 	free(meta->album);
 	free(meta->track);
+	free(meta->genre);
 	meta->title = NULL;
 	meta->artist = NULL;
 	meta->album = NULL;
 	meta->track = NULL;
 	meta->track_number = -1;
+	meta->genre = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static const char *const id3_genres[256] = {
+	/*
+	 * NOTE: The spelling of these genre names is identical to those found in
+	 * Winamp and mp3info.
+	 */
+	"Blues", "Classic Rock", "Country", "Dance", "Disco", "Funk", "Grunge", "Hip-Hop", "Jazz",
+	"Metal", "New Age", "Oldies", "Other", "Pop", "R&B", "Rap", "Reggae", "Rock", "Techno",
+	"Industrial", "Alternative", "Ska", "Death Metal", "Pranks", "Soundtrack", "Euro-Techno",
+	"Ambient", "Trip-Hop", "Vocal", "Jazz+Funk", "Fusion", "Trance", "Classical",
+	"Instrumental", "Acid", "House", "Game", "Sound Clip", "Gospel", "Noise", "Alt. Rock",
+	"Bass", "Soul", "Punk", "Space", "Meditative", "Instrumental Pop", "Instrumental Rock",
+	"Ethnic", "Gothic", "Darkwave", "Techno-Industrial", "Electronic", "Pop-Folk", "Eurodance",
+	"Dream", "Southern Rock", "Comedy", "Cult", "Gangsta Rap", "Top 40", "Christian Rap",
+	"Pop/Funk", "Jungle", "Native American", "Cabaret", "New Wave", "Psychedelic", "Rave",
+	"Showtunes", "Trailer", "Lo-Fi", "Tribal", "Acid Punk", "Acid Jazz", "Polka", "Retro",
+	"Musical", "Rock & Roll", "Hard Rock", "Folk", "Folk/Rock", "National Folk", "Swing",
+	"Fast-Fusion", "Bebob", "Latin", "Revival", "Celtic", "Bluegrass", "Avantgarde",
+	"Gothic Rock", "Progressive Rock", "Psychedelic Rock", "Symphonic Rock", "Slow Rock",
+	"Big Band", "Chorus", "Easy Listening", "Acoustic", "Humour", "Speech", "Chanson", "Opera",
+	"Chamber Music", "Sonata", "Symphony", "Booty Bass", "Primus", "Porn Groove", "Satire",
+	"Slow Jam", "Club", "Tango", "Samba", "Folklore", "Ballad", "Power Ballad", "Rhythmic Soul",
+	"Freestyle", "Duet", "Punk Rock", "Drum Solo", "A Cappella", "Euro-House", "Dance Hall",
+	"Goa", "Drum & Bass", "Club-House", "Hardcore", "Terror", "Indie", "BritPop", "Negerpunk",
+	"Polsk Punk", "Beat", "Christian Gangsta Rap", "Heavy Metal", "Black Metal", "Crossover",
+	"Contemporary Christian", "Christian Rock", "Merengue", "Salsa", "Thrash Metal", "Anime",
+	"JPop", "Synthpop"
+};
+
+/*
+ * Return the name of an ID3v1 genre, NULL for the numbers without one
+ * (0xff is "no genre"). O(1)
+ */
+const char *id3_genre_name(int genre) {
+	return id3_genres[genre & 0xff];
+}
+
+/* The ID3v1 genre of a tag such as "17", "(17)" or "Rock", 0xff when it has none */
+int id3_genre_number(const char *text) {
+	char *end;
+	long n;
+
+	if (!text)
+		return 0xff;
+	n = strtol(text + ('(' == text[0]), &end, 10);
+	if (end != text + ('(' == text[0]) && n >= 0 && n < 256
+	    && ('\0' == *end || (')' == *end && '(' == text[0])))
+		return (int)n;
+	for (int i = 0; i < 256; i++) {
+		if (id3_genres[i] && 0 == strcasecmp(id3_genres[i], text))
+			return i;
+	}
+	return 0xff;
+}
+
+/*
+ * The genre of the len bytes of a genre tag, with an ID3v1 genre number
+ * ("17", or "(17)" as ID3v2 writes it) spelled out. A refinement after
+ * the number, "(17)Garage Rock", is taken instead. Returns a new
+ * string, NULL when there is no genre or no memory.
+ */
+char *genre_from_tag(const char *text, size_t len) {
+	char buf[256];
+	const char *name;
+	char *end;
+	long n;
+
+	while (len && isspace((unsigned char)text[len - 1]))
+		len--;
+	if (0 == len)
+		return NULL;
+	if (len >= sizeof(buf))
+		return strndup(text, len);
+	memcpy(buf, text, len);
+	buf[len] = '\0';
+
+	n = strtol(buf + ('(' == buf[0]), &end, 10);
+	if (end == buf + ('(' == buf[0]) || n < 0 || n > 255)
+		return strdup(buf);
+	if ('(' == buf[0] && ')' == *end)
+		end++;
+	else if ('(' == buf[0] || '\0' != *end)
+		return strdup(buf);
+	if ('\0' != *end)
+		return strdup(end);
+	name = id3_genre_name((int)n);
+	return name ? strdup(name) : NULL;
 }
 
 /* -------------------------------------------------------------------------- */
@@ -8,7 +8,7 @@
 typedef unsigned long BIGPTR;
 
 /*
-** 4+4+2+2+1+1
+** 4+4+2+2+1+1+1
 */
 struct tuneinfo {
 	int filesize;
@@ -17,13 +17,16 @@ struct tuneinfo {
 	short bitrate;
 	unsigned char genre;
 	unsigned char rating;
+	unsigned char format; /* enum music_format, see music.h */
 };
 
+/* The path of a tune is its directory and file, see tune_path() in glaciera.c */
 struct tune {
-	char *path;
+	char *file; /* the whole path when dir is 0 */
 	char *display;
 	char *search;
 	struct tuneinfo *ti;
+	int dir; /* database id of the directory */
 };
 
 struct smalltune {
@@ -44,6 +47,7 @@ struct track_metadata {
 	char *album;
 	char *track;
 	int track_number;
+	char *genre; /* does not make a name, see genre_from_tag() */
 };
 
 extern char tolowerarray[256];
@@ -55,7 +59,7 @@ void only_searchables(char *src);
 void sanitize_user_input(char *src);
 void chop(char *buf);
 int trim(char s[]);
-int fuzzy(char *haystack, char *needle);
+int fuzzy(const char *haystack, const char *needle);
 void swap(struct tune **a, struct tune **b);
 char *strrev(char *str);
 
@@ -69,6 +73,10 @@ BITS *bitalloc(int bits);
 void track_metadata_init(struct track_metadata *meta);
 void track_metadata_clear(struct track_metadata *meta);
 
+const char *id3_genre_name(int genre);
+int id3_genre_number(const char *text);
+char *genre_from_tag(const char *text, size_t len);
+
 /* Safe string handling functions to prevent buffer overflows */
 size_t safe_strcpy(char *dst, const char *src, size_t dst_size);
 size_t safe_strcat(char *dst, const char *src, size_t dst_size);
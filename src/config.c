@@ -6,6 +6,7 @@
 
 // System headers
 #include <errno.h>
+#include <limits.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,6 +26,8 @@ char xdg_cache_dir[512];
 config_t global_config;
 
 static char db_path_cache[512];
+static char snapshot_path_cache[512];
+static char replica_path_cache[512];
 static char home_dir[512] = "/tmp";
 
 /* Create directory if it doesn't exist */
@@ -196,6 +199,39 @@ void config_set_defaults(config_t *config) {
 	strcpy(config->pls_player_path, "mplayer");
 	strcpy(config->pls_player_flags,
 	    "-quiet -really-quiet -vo null -vc null -noautosub -noconsolecontrols -playlist");
+	strcpy(config->m4a_player_path, "mplayer");
+	strcpy(config->m4a_player_flags,
+	    "-quiet -really-quiet -vo null -vc null -noautosub -noconsolecontrols");
+	strcpy(config->opus_player_path, "ogg123");
+	config->opus_player_flags[0] = '\0';
+
+	strcpy(config->indexer_io_class, "best-effort");
+	config->indexer_io_priority = 7;
+	config->indexer_sched_idle = true;
+	config->indexer_max_bytes_per_sec = 0;
+	config->indexer_max_files_per_sec = 0;
+
+	/* Bulk writes: a big cache, WAL checkpoints kept out of the insert path */
+	config->db_indexer.page_size = 4096;
+	strcpy(config->db_indexer.synchronous, "normal");
+	strcpy(config->db_indexer.temp_store, "memory");
+	config->db_indexer.cache_size_kb = 65536;
+	config->db_indexer.mmap_size_mb = 0;
+	config->db_indexer.wal_autocheckpoint = 10000;
+	config->db_indexer.busy_timeout_ms = 5000;
+	config->db_indexer.maintain_after = 1000;
+
+	/* Reads: the library load and searches come from the page cache */
+	config->db_player.page_size = 4096;
+	strcpy(config->db_player.synchronous, "normal");
+	strcpy(config->db_player.temp_store, "memory");
+	config->db_player.cache_size_kb = 16384;
+	config->db_player.mmap_size_mb = 256;
+	config->db_player.wal_autocheckpoint = 1000;
+	config->db_player.busy_timeout_ms = 1000;
+	config->db_player.maintain_after = 0;
+	config->db_replica = false;
+	config->db_shards = false;
 
 	/* Default Nord dark theme */
 	strcpy(config->theme_name, "default");
@@ -348,7 +384,53 @@ bool config_create_default_file(void) {
 	fprintf(fp, "pls_player = \"mplayer\"\n");
 	fprintf(fp,
 	    "pls_flags = \"-quiet -really-quiet -vo null -vc null -noautosub -noconsolecontrols "
-	    "-playlist\"\n\n");
+	    "-playlist\"\n");
+	fprintf(fp, "m4a_player = \"mplayer\"\n");
+	fprintf(fp,
+	    "m4a_flags = \"-quiet -really-quiet -vo null -vc null -noautosub "
+	    "-noconsolecontrols\"\n");
+	fprintf(fp, "opus_player = \"ogg123\"\n");
+	fprintf(fp, "opus_flags = \"\"\n\n");
+
+	fprintf(fp, "[indexer]\n");
+	fprintf(fp, "# Used while glaciera is running, so indexing does not disturb playback\n");
+	fprintf(fp, "# I/O class: \"idle\", \"best-effort\" or \"normal\"\n");
+	fprintf(fp, "io_class = \"best-effort\"\n");
+	fprintf(fp, "# 0 (highest) to 7 (lowest), for best-effort\n");
+	fprintf(fp, "io_priority = 7\n");
+	fprintf(fp, "sched_idle = true\n");
+	fprintf(fp, "# Per device, 0 means no limit\n");
+	fprintf(fp, "max_bytes_per_sec = 0\n");
+	fprintf(fp, "max_files_per_sec = 0\n\n");
+
+	fprintf(fp, "[database]\n");
+	fprintf(fp, "# Only used when the database is created\n");
+	fprintf(fp, "page_size = 4096\n");
+	fprintf(fp, "# Let the player read a copy in the cache directory, for a\n");
+	fprintf(fp, "# database on a network share\n");
+	fprintf(fp, "replica = false\n");
+	fprintf(fp, "# One database per index path, so that the paths are indexed\n");
+	fprintf(fp, "# in parallel. Cannot be turned off again\n");
+	fprintf(fp, "shards = false\n\n");
+	fprintf(fp, "[database.indexer]\n");
+	fprintf(fp, "# synchronous: \"off\", \"normal\" or \"full\"\n");
+	fprintf(fp, "synchronous = \"normal\"\n");
+	fprintf(fp, "# temp_store: \"default\", \"file\" or \"memory\"\n");
+	fprintf(fp, "temp_store = \"memory\"\n");
+	fprintf(fp, "cache_size_kb = 65536\n");
+	fprintf(fp, "mmap_size_mb = 0\n");
+	fprintf(fp, "wal_autocheckpoint = 10000\n");
+	fprintf(fp, "busy_timeout_ms = 5000\n");
+	fprintf(fp, "# ANALYZE, optimize and truncate the WAL after a scan that changed\n");
+	fprintf(fp, "# at least this many tracks, 0 means never\n");
+	fprintf(fp, "maintain_after = 1000\n\n");
+	fprintf(fp, "[database.player]\n");
+	fprintf(fp, "synchronous = \"normal\"\n");
+	fprintf(fp, "temp_store = \"memory\"\n");
+	fprintf(fp, "cache_size_kb = 16384\n");
+	fprintf(fp, "mmap_size_mb = 256\n");
+	fprintf(fp, "wal_autocheckpoint = 1000\n");
+	fprintf(fp, "busy_timeout_ms = 1000\n\n");
 
 	fprintf(fp, "[appearance]\n");
 	fprintf(fp, "# Theme name (default, or filename from themes/ directory without .toml)\n");
@@ -364,6 +446,48 @@ bool config_create_default_file(void) {
 	return true;
 }
 
+/* One [database.*] table, keys that are missing or out of range keep their defaults */
+static void parse_db_profile(toml_table_t *table, db_profile_t *p) {
+	if (!table)
+		return;
+
+	toml_datum_t sync = toml_string_in(table, "synchronous");
+	if (sync.ok) {
+		if (strcmp(sync.u.s, "off") == 0 || strcmp(sync.u.s, "normal") == 0
+		    || strcmp(sync.u.s, "full") == 0)
+			strcpy(p->synchronous, sync.u.s);
+		free(sync.u.s);
+	}
+
+	toml_datum_t temp = toml_string_in(table, "temp_store");
+	if (temp.ok) {
+		if (strcmp(temp.u.s, "default") == 0 || strcmp(temp.u.s, "file") == 0
+		    || strcmp(temp.u.s, "memory") == 0)
+			strcpy(p->temp_store, temp.u.s);
+		free(temp.u.s);
+	}
+
+	toml_datum_t cache = toml_int_in(table, "cache_size_kb");
+	if (cache.ok && cache.u.i >= 0 && cache.u.i <= INT_MAX)
+		p->cache_size_kb = (int)cache.u.i;
+
+	toml_datum_t mmap = toml_int_in(table, "mmap_size_mb");
+	if (mmap.ok && mmap.u.i >= 0 && mmap.u.i <= INT_MAX)
+		p->mmap_size_mb = (int)mmap.u.i;
+
+	toml_datum_t checkpoint = toml_int_in(table, "wal_autocheckpoint");
+	if (checkpoint.ok && checkpoint.u.i >= 0 && checkpoint.u.i <= INT_MAX)
+		p->wal_autocheckpoint = (int)checkpoint.u.i;
+
+	toml_datum_t busy = toml_int_in(table, "busy_timeout_ms");
+	if (busy.ok && busy.u.i >= 0 && busy.u.i <= INT_MAX)
+		p->busy_timeout_ms = (int)busy.u.i;
+
+	toml_datum_t maintain = toml_int_in(table, "maintain_after");
+	if (maintain.ok && maintain.u.i >= 0 && maintain.u.i <= INT_MAX)
+		p->maintain_after = (int)maintain.u.i;
+}
+
 /* Load configuration from config.toml */
 static bool load_config_file(void) {
 	char config_path[512];
@@ -490,6 +614,84 @@ static bool load_config_file(void) {
 			    sizeof(global_config.pls_player_flags) - 1);
 			free(plsflags.u.s);
 		}
+
+		toml_datum_t m4a = toml_string_in(players, "m4a_player");
+		if (m4a.ok) {
+			strncpy(global_config.m4a_player_path, m4a.u.s,
+			    sizeof(global_config.m4a_player_path) - 1);
+			free(m4a.u.s);
+		}
+
+		toml_datum_t m4aflags = toml_string_in(players, "m4a_flags");
+		if (m4aflags.ok) {
+			strncpy(global_config.m4a_player_flags, m4aflags.u.s,
+			    sizeof(global_config.m4a_player_flags) - 1);
+			free(m4aflags.u.s);
+		}
+
+		toml_datum_t opus = toml_string_in(players, "opus_player");
+		if (opus.ok) {
+			strncpy(global_config.opus_player_path, opus.u.s,
+			    sizeof(global_config.opus_player_path) - 1);
+			free(opus.u.s);
+		}
+
+		toml_datum_t opusflags = toml_string_in(players, "opus_flags");
+		if (opusflags.ok) {
+			strncpy(global_config.opus_player_flags, opusflags.u.s,
+			    sizeof(global_config.opus_player_flags) - 1);
+			free(opusflags.u.s);
+		}
+	}
+
+	/* Parse [indexer] section */
+	toml_table_t *indexer = toml_table_in(conf, "indexer");
+	if (indexer) {
+		toml_datum_t ioclass = toml_string_in(indexer, "io_class");
+		if (ioclass.ok) {
+			strncpy(global_config.indexer_io_class, ioclass.u.s,
+			    sizeof(global_config.indexer_io_class) - 1);
+			free(ioclass.u.s);
+		}
+
+		toml_datum_t ioprio = toml_int_in(indexer, "io_priority");
+		if (ioprio.ok && ioprio.u.i >= 0 && ioprio.u.i <= 7)
+			global_config.indexer_io_priority = (int)ioprio.u.i;
+
+		toml_datum_t schedidle = toml_bool_in(indexer, "sched_idle");
+		if (schedidle.ok)
+			global_config.indexer_sched_idle = schedidle.u.b;
+
+		toml_datum_t maxbytes = toml_int_in(indexer, "max_bytes_per_sec");
+		if (maxbytes.ok && maxbytes.u.i >= 0)
+			global_config.indexer_max_bytes_per_sec = maxbytes.u.i;
+
+		toml_datum_t maxfiles = toml_int_in(indexer, "max_files_per_sec");
+		if (maxfiles.ok && maxfiles.u.i >= 0 && maxfiles.u.i <= INT_MAX)
+			global_config.indexer_max_files_per_sec = (int)maxfiles.u.i;
+	}
+
+	/* Parse [database] section */
+	toml_table_t *database = toml_table_in(conf, "database");
+	if (database) {
+		toml_datum_t pagesize = toml_int_in(database, "page_size");
+		/* A power of two from 512 to 65536 */
+		if (pagesize.ok && pagesize.u.i >= 512 && pagesize.u.i <= 65536
+		    && (pagesize.u.i & (pagesize.u.i - 1)) == 0) {
+			global_config.db_indexer.page_size = (int)pagesize.u.i;
+			global_config.db_player.page_size = (int)pagesize.u.i;
+		}
+
+		toml_datum_t replica = toml_bool_in(database, "replica");
+		if (replica.ok)
+			global_config.db_replica = replica.u.b;
+
+		toml_datum_t shards = toml_bool_in(database, "shards");
+		if (shards.ok)
+			global_config.db_shards = shards.u.b;
+
+		parse_db_profile(toml_table_in(database, "indexer"), &global_config.db_indexer);
+		parse_db_profile(toml_table_in(database, "player"), &global_config.db_player);
 	}
 
 	/* Parse [appearance] section */
@@ -537,6 +739,24 @@ const char *config_get_db_path(void) {
 	return db_path_cache;
 }
 
+/* Get library snapshot path (in XDG_CACHE_HOME) */
+const char *config_get_snapshot_path(void) {
+	if (snapshot_path_cache[0] == '\0') {
+		snprintf(snapshot_path_cache, sizeof(snapshot_path_cache), "%s/library.snap",
+		    xdg_cache_dir);
+	}
+	return snapshot_path_cache;
+}
+
+/* Get the path of the players copy of the database (in XDG_CACHE_HOME) */
+const char *config_get_replica_path(void) {
+	if (replica_path_cache[0] == '\0') {
+		snprintf(replica_path_cache, sizeof(replica_path_cache), "%s/replica.db",
+		    xdg_cache_dir);
+	}
+	return replica_path_cache;
+}
+
 /* Get primary music library path (first index path) */
 const char *config_get_music_library_path(void) {
 	if (global_config.index_paths_count > 0) {
@@ -587,10 +807,62 @@ const char *config_get_pls_player_flags(void) {
 	return global_config.pls_player_flags;
 }
 
+const char *config_get_m4a_player_path(void) {
+	return global_config.m4a_player_path;
+}
+
+const char *config_get_m4a_player_flags(void) {
+	return global_config.m4a_player_flags;
+}
+
+const char *config_get_opus_player_path(void) {
+	return global_config.opus_player_path;
+}
+
+const char *config_get_opus_player_flags(void) {
+	return global_config.opus_player_flags;
+}
+
 const char *config_get_rippers_path(void) {
 	return global_config.rippers_path;
 }
 
+const char *config_get_indexer_io_class(void) {
+	return global_config.indexer_io_class;
+}
+
+int config_get_indexer_io_priority(void) {
+	return global_config.indexer_io_priority;
+}
+
+bool config_get_indexer_sched_idle(void) {
+	return global_config.indexer_sched_idle;
+}
+
+long long config_get_indexer_max_bytes_per_sec(void) {
+	return global_config.indexer_max_bytes_per_sec;
+}
+
+int config_get_indexer_max_files_per_sec(void) {
+	return global_config.indexer_max_files_per_sec;
+}
+
+const db_profile_t *config_get_db_indexer_profile(void) {
+	return &global_config.db_indexer;
+}
+
+const db_profile_t *config_get_db_player_profile(void) {
+	return &global_config.db_player;
+}
+
+bool config_get_db_replica(void) {
+	return global_config.db_replica;
+}
+
+bool config_get_db_shards(void) {
+	return global_config.db_shards;
+}
+
 const char *config_get_home_dir(void) {
 	return home_dir;
 }
@@ -658,6 +930,20 @@ bool config_validate_players(void) {
 		all_valid = false;
 	}
 
+	/* Check M4A player */
+	if (!check_executable_exists(global_config.m4a_player_path)) {
+		fprintf(stderr, "Warning: M4A player '%s' not found or not executable\n",
+		    global_config.m4a_player_path);
+		all_valid = false;
+	}
+
+	/* Check Opus player */
+	if (!check_executable_exists(global_config.opus_player_path)) {
+		fprintf(stderr, "Warning: Opus player '%s' not found or not executable\n",
+		    global_config.opus_player_path);
+		all_valid = false;
+	}
+
 	if (!all_valid) {
 		fprintf(stderr,
 		    "\nPlease install the missing players or update the configuration file:\n");
@@ -666,7 +952,9 @@ bool config_validate_players(void) {
 		fprintf(stderr, "  MP3:  mpg321, mpg123, ffplay\n");
 		fprintf(stderr, "  OGG:  ogg123, ffplay\n");
 		fprintf(stderr, "  FLAC: flac123, ogg123, ffplay\n");
-		fprintf(stderr, "  PLS:  mplayer, mpv, ffplay\n\n");
+		fprintf(stderr, "  PLS:  mplayer, mpv, ffplay\n");
+		fprintf(stderr, "  M4A:  mplayer, mpv, ffplay\n");
+		fprintf(stderr, "  OPUS: ogg123, opusdec, ffplay\n\n");
 	}
 
 	return all_valid;
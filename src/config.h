@@ -27,6 +27,18 @@ typedef struct {
 
 #define MAX_INDEX_PATHS 16
 
+/* SQLite settings for one program, a [database.indexer] or [database.player] table */
+typedef struct {
+	int page_size; /* from [database], only used when the database is created */
+	char synchronous[8]; /* "off", "normal" or "full" */
+	char temp_store[8]; /* "default", "file" or "memory" */
+	int cache_size_kb;
+	int mmap_size_mb; /* 0 = no memory mapped I/O */
+	int wal_autocheckpoint; /* pages, 0 = only on close */
+	int busy_timeout_ms;
+	int maintain_after; /* changed tracks that make a scan large, 0 = never */
+} db_profile_t;
+
 /* Main configuration structure */
 typedef struct {
 	/* Multiple paths to index */
@@ -42,6 +54,23 @@ typedef struct {
 	char flac_player_flags[256];
 	char pls_player_path[128];
 	char pls_player_flags[256];
+	char m4a_player_path[128];
+	char m4a_player_flags[256];
+	char opus_player_path[128];
+	char opus_player_flags[256];
+
+	/* [indexer], applied while a glaciera player is running */
+	char indexer_io_class[16]; /* "idle", "best-effort" or "normal" */
+	int indexer_io_priority; /* 0 (highest) to 7, for best-effort */
+	bool indexer_sched_idle;
+	long long indexer_max_bytes_per_sec; /* per device, 0 = no limit */
+	int indexer_max_files_per_sec; /* per device, 0 = no limit */
+
+	/* [database] */
+	db_profile_t db_indexer;
+	db_profile_t db_player;
+	bool db_replica; /* the player reads a copy in XDG_CACHE_HOME */
+	bool db_shards; /* the indexer writes a database per index path */
 
 	/* Active theme */
 	theme_t theme;
@@ -71,6 +100,12 @@ bool config_create_default_file(void);
 /* Get the database path (in XDG_DATA_HOME) */
 const char *config_get_db_path(void);
 
+/* Get the library snapshot path (in XDG_CACHE_HOME) */
+const char *config_get_snapshot_path(void);
+
+/* Get the path of the players copy of the database (in XDG_CACHE_HOME) */
+const char *config_get_replica_path(void);
+
 /* Get primary music library path (first index path or default) */
 const char *config_get_music_library_path(void);
 
@@ -86,8 +121,25 @@ const char *config_get_flac_player_path(void);
 const char *config_get_flac_player_flags(void);
 const char *config_get_pls_player_path(void);
 const char *config_get_pls_player_flags(void);
+const char *config_get_m4a_player_path(void);
+const char *config_get_m4a_player_flags(void);
+const char *config_get_opus_player_path(void);
+const char *config_get_opus_player_flags(void);
 const char *config_get_rippers_path(void);
 
+/* Get indexer settings */
+const char *config_get_indexer_io_class(void);
+int config_get_indexer_io_priority(void);
+bool config_get_indexer_sched_idle(void);
+long long config_get_indexer_max_bytes_per_sec(void);
+int config_get_indexer_max_files_per_sec(void);
+
+/* Get database settings */
+const db_profile_t *config_get_db_indexer_profile(void);
+const db_profile_t *config_get_db_player_profile(void);
+bool config_get_db_replica(void);
+bool config_get_db_shards(void);
+
 /* Validate that configured player binaries exist */
 bool config_validate_players(void);
 
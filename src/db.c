@@ -1,10 +1,16 @@
+/* st_mtim */
+#define _DEFAULT_SOURCE
+
 // System headers
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -15,6 +21,246 @@
 #include "db.h"
 
 static sqlite3 *db = NULL;
+static sqlite3 *db_primary = NULL; /* see db_set_primary() */
+static sqlite3 *db_writer = NULL; /* the writer thread's, see db_open_writer() */
+static sqlite3 *db_writer_primary = NULL;
+static db_profile_t db_profile; /* all zero without a profile */
+
+/* Files come directory by directory, the last directory looked up is remembered */
+struct db_dir_cache {
+	pthread_mutex_t lock;
+	char last[4096];
+	int last_id; /* 0 when nothing is remembered, see db_dir_find() */
+};
+
+static struct db_dir_cache db_dirs = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* The shard an indexer thread writes, see db_shard_open() */
+struct db_shard {
+	sqlite3 *conn;
+	struct db_dir_cache dirs;
+};
+
+#define DB_SHARD_ATTACH_MAX 125 /* the hard limit of SQLite */
+
+static _Thread_local struct db_shard *db_shard;
+static pthread_mutex_t db_shard_lock = PTHREAD_MUTEX_INITIALIZER;
+static int db_shard_count; /* attached to db, see db_attach_shards() */
+
+/* The connection of the calling thread: its shard, or the database */
+static sqlite3 *db_conn(void) {
+	return db_shard ? db_shard->conn : db;
+}
+
+static int db_shard_next_dir(void);
+static int db_attach_shards(sqlite3 *conn);
+static bool db_intern_all(void);
+
+/*
+ * Paths of all directories, and the directory ?1 with everything below
+ * it. See db_dir_find().
+ */
+#define DB_DIR_PATHS_CTE                                                                           \
+	"WITH RECURSIVE dir_paths(id, path) AS ("                                                  \
+	"    SELECT id, name FROM dirs WHERE parent=0"                                             \
+	"    UNION ALL SELECT dirs.id, dir_paths.path || '/' || dirs.name"                         \
+	"    FROM dirs JOIN dir_paths ON dirs.parent=dir_paths.id) "
+#define DB_DIRS_BELOW_CTE                                                                          \
+	"WITH RECURSIVE below(id) AS ("                                                            \
+	"    SELECT ?1"                                                                            \
+	"    UNION ALL SELECT dirs.id FROM dirs JOIN below ON dirs.parent=below.id) "
+
+/*
+ * Statements run once per file by the indexer or once per search by
+ * the player. They are kept together so that --db-explain can show
+ * their query plans, see db_explain().
+ */
+static const char db_sql_insert_track[]
+    = "INSERT INTO tracks (dir_id, filename, display_name, search_text, "
+      "filesize, filedate, duration, bitrate, genre, rating, format, updated_at) "
+      "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, strftime('%s', 'now'))";
+static const char db_sql_update_track[]
+    = "UPDATE tracks SET dir_id=?, filename=?, display_name=?, search_text=?, "
+      "filesize=?, filedate=?, duration=?, bitrate=?, genre=?, rating=?, format=?, "
+      "updated_at=strftime('%s', 'now') WHERE id=?";
+static const char db_sql_track_exists[]
+    = "SELECT COUNT(*) FROM tracks WHERE dir_id=? AND filename=?";
+static const char db_sql_track_by_filepath[]
+    = "SELECT id, dir_id, filename, display_name, search_text, "
+      "filesize, filedate, duration, bitrate, genre, rating, "
+      "created_at, updated_at, format, fingerprint "
+      "FROM tracks WHERE dir_id=? AND filename=?";
+/*
+ * Directory paths are only put together when the pattern is not "%%". A
+ * pattern matches the directory or the file name, not across the '/'.
+ */
+static const char db_sql_search_tracks[]
+    = DB_DIR_PATHS_CTE "SELECT id, dir_id, filename, display_name, search_text, "
+		       "filesize, filedate, duration, bitrate, genre, rating, "
+		       "created_at, updated_at, format, fingerprint FROM tracks "
+		       "WHERE ?1 = '%%' OR display_name LIKE ?1 OR search_text LIKE ?1 "
+		       "OR filename LIKE ?1 "
+		       "OR dir_id IN (SELECT id FROM dir_paths WHERE path LIKE ?1) "
+		       "ORDER BY display_name";
+/* Scores every track, but only copies out the ones that are shown */
+static const char db_sql_fuzzy_search_tracks[]
+    = "SELECT id, dir_id, filename, display_name, search_text, "
+      "filesize, filedate, duration, bitrate, genre, rating, "
+      "created_at, updated_at, format, fingerprint FROM tracks "
+      "WHERE glaciera_fuzzy(search_text, glaciera_norm(?1)) >= ?2 "
+      "ORDER BY glaciera_fuzzy(search_text, glaciera_norm(?1)) DESC, display_name LIMIT ?3";
+/* The partial index on play_count needs the "play_count > 0" spelled out */
+static const char db_sql_top_tracks[]
+    = "SELECT id, dir_id, filename, display_name, search_text, "
+      "filesize, filedate, duration, bitrate, genre, rating, "
+      "created_at, updated_at, format, fingerprint, play_count FROM tracks "
+      "WHERE play_count > 0 AND play_count >= ?1 "
+      "ORDER BY play_count DESC, display_name LIMIT ?2";
+static const char db_sql_record_play[]
+    = "INSERT INTO plays (track_id, started_at, seconds_played, skipped) "
+      "SELECT id, ?3, ?4, ?5 FROM tracks WHERE dir_id=?1 AND filename=?2";
+/* The track is in main or in one of the shards, see db_store_plays() */
+#define DB_SQL_COUNT_PLAY(schema)                                                             \
+	"UPDATE " schema ".tracks SET play_count=play_count+1, last_played=max(last_played, ?3) " \
+	"WHERE dir_id=?1 AND filename=?2"
+static const char db_sql_count_play[] = DB_SQL_COUNT_PLAY("main");
+static const char db_sql_find_dir[] = "SELECT id FROM dirs WHERE parent=? AND name=?";
+/* The id is left NULL, except in a shard, see db_shard_next_dir() */
+static const char db_sql_add_dir[] = "INSERT INTO dirs (id, parent, name) VALUES (?3, ?1, ?2)";
+static const char db_sql_scan_dir_is_done[]
+    = "SELECT 1 FROM scan_progress WHERE root=? AND dir=?";
+static const char db_sql_scan_dir_done[]
+    = "INSERT OR IGNORE INTO scan_progress (root, dir) VALUES (?, ?)";
+static const char db_sql_mark_track_scanned[]
+    = "UPDATE tracks SET scan_id=? WHERE dir_id=? AND filename=?";
+static const char db_sql_sweep_tracks[]
+    = DB_DIRS_BELOW_CTE "DELETE FROM tracks WHERE dir_id IN below AND scan_id <> ?2";
+/* Directories below ?1 left empty, each round empties their parents */
+static const char db_sql_sweep_dirs[]
+    = DB_DIRS_BELOW_CTE "DELETE FROM dirs WHERE id IN below AND id <> ?1 "
+			"AND NOT EXISTS (SELECT 1 FROM tracks WHERE dir_id=dirs.id) "
+			"AND NOT EXISTS (SELECT 1 FROM dirs AS child WHERE child.parent=dirs.id)";
+static const char db_sql_set_fingerprint[]
+    = "UPDATE tracks SET fingerprint=? WHERE dir_id=? AND filename=?";
+/* Written only when something differs, a rescan of an unchanged file is a lookup */
+static const char db_sql_set_tags[]
+    = "UPDATE tracks SET tagged=?3, tag_title=?4, tag_artist=?5, tag_album=?6, tag_track=?7, "
+      "tag_track_number=?8, tag_genre=?9 WHERE dir_id=?1 AND filename=?2 AND (tagged IS NOT ?3 "
+      "OR tag_title IS NOT ?4 OR tag_artist IS NOT ?5 OR tag_album IS NOT ?6 "
+      "OR tag_track IS NOT ?7 OR tag_track_number IS NOT ?8 OR tag_genre IS NOT ?9)";
+/*
+ * The artist, album and genre of the tracks matching where, added to
+ * their tables when new, see db_set_track_tags(). Names match without
+ * regard to case, the first spelling seen is the one kept. They are
+ * looked up before the insert, an ignored insert would use up an id.
+ */
+#define DB_SQL_INTERN_TAGS(where)                                                                  \
+	"INSERT OR IGNORE INTO artists (name) "                                                    \
+	"SELECT tag_artist FROM tracks WHERE " where " AND tag_artist <> '' "                      \
+	"AND NOT EXISTS (SELECT 1 FROM artists WHERE name=tag_artist)",                            \
+	"INSERT OR IGNORE INTO genres (name) "                                                     \
+	"SELECT tag_genre FROM tracks WHERE " where " AND tag_genre <> '' "                        \
+	"AND NOT EXISTS (SELECT 1 FROM genres WHERE name=tag_genre)",                              \
+	"INSERT OR IGNORE INTO albums (artist_id, name) "                                          \
+	"SELECT coalesce(a.id, 0), t.tag_album FROM tracks AS t "                                  \
+	"LEFT JOIN artists AS a ON a.name=t.tag_artist "                                           \
+	"WHERE " where " AND t.tag_album <> '' AND NOT EXISTS (SELECT 1 FROM albums AS b "         \
+	"WHERE b.artist_id=coalesce(a.id, 0) AND b.name=t.tag_album)",                             \
+	"UPDATE tracks SET "                                                                       \
+	"artist_id=coalesce((SELECT id FROM artists WHERE name=tag_artist), 0), "                  \
+	"genre_id=coalesce((SELECT id FROM genres WHERE name=tag_genre), 0) "                      \
+	"WHERE " where,                                                                            \
+	"UPDATE tracks SET album_id=coalesce((SELECT id FROM albums "                              \
+	"WHERE artist_id=tracks.artist_id AND name=tag_album), 0) WHERE " where
+static const char *const db_sql_intern_track[]
+    = { DB_SQL_INTERN_TAGS("dir_id=?1 AND filename=?2") };
+static const char *const db_sql_intern_all[] = { DB_SQL_INTERN_TAGS("1") };
+/*
+ * The counts of the artists, albums and genres in schema, and the names
+ * no track has any more removed. Only rows that changed are written.
+ */
+#define DB_SQL_COUNT_TAG(schema, table, column)                                                    \
+	"UPDATE " schema "." table " SET track_count=c.n, duration=c.d FROM ("                     \
+	"    SELECT " column ", count(*) AS n, sum(duration) AS d FROM " schema ".tracks"          \
+	"    GROUP BY " column ") AS c "                                                           \
+	"WHERE " table ".id=c." column " AND (track_count<>c.n OR duration<>c.d)"
+#define DB_SQL_UNUSED_TAG(schema, table, column)                                                   \
+	"DELETE FROM " schema "." table " "                                                        \
+	"WHERE id NOT IN (SELECT " column " FROM " schema ".tracks)"
+#define DB_SQL_COUNT_TAGS(schema)                                                                  \
+	DB_SQL_COUNT_TAG(schema, "artists", "artist_id"),                                          \
+	DB_SQL_COUNT_TAG(schema, "albums", "album_id"),                                            \
+	DB_SQL_COUNT_TAG(schema, "genres", "genre_id"),                                            \
+	DB_SQL_UNUSED_TAG(schema, "albums", "album_id"),                                           \
+	DB_SQL_UNUSED_TAG(schema, "artists", "artist_id"),                                         \
+	DB_SQL_UNUSED_TAG(schema, "genres", "genre_id")
+static const char *const db_sql_count_tags[] = { DB_SQL_COUNT_TAGS("main") };
+/* Each of them by name and by track. Through the views of the shards, see db_attach_shards() */
+#define DB_SQL_TAG_VALUES(table)                                                                   \
+	"SELECT name, sum(track_count), sum(duration) FROM " table " "                             \
+	"WHERE ?1 IS NULL OR name LIKE ?1 || '%' "                                                 \
+	"GROUP BY name COLLATE NOCASE HAVING sum(track_count) >= ?2 ORDER BY name COLLATE NOCASE"
+#define DB_SQL_TAG_TRACKS(table, column)                                                           \
+	"SELECT id, dir_id, filename, display_name, search_text, "                                 \
+	"filesize, filedate, duration, bitrate, genre, rating, "                                   \
+	"created_at, updated_at, format, fingerprint FROM tracks "                                 \
+	"WHERE " column " IN (SELECT id FROM " table " WHERE name=?1 COLLATE NOCASE) "             \
+	"ORDER BY display_name"
+#define DB_SQL_TRACK_TAG(table, column)                                                            \
+	"SELECT name FROM " table " WHERE id=("                                                    \
+	"    SELECT " column " FROM tracks WHERE dir_id=?1 AND filename=?2)"
+
+static const struct {
+	const char *table;
+	const char *values;
+	const char *tracks;
+	const char *of_track;
+} db_sql_tags[] = {
+	[DB_ARTISTS] = { "artists", DB_SQL_TAG_VALUES("artists"),
+	    DB_SQL_TAG_TRACKS("artists", "artist_id"), DB_SQL_TRACK_TAG("artists", "artist_id") },
+	[DB_ALBUMS] = { "albums", DB_SQL_TAG_VALUES("albums"),
+	    DB_SQL_TAG_TRACKS("albums", "album_id"), DB_SQL_TRACK_TAG("albums", "album_id") },
+	[DB_GENRES] = { "genres", DB_SQL_TAG_VALUES("genres"),
+	    DB_SQL_TAG_TRACKS("genres", "genre_id"), DB_SQL_TRACK_TAG("genres", "genre_id") },
+};
+static const char db_sql_set_keepers[]
+    = "UPDATE dirs SET keepers=?2 WHERE id=?1 AND keepers IS NOT ?2";
+static const char db_sql_find_moved_track[]
+    = "SELECT id, dir_id, filename FROM tracks WHERE fingerprint=? AND filesize=? LIMIT 64";
+static const char db_sql_move_track[]
+    = "UPDATE tracks SET dir_id=?1, filename=?2, scan_id=?3, "
+      "display_name=coalesce(?5, display_name), search_text=coalesce(?6, search_text), "
+      "updated_at=strftime('%s', 'now') WHERE id=?4";
+
+static const struct {
+	const char *name;
+	const char *sql;
+} db_hot_statements[] = {
+	{ "load and search", db_sql_search_tracks },
+	{ "fuzzy search", db_sql_fuzzy_search_tracks },
+	{ "top tracks", db_sql_top_tracks },
+	{ "record play", db_sql_record_play },
+	{ "count play", db_sql_count_play },
+	{ "track exists", db_sql_track_exists },
+	{ "track by path", db_sql_track_by_filepath },
+	{ "find directory", db_sql_find_dir },
+	{ "add directory", db_sql_add_dir },
+	{ "insert track", db_sql_insert_track },
+	{ "update track", db_sql_update_track },
+	{ "mark scanned", db_sql_mark_track_scanned },
+	{ "set fingerprint", db_sql_set_fingerprint },
+	{ "set tags", db_sql_set_tags },
+	{ "set keepers", db_sql_set_keepers },
+	{ "artists", DB_SQL_TAG_VALUES("artists") },
+	{ "artist tracks", DB_SQL_TAG_TRACKS("artists", "artist_id") },
+	{ "genre tracks", DB_SQL_TAG_TRACKS("genres", "genre_id") },
+	{ "find moved track", db_sql_find_moved_track },
+	{ "move track", db_sql_move_track },
+	{ "directory done?", db_sql_scan_dir_is_done },
+	{ "directory done", db_sql_scan_dir_done },
+	{ "sweep", db_sql_sweep_tracks },
+	{ "sweep directories", db_sql_sweep_dirs },
+};
 
 static bool db_migrate_from_mmap(const char *db_path) {
 	char old_db_path[1024];
@@ -93,6 +339,9 @@ static bool db_migrate_from_mmap(const char *db_path) {
 		char *search = search_data + base0->p3;
 		struct tuneinfo ti = *ti_data;
 
+		/* The old format has no format id, resolve it again on next scan */
+		ti.format = 0;
+
 		/* Insert track into SQLite */
 		if (db_insert_track(path, display, search, &ti)) {
 			track_count++;
@@ -153,13 +402,78 @@ static bool mkdir_recursive(const char *path) {
 	return true;
 }
 
-bool db_init(const char *db_path) {
+/* Settings that last as long as the connection, see db_profile_t */
+static void db_apply_profile(sqlite3 *conn, const db_profile_t *p) {
+	char sql[256];
+
+	snprintf(sql, sizeof(sql),
+	    "PRAGMA synchronous=%s; PRAGMA temp_store=%s; PRAGMA cache_size=-%d; "
+	    "PRAGMA mmap_size=%lld; PRAGMA wal_autocheckpoint=%d",
+	    p->synchronous, p->temp_store, p->cache_size_kb,
+	    (long long)p->mmap_size_mb * 1024 * 1024, p->wal_autocheckpoint);
+	sqlite3_exec(conn, sql, NULL, NULL, NULL);
+	sqlite3_busy_timeout(conn, p->busy_timeout_ms);
+}
+
+/*
+ * SQL versions of only_searchables() and fuzzy(), so that searches can
+ * filter and rank inside SQLite instead of on every row copied out:
+ *
+ *   glaciera_norm(text)              uppercase letters and digits only
+ *   glaciera_fuzzy(haystack, needle) n-gram similarity, 0 to 100
+ *
+ * Both are deterministic, which also allows them in index expressions.
+ */
+static void db_sql_norm(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+	const unsigned char *text = sqlite3_value_text(argv[0]);
+	char *norm;
+
+	(void)argc;
+	if (!text) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	norm = sqlite3_malloc(sqlite3_value_bytes(argv[0]) + 1);
+	if (!norm) {
+		sqlite3_result_error_nomem(ctx);
+		return;
+	}
+	strcpy(norm, (const char *)text);
+	only_searchables(norm);
+	sqlite3_result_text(ctx, norm, -1, sqlite3_free);
+}
+
+static void db_sql_fuzzy(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+	const char *haystack = (const char *)sqlite3_value_text(argv[0]);
+	const char *needle = (const char *)sqlite3_value_text(argv[1]);
+
+	(void)argc;
+	if (!haystack || !needle) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	sqlite3_result_int(ctx, fuzzy(haystack, needle));
+}
+
+static void db_register_functions(sqlite3 *conn) {
+	int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+
+	/* The character tables of only_searchables() have to be filled first */
+	build_fastarrays();
+	sqlite3_create_function(conn, "glaciera_norm", 1, flags, NULL, db_sql_norm, NULL, NULL);
+	sqlite3_create_function(conn, "glaciera_fuzzy", 2, flags, NULL, db_sql_fuzzy, NULL, NULL);
+}
+
+/* profile may be NULL for the SQLite defaults */
+bool db_init(const char *db_path, const db_profile_t *profile) {
+	char sql[64];
 	int rc;
+	bool in_memory = strcmp(db_path, DB_IN_MEMORY) == 0;
 
 	/* Create directory if it doesn't exist */
 	char *dir = strdup(db_path);
 	char *last_slash = strrchr(dir, '/');
-	if (last_slash) {
+	if (last_slash && !in_memory) {
 		*last_slash = '\0';
 		if (!mkdir_recursive(dir)) {
 			fprintf(stderr, "Failed to create database directory: %s\n", dir);
@@ -174,103 +488,671 @@ bool db_init(const char *db_path) {
 		fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
 		return false;
 	}
+	db_register_functions(db);
+
+	if (profile) {
+		db_profile = *profile;
+		/* Has to come before WAL mode, which writes the first page */
+		snprintf(sql, sizeof(sql), "PRAGMA page_size=%d", profile->page_size);
+		sqlite3_exec(db, sql, NULL, NULL, NULL);
+	} else {
+		memset(&db_profile, 0, sizeof(db_profile));
+	}
 
 	/* Enable WAL mode for better concurrency */
 	sqlite3_exec(db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+	if (profile)
+		db_apply_profile(db, profile);
 
-	/* Migrate from old mmap format if needed */
-	if (!db_migrate_from_mmap(db_path)) {
+	/* Create schema if needed */
+	if (!db_migrate()) {
 		sqlite3_close(db);
 		db = NULL;
 		return false;
 	}
 
-	/* Create schema if needed */
-	if (!db_migrate()) {
+	/* Migrate from old mmap format if needed, into the current schema */
+	if (!in_memory && !db_migrate_from_mmap(db_path)) {
+		sqlite3_close(db);
+		db = NULL;
+		return false;
+	}
+
+	db_shard_count = db_attach_shards(db);
+	if (db_shard_count < 0) {
 		sqlite3_close(db);
 		db = NULL;
+		db_shard_count = 0;
 		return false;
 	}
 
 	return true;
 }
 
+/* Called when directory ids may have gone: another database, or a rollback */
+static void db_dir_forget(void) {
+	struct db_dir_cache *cache = db_shard ? &db_shard->dirs : &db_dirs;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->last_id = 0;
+	pthread_mutex_unlock(&cache->lock);
+}
+
 void db_close(void) {
 	if (db) {
 		sqlite3_close(db);
 		db = NULL;
 	}
+	db_shard_count = 0;
+	db_close_writer();
+	if (db_primary) {
+		sqlite3_close(db_primary);
+		db_primary = NULL;
+	}
+	db_dir_forget();
 }
 
-bool db_migrate(void) {
-	int rc;
+static bool db_column_exists(const char *table, const char *column) {
+	sqlite3_stmt *stmt;
+	char sql[128];
+	bool exists = false;
+
+	snprintf(sql, sizeof(sql), "PRAGMA table_info(%s)", table);
+	if (sqlite3_prepare_v2(db_conn(), sql, -1, &stmt, NULL) != SQLITE_OK)
+		return false;
+
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		const char *name = (const char *)sqlite3_column_text(stmt, 1);
+		if (name && strcmp(name, column) == 0) {
+			exists = true;
+			break;
+		}
+	}
+
+	sqlite3_finalize(stmt);
+	return exists;
+}
+
+static bool db_exec(const char *sql) {
 	char *errmsg = NULL;
 
-	/* Create tracks table */
-	const char *create_tracks_sql
-	    = "CREATE TABLE IF NOT EXISTS tracks ("
-	      "    id INTEGER PRIMARY KEY AUTOINCREMENT,"
-	      "    filepath TEXT NOT NULL UNIQUE,"
-	      "    display_name TEXT NOT NULL,"
-	      "    search_text TEXT NOT NULL,"
-	      "    filesize INTEGER NOT NULL,"
-	      "    filedate INTEGER NOT NULL,"
-	      "    duration INTEGER NOT NULL,"
-	      "    bitrate INTEGER NOT NULL,"
-	      "    genre INTEGER NOT NULL,"
-	      "    rating INTEGER NOT NULL,"
-	      "    created_at INTEGER NOT NULL DEFAULT (strftime('%s', 'now')),"
-	      "    updated_at INTEGER NOT NULL DEFAULT (strftime('%s', 'now'))"
-	      ");"
-	      "CREATE INDEX IF NOT EXISTS idx_tracks_filepath ON tracks(filepath);"
-	      "CREATE INDEX IF NOT EXISTS idx_tracks_display_name ON tracks(display_name);"
-	      "CREATE INDEX IF NOT EXISTS idx_tracks_search_text ON tracks(search_text);"
-	      "CREATE INDEX IF NOT EXISTS idx_tracks_filesize ON tracks(filesize);"
-	      "CREATE INDEX IF NOT EXISTS idx_tracks_filedate ON tracks(filedate);"
-	      "CREATE INDEX IF NOT EXISTS idx_tracks_genre ON tracks(genre);"
-	      "CREATE INDEX IF NOT EXISTS idx_tracks_rating ON tracks(rating);";
-
-	rc = sqlite3_exec(db, create_tracks_sql, NULL, NULL, &errmsg);
-	if (rc != SQLITE_OK) {
+	if (sqlite3_exec(db_conn(), sql, NULL, NULL, &errmsg) != SQLITE_OK) {
 		fprintf(stderr, "SQL error: %s\n", errmsg);
 		sqlite3_free(errmsg);
 		return false;
 	}
+	return true;
+}
+
+static bool db_step_done(sqlite3_stmt *stmt, const char *what) {
+	int rc = sqlite3_step(stmt);
+
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Failed to %s: %s\n", what, sqlite3_errmsg(db_conn()));
+		return false;
+	}
+	return true;
+}
+
+static sqlite3_stmt *db_prepare(const char *sql) {
+	sqlite3_stmt *stmt;
+
+	if (sqlite3_prepare_v2(db_conn(), sql, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db_conn()));
+		return NULL;
+	}
+	return stmt;
+}
+
+/* --------------------------------------------------------------------------
+ * Directories
+ *
+ * A track is stored as the id of its directory and its file name. A
+ * row of dirs is one path component below its parent, parent 0 for
+ * the first component, so the part of the paths a library shares is
+ * stored once. The first component of an absolute path is the empty
+ * name in front of its leading '/'. A file name without any '/' has
+ * dir_id 0.
+ */
+
+/*
+ * Id of the directory in the first len bytes of dir, added to dirs with
+ * create. Returns 0 if there is no such directory, -1 on error.
+ *
+ * Through the shards, every database has its own rows for the part of
+ * the paths they share, so each component is looked up below all the
+ * rows the one before it matched.
+ */
+static int db_dir_find(const char *dir, size_t len, bool create) {
+	struct db_dir_cache *cache = db_shard ? &db_shard->dirs : &db_dirs;
+	sqlite3_stmt *find;
+	sqlite3_stmt *add = NULL;
+	int parents[DB_SHARD_ATTACH_MAX + 1];
+	int found[DB_SHARD_ATTACH_MAX + 1];
+	int parent_count = 1;
+	int found_count;
+	size_t start = 0;
+	int id = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	if (cache->last_id && strlen(cache->last) == len && memcmp(cache->last, dir, len) == 0) {
+		id = cache->last_id;
+		pthread_mutex_unlock(&cache->lock);
+		return id;
+	}
+
+	find = db_prepare(db_sql_find_dir);
+	if (create)
+		add = db_prepare(db_sql_add_dir);
+	if (!find || (create && !add))
+		id = -1;
+	parents[0] = 0;
+	while (id >= 0) {
+		const char *slash = memchr(dir + start, '/', len - start);
+		size_t end = slash ? (size_t)(slash - dir) : len;
+
+		found_count = 0;
+		for (int p = 0; p < parent_count; p++) {
+			sqlite3_bind_int(find, 1, parents[p]);
+			sqlite3_bind_text(find, 2, dir + start, (int)(end - start), SQLITE_STATIC);
+			while (found_count < DB_SHARD_ATTACH_MAX + 1
+			    && sqlite3_step(find) == SQLITE_ROW)
+				found[found_count++] = sqlite3_column_int(find, 0);
+			sqlite3_reset(find);
+		}
+		id = found_count ? found[0] : 0;
+		if (!id && create) {
+			int new_id = db_shard ? db_shard_next_dir() : 0;
+
+			sqlite3_bind_int(add, 1, parents[0]);
+			sqlite3_bind_text(add, 2, dir + start, (int)(end - start), SQLITE_STATIC);
+			if (new_id)
+				sqlite3_bind_int(add, 3, new_id);
+			if (new_id >= 0 && sqlite3_step(add) == SQLITE_DONE) {
+				id = (int)sqlite3_last_insert_rowid(db_conn());
+				found[found_count++] = id;
+			} else {
+				fprintf(stderr, "Failed to add directory: %s\n",
+				    sqlite3_errmsg(db_conn()));
+				id = -1;
+			}
+			sqlite3_reset(add);
+		}
+		if (id <= 0 || !slash)
+			break;
+		memcpy(parents, found, found_count * sizeof(found[0]));
+		parent_count = found_count;
+		start = end + 1;
+	}
+	sqlite3_finalize(find);
+	sqlite3_finalize(add);
+
+	if (id > 0 && len < sizeof(cache->last)) {
+		memcpy(cache->last, dir, len);
+		cache->last[len] = '\0';
+		cache->last_id = id;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return id;
+}
+
+/*
+ * Directory id and file name of path. Returns -1, which no track has,
+ * when the directory is not known or on error.
+ */
+static int db_split_path(const char *path, const char **filename, bool create) {
+	const char *slash = strrchr(path, '/');
+	int id;
+
+	if (!slash) {
+		*filename = path;
+		return 0;
+	}
+	*filename = slash + 1;
+	id = db_dir_find(path, slash - path, create);
+	return id > 0 ? id : -1;
+}
+
+/* Directory id of a scanned root, -1 if nothing below it was ever stored */
+static int db_root_dir(const char *root) {
+	size_t len = strlen(root);
+	int id;
+
+	/* "/" is the empty first component */
+	while (len && root[len - 1] == '/')
+		len--;
+	id = db_dir_find(root, len, false);
+	return id > 0 ? id : -1;
+}
+
+/* Path of directory id in out, walking up to the first component */
+static bool db_dir_path(int id, char *out, size_t out_size) {
+	sqlite3_stmt *stmt = db_prepare("SELECT parent, name FROM dirs WHERE id=?");
+	size_t pos = out_size - 1;
+
+	if (!stmt || out_size == 0)
+		return false;
+	out[pos] = '\0';
+	while (id > 0) {
+		const char *name;
+		size_t len;
+		int parent;
+
+		sqlite3_bind_int(stmt, 1, id);
+		if (sqlite3_step(stmt) != SQLITE_ROW)
+			break;
+		name = (const char *)sqlite3_column_text(stmt, 1);
+		len = strlen(name);
+		parent = sqlite3_column_int(stmt, 0);
+		if (len + (parent > 0) > pos)
+			break;
+		pos -= len;
+		memcpy(out + pos, name, len);
+		if (parent > 0)
+			out[--pos] = '/';
+		id = parent;
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+	if (id > 0)
+		return false;
+	memmove(out, out + pos, out_size - pos);
+	return true;
+}
+
+/*
+ * Paths of all directories, indexed by id, NULL where there is no
+ * directory (always at 0). count is one more than the largest id.
+ */
+char **db_get_dir_paths(int *count) {
+	sqlite3_stmt *stmt = db_prepare(DB_DIR_PATHS_CTE "SELECT id, path FROM dir_paths");
+	char **dirs = calloc(1, sizeof(*dirs));
+	int n = 1;
+
+	*count = 0;
+	if (!stmt || !dirs) {
+		sqlite3_finalize(stmt);
+		free(dirs);
+		return NULL;
+	}
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		int id = sqlite3_column_int(stmt, 0);
+
+		if (id <= 0)
+			continue;
+		if (id >= n) {
+			char **d = realloc(dirs, (id + 1) * sizeof(*dirs));
+
+			if (!d) {
+				sqlite3_finalize(stmt);
+				db_free_dir_paths(dirs, n);
+				return NULL;
+			}
+			dirs = d;
+			memset(dirs + n, 0, (id + 1 - n) * sizeof(*dirs));
+			n = id + 1;
+		}
+		dirs[id] = strdup((const char *)sqlite3_column_text(stmt, 1));
+	}
+	sqlite3_finalize(stmt);
+	*count = n;
+	return dirs;
+}
+
+void db_free_dir_paths(char **dirs, int count) {
+	if (dirs) {
+		for (int i = 0; i < count; i++)
+			free(dirs[i]);
+		free(dirs);
+	}
+}
+
+/* --------------------------------------------------------------------------
+ * Schema migrations
+ *
+ * PRAGMA user_version is the number of migrations applied. db_migrate()
+ * applies the missing ones in order, each in a transaction together
+ * with the new version. A released migration is never changed, the
+ * schema moves on with a new one.
+ */
+
+/* 1: the schema as it was before migrations were numbered */
+static bool db_migration_1(void) {
+	if (!db_exec("CREATE TABLE IF NOT EXISTS tracks ("
+		     "    id INTEGER PRIMARY KEY AUTOINCREMENT,"
+		     "    filepath TEXT NOT NULL UNIQUE,"
+		     "    display_name TEXT NOT NULL,"
+		     "    search_text TEXT NOT NULL,"
+		     "    filesize INTEGER NOT NULL,"
+		     "    filedate INTEGER NOT NULL,"
+		     "    duration INTEGER NOT NULL,"
+		     "    bitrate INTEGER NOT NULL,"
+		     "    genre INTEGER NOT NULL,"
+		     "    rating INTEGER NOT NULL,"
+		     "    format INTEGER NOT NULL DEFAULT 0,"
+		     "    created_at INTEGER NOT NULL DEFAULT (strftime('%s', 'now')),"
+		     "    updated_at INTEGER NOT NULL DEFAULT (strftime('%s', 'now'))"
+		     ");"
+		     "CREATE INDEX IF NOT EXISTS idx_tracks_filepath ON tracks(filepath);"
+		     "CREATE INDEX IF NOT EXISTS idx_tracks_display_name ON tracks(display_name);"
+		     "CREATE INDEX IF NOT EXISTS idx_tracks_search_text ON tracks(search_text);"
+		     "CREATE INDEX IF NOT EXISTS idx_tracks_filesize ON tracks(filesize);"
+		     "CREATE INDEX IF NOT EXISTS idx_tracks_filedate ON tracks(filedate);"
+		     "CREATE INDEX IF NOT EXISTS idx_tracks_genre ON tracks(genre);"
+		     "CREATE INDEX IF NOT EXISTS idx_tracks_rating ON tracks(rating);"
+		     /* One row per indexed root, completed_at is NULL while a scan is unfinished */
+		     "CREATE TABLE IF NOT EXISTS scan_roots ("
+		     "    root TEXT PRIMARY KEY,"
+		     "    scan_id INTEGER NOT NULL,"
+		     "    started_at INTEGER NOT NULL DEFAULT (strftime('%s', 'now')),"
+		     "    completed_at INTEGER"
+		     ");"
+		     /* Directories (with all their subdirectories) done by an unfinished scan */
+		     "CREATE TABLE IF NOT EXISTS scan_progress ("
+		     "    root TEXT NOT NULL,"
+		     "    dir TEXT NOT NULL,"
+		     "    PRIMARY KEY (root, dir)"
+		     ") WITHOUT ROWID;"))
+		return false;
+
+	/* Databases created before the format column existed */
+	if (!db_column_exists("tracks", "format")
+	    && !db_exec("ALTER TABLE tracks ADD COLUMN format INTEGER NOT NULL DEFAULT 0"))
+		return false;
+
+	/* Size and head/tail hash of the file, see db_find_moved_track() */
+	if (!db_column_exists("tracks", "fingerprint")
+	    && !db_exec("ALTER TABLE tracks ADD COLUMN fingerprint INTEGER NOT NULL DEFAULT 0;"
+			"CREATE INDEX IF NOT EXISTS idx_tracks_fingerprint "
+			"    ON tracks(fingerprint);"))
+		return false;
+
+	/* The scan that last saw the file, see db_scan_finish() */
+	if (!db_column_exists("tracks", "scan_id")
+	    && !db_exec("ALTER TABLE tracks ADD COLUMN scan_id INTEGER NOT NULL DEFAULT 0"))
+		return false;
+
+	return true;
+}
+
+/*
+ * 2: index audit. The UNIQUE constraint already indexes filepath, and
+ * nothing looks tracks up by search text (searches are LIKE '%...%'),
+ * size, date, genre or rating. The library load reads every column in
+ * display name order, which a covering index serves without a sort or
+ * a table lookup per row. Move detection reads id and path by
+ * fingerprint and size.
+ */
+static bool db_migration_2(void) {
+	return db_exec("DROP INDEX IF EXISTS idx_tracks_filepath;"
+		       "DROP INDEX IF EXISTS idx_tracks_display_name;"
+		       "DROP INDEX IF EXISTS idx_tracks_search_text;"
+		       "DROP INDEX IF EXISTS idx_tracks_filesize;"
+		       "DROP INDEX IF EXISTS idx_tracks_filedate;"
+		       "DROP INDEX IF EXISTS idx_tracks_genre;"
+		       "DROP INDEX IF EXISTS idx_tracks_rating;"
+		       "DROP INDEX IF EXISTS idx_tracks_fingerprint;"
+		       "CREATE INDEX idx_tracks_load ON tracks(display_name, filepath, "
+		       "    search_text, filesize, filedate, duration, bitrate, genre, rating, "
+		       "    created_at, updated_at, format, fingerprint);"
+		       "CREATE INDEX idx_tracks_moved ON tracks(fingerprint, filesize, filepath);");
+}
+
+/*
+ * 3: library generation, bumped by every indexer run that changes
+ * tracks. A snapshot is only used for the generation it was written
+ * for, see snapshot.c.
+ */
+static bool db_migration_3(void) {
+	return db_exec("CREATE TABLE meta ("
+		       "    key TEXT PRIMARY KEY,"
+		       "    value INTEGER NOT NULL"
+		       ") WITHOUT ROWID;"
+		       "INSERT INTO meta (key, value) VALUES ('generation', 1);");
+}
+
+/*
+ * 4: paths split into a directory and a file name, see db_dir_find().
+ * The UNIQUE constraint moves from the path to (dir_id, filename), and
+ * the indices that held the path hold both instead.
+ */
+static bool db_migration_4(void) {
+	sqlite3_stmt *rows;
+	sqlite3_stmt *copy;
+	bool ok;
+
+	if (!db_exec("CREATE TABLE dirs ("
+		     "    id INTEGER PRIMARY KEY,"
+		     "    parent INTEGER NOT NULL,"
+		     "    name TEXT NOT NULL,"
+		     "    UNIQUE (parent, name)"
+		     ");"
+		     "CREATE TABLE tracks_new ("
+		     "    id INTEGER PRIMARY KEY AUTOINCREMENT,"
+		     "    dir_id INTEGER NOT NULL,"
+		     "    filename TEXT NOT NULL,"
+		     "    display_name TEXT NOT NULL,"
+		     "    search_text TEXT NOT NULL,"
+		     "    filesize INTEGER NOT NULL,"
+		     "    filedate INTEGER NOT NULL,"
+		     "    duration INTEGER NOT NULL,"
+		     "    bitrate INTEGER NOT NULL,"
+		     "    genre INTEGER NOT NULL,"
+		     "    rating INTEGER NOT NULL,"
+		     "    format INTEGER NOT NULL DEFAULT 0,"
+		     "    created_at INTEGER NOT NULL DEFAULT (strftime('%s', 'now')),"
+		     "    updated_at INTEGER NOT NULL DEFAULT (strftime('%s', 'now')),"
+		     "    fingerprint INTEGER NOT NULL DEFAULT 0,"
+		     "    scan_id INTEGER NOT NULL DEFAULT 0,"
+		     "    UNIQUE (dir_id, filename)"
+		     ");"))
+		return false;
+
+	rows = db_prepare("SELECT id, filepath FROM tracks");
+	copy = db_prepare("INSERT INTO tracks_new (id, dir_id, filename, display_name, "
+			  "    search_text, filesize, filedate, duration, bitrate, genre, rating, "
+			  "    format, created_at, updated_at, fingerprint, scan_id) "
+			  "SELECT id, ?2, ?3, display_name, search_text, filesize, filedate, "
+			  "    duration, bitrate, genre, rating, format, created_at, updated_at, "
+			  "    fingerprint, scan_id FROM tracks WHERE id=?1");
+	ok = rows && copy;
+	while (ok && sqlite3_step(rows) == SQLITE_ROW) {
+		const char *filename;
+		int dir_id = db_split_path(
+		    (const char *)sqlite3_column_text(rows, 1), &filename, true);
+
+		sqlite3_bind_int(copy, 1, sqlite3_column_int(rows, 0));
+		sqlite3_bind_int(copy, 2, dir_id);
+		sqlite3_bind_text(copy, 3, filename, -1, SQLITE_STATIC);
+		ok = dir_id >= 0 && sqlite3_step(copy) == SQLITE_DONE;
+		sqlite3_reset(copy);
+	}
+	sqlite3_finalize(rows);
+	sqlite3_finalize(copy);
+
+	return ok
+	    && db_exec("DROP TABLE tracks;"
+		       "ALTER TABLE tracks_new RENAME TO tracks;"
+		       "CREATE INDEX idx_tracks_load ON tracks(display_name, dir_id, filename, "
+		       "    search_text, filesize, filedate, duration, bitrate, genre, rating, "
+		       "    created_at, updated_at, format, fingerprint);"
+		       "CREATE INDEX idx_tracks_moved ON tracks(fingerprint, filesize, dir_id, "
+		       "    filename);");
+}
+
+/*
+ * 5: play statistics. plays has a row for every play, and tracks keeps
+ * the number and the time of the last one that was not skipped, see
+ * db_record_plays(). The toplist reads the partial index on play_count.
+ */
+static bool db_migration_5(void) {
+	return db_exec("CREATE TABLE plays ("
+		       "    id INTEGER PRIMARY KEY,"
+		       "    track_id INTEGER NOT NULL,"
+		       "    started_at INTEGER NOT NULL,"
+		       "    seconds_played INTEGER NOT NULL,"
+		       "    skipped INTEGER NOT NULL DEFAULT 0"
+		       ");"
+		       "CREATE INDEX idx_plays_time ON plays(started_at);"
+		       "ALTER TABLE tracks ADD COLUMN play_count INTEGER NOT NULL DEFAULT 0;"
+		       "ALTER TABLE tracks ADD COLUMN last_played INTEGER NOT NULL DEFAULT 0;"
+		       "CREATE INDEX idx_tracks_plays ON tracks(play_count DESC, display_name) "
+		       "    WHERE play_count > 0;");
+}
+
+/*
+ * 6: shards, see db_shard_open(). path is absolute, a replica of the
+ * database reads the same files.
+ */
+static bool db_migration_6(void) {
+	return db_exec("CREATE TABLE shards ("
+		       "    id INTEGER PRIMARY KEY,"
+		       "    root TEXT NOT NULL UNIQUE,"
+		       "    path TEXT NOT NULL"
+		       ");");
+}
+
+/*
+ * 7: what display names are made of, see db_get_name_sources(). tagged
+ * is NULL for tracks indexed before, 0 when the file has no tags. The
+ * keepers of a directory are the file name columns its names keep.
+ */
+static bool db_migration_7(void) {
+	return db_exec("ALTER TABLE tracks ADD COLUMN tagged INTEGER;"
+		       "ALTER TABLE tracks ADD COLUMN tag_title TEXT;"
+		       "ALTER TABLE tracks ADD COLUMN tag_artist TEXT;"
+		       "ALTER TABLE tracks ADD COLUMN tag_album TEXT;"
+		       "ALTER TABLE tracks ADD COLUMN tag_track TEXT;"
+		       "ALTER TABLE tracks ADD COLUMN tag_track_number INTEGER NOT NULL DEFAULT -1;"
+		       "ALTER TABLE dirs ADD COLUMN keepers BLOB;");
+}
+
+/*
+ * 8: artists, albums and genres from the tags, each name once, see
+ * db_count_tags(). Tracks refer to them by id, 0 when the tag is not
+ * there. The indices on the ids cover the durations the counts add up.
+ * Ids of a shard start at its offset, which it does not have yet, so
+ * the tracks are only given ids later.
+ */
+static bool db_migration_8(void) {
+	return db_exec("CREATE TABLE artists ("
+		       "    id INTEGER PRIMARY KEY AUTOINCREMENT,"
+		       "    name TEXT NOT NULL COLLATE NOCASE UNIQUE,"
+		       "    track_count INTEGER NOT NULL DEFAULT 0,"
+		       "    duration INTEGER NOT NULL DEFAULT 0"
+		       ");"
+		       "CREATE TABLE albums ("
+		       "    id INTEGER PRIMARY KEY AUTOINCREMENT,"
+		       "    artist_id INTEGER NOT NULL,"
+		       "    name TEXT NOT NULL COLLATE NOCASE,"
+		       "    track_count INTEGER NOT NULL DEFAULT 0,"
+		       "    duration INTEGER NOT NULL DEFAULT 0,"
+		       "    UNIQUE (artist_id, name)"
+		       ");"
+		       "CREATE TABLE genres ("
+		       "    id INTEGER PRIMARY KEY AUTOINCREMENT,"
+		       "    name TEXT NOT NULL COLLATE NOCASE UNIQUE,"
+		       "    track_count INTEGER NOT NULL DEFAULT 0,"
+		       "    duration INTEGER NOT NULL DEFAULT 0"
+		       ");"
+		       "ALTER TABLE tracks ADD COLUMN tag_genre TEXT;"
+		       "ALTER TABLE tracks ADD COLUMN artist_id INTEGER NOT NULL DEFAULT 0;"
+		       "ALTER TABLE tracks ADD COLUMN album_id INTEGER NOT NULL DEFAULT 0;"
+		       "ALTER TABLE tracks ADD COLUMN genre_id INTEGER NOT NULL DEFAULT 0;"
+		       "CREATE INDEX idx_tracks_artist_id ON tracks(artist_id, duration);"
+		       "CREATE INDEX idx_tracks_album_id ON tracks(album_id, duration);"
+		       "CREATE INDEX idx_tracks_genre_id ON tracks(genre_id, duration);"
+		       /* Tags that were indexed before get their ids from db_count_tags() */
+		       "INSERT INTO meta (key, value) SELECT 'tags_interned', 1 "
+		       "WHERE NOT EXISTS (SELECT 1 FROM tracks WHERE tagged);");
+}
+
+static bool (*const db_migrations[])(void) = {
+	db_migration_1,
+	db_migration_2,
+	db_migration_3,
+	db_migration_4,
+	db_migration_5,
+	db_migration_6,
+	db_migration_7,
+	db_migration_8,
+};
+
+#define DB_SCHEMA_VERSION ((int)(sizeof(db_migrations) / sizeof(db_migrations[0])))
+
+static int db_user_version(void) {
+	sqlite3_stmt *stmt;
+	int version = 0;
+
+	if (sqlite3_prepare_v2(db_conn(), "PRAGMA user_version", -1, &stmt, NULL) != SQLITE_OK)
+		return -1;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		version = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	return version;
+}
+
+bool db_migrate(void) {
+	char sql[64];
+	int version = db_user_version();
+
+	if (version < 0) {
+		fprintf(stderr, "Cannot read schema version: %s\n", sqlite3_errmsg(db_conn()));
+		return false;
+	}
 
+	/* A newer glaciera upgraded the database, its additions are left alone */
+	for (; version < DB_SCHEMA_VERSION; version++) {
+		snprintf(sql, sizeof(sql), "PRAGMA user_version=%d", version + 1);
+		if (!db_exec("BEGIN"))
+			return false;
+		if (!db_migrations[version]() || !db_exec(sql)) {
+			fprintf(stderr, "Database migration %d failed\n", version + 1);
+			sqlite3_exec(db_conn(), "ROLLBACK", NULL, NULL, NULL);
+			db_dir_forget();
+			return false;
+		}
+		if (!db_exec("COMMIT"))
+			return false;
+	}
 	return true;
 }
 
 /* Track operations */
 bool db_insert_track(const char *filepath, const char *display_name, const char *search_text,
     const struct tuneinfo *ti) {
+	const char *filename;
+	int dir_id = db_split_path(filepath, &filename, true);
 	sqlite3_stmt *stmt;
 	int rc;
 
-	const char *sql = "INSERT INTO tracks (filepath, display_name, search_text, "
-			  "filesize, filedate, duration, bitrate, genre, rating, updated_at) "
-			  "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, strftime('%s', 'now'))";
+	if (dir_id < 0)
+		return false;
 
-	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	rc = sqlite3_prepare_v2(db_conn(), db_sql_insert_track, -1, &stmt, NULL);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db_conn()));
 		return false;
 	}
 
-	sqlite3_bind_text(stmt, 1, filepath, -1, SQLITE_STATIC);
-	sqlite3_bind_text(stmt, 2, display_name, -1, SQLITE_STATIC);
-	sqlite3_bind_text(stmt, 3, search_text, -1, SQLITE_STATIC);
-	sqlite3_bind_int(stmt, 4, ti->filesize);
-	sqlite3_bind_int64(stmt, 5, ti->filedate);
-	sqlite3_bind_int(stmt, 6, ti->duration);
-	sqlite3_bind_int(stmt, 7, ti->bitrate);
-	sqlite3_bind_int(stmt, 8, ti->genre);
-	sqlite3_bind_int(stmt, 9, ti->rating);
+	sqlite3_bind_int(stmt, 1, dir_id);
+	sqlite3_bind_text(stmt, 2, filename, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, display_name, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 4, search_text, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 5, ti->filesize);
+	sqlite3_bind_int64(stmt, 6, ti->filedate);
+	sqlite3_bind_int(stmt, 7, ti->duration);
+	sqlite3_bind_int(stmt, 8, ti->bitrate);
+	sqlite3_bind_int(stmt, 9, ti->genre);
+	sqlite3_bind_int(stmt, 10, ti->rating);
+	sqlite3_bind_int(stmt, 11, ti->format);
 
 	rc = sqlite3_step(stmt);
 	sqlite3_finalize(stmt);
 
 	if (rc != SQLITE_DONE) {
-		fprintf(stderr, "Failed to insert track: %s\n", sqlite3_errmsg(db));
+		fprintf(stderr, "Failed to insert track: %s\n", sqlite3_errmsg(db_conn()));
 		return false;
 	}
 
@@ -279,35 +1161,38 @@ bool db_insert_track(const char *filepath, const char *display_name, const char
 
 bool db_update_track(int id, const char *filepath, const char *display_name,
     const char *search_text, const struct tuneinfo *ti) {
+	const char *filename;
+	int dir_id = db_split_path(filepath, &filename, true);
 	sqlite3_stmt *stmt;
 	int rc;
 
-	const char *sql = "UPDATE tracks SET filepath=?, display_name=?, search_text=?, "
-			  "filesize=?, filedate=?, duration=?, bitrate=?, genre=?, rating=?, "
-			  "updated_at=strftime('%s', 'now') WHERE id=?";
+	if (dir_id < 0)
+		return false;
 
-	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	rc = sqlite3_prepare_v2(db_conn(), db_sql_update_track, -1, &stmt, NULL);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db_conn()));
 		return false;
 	}
 
-	sqlite3_bind_text(stmt, 1, filepath, -1, SQLITE_STATIC);
-	sqlite3_bind_text(stmt, 2, display_name, -1, SQLITE_STATIC);
-	sqlite3_bind_text(stmt, 3, search_text, -1, SQLITE_STATIC);
-	sqlite3_bind_int(stmt, 4, ti->filesize);
-	sqlite3_bind_int64(stmt, 5, ti->filedate);
-	sqlite3_bind_int(stmt, 6, ti->duration);
-	sqlite3_bind_int(stmt, 7, ti->bitrate);
-	sqlite3_bind_int(stmt, 8, ti->genre);
-	sqlite3_bind_int(stmt, 9, ti->rating);
-	sqlite3_bind_int(stmt, 10, id);
+	sqlite3_bind_int(stmt, 1, dir_id);
+	sqlite3_bind_text(stmt, 2, filename, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, display_name, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 4, search_text, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 5, ti->filesize);
+	sqlite3_bind_int64(stmt, 6, ti->filedate);
+	sqlite3_bind_int(stmt, 7, ti->duration);
+	sqlite3_bind_int(stmt, 8, ti->bitrate);
+	sqlite3_bind_int(stmt, 9, ti->genre);
+	sqlite3_bind_int(stmt, 10, ti->rating);
+	sqlite3_bind_int(stmt, 11, ti->format);
+	sqlite3_bind_int(stmt, 12, id);
 
 	rc = sqlite3_step(stmt);
 	sqlite3_finalize(stmt);
 
 	if (rc != SQLITE_DONE) {
-		fprintf(stderr, "Failed to update track: %s\n", sqlite3_errmsg(db));
+		fprintf(stderr, "Failed to update track: %s\n", sqlite3_errmsg(db_conn()));
 		return false;
 	}
 
@@ -320,9 +1205,9 @@ bool db_delete_track(int id) {
 
 	const char *sql = "DELETE FROM tracks WHERE id=?";
 
-	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	rc = sqlite3_prepare_v2(db_conn(), sql, -1, &stmt, NULL);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db_conn()));
 		return false;
 	}
 
@@ -332,7 +1217,7 @@ bool db_delete_track(int id) {
 	sqlite3_finalize(stmt);
 
 	if (rc != SQLITE_DONE) {
-		fprintf(stderr, "Failed to delete track: %s\n", sqlite3_errmsg(db));
+		fprintf(stderr, "Failed to delete track: %s\n", sqlite3_errmsg(db_conn()));
 		return false;
 	}
 
@@ -340,19 +1225,20 @@ bool db_delete_track(int id) {
 }
 
 bool db_track_exists(const char *filepath) {
+	const char *filename;
+	int dir_id = db_split_path(filepath, &filename, false);
 	sqlite3_stmt *stmt;
 	int rc;
 	bool exists = false;
 
-	const char *sql = "SELECT COUNT(*) FROM tracks WHERE filepath=?";
-
-	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	rc = sqlite3_prepare_v2(db_conn(), db_sql_track_exists, -1, &stmt, NULL);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db_conn()));
 		return false;
 	}
 
-	sqlite3_bind_text(stmt, 1, filepath, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 1, dir_id);
+	sqlite3_bind_text(stmt, 2, filename, -1, SQLITE_STATIC);
 
 	rc = sqlite3_step(stmt);
 	if (rc == SQLITE_ROW) {
@@ -363,19 +1249,74 @@ bool db_track_exists(const char *filepath) {
 	return exists;
 }
 
+/*
+ * A track from a row of id, dir_id, filename, display_name, search_text,
+ * filesize, filedate, duration, bitrate, genre, rating, created_at,
+ * updated_at, format and fingerprint. dirs is a db_get_dir_paths()
+ * table, the directory is looked up when it is not in there.
+ */
+static struct db_track *db_track_from_row(sqlite3_stmt *stmt, char **dirs, int dir_count) {
+	struct db_track *track = malloc(sizeof(struct db_track));
+	const char *filename = (const char *)sqlite3_column_text(stmt, 2);
+	const char *dir = NULL;
+	char path[4096];
+	size_t dir_len;
+
+	if (!track)
+		return NULL;
+
+	track->id = sqlite3_column_int(stmt, 0);
+	track->dir_id = sqlite3_column_int(stmt, 1);
+	if (track->dir_id > 0 && track->dir_id < dir_count && dirs[track->dir_id])
+		dir = dirs[track->dir_id];
+	else if (track->dir_id > 0 && db_dir_path(track->dir_id, path, sizeof(path)))
+		dir = path;
+
+	/* One allocation, filename points into filepath */
+	dir_len = dir ? strlen(dir) + 1 : 0;
+	track->filepath = malloc(dir_len + strlen(filename) + 1);
+	if (!track->filepath) {
+		free(track);
+		return NULL;
+	}
+	if (dir) {
+		memcpy(track->filepath, dir, dir_len - 1);
+		track->filepath[dir_len - 1] = '/';
+	}
+	strcpy(track->filepath + dir_len, filename);
+	track->filename = track->filepath + dir_len;
+	track->display_name = strdup((const char *)sqlite3_column_text(stmt, 3));
+	track->search_text = strdup((const char *)sqlite3_column_text(stmt, 4));
+
+	track->ti.filesize = sqlite3_column_int(stmt, 5);
+	track->ti.filedate = sqlite3_column_int64(stmt, 6);
+	track->ti.duration = sqlite3_column_int(stmt, 7);
+	track->ti.bitrate = sqlite3_column_int(stmt, 8);
+	track->ti.genre = sqlite3_column_int(stmt, 9);
+	track->ti.rating = sqlite3_column_int(stmt, 10);
+
+	track->created_at = sqlite3_column_int64(stmt, 11);
+	track->updated_at = sqlite3_column_int64(stmt, 12);
+	track->ti.format = sqlite3_column_int(stmt, 13);
+	track->fingerprint = (uint64_t)sqlite3_column_int64(stmt, 14);
+	/* Only the queries that rank by plays select it */
+	track->play_count = sqlite3_column_count(stmt) > 15 ? sqlite3_column_int(stmt, 15) : 0;
+	return track;
+}
+
 /* Track retrieval */
 struct db_track *db_get_track_by_id(int id) {
 	sqlite3_stmt *stmt;
 	int rc;
 	struct db_track *track = NULL;
 
-	const char *sql = "SELECT id, filepath, display_name, search_text, "
+	const char *sql = "SELECT id, dir_id, filename, display_name, search_text, "
 			  "filesize, filedate, duration, bitrate, genre, rating, "
-			  "created_at, updated_at FROM tracks WHERE id=?";
+			  "created_at, updated_at, format, fingerprint FROM tracks WHERE id=?";
 
-	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	rc = sqlite3_prepare_v2(db_conn(), sql, -1, &stmt, NULL);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db_conn()));
 		return NULL;
 	}
 
@@ -383,26 +1324,7 @@ struct db_track *db_get_track_by_id(int id) {
 
 	rc = sqlite3_step(stmt);
 	if (rc == SQLITE_ROW) {
-		track = malloc(sizeof(struct db_track));
-		if (!track) {
-			sqlite3_finalize(stmt);
-			return NULL;
-		}
-
-		track->id = sqlite3_column_int(stmt, 0);
-		track->filepath = strdup((const char *)sqlite3_column_text(stmt, 1));
-		track->display_name = strdup((const char *)sqlite3_column_text(stmt, 2));
-		track->search_text = strdup((const char *)sqlite3_column_text(stmt, 3));
-
-		track->ti.filesize = sqlite3_column_int(stmt, 4);
-		track->ti.filedate = sqlite3_column_int64(stmt, 5);
-		track->ti.duration = sqlite3_column_int(stmt, 6);
-		track->ti.bitrate = sqlite3_column_int(stmt, 7);
-		track->ti.genre = sqlite3_column_int(stmt, 8);
-		track->ti.rating = sqlite3_column_int(stmt, 9);
-
-		track->created_at = sqlite3_column_int64(stmt, 10);
-		track->updated_at = sqlite3_column_int64(stmt, 11);
+		track = db_track_from_row(stmt, NULL, 0);
 	}
 
 	sqlite3_finalize(stmt);
@@ -410,55 +1332,73 @@ struct db_track *db_get_track_by_id(int id) {
 }
 
 struct db_track *db_get_track_by_filepath(const char *filepath) {
+	const char *filename;
+	int dir_id = db_split_path(filepath, &filename, false);
 	sqlite3_stmt *stmt;
 	int rc;
 	struct db_track *track = NULL;
 
-	const char *sql = "SELECT id, filepath, display_name, search_text, "
-			  "filesize, filedate, duration, bitrate, genre, rating, "
-			  "created_at, updated_at FROM tracks WHERE filepath=?";
-
-	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	rc = sqlite3_prepare_v2(db_conn(), db_sql_track_by_filepath, -1, &stmt, NULL);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db_conn()));
 		return NULL;
 	}
 
-	sqlite3_bind_text(stmt, 1, filepath, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 1, dir_id);
+	sqlite3_bind_text(stmt, 2, filename, -1, SQLITE_STATIC);
 
 	rc = sqlite3_step(stmt);
 	if (rc == SQLITE_ROW) {
-		track = malloc(sizeof(struct db_track));
-		if (!track) {
+		track = db_track_from_row(stmt, NULL, 0);
+	}
+
+	sqlite3_finalize(stmt);
+	return track;
+}
+
+/* Every row of a prepared track query, finalizes stmt */
+static struct db_track **db_collect_tracks(sqlite3_stmt *stmt, int *count) {
+	struct db_track **tracks = NULL;
+	int allocated = 0;
+	char **dirs;
+	int dir_count;
+
+	dirs = db_get_dir_paths(&dir_count);
+
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if (*count >= allocated) {
+			allocated = allocated == 0 ? 16 : allocated * 2;
+			tracks = realloc(tracks, allocated * sizeof(struct db_track *));
+			if (!tracks) {
+				sqlite3_finalize(stmt);
+				db_free_dir_paths(dirs, dir_count);
+				return NULL;
+			}
+		}
+
+		tracks[*count] = db_track_from_row(stmt, dirs, dir_count);
+		if (!tracks[*count]) {
 			sqlite3_finalize(stmt);
+			db_free_dir_paths(dirs, dir_count);
 			return NULL;
 		}
 
-		track->id = sqlite3_column_int(stmt, 0);
-		track->filepath = strdup((const char *)sqlite3_column_text(stmt, 1));
-		track->display_name = strdup((const char *)sqlite3_column_text(stmt, 2));
-		track->search_text = strdup((const char *)sqlite3_column_text(stmt, 3));
+		(*count)++;
+	}
 
-		track->ti.filesize = sqlite3_column_int(stmt, 4);
-		track->ti.filedate = sqlite3_column_int64(stmt, 5);
-		track->ti.duration = sqlite3_column_int(stmt, 6);
-		track->ti.bitrate = sqlite3_column_int(stmt, 7);
-		track->ti.genre = sqlite3_column_int(stmt, 8);
-		track->ti.rating = sqlite3_column_int(stmt, 9);
+	sqlite3_finalize(stmt);
+	db_free_dir_paths(dirs, dir_count);
 
-		track->created_at = sqlite3_column_int64(stmt, 10);
-		track->updated_at = sqlite3_column_int64(stmt, 11);
+	if (tracks && *count < allocated) {
+		tracks = realloc(tracks, *count * sizeof(struct db_track *));
 	}
 
-	sqlite3_finalize(stmt);
-	return track;
+	return tracks;
 }
 
 struct db_track **db_search_tracks(const char *query, int *count) {
 	sqlite3_stmt *stmt;
 	int rc;
-	struct db_track **tracks = NULL;
-	int allocated = 0;
 	*count = 0;
 
 	if (!db) {
@@ -466,70 +1406,45 @@ struct db_track **db_search_tracks(const char *query, int *count) {
 		return NULL;
 	}
 
-	/* Simple search: look for query in filepath, display_name, or search_text */
-	const char *sql = "SELECT id, filepath, display_name, search_text, "
-			  "filesize, filedate, duration, bitrate, genre, rating, "
-			  "created_at, updated_at FROM tracks "
-			  "WHERE filepath LIKE ? OR display_name LIKE ? OR search_text LIKE ? "
-			  "ORDER BY display_name";
-
+	/* Simple search: look for query in the path, display_name, or search_text */
 	char *pattern = malloc(strlen(query) + 3);
 	sprintf(pattern, "%%%s%%", query);
 
-	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	rc = sqlite3_prepare_v2(db_conn(), db_sql_search_tracks, -1, &stmt, NULL);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db_conn()));
 		free(pattern);
 		return NULL;
 	}
 
 	sqlite3_bind_text(stmt, 1, pattern, -1, SQLITE_TRANSIENT);
-	sqlite3_bind_text(stmt, 2, pattern, -1, SQLITE_TRANSIENT);
-	sqlite3_bind_text(stmt, 3, pattern, -1, SQLITE_TRANSIENT);
 
 	free(pattern);
 
-	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-		if (*count >= allocated) {
-			allocated = allocated == 0 ? 16 : allocated * 2;
-			tracks = realloc(tracks, allocated * sizeof(struct db_track *));
-			if (!tracks) {
-				sqlite3_finalize(stmt);
-				return NULL;
-			}
-		}
-
-		tracks[*count] = malloc(sizeof(struct db_track));
-		if (!tracks[*count]) {
-			sqlite3_finalize(stmt);
-			return NULL;
-		}
-
-		tracks[*count]->id = sqlite3_column_int(stmt, 0);
-		tracks[*count]->filepath = strdup((const char *)sqlite3_column_text(stmt, 1));
-		tracks[*count]->display_name = strdup((const char *)sqlite3_column_text(stmt, 2));
-		tracks[*count]->search_text = strdup((const char *)sqlite3_column_text(stmt, 3));
-
-		tracks[*count]->ti.filesize = sqlite3_column_int(stmt, 4);
-		tracks[*count]->ti.filedate = sqlite3_column_int64(stmt, 5);
-		tracks[*count]->ti.duration = sqlite3_column_int(stmt, 6);
-		tracks[*count]->ti.bitrate = sqlite3_column_int(stmt, 7);
-		tracks[*count]->ti.genre = sqlite3_column_int(stmt, 8);
-		tracks[*count]->ti.rating = sqlite3_column_int(stmt, 9);
+	return db_collect_tracks(stmt, count);
+}
 
-		tracks[*count]->created_at = sqlite3_column_int64(stmt, 10);
-		tracks[*count]->updated_at = sqlite3_column_int64(stmt, 11);
+/*
+ * The limit best tracks by glaciera_fuzzy() of their search text and
+ * query, scoring at least min_score, best first
+ */
+struct db_track **db_fuzzy_search_tracks(const char *query, int min_score, int limit, int *count) {
+	sqlite3_stmt *stmt;
+	*count = 0;
 
-		(*count)++;
+	if (!db) {
+		fprintf(stderr, "ERROR: Database not initialized\n");
+		return NULL;
 	}
 
-	sqlite3_finalize(stmt);
-
-	if (tracks && *count < allocated) {
-		tracks = realloc(tracks, *count * sizeof(struct db_track *));
-	}
+	stmt = db_prepare(db_sql_fuzzy_search_tracks);
+	if (!stmt)
+		return NULL;
+	sqlite3_bind_text(stmt, 1, query, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_int(stmt, 2, min_score);
+	sqlite3_bind_int(stmt, 3, limit);
 
-	return tracks;
+	return db_collect_tracks(stmt, count);
 }
 
 struct db_track **db_get_all_tracks(int *count) {
@@ -538,15 +1453,16 @@ struct db_track **db_get_all_tracks(int *count) {
 
 /* Batch operations for indexing */
 bool db_begin_transaction(void) {
-	return sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL) == SQLITE_OK;
+	return sqlite3_exec(db_conn(), "BEGIN TRANSACTION", NULL, NULL, NULL) == SQLITE_OK;
 }
 
 bool db_commit_transaction(void) {
-	return sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK;
+	return sqlite3_exec(db_conn(), "COMMIT", NULL, NULL, NULL) == SQLITE_OK;
 }
 
 bool db_rollback_transaction(void) {
-	return sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL) == SQLITE_OK;
+	db_dir_forget();
+	return sqlite3_exec(db_conn(), "ROLLBACK", NULL, NULL, NULL) == SQLITE_OK;
 }
 
 void db_insert_track_batch(const char *filepath, const char *display_name, const char *search_text,
@@ -554,6 +1470,1701 @@ void db_insert_track_batch(const char *filepath, const char *display_name, const
 	db_insert_track(filepath, display_name, search_text, ti);
 }
 
+/* --------------------------------------------------------------------------
+ * Scan checkpoints
+ *
+ * A scan of a root gets a scan id, and every track it sees is marked with
+ * it. Directories are recorded in scan_progress once they and everything
+ * below them are done, in the same transaction as their tracks, so an
+ * interrupted scan picks up at the first unfinished directory. Tracks
+ * that were not marked are swept only when the whole root was covered.
+ */
+
+/*
+ * Start a scan of root, or pick up an unfinished one. Returns the scan
+ * id, 0 on error. resumed_dirs is -1 for a new scan, otherwise the
+ * number of directories the unfinished scan already did.
+ */
+int db_scan_begin(const char *root, int *resumed_dirs) {
+	sqlite3_stmt *stmt;
+	int scan_id = 0;
+
+	*resumed_dirs = -1;
+
+	stmt = db_prepare("SELECT scan_id, (SELECT COUNT(*) FROM scan_progress WHERE root=?1) "
+			  "FROM scan_roots WHERE root=?1 AND completed_at IS NULL");
+	if (!stmt)
+		return 0;
+	sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		scan_id = sqlite3_column_int(stmt, 0);
+		*resumed_dirs = sqlite3_column_int(stmt, 1);
+	}
+	sqlite3_finalize(stmt);
+	if (scan_id)
+		return scan_id;
+
+	stmt = db_prepare("SELECT COALESCE(MAX(scan_id), 0) + 1 FROM scan_roots");
+	if (!stmt)
+		return 0;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		scan_id = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	stmt = db_prepare("DELETE FROM scan_progress WHERE root=?");
+	if (!stmt)
+		return 0;
+	sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+	if (!db_step_done(stmt, "reset scan progress"))
+		return 0;
+
+	stmt = db_prepare("INSERT OR REPLACE INTO scan_roots (root, scan_id) VALUES (?, ?)");
+	if (!stmt)
+		return 0;
+	sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 2, scan_id);
+	if (!db_step_done(stmt, "start scan"))
+		return 0;
+
+	return scan_id;
+}
+
+bool db_scan_dir_is_done(const char *root, const char *dir) {
+	sqlite3_stmt *stmt = db_prepare(db_sql_scan_dir_is_done);
+	bool done;
+
+	if (!stmt)
+		return false;
+	sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, dir, -1, SQLITE_STATIC);
+	done = sqlite3_step(stmt) == SQLITE_ROW;
+	sqlite3_finalize(stmt);
+	return done;
+}
+
+bool db_scan_dir_done(const char *root, const char *dir) {
+	sqlite3_stmt *stmt = db_prepare(db_sql_scan_dir_done);
+
+	if (!stmt)
+		return false;
+	sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, dir, -1, SQLITE_STATIC);
+	return db_step_done(stmt, "record scan progress");
+}
+
+bool db_mark_track_scanned(const char *filepath, int scan_id) {
+	const char *filename;
+	int dir_id = db_split_path(filepath, &filename, false);
+	sqlite3_stmt *stmt = db_prepare(db_sql_mark_track_scanned);
+
+	if (!stmt)
+		return false;
+	sqlite3_bind_int(stmt, 1, scan_id);
+	sqlite3_bind_int(stmt, 2, dir_id);
+	sqlite3_bind_text(stmt, 3, filename, -1, SQLITE_STATIC);
+	return db_step_done(stmt, "mark track");
+}
+
+/*
+ * The scan of root is complete. With sweep, tracks below root that this
+ * scan did not see are deleted. Returns the number of deleted tracks,
+ * -1 on error.
+ */
+int db_scan_finish(const char *root, int scan_id, bool sweep) {
+	sqlite3_stmt *stmt;
+	int removed = 0;
+
+	if (sweep) {
+		int root_dir = db_root_dir(root);
+		int dirs_removed;
+
+		stmt = db_prepare(db_sql_sweep_tracks);
+		if (!stmt)
+			return -1;
+		sqlite3_bind_int(stmt, 1, root_dir);
+		sqlite3_bind_int(stmt, 2, scan_id);
+		if (!db_step_done(stmt, "sweep tracks"))
+			return -1;
+		removed = sqlite3_changes(db_conn());
+
+		/* Renamed and removed directories, searches walk every one */
+		do {
+			stmt = db_prepare(db_sql_sweep_dirs);
+			if (!stmt)
+				return -1;
+			sqlite3_bind_int(stmt, 1, root_dir);
+			if (!db_step_done(stmt, "sweep directories"))
+				return -1;
+			dirs_removed = sqlite3_changes(db_conn());
+		} while (dirs_removed > 0);
+		db_dir_forget();
+	}
+
+	stmt = db_prepare("DELETE FROM scan_progress WHERE root=?");
+	if (!stmt)
+		return -1;
+	sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+	if (!db_step_done(stmt, "clear scan progress"))
+		return -1;
+
+	stmt = db_prepare("UPDATE scan_roots SET completed_at=strftime('%s', 'now') WHERE root=?");
+	if (!stmt)
+		return -1;
+	sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+	if (!db_step_done(stmt, "finish scan"))
+		return -1;
+
+	return removed;
+}
+
+/* --------------------------------------------------------------------------
+ * Moved files
+ *
+ * A file that shows up under a new path with the same size and
+ * fingerprint as a track whose file is gone is that track, moved. It
+ * keeps its row, so the id, tags, rating and play history stay.
+ */
+
+bool db_set_track_fingerprint(const char *filepath, uint64_t fingerprint) {
+	const char *filename;
+	int dir_id = db_split_path(filepath, &filename, false);
+	sqlite3_stmt *stmt = db_prepare(db_sql_set_fingerprint);
+
+	if (!stmt)
+		return false;
+	sqlite3_bind_int64(stmt, 1, (sqlite3_int64)fingerprint);
+	sqlite3_bind_int(stmt, 2, dir_id);
+	sqlite3_bind_text(stmt, 3, filename, -1, SQLITE_STATIC);
+	return db_step_done(stmt, "set fingerprint");
+}
+
+/* Returns the id of a track with this content whose file is gone, or 0 */
+int db_find_moved_track(uint64_t fingerprint, int filesize) {
+	sqlite3_stmt *stmt;
+	int id = 0;
+
+	/* Identical copies all share one fingerprint, look at a few */
+	stmt = db_prepare(db_sql_find_moved_track);
+	if (!stmt)
+		return 0;
+	sqlite3_bind_int64(stmt, 1, (sqlite3_int64)fingerprint);
+	sqlite3_bind_int(stmt, 2, filesize);
+	while (!id && sqlite3_step(stmt) == SQLITE_ROW) {
+		const char *filename = (const char *)sqlite3_column_text(stmt, 2);
+		char path[4096];
+		int dir_id = sqlite3_column_int(stmt, 1);
+
+		if (dir_id && !db_dir_path(dir_id, path, sizeof(path)))
+			continue;
+		if (dir_id)
+			safe_strcat(path, "/", sizeof(path));
+		else
+			path[0] = '\0';
+		safe_strcat(path, filename, sizeof(path));
+		/* A copy, not a move, when the old file is still there */
+		if (access(path, F_OK) != 0)
+			id = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+	return id;
+}
+
+/* Whether any track has a fingerprint, without one nothing can have moved */
+bool db_have_fingerprints(void) {
+	sqlite3_stmt *stmt = db_prepare("SELECT 1 FROM tracks WHERE fingerprint<>0 LIMIT 1");
+	bool have;
+
+	if (!stmt)
+		return true;
+	have = sqlite3_step(stmt) != SQLITE_DONE;
+	sqlite3_finalize(stmt);
+	return have;
+}
+
+/*
+ * The names are made for the new path, see db_get_track_meta(). When
+ * both are NULL the track keeps the names it had.
+ */
+bool db_move_track(int id, const char *filepath, const char *display_name,
+    const char *search_text, int scan_id) {
+	const char *filename;
+	int dir_id = db_split_path(filepath, &filename, true);
+	sqlite3_stmt *stmt;
+
+	if (dir_id < 0)
+		return false;
+	stmt = db_prepare(db_sql_move_track);
+	if (!stmt)
+		return false;
+	sqlite3_bind_int(stmt, 1, dir_id);
+	sqlite3_bind_text(stmt, 2, filename, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 3, scan_id);
+	sqlite3_bind_int(stmt, 4, id);
+	sqlite3_bind_text(stmt, 5, display_name, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 6, search_text, -1, SQLITE_STATIC);
+	return db_step_done(stmt, "move track");
+}
+
+/* --------------------------------------------------------------------------
+ * Shards
+ *
+ * With [database] shards, every root is indexed into a database file of
+ * its own, so that the scan threads commit independently instead of
+ * taking turns on one writer lock. The database keeps the list of
+ * shards, hands out directory ids and stores the plays. Connections to
+ * it attach the shards and read the tables of db_shard_tables[] through
+ * TEMP views of the union, which SQLite finds before the tables of the
+ * same name, so the statements above read the whole library unchanged.
+ * Play counts are written to each attached database, see
+ * db_store_plays().
+ *
+ * Ids are unique across the union: the track, artist, album and genre
+ * ids of shard n start at n << DB_SHARD_ID_SHIFT, and shards take
+ * directory ids from the database in blocks, which keeps them dense for
+ * db_get_dir_paths().
+ */
+
+#define DB_SHARD_ID_SHIFT 24
+#define DB_DIR_LEASE 1024
+
+/* Integer in meta, 0 when the key is not there, -1 on error */
+static int64_t db_meta_value(const char *key) {
+	sqlite3_stmt *stmt = db_prepare("SELECT value FROM meta WHERE key=?");
+	int64_t value = -1;
+	int rc;
+
+	if (!stmt)
+		return -1;
+	sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+	rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW)
+		value = sqlite3_column_int64(stmt, 0);
+	else if (rc == SQLITE_DONE)
+		value = 0;
+	sqlite3_finalize(stmt);
+	return value;
+}
+
+static bool db_meta_set(const char *key, int64_t value) {
+	sqlite3_stmt *stmt = db_prepare("INSERT OR REPLACE INTO meta (key, value) VALUES (?, ?)");
+
+	if (!stmt)
+		return false;
+	sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, value);
+	return db_step_done(stmt, "update meta");
+}
+
+/* The next DB_DIR_LEASE directory ids from the database, -1 on error */
+static int64_t db_lease_dirs(void) {
+	sqlite3_stmt *stmt = NULL;
+	int64_t end = -1;
+
+	pthread_mutex_lock(&db_shard_lock);
+	/* Above every directory the database had before it had shards */
+	if (sqlite3_exec(db,
+		"INSERT OR IGNORE INTO main.meta (key, value) "
+		"SELECT 'dir_next', coalesce(max(id), 0) + 1 FROM main.dirs",
+		NULL, NULL, NULL)
+		== SQLITE_OK
+	    && sqlite3_prepare_v2(db,
+		   "UPDATE main.meta SET value=value+?1 WHERE key='dir_next' RETURNING value", -1,
+		   &stmt, NULL)
+		== SQLITE_OK) {
+		sqlite3_bind_int(stmt, 1, DB_DIR_LEASE);
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			end = sqlite3_column_int64(stmt, 0);
+	}
+	if (end < 0)
+		fprintf(stderr, "Cannot take directory ids: %s\n", sqlite3_errmsg(db));
+	sqlite3_finalize(stmt);
+	pthread_mutex_unlock(&db_shard_lock);
+	return end;
+}
+
+/*
+ * Id for a new directory of the calling thread's shard, -1 on error.
+ * Where the block stands is kept in the shard's meta, in the same
+ * transaction as the directory.
+ */
+static int db_shard_next_dir(void) {
+	int64_t next = db_meta_value("dir_next");
+	int64_t end = db_meta_value("dir_end");
+
+	if (next < 0 || end < 0)
+		return -1;
+	if (next >= end) {
+		end = db_lease_dirs();
+		if (end < 0 || !db_meta_set("dir_end", end))
+			return -1;
+		next = end - DB_DIR_LEASE;
+	}
+	if (next > INT_MAX || !db_meta_set("dir_next", next + 1))
+		return -1;
+	return (int)next;
+}
+
+static void db_shard_free(struct db_shard *shard) {
+	if (shard) {
+		sqlite3_close(shard->conn);
+		pthread_mutex_destroy(&shard->dirs.lock);
+		free(shard);
+	}
+}
+
+/* The shard at path with its schema up to date, NULL on error */
+static struct db_shard *db_shard_load(const char *path, const db_profile_t *profile) {
+	struct db_shard *prev = db_shard;
+	struct db_shard *shard = calloc(1, sizeof(*shard));
+	char sql[64];
+	bool ok;
+
+	if (!shard)
+		return NULL;
+	pthread_mutex_init(&shard->dirs.lock, NULL);
+	if (sqlite3_open(path, &shard->conn) != SQLITE_OK) {
+		fprintf(stderr, "Cannot open shard %s: %s\n", path, sqlite3_errmsg(shard->conn));
+		db_shard_free(shard);
+		return NULL;
+	}
+	db_register_functions(shard->conn);
+	if (profile) {
+		snprintf(sql, sizeof(sql), "PRAGMA page_size=%d", profile->page_size);
+		sqlite3_exec(shard->conn, sql, NULL, NULL, NULL);
+	}
+	sqlite3_exec(shard->conn, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+	if (profile)
+		db_apply_profile(shard->conn, profile);
+
+	/* db_migrate() works on the connection of the thread */
+	db_shard = shard;
+	ok = db_migrate();
+	db_shard = prev;
+	if (!ok) {
+		fprintf(stderr, "Cannot upgrade shard %s\n", path);
+		db_shard_free(shard);
+		return NULL;
+	}
+	return shard;
+}
+
+/* The tables read through a view of the union, see db_attach_shards() */
+static const char *const db_shard_tables[] = { "tracks", "dirs", "artists", "albums", "genres" };
+
+#define DB_SHARD_TABLES ((int)(sizeof(db_shard_tables) / sizeof(db_shard_tables[0])))
+
+/*
+ * Attach the shards the database at conn lists, and make views of the
+ * union of db_shard_tables[] and library_generation. Returns the number
+ * of shards, -1 on error. Without shards there are no views.
+ */
+static int db_attach_shards(sqlite3 *conn) {
+	sqlite3_str *unions[DB_SHARD_TABLES];
+	sqlite3_str *generation = sqlite3_str_new(conn);
+	sqlite3_str *views = sqlite3_str_new(conn);
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_stmt *attached = NULL;
+	char *sql = NULL;
+	int count = 0;
+
+	for (int t = 0; t < DB_SHARD_TABLES; t++)
+		unions[t] = sqlite3_str_new(conn);
+	if (sqlite3_prepare_v2(conn, "SELECT id, path FROM main.shards ORDER BY id", -1, &stmt,
+		NULL)
+		!= SQLITE_OK
+	    || sqlite3_prepare_v2(conn, "SELECT 1 FROM pragma_database_list WHERE name=?", -1,
+		   &attached, NULL)
+		!= SQLITE_OK)
+		count = -1;
+	while (count >= 0 && sqlite3_step(stmt) == SQLITE_ROW) {
+		int id = sqlite3_column_int(stmt, 0);
+		const char *path = (const char *)sqlite3_column_text(stmt, 1);
+		char name[32];
+		struct db_shard *shard;
+		bool known;
+
+		/* Registered, but the indexer never got to create it */
+		if (access(path, F_OK) != 0)
+			continue;
+		snprintf(name, sizeof(name), "shard%d", id);
+		sqlite3_bind_text(attached, 1, name, -1, SQLITE_STATIC);
+		known = sqlite3_step(attached) == SQLITE_ROW;
+		sqlite3_reset(attached);
+		if (!known) {
+			/* A shard the indexer has not opened since glaciera was upgraded */
+			shard = db_shard_load(path, NULL);
+			db_shard_free(shard);
+			sql = sqlite3_mprintf("ATTACH DATABASE %Q AS %s", path, name);
+			if (!shard || !sql
+			    || sqlite3_exec(conn, sql, NULL, NULL, NULL) != SQLITE_OK) {
+				fprintf(stderr, "Cannot attach shard %s: %s\n", path,
+				    sqlite3_errmsg(conn));
+				count = -1;
+			}
+			sqlite3_free(sql);
+			sql = NULL;
+		}
+		for (int t = 0; t < DB_SHARD_TABLES; t++)
+			sqlite3_str_appendf(unions[t], " UNION ALL SELECT * FROM %s.%s", name,
+			    db_shard_tables[t]);
+		sqlite3_str_appendf(generation,
+		    " UNION ALL SELECT value FROM %s.meta WHERE key='generation'", name);
+		if (count >= 0)
+			count++;
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_finalize(attached);
+
+	if (count > 0) {
+		for (int t = 0; t < DB_SHARD_TABLES; t++)
+			sqlite3_str_appendf(views,
+			    "DROP VIEW IF EXISTS temp.%s;"
+			    "CREATE TEMP VIEW %s AS SELECT * FROM main.%s%s;",
+			    db_shard_tables[t], db_shard_tables[t], db_shard_tables[t],
+			    sqlite3_str_value(unions[t]));
+		sql = sqlite3_mprintf(
+		    "%sDROP VIEW IF EXISTS temp.library_generation;"
+		    "CREATE TEMP VIEW library_generation AS SELECT sum(value) AS value FROM ("
+		    "    SELECT value FROM main.meta WHERE key='generation'%s);",
+		    sqlite3_str_value(views), sqlite3_str_value(generation));
+		if (!sql || sqlite3_exec(conn, sql, NULL, NULL, NULL) != SQLITE_OK) {
+			fprintf(stderr, "Cannot read the shards: %s\n", sqlite3_errmsg(conn));
+			count = -1;
+		}
+		sqlite3_free(sql);
+	}
+	for (int t = 0; t < DB_SHARD_TABLES; t++)
+		sqlite3_free(sqlite3_str_finish(unions[t]));
+	sqlite3_free(sqlite3_str_finish(generation));
+	sqlite3_free(sqlite3_str_finish(views));
+	return count;
+}
+
+/*
+ * sql, with %s for the schema, prepared for main and each shard attached
+ * to conn. For writes by dir_id or id, which are in only one of them.
+ * Returns the number of statements, -1 on error.
+ */
+static int db_prepare_in_each(sqlite3 *conn, const char *sql, sqlite3_stmt **stmts, int size) {
+	sqlite3_stmt *stmt;
+	int count = 0;
+
+	if (sqlite3_prepare_v2(conn,
+		"SELECT name FROM pragma_database_list WHERE name='main' OR name GLOB 'shard*'",
+		-1, &stmt, NULL)
+	    != SQLITE_OK)
+		return -1;
+	while (count < size && sqlite3_step(stmt) == SQLITE_ROW) {
+		char *schema_sql
+		    = sqlite3_mprintf(sql, (const char *)sqlite3_column_text(stmt, 0));
+
+		if (!schema_sql
+		    || sqlite3_prepare_v2(conn, schema_sql, -1, &stmts[count], NULL) != SQLITE_OK) {
+			sqlite3_free(schema_sql);
+			while (count > 0)
+				sqlite3_finalize(stmts[--count]);
+			count = -1;
+			break;
+		}
+		sqlite3_free(schema_sql);
+		count++;
+	}
+	sqlite3_finalize(stmt);
+	return count;
+}
+
+/*
+ * Move what the database knows about root into the calling thread's
+ * shard. The tracks keep the ids the plays refer to, their directories
+ * get ids of the shard.
+ */
+static bool db_shard_take_root(const char *root) {
+	static const char *const scan_rows[] = {
+		"INSERT OR IGNORE INTO main.scan_roots "
+		"    SELECT * FROM library.scan_roots WHERE root=?1",
+		"INSERT OR IGNORE INTO main.scan_progress "
+		"    SELECT * FROM library.scan_progress WHERE root=?1",
+		"COMMIT",
+		/*
+		 * Taking directory ids wrote the database after the copy began
+		 * reading it, so the copy cannot also write it
+		 */
+		"BEGIN",
+		"DELETE FROM library.tracks WHERE id IN (SELECT id FROM main.tracks)",
+		DB_SQL_COUNT_TAGS("library"),
+		"DELETE FROM library.scan_roots WHERE root=?1",
+		"DELETE FROM library.scan_progress WHERE root=?1",
+	};
+	sqlite3_stmt *stmt = db_prepare("ATTACH DATABASE ? AS library");
+	sqlite3_stmt *dirs;
+	sqlite3_stmt *copy;
+	size_t len = strlen(root);
+	bool ok;
+
+	if (!stmt)
+		return false;
+	sqlite3_bind_text(stmt, 1, sqlite3_db_filename(db, "main"), -1, SQLITE_STATIC);
+	if (!db_step_done(stmt, "attach the database"))
+		return false;
+
+	/* "/" is the empty first component */
+	while (len && root[len - 1] == '/')
+		len--;
+	dirs = db_prepare("WITH RECURSIVE p(id, path) AS ("
+			  "    SELECT id, name FROM library.dirs WHERE parent=0"
+			  "    UNION ALL SELECT d.id, p.path || '/' || d.name"
+			  "    FROM library.dirs AS d JOIN p ON d.parent=p.id) "
+			  "SELECT id, path FROM p "
+			  "WHERE path=?1 OR substr(path, 1, ?2 + 1)=?1 || '/'");
+	/* Ids of artists, albums and genres are the shard's own, see db_intern_all() */
+	copy = db_prepare("INSERT OR IGNORE INTO main.tracks (id, dir_id, filename, display_name, "
+			  "    search_text, filesize, filedate, duration, bitrate, genre, rating, "
+			  "    format, created_at, updated_at, fingerprint, scan_id, play_count, "
+			  "    last_played, tagged, tag_title, tag_artist, tag_album, tag_track, "
+			  "    tag_track_number, tag_genre) "
+			  "SELECT id, ?2, filename, display_name, search_text, filesize, filedate, "
+			  "    duration, bitrate, genre, rating, format, created_at, updated_at, "
+			  "    fingerprint, scan_id, play_count, last_played, tagged, tag_title, "
+			  "    tag_artist, tag_album, tag_track, tag_track_number, tag_genre "
+			  "FROM library.tracks WHERE dir_id=?1");
+	ok = dirs && copy && db_exec("BEGIN");
+	if (ok) {
+		sqlite3_bind_text(dirs, 1, root, (int)len, SQLITE_STATIC);
+		sqlite3_bind_int(dirs, 2, (int)len);
+	}
+	/* The shard's directories first, taking ids writes the database */
+	while (ok && sqlite3_step(dirs) == SQLITE_ROW) {
+		const char *path = (const char *)sqlite3_column_text(dirs, 1);
+		int dir_id = db_dir_find(path, strlen(path), true);
+
+		sqlite3_bind_int(copy, 1, sqlite3_column_int(dirs, 0));
+		sqlite3_bind_int(copy, 2, dir_id);
+		ok = dir_id > 0 && sqlite3_step(copy) == SQLITE_DONE;
+		sqlite3_reset(copy);
+	}
+	sqlite3_finalize(dirs);
+	sqlite3_finalize(copy);
+	ok = ok && db_intern_all();
+
+	/* Copied twice when interrupted before the second commit, hence OR IGNORE */
+	for (size_t i = 0; ok && i < sizeof(scan_rows) / sizeof(scan_rows[0]); i++) {
+		stmt = db_prepare(scan_rows[i]);
+		if (!stmt)
+			ok = false;
+		else {
+			if (sqlite3_bind_parameter_count(stmt))
+				sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+			ok = db_step_done(stmt, "move the root into its shard");
+		}
+	}
+	/* The root's directories and the ones above it, once nothing uses them */
+	while (ok) {
+		stmt = db_prepare(
+		    "WITH RECURSIVE p(id, path) AS ("
+		    "    SELECT id, name FROM library.dirs WHERE parent=0"
+		    "    UNION ALL SELECT d.id, p.path || '/' || d.name"
+		    "    FROM library.dirs AS d JOIN p ON d.parent=p.id) "
+		    "DELETE FROM library.dirs WHERE id IN (SELECT id FROM p WHERE path=?1"
+		    "    OR substr(path, 1, ?2 + 1)=?1 || '/'"
+		    "    OR substr(?1, 1, length(path) + 1)=path || '/') "
+		    "AND NOT EXISTS (SELECT 1 FROM library.tracks WHERE dir_id=dirs.id) "
+		    "AND NOT EXISTS (SELECT 1 FROM library.dirs AS child "
+		    "    WHERE child.parent=dirs.id)");
+		if (!stmt) {
+			ok = false;
+			break;
+		}
+		sqlite3_bind_text(stmt, 1, root, (int)len, SQLITE_STATIC);
+		sqlite3_bind_int(stmt, 2, (int)len);
+		ok = db_step_done(stmt, "remove the root's directories");
+		if (ok && sqlite3_changes(db_conn()) == 0)
+			break;
+	}
+	ok = ok && db_exec("COMMIT");
+	if (!ok) {
+		sqlite3_exec(db_conn(), "ROLLBACK", NULL, NULL, NULL);
+		db_dir_forget();
+	}
+	db_exec("DETACH DATABASE library");
+	return ok;
+}
+
+/*
+ * Make the calling thread read and write the shard of root, creating
+ * it when root has none yet. Everything it does through this file goes
+ * to the shard until db_shard_close().
+ */
+bool db_shard_open(const char *root, const db_profile_t *profile) {
+	char dir[1024];
+	char path[1100];
+	char sql[320];
+	sqlite3_stmt *stmt;
+	struct db_shard *shard = NULL;
+	bool registered = false;
+	bool in_database = false;
+	int id = 0;
+
+	pthread_mutex_lock(&db_shard_lock);
+	/* The shard of root, or the id a new one gets */
+	stmt = db_prepare("SELECT id, path, EXISTS (SELECT 1 FROM main.scan_roots WHERE root=?1) "
+			  "FROM main.shards WHERE root=?1 "
+			  "UNION ALL SELECT coalesce(max(id), 0) + 1, NULL, "
+			  "    EXISTS (SELECT 1 FROM main.scan_roots WHERE root=?1) "
+			  "FROM main.shards LIMIT 1");
+	if (stmt) {
+		sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			id = sqlite3_column_int(stmt, 0);
+			registered = sqlite3_column_type(stmt, 1) != SQLITE_NULL;
+			if (registered)
+				safe_strcpy(path, (const char *)sqlite3_column_text(stmt, 1),
+				    sizeof(path));
+			in_database = sqlite3_column_int(stmt, 2) != 0;
+		}
+		sqlite3_finalize(stmt);
+	}
+	if (!registered && id > 0) {
+		/* Next to the database, a replica lists the same files */
+		safe_strcpy(dir, sqlite3_db_filename(db, "main"), sizeof(dir));
+		if (strrchr(dir, '/'))
+			*strrchr(dir, '/') = '\0';
+		safe_strcat(dir, "/shards", sizeof(dir));
+		snprintf(path, sizeof(path), "%s/%d.db", dir, id);
+		if (id >= 1 << (31 - DB_SHARD_ID_SHIFT)
+		    || db_shard_count >= sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, -1)) {
+			fprintf(stderr, "Too many shards for '%s'\n", root);
+			id = 0;
+		} else if (!mkdir_recursive(dir)) {
+			fprintf(stderr, "Failed to create shard directory: %s\n", dir);
+			id = 0;
+		}
+	}
+	if (id > 0)
+		shard = db_shard_load(path, profile);
+	if (shard) {
+		/* Ids of the shard start at its own offset */
+		sqlite3_snprintf(sizeof(sql), sql,
+		    "INSERT INTO sqlite_sequence (name, seq) SELECT column1, %lld "
+		    "FROM (VALUES ('tracks'), ('artists'), ('albums'), ('genres')) "
+		    "WHERE column1 NOT IN (SELECT name FROM sqlite_sequence)",
+		    (long long)id << DB_SHARD_ID_SHIFT);
+		sqlite3_exec(shard->conn, sql, NULL, NULL, NULL);
+	}
+	if (shard && !registered) {
+		stmt = db_prepare("INSERT INTO main.shards (id, root, path) VALUES (?, ?, ?)");
+		if (stmt) {
+			sqlite3_bind_int(stmt, 1, id);
+			sqlite3_bind_text(stmt, 2, root, -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC);
+		}
+		if (!stmt || !db_step_done(stmt, "add shard")) {
+			db_shard_free(shard);
+			shard = NULL;
+		}
+	}
+	/* Also when the file of a registered shard was gone at db_init() */
+	if (shard) {
+		int count = db_attach_shards(db);
+
+		if (count < 0) {
+			db_shard_free(shard);
+			shard = NULL;
+		} else {
+			db_shard_count = count;
+		}
+	}
+	pthread_mutex_unlock(&db_shard_lock);
+
+	if (!shard)
+		return false;
+	db_shard = shard;
+	/* Tracks of root indexed before it had a shard */
+	if (in_database && !db_shard_take_root(root)) {
+		db_shard_close();
+		return false;
+	}
+	return true;
+}
+
+/* Back to the database for the calling thread */
+void db_shard_close(void) {
+	db_shard_free(db_shard);
+	db_shard = NULL;
+}
+
+/* Number of shards the library is in, 0 when it is in the database alone */
+int db_shard_total(void) {
+	return db_shard_count;
+}
+
+/* --------------------------------------------------------------------------
+ * Names
+ *
+ * The indexer keeps the tags of every file and the keepers of every
+ * directory, the two things display names are made of besides the
+ * path. glaciera-indexer --rebuild-names makes the names again from
+ * them alone when the rules or the rippers change, without reading a
+ * single file.
+ */
+
+/*
+ * The tags of the file at filepath, NULL when it has none, and its
+ * genre, which files without those can have too. A track whose tags
+ * changed gets the ids of its artist, album and genre.
+ */
+bool db_set_track_tags(
+    const char *filepath, const struct track_metadata *meta, const char *genre) {
+	const char *filename;
+	int dir_id = db_split_path(filepath, &filename, false);
+	sqlite3_stmt *stmt = db_prepare(db_sql_set_tags);
+
+	if (!stmt)
+		return false;
+	sqlite3_bind_int(stmt, 1, dir_id);
+	sqlite3_bind_text(stmt, 2, filename, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 3, meta != NULL);
+	if (meta) {
+		sqlite3_bind_text(stmt, 4, meta->title, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 5, meta->artist, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 6, meta->album, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 7, meta->track, -1, SQLITE_STATIC);
+	}
+	sqlite3_bind_int(stmt, 8, meta ? meta->track_number : -1);
+	sqlite3_bind_text(stmt, 9, genre, -1, SQLITE_STATIC);
+	if (!db_step_done(stmt, "set tags"))
+		return false;
+	if (sqlite3_changes(db_conn()) == 0)
+		return true;
+
+	for (size_t i = 0; i < sizeof(db_sql_intern_track) / sizeof(db_sql_intern_track[0]); i++) {
+		stmt = db_prepare(db_sql_intern_track[i]);
+		if (!stmt)
+			return false;
+		sqlite3_bind_int(stmt, 1, dir_id);
+		sqlite3_bind_text(stmt, 2, filename, -1, SQLITE_STATIC);
+		if (!db_step_done(stmt, "look up tags"))
+			return false;
+	}
+	return true;
+}
+
+/* The keepers of the file names in dir, see find_redundant_song_names() */
+bool db_set_dir_keepers(const char *dir, const BITS keepers[], size_t size) {
+	int dir_id = db_dir_find(dir, strlen(dir), true);
+	sqlite3_stmt *stmt;
+
+	if (dir_id <= 0)
+		return false;
+	stmt = db_prepare(db_sql_set_keepers);
+	if (!stmt)
+		return false;
+	sqlite3_bind_int(stmt, 1, dir_id);
+	sqlite3_bind_blob(stmt, 2, keepers, (int)size, SQLITE_STATIC);
+	return db_step_done(stmt, "set keepers");
+}
+
+static char *db_column_strdup(sqlite3_stmt *stmt, int column) {
+	const char *text = (const char *)sqlite3_column_text(stmt, column);
+
+	return text ? strdup(text) : NULL;
+}
+
+/*
+ * The tagged column at column and the tags after it, in the order of
+ * db_sql_set_tags. Returns 1 when the names are made from meta, 0 when
+ * from the path, -1 when the tags were never stored.
+ */
+static int db_column_meta(sqlite3_stmt *stmt, int column, struct track_metadata *meta) {
+	if (sqlite3_column_type(stmt, column) == SQLITE_NULL)
+		return -1;
+	meta->title = db_column_strdup(stmt, column + 1);
+	meta->artist = db_column_strdup(stmt, column + 2);
+	meta->album = db_column_strdup(stmt, column + 3);
+	meta->track = db_column_strdup(stmt, column + 4);
+	meta->track_number = sqlite3_column_int(stmt, column + 5);
+	return sqlite3_column_int(stmt, column) != 0;
+}
+
+/* The tags of track id, see db_column_meta(); -1 on error too */
+int db_get_track_meta(int id, struct track_metadata *meta) {
+	sqlite3_stmt *stmt;
+	int tagged = -1;
+
+	stmt = db_prepare("SELECT tagged, tag_title, tag_artist, tag_album, tag_track, "
+			  "    tag_track_number FROM tracks WHERE id=?");
+	if (!stmt)
+		return -1;
+	sqlite3_bind_int(stmt, 1, id);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		tagged = db_column_meta(stmt, 0, meta);
+	sqlite3_finalize(stmt);
+	return tagged;
+}
+
+/* Every track with what its names were made from, NULL on error */
+struct db_name_source *db_get_name_sources(int *count) {
+	sqlite3_stmt *stmt;
+	struct db_name_source *sources = NULL;
+	int capacity = 0;
+	int n = 0;
+
+	*count = 0;
+	stmt = db_prepare("SELECT t.id, t.dir_id, t.filename, t.tagged, t.tag_title, t.tag_artist, "
+			  "    t.tag_album, t.tag_track, t.tag_track_number, d.keepers, "
+			  "    t.display_name, t.search_text "
+			  "FROM tracks AS t LEFT JOIN dirs AS d ON d.id=t.dir_id");
+	if (!stmt)
+		return NULL;
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		struct db_name_source *src;
+		const void *keepers = sqlite3_column_blob(stmt, 9);
+
+		if (n == capacity) {
+			struct db_name_source *grown;
+
+			capacity = capacity ? capacity * 2 : 1024;
+			grown = realloc(sources, (size_t)capacity * sizeof(*sources));
+			if (!grown) {
+				sqlite3_finalize(stmt);
+				db_free_name_sources(sources, n);
+				return NULL;
+			}
+			sources = grown;
+		}
+		src = &sources[n++];
+		memset(src, 0, sizeof(*src));
+		src->id = sqlite3_column_int(stmt, 0);
+		src->dir_id = sqlite3_column_int(stmt, 1);
+		src->filename = db_column_strdup(stmt, 2);
+		track_metadata_init(&src->meta);
+		src->tagged = db_column_meta(stmt, 3, &src->meta);
+		src->have_keepers
+		    = keepers && sqlite3_column_bytes(stmt, 9) == (int)sizeof(src->keepers);
+		if (src->have_keepers)
+			memcpy(src->keepers, keepers, sizeof(src->keepers));
+		src->display_name = db_column_strdup(stmt, 10);
+		src->search_text = db_column_strdup(stmt, 11);
+	}
+	sqlite3_finalize(stmt);
+	*count = n;
+	return sources ? sources : calloc(1, sizeof(*sources));
+}
+
+void db_free_name_sources(struct db_name_source *sources, int count) {
+	if (!sources)
+		return;
+	for (int i = 0; i < count; i++) {
+		free(sources[i].filename);
+		track_metadata_clear(&sources[i].meta);
+		free(sources[i].display_name);
+		free(sources[i].search_text);
+	}
+	free(sources);
+}
+
+/*
+ * The names of the renamed sources, batch tracks per transaction.
+ * Shards are written through their attachment. Returns the number of
+ * tracks written, -1 on error.
+ */
+int db_store_names(const struct db_name_source *sources, int count, int batch) {
+	sqlite3_stmt *stmts[DB_SHARD_ATTACH_MAX + 1];
+	sqlite3 *conn = db_conn();
+	int databases = db_prepare_in_each(conn,
+	    "UPDATE %s.tracks SET display_name=?2, search_text=?3 WHERE id=?1", stmts,
+	    DB_SHARD_ATTACH_MAX + 1);
+	int written = 0;
+	bool ok = databases > 0;
+
+	for (int i = 0; ok && i < count; i++) {
+		if (!sources[i].renamed)
+			continue;
+		if (written % batch == 0)
+			ok = sqlite3_exec(conn, "BEGIN", NULL, NULL, NULL) == SQLITE_OK;
+		for (int d = 0; ok && d < databases; d++) {
+			sqlite3_bind_int(stmts[d], 1, sources[i].id);
+			sqlite3_bind_text(stmts[d], 2, sources[i].display_name, -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmts[d], 3, sources[i].search_text, -1, SQLITE_STATIC);
+			ok = sqlite3_step(stmts[d]) == SQLITE_DONE;
+			sqlite3_reset(stmts[d]);
+		}
+		if (ok && ++written % batch == 0)
+			ok = sqlite3_exec(conn, "COMMIT", NULL, NULL, NULL) == SQLITE_OK;
+	}
+	if (ok && written % batch != 0)
+		ok = sqlite3_exec(conn, "COMMIT", NULL, NULL, NULL) == SQLITE_OK;
+	if (!ok) {
+		fprintf(stderr, "Cannot store names: %s\n", sqlite3_errmsg(conn));
+		if (!sqlite3_get_autocommit(conn))
+			sqlite3_exec(conn, "ROLLBACK", NULL, NULL, NULL);
+	}
+	for (int d = 0; d < databases; d++)
+		sqlite3_finalize(stmts[d]);
+	return ok ? written : -1;
+}
+
+/* --------------------------------------------------------------------------
+ * Artists, albums and genres
+ *
+ * Every name of an artist, album or genre tag is a row of its table,
+ * with the number and total duration of its tracks. The indexer adds
+ * the names as it sees them, see db_set_track_tags(), and counts once
+ * a scan is done. The player lists them and looks tracks up by their
+ * ids instead of going through every display name. With shards the
+ * same name can be a row in each, so the player goes by name.
+ */
+
+/* Ids for every track, for the ones indexed before the tables existed */
+static bool db_intern_all(void) {
+	for (size_t i = 0; i < sizeof(db_sql_intern_all) / sizeof(db_sql_intern_all[0]); i++) {
+		if (!db_exec(db_sql_intern_all[i]))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * The counts in the tables of the calling thread's database, see
+ * DB_SQL_COUNT_TAGS. Run after a scan, outside of a transaction.
+ */
+bool db_count_tags(void) {
+	int64_t interned = db_meta_value("tags_interned");
+	bool ok = interned >= 0 && db_exec("BEGIN");
+
+	if (ok && interned == 0)
+		ok = db_intern_all() && db_meta_set("tags_interned", 1);
+	for (size_t i = 0; ok && i < sizeof(db_sql_count_tags) / sizeof(db_sql_count_tags[0]); i++)
+		ok = db_exec(db_sql_count_tags[i]);
+	ok = ok && db_exec("COMMIT");
+	if (!ok && !sqlite3_get_autocommit(db_conn()))
+		sqlite3_exec(db_conn(), "ROLLBACK", NULL, NULL, NULL);
+	return ok;
+}
+
+/* Whether the indexer filled the table, it is empty until the first scan after an upgrade */
+bool db_have_tags(enum db_tag_table table) {
+	char sql[64];
+	sqlite3_stmt *stmt;
+	bool have = false;
+
+	snprintf(sql, sizeof(sql), "SELECT 1 FROM %s LIMIT 1", db_sql_tags[table].table);
+	stmt = db_prepare(sql);
+	if (!stmt)
+		return false;
+	have = sqlite3_step(stmt) == SQLITE_ROW;
+	sqlite3_finalize(stmt);
+	return have;
+}
+
+/*
+ * The names in table starting with prefix, or all of them when it is
+ * NULL, with at least min_tracks tracks. In name order, NULL on error.
+ */
+struct db_tag_value *db_get_tag_values(
+    enum db_tag_table table, const char *prefix, int min_tracks, int *count) {
+	sqlite3_stmt *stmt = db_prepare(db_sql_tags[table].values);
+	struct db_tag_value *values = NULL;
+	int capacity = 0;
+	int n = 0;
+
+	*count = 0;
+	if (!stmt)
+		return NULL;
+	sqlite3_bind_text(stmt, 1, prefix, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 2, min_tracks);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if (n == capacity) {
+			struct db_tag_value *grown;
+
+			capacity = capacity ? capacity * 2 : 256;
+			grown = realloc(values, (size_t)capacity * sizeof(*values));
+			if (!grown) {
+				sqlite3_finalize(stmt);
+				db_free_tag_values(values, n);
+				return NULL;
+			}
+			values = grown;
+		}
+		values[n].name = db_column_strdup(stmt, 0);
+		values[n].track_count = sqlite3_column_int(stmt, 1);
+		values[n].duration = sqlite3_column_int(stmt, 2);
+		n++;
+	}
+	sqlite3_finalize(stmt);
+	*count = n;
+	return values ? values : calloc(1, sizeof(*values));
+}
+
+void db_free_tag_values(struct db_tag_value *values, int count) {
+	if (!values)
+		return;
+	for (int i = 0; i < count; i++)
+		free(values[i].name);
+	free(values);
+}
+
+/* The tracks of the artist, album or genre called name, in display name order */
+struct db_track **db_get_tag_tracks(enum db_tag_table table, const char *name, int *count) {
+	sqlite3_stmt *stmt;
+
+	*count = 0;
+	stmt = db_prepare(db_sql_tags[table].tracks);
+	if (!stmt)
+		return NULL;
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_TRANSIENT);
+	return db_collect_tracks(stmt, count);
+}
+
+/* The name of the artist, album or genre of a track, NULL when it has none */
+char *db_get_track_tag(enum db_tag_table table, int dir_id, const char *filename) {
+	sqlite3_stmt *stmt = db_prepare(db_sql_tags[table].of_track);
+	char *name = NULL;
+
+	if (!stmt)
+		return NULL;
+	sqlite3_bind_int(stmt, 1, dir_id);
+	sqlite3_bind_text(stmt, 2, filename, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		name = db_column_strdup(stmt, 0);
+	sqlite3_finalize(stmt);
+	return name;
+}
+
+/* --------------------------------------------------------------------------
+ * Library generation
+ */
+
+/*
+ * 0 on error, generations start at 1. With shards it is the sum of
+ * theirs and the database's, which also goes up with each of them.
+ */
+uint64_t db_get_generation(void) {
+	sqlite3_stmt *stmt = db_prepare(!db_shard && db_shard_count
+		? "SELECT value FROM library_generation"
+		: "SELECT value FROM meta WHERE key='generation'");
+	uint64_t generation = 0;
+
+	if (!stmt)
+		return 0;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		generation = (uint64_t)sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	return generation;
+}
+
+/* The library changed, older snapshots no longer describe it */
+bool db_bump_generation(void) {
+	return db_exec("UPDATE meta SET value=value+1 WHERE key='generation'");
+}
+
+/* --------------------------------------------------------------------------
+ * Play statistics
+ *
+ * Every play the player records is a row in plays. The ones that were
+ * not skipped also count in play_count and last_played of the track, in
+ * the same transaction, so the toplist is one indexed query. Plays are
+ * looked up by directory id and file name, which the player has.
+ */
+
+/* plays on conn in one transaction, history marks the history as imported */
+static bool db_store_plays(sqlite3 *conn, const struct db_play *plays, int count, bool history) {
+	sqlite3_stmt *record = NULL;
+	sqlite3_stmt *counted[DB_SHARD_ATTACH_MAX + 1] = { 0 };
+	int databases;
+	bool ok;
+
+	if (sqlite3_exec(conn, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Cannot record plays: %s\n", sqlite3_errmsg(conn));
+		return false;
+	}
+	databases
+	    = db_prepare_in_each(conn, DB_SQL_COUNT_PLAY("%s"), counted, DB_SHARD_ATTACH_MAX + 1);
+	ok = databases > 0
+	    && sqlite3_prepare_v2(conn, db_sql_record_play, -1, &record, NULL) == SQLITE_OK;
+	for (int i = 0; ok && i < count; i++) {
+		sqlite3_bind_int(record, 1, plays[i].dir_id);
+		sqlite3_bind_text(record, 2, plays[i].filename, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(record, 3, plays[i].started_at);
+		sqlite3_bind_int(record, 4, plays[i].seconds_played);
+		sqlite3_bind_int(record, 5, plays[i].skipped);
+		ok = sqlite3_step(record) == SQLITE_DONE;
+		sqlite3_reset(record);
+		for (int d = 0; ok && !plays[i].skipped && d < databases; d++) {
+			sqlite3_bind_int(counted[d], 1, plays[i].dir_id);
+			sqlite3_bind_text(counted[d], 2, plays[i].filename, -1, SQLITE_STATIC);
+			sqlite3_bind_int64(counted[d], 3, plays[i].started_at);
+			ok = sqlite3_step(counted[d]) == SQLITE_DONE;
+			sqlite3_reset(counted[d]);
+		}
+	}
+	if (ok && history)
+		ok = sqlite3_exec(conn,
+			 "INSERT OR REPLACE INTO meta (key, value) VALUES ('history_imported', 1)",
+			 NULL, NULL, NULL)
+		    == SQLITE_OK;
+	if (!ok)
+		fprintf(stderr, "Cannot record plays: %s\n", sqlite3_errmsg(conn));
+	sqlite3_finalize(record);
+	for (int d = 0; d < databases; d++)
+		sqlite3_finalize(counted[d]);
+	sqlite3_exec(conn, ok ? "COMMIT" : "ROLLBACK", NULL, NULL, NULL);
+	return ok;
+}
+
+/* A connection for plays to the database at db_path, NULL on error */
+static sqlite3 *db_open_plays(const char *db_path) {
+	sqlite3 *conn;
+
+	if (sqlite3_open(db_path, &conn) != SQLITE_OK) {
+		fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(conn));
+		sqlite3_close(conn);
+		return NULL;
+	}
+	sqlite3_busy_timeout(conn, db_profile.busy_timeout_ms);
+	if (db_attach_shards(conn) < 0) {
+		sqlite3_close(conn);
+		return NULL;
+	}
+	return conn;
+}
+
+/*
+ * The player reads a replica, see db_replica_copy(). Plays go to the
+ * database at db_path as well, the next refresh would lose them.
+ */
+bool db_set_primary(const char *db_path) {
+	db_primary = db_open_plays(db_path);
+	return db_primary != NULL;
+}
+
+/*
+ * Connections of their own for the player's writer thread, so that its
+ * transactions never hold the mutex of the one the player reads with
+ * while they wait for a lock or sync to disk. Only db_record_plays()
+ * uses them, from that thread alone, until db_close_writer().
+ */
+bool db_open_writer(void) {
+	const char *path = db ? sqlite3_db_filename(db, "main") : NULL;
+
+	/* A database in memory cannot be opened twice */
+	if (!path || !*path)
+		return false;
+	db_writer = db_open_plays(path);
+	if (db_writer && db_primary)
+		db_writer_primary = db_open_plays(sqlite3_db_filename(db_primary, "main"));
+	if (!db_writer || (db_primary && !db_writer_primary)) {
+		db_close_writer();
+		return false;
+	}
+	return true;
+}
+
+void db_close_writer(void) {
+	sqlite3_close(db_writer);
+	db_writer = NULL;
+	sqlite3_close(db_writer_primary);
+	db_writer_primary = NULL;
+}
+
+/*
+ * The replica reads the same shards as the database, so with shards the
+ * plays only go to the database, or the shards would count them twice.
+ */
+bool db_record_plays(const struct db_play *plays, int count) {
+	sqlite3 *conn = db_writer ? db_writer : db;
+	sqlite3 *primary = db_writer ? db_writer_primary : db_primary;
+	bool ok = !primary || db_store_plays(primary, plays, count, false);
+
+	if (primary && db_shard_count)
+		return ok;
+	return db_store_plays(conn, plays, count, false) && ok;
+}
+
+/* Plays from the dated playlists of the history, once per database */
+bool db_import_history(const struct db_play *plays, int count) {
+	bool ok = !db_primary || db_store_plays(db_primary, plays, count, true);
+
+	if (db_primary && db_shard_count)
+		return ok;
+	return db_store_plays(db, plays, count, true) && ok;
+}
+
+bool db_history_imported(void) {
+	sqlite3 *conn = db_primary && db_shard_count ? db_primary : db;
+	sqlite3_stmt *stmt;
+	bool imported = false;
+
+	if (sqlite3_prepare_v2(conn, "SELECT value FROM meta WHERE key='history_imported'", -1,
+		&stmt, NULL)
+	    != SQLITE_OK)
+		return false;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		imported = sqlite3_column_int(stmt, 0) != 0;
+	sqlite3_finalize(stmt);
+	return imported;
+}
+
+/* The limit most played tracks with at least min_plays plays, most played first */
+struct db_track **db_get_top_tracks(int min_plays, int limit, int *count) {
+	sqlite3_stmt *stmt;
+	*count = 0;
+
+	stmt = db_prepare(db_sql_top_tracks);
+	if (!stmt)
+		return NULL;
+	sqlite3_bind_int(stmt, 1, min_plays);
+	sqlite3_bind_int(stmt, 2, limit);
+
+	return db_collect_tracks(stmt, count);
+}
+
+/* --------------------------------------------------------------------------
+ * Rebuilds
+ *
+ * A rebuild loads a new database file next to the live one, without a
+ * journal, without syncing and without secondary indices, then builds
+ * the indices and copies it into the live database in one transaction
+ * with the backup API. A running player keeps reading the old library
+ * until that transaction commits and sees the new one on its next query.
+ *
+ * The new file is not rename()d over the live one: the live database
+ * is in WAL mode, and a player still reading the old file would share
+ * its "-wal" and "-shm" files with the new one.
+ */
+
+/* CREATE INDEX statements of the schema, run once the rebuild is loaded */
+static char **rebuild_indices;
+static int rebuild_index_count;
+
+static void db_rebuild_path(const char *db_path, char *out, size_t out_size) {
+	snprintf(out, out_size, "%s.rebuild", db_path);
+}
+
+static void db_rebuild_free_indices(void) {
+	for (int i = 0; i < rebuild_index_count; i++)
+		free(rebuild_indices[i]);
+	free(rebuild_indices);
+	rebuild_indices = NULL;
+	rebuild_index_count = 0;
+}
+
+/* Take the secondary indices out of the migrated schema, for later */
+static bool db_rebuild_defer_indices(void) {
+	sqlite3_stmt *stmt;
+	char sql[256];
+	char **names = NULL;
+	int count = 0;
+	bool ok = true;
+
+	stmt = db_prepare(
+	    "SELECT name, sql FROM sqlite_master WHERE type='index' AND sql IS NOT NULL");
+	if (!stmt)
+		return false;
+	while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+		char **n = realloc(names, (count + 1) * sizeof(*names));
+		char **r = realloc(rebuild_indices, (count + 1) * sizeof(*rebuild_indices));
+
+		if (n)
+			names = n;
+		if (r)
+			rebuild_indices = r;
+		if (!n || !r) {
+			ok = false;
+			break;
+		}
+		names[count] = strdup((const char *)sqlite3_column_text(stmt, 0));
+		rebuild_indices[count] = strdup((const char *)sqlite3_column_text(stmt, 1));
+		count++;
+		rebuild_index_count = count;
+	}
+	sqlite3_finalize(stmt);
+
+	for (int i = 0; ok && i < count; i++) {
+		snprintf(sql, sizeof(sql), "DROP INDEX \"%s\"", names[i]);
+		ok = db_exec(sql);
+	}
+	for (int i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+	return ok;
+}
+
+/*
+ * Open a fresh rebuild database holding a copy of the live one, so that
+ * roots not being rebuilt are kept. See db_rebuild_forget_root().
+ */
+bool db_rebuild_begin(const char *db_path, const db_profile_t *profile) {
+	char path[1024];
+	char sql[64];
+	sqlite3_stmt *stmt;
+	int page_size = 0;
+
+	/* Bring the live schema up to date, its rows are copied column for column */
+	if (!db_init(db_path, profile))
+		return false;
+	if (db_shard_count) {
+		fprintf(stderr, "The library is in shards, it cannot be rebuilt into one "
+				"database\n");
+		db_close();
+		return false;
+	}
+	db_close();
+
+	db_rebuild_path(db_path, path, sizeof(path));
+	unlink(path); /* left over from an interrupted rebuild */
+	if (sqlite3_open(path, &db) != SQLITE_OK) {
+		fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+		db_close();
+		return false;
+	}
+	db_register_functions(db);
+	if (profile)
+		db_apply_profile(db, profile);
+	sqlite3_exec(db, "PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF", NULL, NULL, NULL);
+
+	stmt = db_prepare("ATTACH DATABASE ? AS live");
+	if (!stmt)
+		goto fail;
+	sqlite3_bind_text(stmt, 1, db_path, -1, SQLITE_STATIC);
+	if (!db_step_done(stmt, "attach live database"))
+		goto fail;
+
+	/* The backup into a WAL database needs both to have the same page size */
+	stmt = db_prepare("PRAGMA live.page_size");
+	if (!stmt)
+		goto fail;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		page_size = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	if (page_size > 0) {
+		snprintf(sql, sizeof(sql), "PRAGMA main.page_size=%d", page_size);
+		sqlite3_exec(db, sql, NULL, NULL, NULL);
+	}
+
+	/* Unqualified names in the migrations must not reach the live database */
+	if (!db_exec("DETACH DATABASE live") || !db_migrate() || !db_rebuild_defer_indices())
+		goto fail;
+
+	stmt = db_prepare("ATTACH DATABASE ? AS live");
+	if (!stmt)
+		goto fail;
+	sqlite3_bind_text(stmt, 1, db_path, -1, SQLITE_STATIC);
+	if (!db_step_done(stmt, "attach live database"))
+		goto fail;
+	if (!db_exec("INSERT INTO main.dirs SELECT * FROM live.dirs;"
+		     "INSERT INTO main.tracks SELECT * FROM live.tracks;"
+		     "INSERT INTO main.scan_roots SELECT * FROM live.scan_roots;"
+		     "INSERT INTO main.scan_progress SELECT * FROM live.scan_progress;"
+		     "INSERT OR REPLACE INTO main.meta SELECT * FROM live.meta;"
+		     "INSERT INTO main.plays SELECT * FROM live.plays;"
+		     "INSERT INTO main.artists SELECT * FROM live.artists;"
+		     "INSERT INTO main.albums SELECT * FROM live.albums;"
+		     "INSERT INTO main.genres SELECT * FROM live.genres;"
+		     "DETACH DATABASE live;"
+		     "CREATE TEMP TABLE rebuild_played ("
+		     "    id INTEGER PRIMARY KEY,"
+		     "    dir_id INTEGER NOT NULL,"
+		     "    filename TEXT NOT NULL"
+		     ");"))
+		goto fail;
+	return true;
+
+fail:
+	db_rebuild_free_indices();
+	db_close();
+	unlink(path);
+	return false;
+}
+
+/* Drop everything the copy knows about root, it is indexed from scratch */
+bool db_rebuild_forget_root(const char *root) {
+	sqlite3_stmt *stmt;
+
+	/* Their plays go to the tracks that take their place, see db_rebuild_finish() */
+	stmt = db_prepare(DB_DIRS_BELOW_CTE
+	    "INSERT INTO temp.rebuild_played SELECT id, dir_id, filename FROM tracks "
+	    "WHERE dir_id IN below AND id IN (SELECT track_id FROM plays)");
+	if (!stmt)
+		return false;
+	sqlite3_bind_int(stmt, 1, db_root_dir(root));
+	if (!db_step_done(stmt, "remember played tracks"))
+		return false;
+
+	stmt = db_prepare(DB_DIRS_BELOW_CTE "DELETE FROM tracks WHERE dir_id IN below");
+	if (!stmt)
+		return false;
+	sqlite3_bind_int(stmt, 1, db_root_dir(root));
+	if (!db_step_done(stmt, "forget root tracks"))
+		return false;
+
+	stmt = db_prepare("DELETE FROM scan_progress WHERE root=?");
+	if (!stmt)
+		return false;
+	sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+	if (!db_step_done(stmt, "forget root progress"))
+		return false;
+
+	stmt = db_prepare("DELETE FROM scan_roots WHERE root=?");
+	if (!stmt)
+		return false;
+	sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+	return db_step_done(stmt, "forget root");
+}
+
+/* Index the rebuilt database and make it the live one, then close it */
+bool db_rebuild_finish(const char *db_path) {
+	char path[1024];
+	sqlite3 *live;
+	sqlite3_backup *backup;
+	int rc;
+
+	db_rebuild_path(db_path, path, sizeof(path));
+	/* A file that is gone keeps its plays under its old id */
+	if (!db_exec("UPDATE plays SET track_id=coalesce(("
+		     "    SELECT tracks.id FROM temp.rebuild_played AS r JOIN tracks"
+		     "    ON tracks.dir_id=r.dir_id AND tracks.filename=r.filename"
+		     "    WHERE r.id=plays.track_id), track_id) "
+		     "WHERE track_id IN (SELECT id FROM temp.rebuild_played);"
+		     "UPDATE tracks SET play_count=p.n, last_played=p.last FROM ("
+		     "    SELECT track_id, count(*) AS n, max(started_at) AS last FROM plays"
+		     "    WHERE NOT skipped GROUP BY track_id) AS p "
+		     "WHERE tracks.id=p.track_id"))
+		return false;
+	for (int i = 0; i < rebuild_index_count; i++) {
+		if (!db_exec(rebuild_indices[i]))
+			return false;
+	}
+	db_rebuild_free_indices();
+	/* Always a large change, and ANALYZE has to see the indices */
+	if (!db_exec("ANALYZE"))
+		return false;
+
+	rc = sqlite3_open(db_path, &live);
+	if (rc == SQLITE_OK) {
+		/* Waits out a writer, readers never block the backup in WAL mode */
+		sqlite3_busy_timeout(live, 10000);
+		backup = sqlite3_backup_init(live, "main", db, "main");
+		if (backup) {
+			rc = sqlite3_backup_step(backup, -1);
+			sqlite3_backup_finish(backup);
+		} else {
+			rc = sqlite3_errcode(live);
+		}
+	}
+	if (rc != SQLITE_OK && rc != SQLITE_DONE) {
+		fprintf(stderr, "Cannot replace database: %s\n", sqlite3_errstr(rc));
+		fprintf(stderr, "The rebuilt database was left in %s\n", path);
+		sqlite3_close(live);
+		db_close();
+		return false;
+	}
+
+	sqlite3_close(live);
+	db_close();
+	unlink(path);
+	return true;
+}
+
+/* --------------------------------------------------------------------------
+ * Player lock
+ *
+ * A running player holds a shared flock() on "<database>.player" for
+ * as long as it runs, which lets the indexer see whether someone is
+ * listening. flock() is separate from the POSIX locks SQLite takes on
+ * the database itself.
+ */
+
+static void db_player_lock_path(const char *db_path, char *out, size_t out_size) {
+	snprintf(out, out_size, "%s.player", db_path);
+}
+
+/* Called by the player, the lock is released when it exits */
+bool db_hold_player_lock(const char *db_path) {
+	char path[1024];
+	int fd;
+
+	db_player_lock_path(db_path, path, sizeof(path));
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd == -1)
+		return false;
+	/* Not inherited by the players glaciera starts, they may outlive it */
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if (flock(fd, LOCK_SH | LOCK_NB) == -1) {
+		close(fd);
+		return false;
+	}
+	return true; /* fd stays open on purpose */
+}
+
+bool db_player_running(const char *db_path) {
+	char path[1024];
+	bool running;
+	int fd;
+
+	db_player_lock_path(db_path, path, sizeof(path));
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return false; /* no player has run since the database was made */
+	running = flock(fd, LOCK_EX | LOCK_NB) == -1 && errno == EWOULDBLOCK;
+	close(fd);
+	return running;
+}
+
+/* --------------------------------------------------------------------------
+ * Local replica
+ *
+ * With the database on a network share, the player can read a copy of
+ * it in the cache directory, so that its queries never wait on the
+ * network. The copy is made with the backup API on connections of its
+ * own, a few pages per step with a pause in between, so the share is
+ * not saturated and the indexer is not kept from writing. The copy is
+ * in WAL mode like the database: the player keeps reading the previous
+ * copy until the last step commits the new one.
+ */
+
+#define DB_REPLICA_PAUSE_MS 10
+
+/* Library generation of the database file at path, 0 when it has none */
+uint64_t db_file_generation(const char *path) {
+	sqlite3 *conn;
+	sqlite3_stmt *stmt;
+	uint64_t generation = 0;
+
+	if (sqlite3_open_v2(path, &conn, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK) {
+		sqlite3_busy_timeout(conn, 1000);
+		if (sqlite3_prepare_v2(conn, "SELECT value FROM meta WHERE key='generation'", -1,
+			&stmt, NULL)
+		    == SQLITE_OK) {
+			if (sqlite3_step(stmt) == SQLITE_ROW)
+				generation = (uint64_t)sqlite3_column_int64(stmt, 0);
+			sqlite3_finalize(stmt);
+		}
+	}
+	sqlite3_close(conn);
+	return generation;
+}
+
+/*
+ * Was the database file at path or its write-ahead log modified since
+ * the last call. Only the mtimes are looked at. Not thread safe, meant
+ * for the one thread that keeps a replica fresh.
+ */
+bool db_file_changed(const char *path) {
+	static struct timespec last;
+	struct timespec newest = { 0 };
+	char wal[1024];
+	struct stat st;
+	bool changed;
+
+	snprintf(wal, sizeof(wal), "%s-wal", path);
+	for (int i = 0; i < 2; i++) {
+		if (stat(i ? wal : path, &st) != 0)
+			continue;
+		if (st.st_mtim.tv_sec > newest.tv_sec
+		    || (st.st_mtim.tv_sec == newest.tv_sec && st.st_mtim.tv_nsec > newest.tv_nsec))
+			newest = st.st_mtim;
+	}
+	changed = newest.tv_sec != last.tv_sec || newest.tv_nsec != last.tv_nsec;
+	last = newest;
+	return changed;
+}
+
+/*
+ * Copy the database at source_path into replica_path, step_pages pages
+ * at a time. progress, when given, is called after every step with the
+ * pages copied so far and the total.
+ */
+bool db_replica_copy(const char *source_path, const char *replica_path, int step_pages,
+    void (*progress)(int done, int total)) {
+	sqlite3 *source = NULL;
+	sqlite3 *replica = NULL;
+	sqlite3_backup *backup;
+	int rc;
+
+	rc = sqlite3_open_v2(source_path, &source, SQLITE_OPEN_READONLY, NULL);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_open(replica_path, &replica);
+	if (rc == SQLITE_OK) {
+		sqlite3_busy_timeout(source, 5000);
+		sqlite3_busy_timeout(replica, 5000);
+		backup = sqlite3_backup_init(replica, "main", source, "main");
+		if (backup) {
+			do {
+				rc = sqlite3_backup_step(backup, step_pages);
+				if (progress)
+					progress(sqlite3_backup_pagecount(backup)
+						- sqlite3_backup_remaining(backup),
+					    sqlite3_backup_pagecount(backup));
+				/* Restarts by itself if the source was written meanwhile */
+				if (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED)
+					sqlite3_sleep(DB_REPLICA_PAUSE_MS);
+			} while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+			sqlite3_backup_finish(backup);
+		} else {
+			rc = sqlite3_errcode(replica);
+		}
+	}
+	if (rc == SQLITE_DONE)
+		sqlite3_exec(replica, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+	else
+		fprintf(stderr, "Cannot copy database to %s: %s\n", replica_path,
+		    sqlite3_errstr(rc));
+	sqlite3_close(replica);
+	sqlite3_close(source);
+	return rc == SQLITE_DONE;
+}
+
+/*
+ * Housekeeping after a scan that changed at least maintain_after tracks
+ * of the profile: fresh statistics for the query planner, and the WAL
+ * checkpointed and truncated so readers do not have to look through it.
+ */
+bool db_maintain(int changed_tracks) {
+	if (!db_profile.maintain_after || changed_tracks < db_profile.maintain_after)
+		return true;
+	return db_exec("ANALYZE; PRAGMA optimize; PRAGMA wal_checkpoint(TRUNCATE)");
+}
+
+/* Print the query plans of the statements in db_hot_statements[] */
+void db_explain(FILE *out) {
+	size_t count = sizeof(db_hot_statements) / sizeof(db_hot_statements[0]);
+	char sql[1024];
+
+	fprintf(out, "Schema version %d\n", db_user_version());
+	for (size_t i = 0; i < count; i++) {
+		sqlite3_stmt *stmt;
+		int ids[16], depth[16];
+		int rows = 0;
+
+		fprintf(out, "\n%s:\n", db_hot_statements[i].name);
+		snprintf(sql, sizeof(sql), "EXPLAIN QUERY PLAN %s", db_hot_statements[i].sql);
+		if (sqlite3_prepare_v2(db_conn(), sql, -1, &stmt, NULL) != SQLITE_OK) {
+			fprintf(out, "  %s\n", sqlite3_errmsg(db_conn()));
+			continue;
+		}
+		/* Columns are id, parent, unused and detail, children follow their parent */
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			int parent = sqlite3_column_int(stmt, 1);
+			int d = 0;
+
+			for (int j = 0; j < rows && j < 16; j++) {
+				if (ids[j] == parent)
+					d = depth[j] + 1;
+			}
+			if (rows < 16) {
+				ids[rows] = sqlite3_column_int(stmt, 0);
+				depth[rows] = d;
+			}
+			fprintf(out, "  %*s%s\n", d * 2, "",
+			    (const char *)sqlite3_column_text(stmt, 3));
+			rows++;
+		}
+		if (rows == 0)
+			fprintf(out, "  (no lookups)\n");
+		sqlite3_finalize(stmt);
+	}
+}
+
 /* Statistics */
 int db_get_track_count(void) {
 	sqlite3_stmt *stmt;
@@ -561,9 +3172,9 @@ int db_get_track_count(void) {
 
 	const char *sql = "SELECT COUNT(*) FROM tracks";
 
-	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	rc = sqlite3_prepare_v2(db_conn(), sql, -1, &stmt, NULL);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+		fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db_conn()));
 		return 0;
 	}
 
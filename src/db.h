@@ -1,21 +1,68 @@
 #pragma once
 
 #include "common.h"
+#include "config.h"
 #include <sqlite3.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 
 struct db_track {
 	int id;
+	int dir_id; /* 0 when filepath has no directory, see db_get_dir_paths() */
 	char *filepath;
+	const char *filename; /* points into filepath */
 	char *display_name;
 	char *search_text;
 	struct tuneinfo ti;
+	uint64_t fingerprint; /* 0 when not computed yet */
 	time_t created_at;
 	time_t updated_at;
+	int play_count; /* only from db_get_top_tracks() */
+};
+
+/* One play of a track, see db_record_plays() */
+struct db_play {
+	int dir_id;
+	const char *filename;
+	time_t started_at;
+	int seconds_played;
+	bool skipped;
+};
+
+/* What the names of a track are made of, see db_get_name_sources() */
+#define DB_KEEPERS_WORDS 8 /* BITS, one for each of 256 file name columns */
+
+struct db_name_source {
+	int id;
+	int dir_id;
+	char *filename;
+	int tagged; /* 1 the name is made from meta, 0 from the path, -1 not known */
+	struct track_metadata meta;
+	bool have_keepers;
+	BITS keepers[DB_KEEPERS_WORDS];
+	char *display_name;
+	char *search_text;
+	bool renamed; /* set by the caller, see db_store_names() */
+};
+
+/* The tables of artists, albums and genres, see db_count_tags() */
+enum db_tag_table {
+	DB_ARTISTS,
+	DB_ALBUMS,
+	DB_GENRES,
+};
+
+struct db_tag_value {
+	char *name;
+	int track_count;
+	int duration; /* seconds, of all its tracks */
 };
 
 /* Database initialization and management */
-bool db_init(const char *db_path);
+#define DB_IN_MEMORY ":memory:" /* db_init() path for a throwaway database */
+
+bool db_init(const char *db_path, const db_profile_t *profile);
 void db_close(void);
 bool db_migrate(void);
 
@@ -27,10 +74,15 @@ bool db_update_track(int id, const char *filepath, const char *display_name,
 bool db_delete_track(int id);
 bool db_track_exists(const char *filepath);
 
+/* Directory paths by id, count is one more than the largest id */
+char **db_get_dir_paths(int *count);
+void db_free_dir_paths(char **dirs, int count);
+
 /* Track retrieval */
 struct db_track *db_get_track_by_id(int id);
 struct db_track *db_get_track_by_filepath(const char *filepath);
 struct db_track **db_search_tracks(const char *query, int *count);
+struct db_track **db_fuzzy_search_tracks(const char *query, int min_score, int limit, int *count);
 struct db_track **db_get_all_tracks(int *count);
 
 /* Batch operations for indexing */
@@ -40,8 +92,75 @@ bool db_rollback_transaction(void);
 void db_insert_track_batch(const char *filepath, const char *display_name, const char *search_text,
     const struct tuneinfo *ti);
 
+/* Resumable scans */
+int db_scan_begin(const char *root, int *resumed_dirs);
+bool db_scan_dir_is_done(const char *root, const char *dir);
+bool db_scan_dir_done(const char *root, const char *dir);
+bool db_mark_track_scanned(const char *filepath, int scan_id);
+int db_scan_finish(const char *root, int scan_id, bool sweep);
+
+/* Rename and move detection */
+bool db_set_track_fingerprint(const char *filepath, uint64_t fingerprint);
+int db_find_moved_track(uint64_t fingerprint, int filesize);
+bool db_have_fingerprints(void);
+bool db_move_track(int id, const char *filepath, const char *display_name,
+    const char *search_text, int scan_id);
+
+/* Names made again without reading the files, see --rebuild-names */
+bool db_set_track_tags(
+    const char *filepath, const struct track_metadata *meta, const char *genre);
+bool db_set_dir_keepers(const char *dir, const BITS keepers[], size_t size);
+int db_get_track_meta(int id, struct track_metadata *meta);
+struct db_name_source *db_get_name_sources(int *count);
+void db_free_name_sources(struct db_name_source *sources, int count);
+int db_store_names(const struct db_name_source *sources, int count, int batch);
+
+/* Artists, albums and genres from the tags */
+bool db_count_tags(void);
+bool db_have_tags(enum db_tag_table table);
+struct db_tag_value *db_get_tag_values(
+    enum db_tag_table table, const char *prefix, int min_tracks, int *count);
+void db_free_tag_values(struct db_tag_value *values, int count);
+struct db_track **db_get_tag_tracks(enum db_tag_table table, const char *name, int *count);
+char *db_get_track_tag(enum db_tag_table table, int dir_id, const char *filename);
+
+/* One database per root for the indexer, see [database] shards */
+bool db_shard_open(const char *root, const db_profile_t *profile);
+void db_shard_close(void);
+int db_shard_total(void);
+
+/* Library generation, see snapshot.c */
+uint64_t db_get_generation(void);
+bool db_bump_generation(void);
+
+/* Play statistics */
+bool db_set_primary(const char *db_path);
+bool db_open_writer(void);
+void db_close_writer(void);
+bool db_record_plays(const struct db_play *plays, int count);
+bool db_import_history(const struct db_play *plays, int count);
+bool db_history_imported(void);
+struct db_track **db_get_top_tracks(int min_plays, int limit, int *count);
+
+/* Rebuild into a new file, then replace the live database with it */
+bool db_rebuild_begin(const char *db_path, const db_profile_t *profile);
+bool db_rebuild_forget_root(const char *root);
+bool db_rebuild_finish(const char *db_path);
+
+/* Is a player using the database */
+bool db_hold_player_lock(const char *db_path);
+bool db_player_running(const char *db_path);
+
+/* A copy of the database for the player, see [database] replica */
+uint64_t db_file_generation(const char *path);
+bool db_file_changed(const char *path);
+bool db_replica_copy(const char *source_path, const char *replica_path, int step_pages,
+    void (*progress)(int done, int total));
+
 /* Statistics */
 int db_get_track_count(void);
+bool db_maintain(int changed_tracks);
+void db_explain(FILE *out);
 
 /* Memory management */
 void db_free_track(struct db_track *track);
@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * dirlist.c - Read a directory once
+ *
+ * The indexer used to read every directory twice: once to find the
+ * parts of the file names that are the same in all files, and once
+ * more to process the files. On a network share each pass is a round
+ * of getdents calls, so the entries are now copied out on the first
+ * and only pass, together with what the later steps need to know
+ * about them (type, extension, format).
+ */
+
+/* d_type and DT_* are not part of POSIX */
+#define _DEFAULT_SOURCE
+
+// System headers
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local headers
+#include "dirlist.h"
+#include "music.h"
+
+/* -------------------------------------------------------------------------- */
+
+static unsigned char dirlist_kind(unsigned char d_type) {
+	switch (d_type) {
+	case DT_DIR:
+		return DIRLIST_DIR;
+	case DT_UNKNOWN:
+	case DT_LNK:
+		return DIRLIST_UNKNOWN;
+	default:
+		return DIRLIST_OTHER;
+	}
+}
+
+static bool dirlist_grow(struct dirlist *dl, size_t name_len) {
+	if (dl->count == dl->capacity) {
+		size_t capacity = dl->capacity ? dl->capacity * 2 : 256;
+		struct dirlist_entry *entries = realloc(dl->entries, capacity * sizeof(*entries));
+		if (!entries)
+			return false;
+		dl->entries = entries;
+		dl->capacity = capacity;
+	}
+
+	if (dl->names_len + name_len + 1 > dl->names_capacity) {
+		size_t capacity = dl->names_capacity ? dl->names_capacity : 16 * 1024;
+		while (dl->names_len + name_len + 1 > capacity)
+			capacity *= 2;
+		char *names = realloc(dl->names, capacity);
+		if (!names)
+			return false;
+		dl->names = names;
+		dl->names_capacity = capacity;
+	}
+	return true;
+}
+
+/*
+ * Append the entries of dir, except "." and "..", and set mark to where
+ * they start. Returns false if the directory cannot be opened; entries
+ * that do not fit in memory are left out.
+ */
+bool dirlist_read(struct dirlist *dl, const char *dir, struct dirlist_mark *mark) {
+	struct dirent *sd;
+	DIR *pdir;
+
+	mark->count = dl->count;
+	mark->names_len = dl->names_len;
+
+	pdir = opendir(dir);
+	if (!pdir)
+		return false;
+
+	while ((sd = readdir(pdir)) != NULL) {
+		struct dirlist_entry *e;
+		const char *dot;
+		size_t len;
+
+		if (sd->d_name[0] == '.'
+		    && (sd->d_name[1] == '\0' || (sd->d_name[1] == '.' && sd->d_name[2] == '\0')))
+			continue;
+
+		len = strlen(sd->d_name);
+		if (len > UINT16_MAX || dl->names_len + len + 1 > UINT32_MAX)
+			continue;
+		if (!dirlist_grow(dl, len)) {
+			fprintf(stderr, "Out of memory reading %s\n", dir);
+			break;
+		}
+
+		e = &dl->entries[dl->count++];
+		e->name = (uint32_t)dl->names_len;
+		e->name_len = (uint16_t)len;
+		dot = strrchr(sd->d_name, '.');
+		e->stem_len = (uint16_t)(dot ? (size_t)(dot - sd->d_name) : len);
+		e->kind = dirlist_kind(sd->d_type);
+		e->format = (unsigned char)music_format(sd->d_name);
+
+		memcpy(dl->names + dl->names_len, sd->d_name, len + 1);
+		dl->names_len += len + 1;
+	}
+	closedir(pdir);
+	return true;
+}
+
+/* Drop everything appended since mark */
+void dirlist_release(struct dirlist *dl, const struct dirlist_mark *mark) {
+	dl->count = mark->count;
+	dl->names_len = mark->names_len;
+}
+
+void dirlist_free(struct dirlist *dl) {
+	free(dl->entries);
+	free(dl->names);
+	memset(dl, 0, sizeof(*dl));
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+// System headers
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The entries of a directory, read once with readdir().
+ * A scanning thread keeps one dirlist for its whole walk: each level of
+ * the recursion appends its directory on top and drops it again with
+ * dirlist_release(), so the memory is reused from one directory to the
+ * next. Names live in one pool and are referenced by offset, which keeps
+ * them valid when the pool grows.
+ */
+/* What d_type says about an entry; symlinks count as unknown */
+enum dirlist_kind {
+	DIRLIST_UNKNOWN = 0, /* stat() it to find out */
+	DIRLIST_DIR,
+	DIRLIST_OTHER,
+};
+
+struct dirlist_entry {
+	uint32_t name; /* offset into names */
+	uint16_t name_len;
+	uint16_t stem_len; /* name_len without the extension */
+	unsigned char kind; /* enum dirlist_kind */
+	unsigned char format; /* enum music_format */
+};
+
+struct dirlist {
+	struct dirlist_entry *entries;
+	size_t count;
+	size_t capacity;
+	char *names;
+	size_t names_len;
+	size_t names_capacity;
+};
+
+/* Where one directory's entries start */
+struct dirlist_mark {
+	size_t count;
+	size_t names_len;
+};
+
+bool dirlist_read(struct dirlist *dl, const char *dir, struct dirlist_mark *mark);
+void dirlist_release(struct dirlist *dl, const struct dirlist_mark *mark);
+void dirlist_free(struct dirlist *dl);
+
+static inline const char *dirlist_name(const struct dirlist *dl, size_t i) {
+	return dl->names + dl->entries[i].name;
+}
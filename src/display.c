@@ -0,0 +1,301 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * display.c - Build the display name of a tune
+ *
+ * A display name comes from the tags when there are any, otherwise
+ * from the path. Either way it is cleaned up by the same rules:
+ *
+ *   "_"              => " "      (path only, also "[" => "(", "]" => ")")
+ *   ripper suffix    => ""       (path only, see rippers.c)
+ *   runs of " "      => " "
+ *   runs of "-"      => "-"
+ *   "- -" and ". -"  => "."
+ *   " . "            => ". "
+ *   leading ASCII punctuation and spaces dropped (path only)
+ *
+ * The rules used to be separate passes over the string, each one
+ * reading the previous one's output. display_normalize() applies
+ * them in one left-to-right pass instead: every rule is a small
+ * stage that holds back at most two characters, and each character
+ * is pushed through the stages in the same order as the passes ran,
+ * so the result is the same byte for byte.
+ */
+
+// System headers
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+// Local headers
+#include "common.h"
+#include "display.h"
+#include "rippers.h"
+
+/* Byte translation for names taken from the path */
+static const unsigned char display_path_map[256] = {
+	RIPPERS_MAP_ID16(0x00), RIPPERS_MAP_ID16(0x10), RIPPERS_MAP_ID16(0x20),
+	RIPPERS_MAP_ID16(0x30), RIPPERS_MAP_ID16(0x40),
+	'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z', '(', '\\', ')', '^', ' ',
+	RIPPERS_MAP_ID16(0x60), RIPPERS_MAP_ID16(0x70), RIPPERS_MAP_ID16(0x80),
+	RIPPERS_MAP_ID16(0x90), RIPPERS_MAP_ID16(0xa0), RIPPERS_MAP_ID16(0xb0),
+	RIPPERS_MAP_ID16(0xc0), RIPPERS_MAP_ID16(0xd0), RIPPERS_MAP_ID16(0xe0),
+	RIPPERS_MAP_ID16(0xf0)
+};
+
+struct display_norm {
+	char *out;
+	size_t pos;
+	size_t size;
+	bool leading; /* still dropping leading punctuation */
+	char prev_space; /* last input of the " " run stage */
+	char prev_minus; /* last input of the "-" run stage */
+	char msm[3]; /* "- -" window */
+	int msm_len;
+	char sds[3]; /* " . " window */
+	int sds_len;
+};
+
+/* -------------------------------------------------------------------------- */
+
+static void norm_emit(struct display_norm *n, char c) {
+	if (n->leading) {
+		if ((unsigned char)c < 128 && !isalnum((unsigned char)c))
+			return;
+		n->leading = false;
+	}
+	if (n->pos + 1 < n->size)
+		n->out[n->pos++] = c;
+}
+
+/* " . " => ". " */
+static void norm_space_dot_space(struct display_norm *n, char c) {
+	n->sds[n->sds_len++] = c;
+	if (n->sds_len < 3)
+		return;
+	if (n->sds[0] == ' ' && n->sds[1] == '.' && n->sds[2] == ' ') {
+		norm_emit(n, '.');
+		norm_emit(n, ' ');
+		n->sds_len = 0;
+	} else {
+		norm_emit(n, n->sds[0]);
+		n->sds[0] = n->sds[1];
+		n->sds[1] = n->sds[2];
+		n->sds_len = 2;
+	}
+}
+
+/* "- -" and ". -" => "." */
+static void norm_minus_space_minus(struct display_norm *n, char c) {
+	n->msm[n->msm_len++] = c;
+	if (n->msm_len < 3)
+		return;
+	if ((n->msm[0] == '-' || n->msm[0] == '.') && n->msm[1] == ' ' && n->msm[2] == '-') {
+		norm_space_dot_space(n, '.');
+		n->msm_len = 0;
+	} else {
+		norm_space_dot_space(n, n->msm[0]);
+		n->msm[0] = n->msm[1];
+		n->msm[1] = n->msm[2];
+		n->msm_len = 2;
+	}
+}
+
+/* Runs of " " => " ", then runs of "-" => "-" */
+static void norm_push(struct display_norm *n, char c) {
+	bool drop = c == ' ' && n->prev_space == ' ';
+
+	n->prev_space = c;
+	if (drop)
+		return;
+	drop = c == '-' && n->prev_minus == '-';
+	n->prev_minus = c;
+	if (!drop)
+		norm_minus_space_minus(n, c);
+}
+
+static void norm_flush(struct display_norm *n) {
+	for (int i = 0; i < n->msm_len; i++)
+		norm_space_dot_space(n, n->msm[i]);
+	n->msm_len = 0;
+	for (int i = 0; i < n->sds_len; i++)
+		norm_emit(n, n->sds[i]);
+	n->sds_len = 0;
+}
+
+/*
+ * Apply the rules above to len bytes of src, writing a NUL terminated
+ * result of at most out_size - 1 bytes. out may be the same buffer as
+ * src, the output never gets ahead of the input. Returns the length.
+ */
+size_t display_normalize(const struct rippers *r, const char *src, size_t len, char *out,
+    size_t out_size, unsigned int flags) {
+	struct display_norm n = {
+		.out = out,
+		.size = out_size,
+		.leading = (flags & DISPLAY_SKIP_LEADING) != 0,
+	};
+
+	if (out_size == 0)
+		return 0;
+
+	if (flags & DISPLAY_FROM_PATH) {
+		len -= rippers_match_mapped(r, src, len, display_path_map);
+		for (size_t i = 0; i < len; i++)
+			norm_push(&n, (char)display_path_map[(unsigned char)src[i]]);
+	} else {
+		for (size_t i = 0; i < len; i++)
+			norm_push(&n, src[i]);
+	}
+	norm_flush(&n);
+
+	out[n.pos] = '\0';
+	return n.pos;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Get the length of a UTF-8 character sequence starting at the given byte
+ * Returns 1-4 for valid sequences, 1 for invalid bytes
+ */
+static int utf8_char_len(unsigned char c) {
+	if ((c & 0x80) == 0x00)
+		return 1; /* 0xxxxxxx - ASCII */
+	if ((c & 0xE0) == 0xC0)
+		return 2; /* 110xxxxx - 2-byte */
+	if ((c & 0xF0) == 0xE0)
+		return 3; /* 1110xxxx - 3-byte */
+	if ((c & 0xF8) == 0xF0)
+		return 4; /* 11110xxx - 4-byte */
+	return 1; /* Invalid UTF-8, treat as single byte */
+}
+
+/* Start of the offset'th last path component */
+static const char *display_nth_component(const char *s, int offset) {
+	int slashcnt = 0;
+
+	for (size_t i = strlen(s); i; i--) {
+		if (s[i] == '/') {
+			slashcnt++;
+			if (offset == slashcnt)
+				return s + i + 1;
+		}
+	}
+	return s;
+}
+
+/*
+ * Pick the part of the path the name is built from, without
+ * the extension:
+ *
+ * "songtitle"    => "path - songtitle"
+ * "10.Songtitle" => "path - 10.songtitle"
+ * "cd1/01-song"  => "album - cd1 - 01-song"
+ */
+static const char *display_pick_name(const char *fullpath, size_t *len) {
+	const char *r = strrchr(fullpath, '/');
+	const char *dot;
+
+	r = r ? r + 1 : fullpath;
+	if (!strchr(r, '-') || (isdigit((unsigned char)r[0]) && isdigit((unsigned char)r[1])))
+		r = display_nth_component(fullpath, 2);
+
+	if ((r[0] == 'c' || r[0] == 'C') && (r[1] == 'd' || r[1] == 'D')
+	    && (r[2] == ' ' || isdigit((unsigned char)r[2]))
+	    && (r[3] == '-' || r[3] == ' ' || r[3] == '/' || isdigit((unsigned char)r[3])))
+		r = display_nth_component(fullpath, 3);
+
+	dot = strrchr(r, '.');
+	*len = dot ? (size_t)(dot - r) : strlen(r);
+	return r;
+}
+
+/*
+ * The directory (path cleaned, ripper dropped) plus the characters
+ * of the file name that the keepers bitmap marks as significant.
+ */
+void display_from_filename(const struct rippers *r, const char *dir, const char *filename,
+    const BITS keepers[], char *out, size_t out_size) {
+	char fullpath[1024 * 4];
+	size_t dir_len = strlen(dir);
+	size_t pos;
+	const char *name;
+	size_t name_len;
+
+	if (dir_len >= sizeof(fullpath)) {
+		snprintf(out, out_size, "%s", filename);
+		return;
+	}
+
+	for (pos = 0; pos < dir_len; pos++)
+		fullpath[pos] = (char)display_path_map[(unsigned char)dir[pos]];
+	pos -= rippers_match(r, fullpath, pos);
+	if (pos < sizeof(fullpath) - 1)
+		fullpath[pos++] = '/';
+
+	/* UTF-8 aware copying using keepers bitmap */
+	for (int i = 0; filename[i] && pos < sizeof(fullpath) - 1;) {
+		int char_len = utf8_char_len((unsigned char)filename[i]);
+
+		/* Copy the whole character if its first byte is kept */
+		if (bittest(keepers, i)) {
+			for (int j = 0; j < char_len && filename[i + j]; j++) {
+				if (pos >= sizeof(fullpath) - 1)
+					break;
+				fullpath[pos++] = filename[i + j];
+			}
+		}
+		i += char_len;
+	}
+	fullpath[pos] = '\0';
+
+	name = display_pick_name(fullpath, &name_len);
+	display_normalize(
+	    r, name, name_len, out, out_size, DISPLAY_FROM_PATH | DISPLAY_SKIP_LEADING);
+}
+
+/* Format: <artist> - <album> - <tracknum> <title> */
+void display_from_metadata(const struct track_metadata *meta, char *out, size_t out_size) {
+	out[0] = '\0';
+	if (!meta)
+		return;
+
+	if (meta->artist && meta->album && meta->title) {
+		if (meta->track_number > 0)
+			snprintf(out, out_size, "%s - %s - %02d %s", meta->artist, meta->album,
+			    meta->track_number, meta->title);
+		else
+			snprintf(
+			    out, out_size, "%s - %s - %s", meta->artist, meta->album, meta->title);
+	}
+	/* Fallback formats when some metadata is missing */
+	else if (meta->artist && meta->title) {
+		if (meta->track_number > 0)
+			snprintf(out, out_size, "%s - %02d %s", meta->artist, meta->track_number,
+			    meta->title);
+		else
+			snprintf(out, out_size, "%s - %s", meta->artist, meta->title);
+	} else if (meta->album && meta->title) {
+		if (meta->track_number > 0)
+			snprintf(out, out_size, "%s - %02d %s", meta->album, meta->track_number,
+			    meta->title);
+		else
+			snprintf(out, out_size, "%s - %s", meta->album, meta->title);
+	} else if (meta->title) {
+		if (meta->track_number > 0)
+			snprintf(out, out_size, "%02d %s", meta->track_number, meta->title);
+		else
+			snprintf(out, out_size, "%s", meta->title);
+	} else if (meta->artist && meta->album) {
+		snprintf(out, out_size, "%s - %s", meta->artist, meta->album);
+	} else if (meta->artist) {
+		snprintf(out, out_size, "%s", meta->artist);
+	} else if (meta->album) {
+		snprintf(out, out_size, "%s", meta->album);
+	} else if (meta->track) {
+		snprintf(out, out_size, "%s", meta->track);
+	}
+
+	display_normalize(NULL, out, strlen(out), out, out_size, 0);
+}
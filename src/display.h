@@ -0,0 +1,18 @@
+#pragma once
+
+// System headers
+#include <stddef.h>
+
+// Local headers
+#include "common.h"
+#include "rippers.h"
+
+/* Flags for display_normalize() */
+#define DISPLAY_FROM_PATH 0x01 /* '_' to ' ', '[]' to '()', drop the ripper suffix */
+#define DISPLAY_SKIP_LEADING 0x02 /* drop leading ASCII non-alphanumerics */
+
+size_t display_normalize(const struct rippers *r, const char *src, size_t len, char *out,
+    size_t out_size, unsigned int flags);
+void display_from_filename(const struct rippers *r, const char *dir, const char *filename,
+    const BITS keepers[], char *out, size_t out_size);
+void display_from_metadata(const struct track_metadata *meta, char *out, size_t out_size);
@@ -37,12 +37,18 @@
 #define _LARGEFILE_SOURCE
 #define _LARGEFILE64_SOURCE
 
+/* posix_fadvise() and sync() */
+#define _DEFAULT_SOURCE
+
 // System headers
 #include <ctype.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
 #include <pthread.h>
 #include <sqlite3.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -60,447 +66,278 @@
 #include "common.h"
 #include "config.h"
 #include "db.h"
+#include "dirlist.h"
+#include "display.h"
 #include "git_version.h"
 #include "music.h"
-
-static char *massage_full_path(char *buf, char *fullpath);
+#include "rippers.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "throttle.h"
 
 struct smalltune *smalltunes = NULL;
 int allcount = 0;
-int total_files = 0;
-double total_bytes = 0;
-int new_files = 0;
-time_t timeprogress = 0;
 bool opt_generate_allmp3db = false;
 bool opt_force_build = false;
 bool opt_skip_file_info = false;
-
-pthread_mutex_t filemutex = PTHREAD_MUTEX_INITIALIZER;
+const char *opt_stats_json = NULL;
+bool opt_bench = false; /* write to an in-memory database */
+bool opt_dry_run = false; /* no database at all */
+bool opt_cold = false; /* read files with a cold page cache */
+bool opt_rebuild = false; /* build a new database, then swap it in */
+bool opt_db_explain = false; /* print query plans and exit */
+bool opt_shards = false; /* a database per root, see [database] shards */
+bool opt_rebuild_names = false; /* names from the database alone, then exit */
 
 /* --------------------------------------------------------------------------- */
 
-struct ripvars {
-	char *str;
-	int len;
-};
-
-struct {
-	short lo;
-	short hi;
-} qsearch[256];
-
-struct ripvars *rippers = NULL;
-int ripperscount = 0;
-
-int rip_sort_function(const void *a, const void *b) {
-	return strcasecmp(((struct ripvars *)a)->str, ((struct ripvars *)b)->str);
-}
-
-void load_rippers(const char *filename) {
-	FILE *f;
-	char buf[255];
-	int i;
-	int ch;
-
-	f = fopen(filename, "r");
-	if (!f)
-		return;
-
-	ripperscount = 0;
-	while (fgets(buf, sizeof(buf), f))
-		ripperscount++;
-	rewind(f);
-	rippers = malloc(ripperscount * sizeof(struct ripvars));
-	ripperscount = 0;
-	while (fgets(buf, sizeof(buf), f)) {
-		chop(buf);
-		if (buf[0]) {
-			rippers[ripperscount].str = strdup(buf);
-			rippers[ripperscount].len = strlen(buf);
-			ripperscount++;
-		}
-	}
-	fclose(f);
+/*
+ * Compiled once in main() and only read afterwards,
+ * so the scanning threads share it without locking.
+ */
+static struct rippers *rippers = NULL;
 
-	for (i = 0; i < ripperscount; i++)
-		strrev(rippers[i].str);
-	qsort((void *)rippers, ripperscount, sizeof(struct ripvars), rip_sort_function);
-	for (i = 0; i < ripperscount; i++)
-		strrev(rippers[i].str);
-	memset(qsearch, 0, sizeof(qsearch));
-	for (i = 0; i < ripperscount; i++) {
-		ch = toupper(0xff & rippers[i].str[rippers[i].len - 1]);
-		if (qsearch[ch].lo == 0)
-			qsearch[ch].lo = i;
-		qsearch[ch].hi = i;
-	}
-}
+/*
+ * Database writes are grouped into transactions of this many tracks,
+ * instead of SQLite committing (and syncing) after every row.
+ */
+#define INDEXER_COMMIT_EVERY 512
+#define RENAME_COMMIT_EVERY 8192
+#define RENAME_THREADS_MAX 16
 
 /*
- * Strip the trailing XXXX from the string AAAAAXXXX.
- * The XXXX strings are stored in the rippers array
+ * Writes to one database connection: the one all roots share, or with
+ * shards the one of a single root. Protected by lock, like the writes
+ * themselves.
  */
-void strip_ripper(char *s) {
-	int i;
-	char *p;
-	int slen = strlen(s);
-	int ch;
-
-	ch = toupper(0xff & s[slen - 1]);
-#ifdef BRUTE_FORCE
-	for (i = 0; i < ripperscount; i++) {
-#else
-	for (i = qsearch[ch].lo; i <= qsearch[ch].hi; i++) {
-#endif
-		if (i) {
-			p = s + slen - rippers[i].len;
-			if (p > s && 0 == strncasecmp(p, rippers[i].str, rippers[i].len)) {
-				*p = 0;
-				break;
-			}
-		}
-	}
-}
+struct db_writes {
+	pthread_mutex_t lock;
+	bool in_transaction;
+	int pending_writes;
+	int changed_tracks; /* inserted, updated, moved or removed, see db_maintain() */
+	bool generation_bumped;
+};
+
+static struct db_writes shared_writes = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static atomic_int moved_files;
+
+/* Bytes hashed at each end of a file for its fingerprint */
+#define FINGERPRINT_BYTES 4096
+
+/* State of the thread that scans one root */
+struct scan_thread {
+	struct dirlist dl;
+	struct stats_root *stats;
+	struct throttle_bucket *bucket; /* of the device root is on */
+	struct db_writes *writes; /* shared_writes, or shard_writes with shards */
+	struct db_writes shard_writes;
+	const char *root;
+	int scan_id; /* 0 without a database */
+	bool resuming; /* skip directories an interrupted scan finished */
+	bool find_moves; /* the database has tracks that files can be moves of */
+	int unreadable; /* directories that could not be read */
+};
 
 /* --------------------------------------------------------------------------- */
 
-void get_cached_info(char *filename, struct tuneinfo *ti) {
-	struct db_track *track = db_get_track_by_filepath(filename);
+void get_cached_info(
+    struct stats_root *stats, struct filetype *ft, char *filename, struct tuneinfo *ti) {
+	struct db_track *track = NULL;
+
+	if (!opt_dry_run && !opt_force_build)
+		track = db_get_track_by_filepath(filename);
+	unsigned char format = ti->format;
 
 	if (track) {
 		memcpy(ti, &track->ti, sizeof(struct tuneinfo));
+		ti->format = format;
 		db_free_track(track);
 	} else if (!opt_skip_file_info) {
-		music_info(filename, ti);
-		/* Note: new_files is incremented when inserting into DB, not here */
+		uint64_t t = stats_now();
+		music_info(ft, filename, ti);
+		stats_record(stats, STATS_PROBE, t);
+		/* Note: new files are counted when inserting into DB, not here */
 	}
 
-	total_files++;
-	total_bytes += ti->filesize;
+	stats_count_file(stats, ti->filesize);
 }
 
-/* --------------------------------------------------------------------------- */
-
-void trim_display_path(char *src) {
-	char *dst;
+/* ------------------------------------------------------------------------- */
 
-	dst = src;
-	while (*src) {
-		switch (*src) {
-		case '_':
-			*dst++ = ' ';
-			break;
-		case '[':
-			*dst++ = '(';
-			break;
-		case ']':
-			*dst++ = ')';
-			break;
-		default:
-			*dst++ = *src;
-			break;
-		}
-		src++;
+/*
+ * Count tracks written to the database. The first change of a run
+ * bumps the library generation in the same transaction, so glaciera
+ * stops trusting the snapshot as soon as the change is visible.
+ * Called with w->lock held.
+ */
+static void library_changed(struct db_writes *w, int tracks) {
+	if (!w->generation_bumped) {
+		db_bump_generation();
+		w->generation_bumped = true;
 	}
+	w->changed_tracks += tracks;
 }
 
-void trim_double_spaces(char *src) {
-	char *dst;
-
-	dst = src;
-	while (*src) {
-		while (' ' == *src && ' ' == *(src + 1))
-			src++;
-		*dst++ = *src++;
-	}
-	*dst = 0;
+static bool same_tuneinfo(const struct tuneinfo *a, const struct tuneinfo *b) {
+	return a->filesize == b->filesize && a->filedate == b->filedate
+	    && a->duration == b->duration && a->bitrate == b->bitrate && a->genre == b->genre
+	    && a->rating == b->rating && a->format == b->format;
 }
 
-void trim_double_minuses(char *src) {
-	char *dst;
-
-	dst = src;
-	while (*src) {
-		while ('-' == *src && '-' == *(src + 1))
-			src++;
-		*dst++ = *src++;
-	}
-	*dst = 0;
-}
+/* Called with w->lock held, stats is NULL from the main thread */
+static void commit_pending_writes(struct db_writes *w, struct stats_root *stats) {
+	uint64_t t = stats_now();
 
-void trim_minus_space_minus(char *src) {
-	char *dst;
-
-	dst = src;
-	while (*src) {
-		if (('-' == *(src + 0) || '.' == *(src + 0)) && ' ' == *(src + 1)
-		    && '-' == *(src + 2)) {
-			*dst++ = '.';
-			src++;
-			src++;
-			src++;
-		} else
-			*dst++ = *src++;
-	}
-	*dst = 0;
-}
-
-void trim_space_dot_space(char *src) {
-	char *dst;
-
-	dst = src;
-	while (*src) {
-		if ((' ' == *(src + 0)) && '.' == *(src + 1) && ' ' == *(src + 2)) {
-			*dst++ = '.';
-			*dst++ = ' ';
-			src++;
-			src++;
-			src++;
-		} else
-			*dst++ = *src++;
-	}
-	*dst = 0;
+	if (!w->in_transaction)
+		return;
+	if (!db_commit_transaction())
+		fprintf(stderr, "\nglaciera-indexer: commit failed\n");
+	stats_record(stats, STATS_COMMIT, t);
+	w->in_transaction = false;
+	w->pending_writes = 0;
 }
 
 /*
- * Get the length of a UTF-8 character sequence starting at the given byte
- * Returns 1-4 for valid sequences, 1 for invalid bytes
+ * Size and FNV-1a hash of the first and last FINGERPRINT_BYTES of a
+ * file. New files are hashed after their probe, which has the head and
+ * usually the tail in the page cache by then; only when the database
+ * has tracks a file can be a move of does it run before the probe.
+ * Returns 0 if the file cannot be read.
  */
-static int utf8_char_len(unsigned char c) {
-	if ((c & 0x80) == 0x00)
-		return 1; /* 0xxxxxxx - ASCII */
-	if ((c & 0xE0) == 0xC0)
-		return 2; /* 110xxxxx - 2-byte */
-	if ((c & 0xF0) == 0xE0)
-		return 3; /* 1110xxxx - 3-byte */
-	if ((c & 0xF8) == 0xF0)
-		return 4; /* 11110xxx - 4-byte */
-	return 1; /* Invalid UTF-8, treat as single byte */
-}
-
-static void build_display_from_filename(
-    const char *dir, const char *filename, BITS keepers[], char *out, size_t out_size) {
-	char fullpath[1024 * 4];
-	char gbuf[1024 * 4];
-	size_t dir_len = strlen(dir);
-
-	if (dir_len >= sizeof(fullpath)) {
-		snprintf(out, out_size, "%s", filename);
-		return;
+static uint64_t file_fingerprint(const char *filename, int *filesize) {
+	unsigned char buf[FINGERPRINT_BYTES];
+	uint64_t h = 0xcbf29ce484222325ULL;
+	struct stat ss;
+	off_t offsets[2];
+	int fd = open(filename, O_RDONLY);
+
+	if (fd == -1)
+		return 0;
+	if (fstat(fd, &ss) == -1) {
+		close(fd);
+		return 0;
 	}
 
-	strncpy(fullpath, dir, sizeof(fullpath));
-	fullpath[sizeof(fullpath) - 1] = '\0';
-	trim_display_path(fullpath);
-	strip_ripper(fullpath);
-	strncat(fullpath, "/", sizeof(fullpath) - strlen(fullpath) - 1);
-
-	/* UTF-8 aware copying using keepers bitmap */
-	char *p = fullpath + strlen(fullpath);
-	for (int i = 0; filename[i] && (size_t)(p - fullpath) < sizeof(fullpath) - 1;) {
-		/* Determine UTF-8 character length */
-		int char_len = utf8_char_len((unsigned char)filename[i]);
-
-		/* Check if first byte of character should be kept */
-		if (bittest(keepers, i)) {
-			/* Copy entire UTF-8 character */
-			for (int j = 0; j < char_len && filename[i + j]
-			    && (size_t)(p - fullpath) < sizeof(fullpath) - 1;
-			    j++) {
-				*p++ = filename[i + j];
-			}
+	offsets[0] = 0;
+	offsets[1] = ss.st_size > FINGERPRINT_BYTES ? ss.st_size - FINGERPRINT_BYTES : 0;
+	for (int i = 0; i < (offsets[1] ? 2 : 1); i++) {
+		ssize_t len = pread(fd, buf, sizeof(buf), offsets[i]);
+		for (ssize_t j = 0; j < len; j++) {
+			h ^= buf[j];
+			h *= 0x100000001b3ULL;
 		}
-
-		/* Advance by full character length */
-		i += char_len;
 	}
-	*p = '\0';
-
-	safe_strcpy(gbuf, massage_full_path(gbuf, fullpath), sizeof(gbuf));
-	trim_display_path(gbuf);
-	strip_ripper(gbuf);
-	trim_double_spaces(gbuf);
-	trim_double_minuses(gbuf);
-	trim_minus_space_minus(gbuf);
-	trim_space_dot_space(gbuf);
-
-	/* Skip leading non-alphanumeric ASCII, but preserve Unicode */
-	p = gbuf;
-	while (*p && (unsigned char)*p < 128 && !isalnum((unsigned char)*p))
-		p++;
-
-	snprintf(out, out_size, "%s", p);
-}
-
-static void build_display_from_metadata(
-    const struct track_metadata *meta, char *out, size_t out_size) {
-	out[0] = '\0';
-	if (!meta)
-		return;
+	close(fd);
 
-	/* Format: <artist> - <album> - <tracknum> <title> */
-	if (meta->artist && meta->album && meta->title) {
-		if (meta->track_number > 0)
-			snprintf(out, out_size, "%s - %s - %02d %s", meta->artist, meta->album,
-			    meta->track_number, meta->title);
-		else
-			snprintf(
-			    out, out_size, "%s - %s - %s", meta->artist, meta->album, meta->title);
-	}
-	/* Fallback formats when some metadata is missing */
-	else if (meta->artist && meta->title) {
-		if (meta->track_number > 0)
-			snprintf(out, out_size, "%s - %02d %s", meta->artist, meta->track_number,
-			    meta->title);
-		else
-			snprintf(out, out_size, "%s - %s", meta->artist, meta->title);
-	} else if (meta->album && meta->title) {
-		if (meta->track_number > 0)
-			snprintf(out, out_size, "%s - %02d %s", meta->album, meta->track_number,
-			    meta->title);
-		else
-			snprintf(out, out_size, "%s - %s", meta->album, meta->title);
-	} else if (meta->title) {
-		if (meta->track_number > 0)
-			snprintf(out, out_size, "%02d %s", meta->track_number, meta->title);
-		else
-			snprintf(out, out_size, "%s", meta->title);
-	} else if (meta->artist && meta->album) {
-		snprintf(out, out_size, "%s - %s", meta->artist, meta->album);
-	} else if (meta->artist) {
-		snprintf(out, out_size, "%s", meta->artist);
-	} else if (meta->album) {
-		snprintf(out, out_size, "%s", meta->album);
-	} else if (meta->track) {
-		snprintf(out, out_size, "%s", meta->track);
-	}
-
-	trim_double_spaces(out);
-	trim_double_minuses(out);
-	trim_minus_space_minus(out);
-	trim_space_dot_space(out);
+	h ^= (uint64_t)ss.st_size;
+	h *= 0x100000001b3ULL;
+	if (filesize)
+		*filesize = (int)ss.st_size;
+	return h ? h : 1;
 }
 
-char *fix_01_to_fullname(int offset, char *s) {
-	int i;
-	int slashcnt;
-
-	slashcnt = 0;
-	for (i = strlen(s); i; i--) {
-		if (s[i] == '/') {
-			slashcnt++;
-			if (offset == slashcnt) {
-				return s + i + 1;
-			}
-		}
-	}
-
-	return s;
+/* Called with w->lock held */
+static void begin_pending_writes(struct db_writes *w) {
+	if (!w->in_transaction)
+		w->in_transaction = db_begin_transaction();
 }
 
-char *massage_full_path(char *buf, char *fullpath) {
-	char *p, *r;
-
-	safe_strcpy(buf, fullpath, 1024 * 4);
-
-	/*
-	 * Find the actual filename
-	 */
-	r = strrchr(buf, '/');
-	if (r)
-		r++;
-	else
-		r = buf;
+/*
+ * The display name and search text of a file: from its tags when meta is
+ * not NULL and they make a name, otherwise from its path and the keepers
+ * of its directory. Returns the display name, which starts inside
+ * display, or NULL when the name comes from the path and keepers is NULL.
+ */
+static const char *make_names(const char *dir, const char *filename, const BITS keepers[],
+    const struct track_metadata *meta, char *display, size_t display_size, char *search_text,
+    size_t search_size) {
+	char *trimmed = display;
 
-	/*
-	 * "songtitle"    => "path - songtitle"
-	 * "10.Songtitle" => "path - 10.songtitle"
-	 */
-	if ((NULL == strchr(r, '-') || (isdigit(r[0]) && isdigit(r[1])))) {
-		r = fix_01_to_fullname(2, fullpath);
-	}
+	display[0] = '\0';
+	if (meta)
+		display_from_metadata(meta, display, display_size);
 
-	if ((r[0] == 'c' || r[0] == 'C') && (r[1] == 'd' || r[1] == 'D')
-	    && (r[2] == ' ' || isdigit(r[2]))
-	    && (r[3] == '-' || r[3] == ' ' || r[3] == '/' || isdigit(r[3]))) {
-		r = fix_01_to_fullname(3, fullpath);
+	if (display[0] == '\0') {
+		if (!keepers)
+			return NULL;
+		display_from_filename(rippers, dir, filename, keepers, display, display_size);
 	}
 
-	/*
-	 * Strip the .mp3 / .ogg part
-	 */
-	p = strrchr(r, '.');
-	if (p)
-		*p = 0;
-
-	return r;
-}
-
-/* --------------------------------------------------------------------------- */
-
-void report_scanning_progress(int sig) {
-	(void)sig;
-
-	static int prev_total_files = 0;
-	static double prev_total_bytes = 0;
-	int megdiff;
-	char suffix[3] = "MB";
-
-	megdiff = (total_bytes - prev_total_bytes) / 1024 / 1024;
-	if (megdiff > 1024) {
-		megdiff /= 1024;
-		safe_strcpy(suffix, "GB", sizeof(suffix));
-	}
+	if (display[0] == '\0')
+		snprintf(display, display_size, "%s", filename);
 
-	fprintf(stderr, "\rTotal files: %8d  new files: %8d (%5d/sec %6d%s/sec)", total_files,
-	    new_files, total_files - prev_total_files, megdiff, suffix);
-	fflush(stderr);
-	prev_total_files = total_files;
-	prev_total_bytes = total_bytes;
+	while (*trimmed && !isalnum((unsigned char)*trimmed))
+		trimmed++;
 
-	alarm(1);
+	/* Create search text from display name */
+	safe_strcpy(search_text, trimmed, search_size);
+	only_searchables(search_text);
+	return trimmed;
 }
 
-/* ------------------------------------------------------------------------- */
-
-void process_one_file(
-    char *dir, char *afullpath, char *filename, struct tuneinfo *pfti, BITS keepers[]) {
+/* Called with st->writes->lock held */
+void process_one_file(struct scan_thread *st, struct filetype *ft, const char *dir,
+    char *afullpath, const char *filename, struct tuneinfo *pfti, const BITS keepers[],
+    uint64_t fingerprint) {
+	struct stats_root *stats = st->stats;
+	struct db_writes *w = st->writes;
 	char display[1024 * 4];
 	char search_text[1024 * 4];
 	struct track_metadata meta;
+	uint64_t t = stats_now();
 	track_metadata_init(&meta);
-	bool have_meta = music_metadata(afullpath, &meta);
-
-	if (have_meta)
-		build_display_from_metadata(&meta, display, sizeof(display));
+	bool have_meta = music_metadata(ft, afullpath, &meta);
+	stats_record(stats, STATS_PROBE, t);
 
-	if (!have_meta || display[0] == '\0')
-		build_display_from_filename(dir, filename, keepers, display, sizeof(display));
+	t = stats_now();
+	const char *trimmed = make_names(dir, filename, keepers, have_meta ? &meta : NULL, display,
+	    sizeof(display), search_text, sizeof(search_text));
+	stats_record(stats, STATS_DISPLAY, t);
 
-	if (display[0] == '\0')
-		snprintf(display, sizeof(display), "%s", filename);
-
-	char *trimmed = display;
-	while (*trimmed && !isalnum((unsigned char)*trimmed))
-		trimmed++;
+	if (opt_dry_run) {
+		track_metadata_clear(&meta);
+		return;
+	}
 
-	/* Create search text from display name */
-	safe_strcpy(search_text, trimmed, sizeof(search_text));
-	only_searchables(search_text);
+	t = stats_now();
+	begin_pending_writes(w);
 
 	/* Check if track already exists and update or insert */
 	if (db_track_exists(afullpath)) {
 		struct db_track *existing = db_get_track_by_filepath(afullpath);
 		if (existing) {
-			/* Update existing track */
-			db_update_track(existing->id, afullpath, trimmed, search_text, pfti);
+			/* Update existing track, if anything about it changed */
+			if (strcmp(existing->display_name, trimmed) != 0
+			    || strcmp(existing->search_text, search_text) != 0
+			    || !same_tuneinfo(&existing->ti, pfti)) {
+				db_update_track(existing->id, afullpath, trimmed, search_text, pfti);
+				library_changed(w, 1);
+			}
+			/* Tracks indexed before fingerprints existed, or forced */
+			if (existing->fingerprint && !opt_force_build)
+				fingerprint = 0;
+			else if (!fingerprint)
+				fingerprint = file_fingerprint(afullpath, NULL);
 			db_free_track(existing);
 		}
 	} else {
 		/* Insert new track */
 		db_insert_track(afullpath, trimmed, search_text, pfti);
-		new_files++;
+		library_changed(w, 1);
+		stats_count_new_file(stats);
+		if (!fingerprint)
+			fingerprint = file_fingerprint(afullpath, NULL);
 	}
+	if (fingerprint)
+		db_set_track_fingerprint(afullpath, fingerprint);
+	/* For --rebuild-names and the artist and genre views, a no-op unless they changed */
+	db_set_track_tags(afullpath, have_meta ? &meta : NULL, meta.genre);
+	if (st->scan_id)
+		db_mark_track_scanned(afullpath, st->scan_id);
+	stats_record(stats, STATS_DB_WRITE, t);
+
+	if (w->in_transaction && ++w->pending_writes >= INDEXER_COMMIT_EVERY)
+		commit_pending_writes(w, stats);
 
 	track_metadata_clear(&meta);
 }
@@ -508,36 +345,33 @@ void process_one_file(
 /*
  * Analyze filename patterns across directory to find common/unique characters
  */
-static int analyze_filename_patterns(DIR *pdir, char basefilename[256], int samecolumn[256],
-    int sumcolumn[256], int trackcolumn[256]) {
-	struct dirent *sd;
-	char *p;
-	int i;
+static int analyze_filename_patterns(const struct dirlist *dl, const struct dirlist_mark *mark,
+    char basefilename[256], int samecolumn[256], int sumcolumn[256], int trackcolumn[256]) {
 	int musicfiles = 0;
 
-	while (NULL != (sd = readdir(pdir))) {
-		if (!music_isit(sd->d_name))
+	for (size_t n = mark->count; n < dl->count; n++) {
+		const struct dirlist_entry *e = &dl->entries[n];
+		const char *name = dirlist_name(dl, n);
+
+		if (!e->format)
 			continue;
 
 		musicfiles++;
 
-		/* Chop the file extension */
-		p = strrchr(sd->d_name, '.');
-		if (p)
-			*p = 0;
-
+		/* Only the name without its extension counts */
 		if (!basefilename[0])
-			safe_strcpy(basefilename, sd->d_name, 256);
+			snprintf(basefilename, 256, "%.*s", (int)e->stem_len, name);
 
 		/* Analyze each character position */
-		for (p = sd->d_name, i = 0; *p; p++, i++) {
-			if (' ' == *p || ispunct(*p))
+		for (int i = 0; i < e->stem_len; i++) {
+			unsigned char c = name[i];
+			if (' ' == c || ispunct(c))
 				continue;
-			if (basefilename[i] == *p)
+			if ((unsigned char)basefilename[i] == c)
 				samecolumn[i]++;
-			if (isdigit(*p)) {
+			if (isdigit(c)) {
 				trackcolumn[i]++;
-				sumcolumn[i] += *p;
+				sumcolumn[i] += (char)c;
 			}
 		}
 	}
@@ -650,7 +484,8 @@ static void build_keepers_bitmap(
  *
  * Removes redundant parts like "Band" that appear in all files
  */
-void find_redundant_song_names(DIR *pdir, BITS keepers[]) {
+void find_redundant_song_names(
+    const struct dirlist *dl, const struct dirlist_mark *mark, BITS keepers[]) {
 	char basefilename[256];
 	int samecolumn[256];
 	int sumcolumn[256];
@@ -663,8 +498,8 @@ void find_redundant_song_names(DIR *pdir, BITS keepers[]) {
 	memset(sumcolumn, 0, sizeof(sumcolumn));
 
 	/* Analyze all music files in directory */
-	musicfiles
-	    = analyze_filename_patterns(pdir, basefilename, samecolumn, sumcolumn, trackcolumn);
+	musicfiles = analyze_filename_patterns(
+	    dl, mark, basefilename, samecolumn, sumcolumn, trackcolumn);
 
 	/* Keep all characters if there's only one file */
 	if (musicfiles <= 1) {
@@ -690,76 +525,265 @@ void find_redundant_song_names(DIR *pdir, BITS keepers[]) {
 	build_keepers_bitmap(samecolumn, trackcolumn, keepers);
 }
 
-void *prim_recurse_disc(void *argdir) {
-	DIR *pdir;
-#if defined(__APPLE__)
-	struct dirent *sd;
-#else
-	struct dirent64 *sd;
-	struct dirent64 *sdbuf;
-#endif
+/* --cold: drop what the page cache holds of a file before it is read */
+static void evict_file(const char *filename) {
+	int fd = open(filename, O_RDONLY);
+
+	if (fd == -1)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+/*
+ * --cold: start from an empty page, dentry and inode cache when allowed
+ * to (root only), otherwise evict_file() still drops each file's pages
+ */
+static void drop_caches(void) {
+	FILE *f;
+
+	sync();
+	f = fopen("/proc/sys/vm/drop_caches", "w");
+	if (!f) {
+		fprintf(stderr, "Cannot drop the page cache, evicting files one by one\n");
+		return;
+	}
+	fputs("3\n", f);
+	fclose(f);
+}
+
+/*
+ * Give the track of a file that is gone the new path, keeping its row.
+ * Nothing is parsed: the names are made for the new path from the tags
+ * the track has and the keepers of its new directory, like
+ * --rebuild-names does. Returns false if no such track was found, or if
+ * its tags were never stored and the file still has to be probed.
+ */
+static bool move_known_file(struct scan_thread *st, const char *dir, const char *fullpath,
+    const char *filename, const BITS keepers[], uint64_t fingerprint, int filesize) {
+	struct db_writes *w = st->writes;
+	char display[1024 * 4];
+	char search_text[1024 * 4];
+	struct track_metadata meta;
+	const char *name = NULL;
+	bool moved = false;
+	int tagged;
+	int id;
+
+	/* Under the lock, so two copies of one file cannot both claim it */
+	pthread_mutex_lock(&w->lock);
+	id = db_find_moved_track(fingerprint, filesize);
+	if (id) {
+		track_metadata_init(&meta);
+		tagged = db_get_track_meta(id, &meta);
+		if (tagged >= 0)
+			name = make_names(dir, filename, keepers, tagged ? &meta : NULL, display,
+			    sizeof(display), search_text, sizeof(search_text));
+		begin_pending_writes(w);
+		moved = db_move_track(id, fullpath, name, name ? search_text : NULL, st->scan_id);
+		if (moved) {
+			atomic_fetch_add(&moved_files, 1);
+			library_changed(w, 1);
+		}
+		if (++w->pending_writes >= INDEXER_COMMIT_EVERY)
+			commit_pending_writes(w, st->stats);
+		track_metadata_clear(&meta);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return moved && name;
+}
+
+/*
+ * Scan one directory from a single read of its entries: the file name
+ * analysis, the files and the subdirectories all come from the listing.
+ * Subdirectories append their own entries on top of dl and drop them
+ * again before returning.
+ *
+ * A directory is checkpointed once it and everything below it has been
+ * read, so a resumed scan can skip it as a whole.
+ */
+static void scan_directory(struct scan_thread *st, const char *dir) {
+	struct dirlist *dl = &st->dl;
+	struct stats_root *stats = st->stats;
+	int unreadable = st->unreadable;
+	struct dirlist_mark mark;
 	struct stat ss;
 	char *fullpath;
-	char *dir = argdir;
 	struct tuneinfo ti;
-	int dirlen = 0;
-	BITS keepers[8];
-	// https://patchwork.kernel.org/patch/110690/
+	size_t dirlen;
+	BITS keepers[DB_KEEPERS_WORDS];
+	bool keepers_saved = false;
+	uint64_t t;
+	bool have_list;
+
+	if (st->resuming && db_scan_dir_is_done(st->root, dir))
+		return;
 
-	pdir = opendir(dir);
-	if (!pdir)
-		return NULL;
+	t = stats_now();
+	have_list = dirlist_read(dl, dir, &mark);
+	stats_record(stats, STATS_READDIR, t);
+	if (!have_list) {
+		st->unreadable++;
+		return;
+	}
 
 	memset(keepers, 0, sizeof(keepers));
-	find_redundant_song_names(pdir, keepers);
+	find_redundant_song_names(dl, &mark, keepers);
 
-	rewinddir(pdir);
+	dirlen = strlen(dir);
+	for (size_t n = mark.count; n < dl->count; n++) {
+		/* Recursing grows dl, so look the entry up again every time */
+		const struct dirlist_entry *e = &dl->entries[n];
+		const char *name = dirlist_name(dl, n);
 
-#if defined(__APPLE__)
-	while ((sd = readdir(pdir)) != NULL) {
-#else
-	sdbuf = (struct dirent64 *)malloc(offsetof(struct dirent64, d_name) + NAME_MAX + 1);
-	while (readdir64_r(pdir, sdbuf, &sd) == 0 && sd) {
-#endif
 		/*
 		 * Do not even consider directories or files starting with .
 		 */
-		if ('.' == sd->d_name[0])
+		if ('.' == name[0])
 			continue;
 
-		if (!dirlen)
-			dirlen = strlen(dir);
-		fullpath = malloc(dirlen + 1 + strlen(sd->d_name) + 1);
+		fullpath = malloc(dirlen + 1 + e->name_len + 1);
+		memcpy(fullpath, dir, dirlen);
+		fullpath[dirlen] = '/';
+		memcpy(fullpath + dirlen + 1, name, e->name_len + 1);
 
-		/* TODO: Optimize using running pointers
-		 * 	this is fast maybe?
-		 *	     sprintf(fullpath, "%s/%s", dir, sd->d_name);
-		 *	also optimize the stat() call from
-		 *	the article ....
-		 * http://udrepper.livejournal.com/18555.html
-		 */
-		strncpy(fullpath, dir, dirlen + 1);
-		strcat(fullpath, "/");
-		strcat(fullpath, sd->d_name);
+		if (e->format) {
+			struct filetype *ft = music_handler(e->format);
+
+			throttle_before_file(st->bucket);
+			if (opt_cold)
+				evict_file(fullpath);
 
-		if (music_isit(sd->d_name)) {
 			memset(&ti, 0, sizeof(ti));
-			get_cached_info(fullpath, &ti);
-
-			pthread_mutex_lock(&filemutex);
-			process_one_file(dir, fullpath, sd->d_name, &ti, keepers);
-			pthread_mutex_unlock(&filemutex);
-			//                } else if (DT_DIR == sd->d_type) {
-		} else if (0 == stat(fullpath, &ss) && S_ISDIR(ss.st_mode)) {
-			prim_recurse_disc(fullpath);
+			ti.format = e->format;
+
+			/* The names of the files are made with them, see --rebuild-names */
+			if (!keepers_saved && !opt_dry_run) {
+				pthread_mutex_lock(&st->writes->lock);
+				begin_pending_writes(st->writes);
+				db_set_dir_keepers(dir, keepers, sizeof(keepers));
+				pthread_mutex_unlock(&st->writes->lock);
+				keepers_saved = true;
+			}
+
+			/* A new path may be a known file that moved */
+			uint64_t fingerprint = 0;
+			if (st->find_moves && !opt_dry_run && !db_track_exists(fullpath)) {
+				int filesize = 0;
+				fingerprint = file_fingerprint(fullpath, &filesize);
+				if (fingerprint
+				    && move_known_file(
+					st, dir, fullpath, name, keepers, fingerprint, filesize)
+				    && !opt_force_build) {
+					stats_count_file(stats, (uint64_t)filesize);
+					throttle_after_file(st->bucket, (uint64_t)filesize);
+					free(fullpath);
+					continue;
+				}
+			}
+
+			get_cached_info(stats, ft, fullpath, &ti);
+
+			pthread_mutex_lock(&st->writes->lock);
+			process_one_file(st, ft, dir, fullpath, name, &ti, keepers, fingerprint);
+			pthread_mutex_unlock(&st->writes->lock);
+			throttle_after_file(st->bucket, (uint64_t)ti.filesize);
+		} else {
+			bool is_dir = DIRLIST_DIR == e->kind;
+
+			if (DIRLIST_UNKNOWN == e->kind) {
+				t = stats_now();
+				is_dir = 0 == stat(fullpath, &ss) && S_ISDIR(ss.st_mode);
+				stats_record(stats, STATS_STAT, t);
+			}
+			if (is_dir)
+				scan_directory(st, fullpath);
 		}
 
 		free(fullpath);
 	}
-	closedir(pdir);
-#if !defined(__APPLE__)
-	free(sdbuf);
-#endif
+
+	dirlist_release(dl, &mark);
+
+	/* Not when something below could not be read, a resumed scan retries it */
+	if (st->scan_id && st->unreadable == unreadable) {
+		pthread_mutex_lock(&st->writes->lock);
+		begin_pending_writes(st->writes);
+		db_scan_dir_done(st->root, dir);
+		pthread_mutex_unlock(&st->writes->lock);
+	}
+}
+
+/* Pick up where an interrupted scan of the root stopped */
+static void begin_scan(struct scan_thread *st) {
+	int resumed_dirs;
+
+	pthread_mutex_lock(&st->writes->lock);
+	if (opt_rebuild)
+		db_rebuild_forget_root(st->root);
+	st->scan_id = db_scan_begin(st->root, &resumed_dirs);
+	st->find_moves = db_have_fingerprints();
+	pthread_mutex_unlock(&st->writes->lock);
+	st->resuming = resumed_dirs > 0;
+	if (st->resuming)
+		fprintf(stderr, "Resuming '%s', %d directories were already done\n", st->root,
+		    resumed_dirs);
+}
+
+/*
+ * Thread entry point, one root per thread, and with shards one database
+ * connection per thread. Tracks below the root that
+ * the scan did not see are removed once it is complete, but not if
+ * some directory could not be read: an unmounted share would otherwise
+ * empty the database.
+ */
+void *prim_recurse_disc(void *argthread) {
+	struct scan_thread *st = argthread;
+	int removed;
+
+	/* From here on, the database calls of this thread go to the shard */
+	if (opt_shards) {
+		if (!db_shard_open(st->root, config_get_db_indexer_profile())) {
+			fprintf(stderr, "\nNo shard for '%s', skipping it\n", st->root);
+			stats_root_done(st->stats);
+			pthread_mutex_destroy(&st->shard_writes.lock);
+			free(st);
+			return NULL;
+		}
+		begin_scan(st);
+	}
+
+	st->bucket = throttle_bucket_for(st->root);
+	scan_directory(st, st->root);
+	dirlist_free(&st->dl);
+	throttle_thread_done();
+	stats_root_done(st->stats);
+
+	if (st->scan_id) {
+		pthread_mutex_lock(&st->writes->lock);
+		begin_pending_writes(st->writes);
+		removed = db_scan_finish(st->root, st->scan_id, st->unreadable == 0);
+		if (removed > 0)
+			library_changed(st->writes, removed);
+		pthread_mutex_unlock(&st->writes->lock);
+
+		if (st->unreadable)
+			fprintf(stderr, "\n'%s': %d directories not readable, nothing removed\n",
+			    st->root, st->unreadable);
+		else if (removed > 0)
+			fprintf(stderr, "\n'%s': removed %d tracks that are gone\n", st->root,
+			    removed);
+	}
+
+	if (opt_shards) {
+		commit_pending_writes(st->writes, st->stats);
+		db_count_tags();
+		db_maintain(st->writes->changed_tracks);
+		db_shard_close();
+	}
+
+	pthread_mutex_destroy(&st->shard_writes.lock);
+	free(st);
 	return NULL;
 }
 
@@ -822,14 +846,30 @@ void start_recurse_disc(const char *argdir) {
 	fprintf(stderr, "\nScanning for audio files in '%s'...\n", dir);
 	fflush(stderr);
 
-	/* Spawn scanning thread */
-	pthread_create(&threads[threadcount++], NULL, &prim_recurse_disc, dir);
+	/* The stats root keeps its own copy of dir */
+	struct scan_thread *st = calloc(1, sizeof(*st));
+	if (st)
+		st->stats = stats_add_root(dir);
+	if (!st || !st->stats) {
+		fprintf(stderr, "Too many paths, skipping '%s'\n", dir);
+		free(st);
+		free(dir);
+		return;
+	}
+	st->root = st->stats->path;
+	free(dir);
 
-	/*
-	 * Note: dir is passed to thread and will be freed by the thread function
-	 * or when thread terminates. If this causes issues, we may need to
-	 * implement proper cleanup in prim_recurse_disc.
-	 */
+	pthread_mutex_init(&st->shard_writes.lock, NULL);
+	st->writes = opt_shards ? &st->shard_writes : &shared_writes;
+	/* A shard is only opened by the thread that writes it */
+	if (!opt_dry_run && !opt_shards)
+		begin_scan(st);
+
+	/* Spawn scanning thread */
+	if (pthread_create(&threads[threadcount], NULL, &prim_recurse_disc, st) == 0)
+		threadcount++;
+	else
+		free(st);
 }
 
 /* --------------------------------------------------------------------------- */
@@ -857,6 +897,154 @@ bool can_create_database(const char *dir) {
 
 /* --------------------------------------------------------------------------- */
 
+/* Let glaciera map the library instead of loading it, see snapshot.c */
+static void write_snapshot(void) {
+	const char *path = config_get_snapshot_path();
+	uint64_t generation = db_get_generation();
+	struct db_track **tracks;
+	char **dirs;
+	int count = 0;
+	int dir_count = 0;
+
+	if (!generation || snapshot_generation(path) == generation)
+		return;
+	dirs = db_get_dir_paths(&dir_count);
+	tracks = db_get_all_tracks(&count);
+	if (tracks && snapshot_write(path, generation, dirs, dir_count, tracks, count))
+		fprintf(stderr, "\nWrote library snapshot %s", path);
+	db_free_track_list(tracks, count);
+	db_free_dir_paths(dirs, dir_count);
+}
+
+/* --------------------------------------------------------------------------- */
+
+/* One thread's share of --rebuild-names */
+struct rename_job {
+	struct db_name_source *sources;
+	int count;
+	char **dirs;
+	int dir_count;
+	int renamed;
+	int unknown;
+};
+
+static void *rename_thread(void *arg) {
+	struct rename_job *job = arg;
+	char display[1024 * 4];
+	char search_text[1024 * 4];
+
+	for (int i = 0; i < job->count; i++) {
+		struct db_name_source *src = &job->sources[i];
+		const char *dir = "";
+		const char *name = NULL;
+
+		if (src->dir_id > 0)
+			dir = src->dir_id < job->dir_count ? job->dirs[src->dir_id] : NULL;
+		if (src->tagged >= 0 && dir && src->filename && src->display_name
+		    && src->search_text) {
+			const BITS *keepers = src->have_keepers ? src->keepers : NULL;
+			const struct track_metadata *meta = src->tagged ? &src->meta : NULL;
+
+			name = make_names(dir, src->filename, keepers, meta, display,
+			    sizeof(display), search_text, sizeof(search_text));
+		}
+		if (!name) {
+			job->unknown++;
+			continue;
+		}
+		if (strcmp(name, src->display_name) == 0
+		    && strcmp(search_text, src->search_text) == 0)
+			continue;
+		free(src->display_name);
+		free(src->search_text);
+		src->display_name = strdup(name);
+		src->search_text = strdup(search_text);
+		src->renamed = src->display_name && src->search_text;
+		if (src->renamed)
+			job->renamed++;
+	}
+	return NULL;
+}
+
+/*
+ * Make every display name and search text again from the tags and keepers
+ * the database has, after the rippers or the naming rules changed. The
+ * names are made in parallel and written in large transactions.
+ */
+static bool rebuild_names(const db_profile_t *profile) {
+	struct rename_job jobs[RENAME_THREADS_MAX];
+	pthread_t workers[RENAME_THREADS_MAX];
+	bool started[RENAME_THREADS_MAX];
+	struct db_name_source *sources;
+	char **dirs;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads = cpus < 1 ? 1 : cpus > RENAME_THREADS_MAX ? RENAME_THREADS_MAX : (int)cpus;
+	int count = 0;
+	int dir_count = 0;
+	int renamed = 0;
+	int unknown = 0;
+	int written;
+
+	fprintf(stderr, "Making names from the database...");
+	if (!db_init(config_get_db_path(), profile)) {
+		fprintf(stderr, "Failed to initialize database\n");
+		return false;
+	}
+	rippers = rippers_load(config_get_rippers_path());
+	sources = db_get_name_sources(&count);
+	dirs = db_get_dir_paths(&dir_count);
+	if (!sources || !dirs) {
+		fprintf(stderr, "Cannot read the library\n");
+		db_free_name_sources(sources, count);
+		db_free_dir_paths(dirs, dir_count);
+		db_close();
+		return false;
+	}
+
+	for (int t = 0; t < nthreads; t++) {
+		int from = (int)((int64_t)count * t / nthreads);
+		int to = (int)((int64_t)count * (t + 1) / nthreads);
+
+		jobs[t] = (struct rename_job) {
+			.sources = sources + from,
+			.count = to - from,
+			.dirs = dirs,
+			.dir_count = dir_count,
+		};
+		started[t] = pthread_create(&workers[t], NULL, rename_thread, &jobs[t]) == 0;
+		if (!started[t])
+			rename_thread(&jobs[t]);
+	}
+	for (int t = 0; t < nthreads; t++) {
+		if (started[t])
+			pthread_join(workers[t], NULL);
+		renamed += jobs[t].renamed;
+		unknown += jobs[t].unknown;
+	}
+
+	/* Before the names change, glaciera stops trusting the snapshot */
+	written = renamed ? -1 : 0;
+	if (!renamed || db_bump_generation())
+		written = db_store_names(sources, count, RENAME_COMMIT_EVERY);
+	db_free_name_sources(sources, count);
+	db_free_dir_paths(dirs, dir_count);
+
+	if (written > 0) {
+		db_maintain(written);
+		write_snapshot();
+	}
+	fprintf(stderr, "\nRenamed %d of %d tracks\n", written > 0 ? written : 0, count);
+	if (unknown)
+		fprintf(stderr,
+		    "%d tracks were indexed before their tags were kept, the next scan keeps "
+		    "them\n",
+		    unknown);
+	db_close();
+	return written >= 0;
+}
+
+/* --------------------------------------------------------------------------- */
+
 void print_version(void) {
 	fprintf(stderr, "Database builder for GLACIERA - %s - %s\n", complete_version(),
 	    __DATE__ " " __TIME__);
@@ -868,8 +1056,17 @@ void print_version(void) {
 int main(int argc, char *argv[]) {
 	int i;
 	int arg;
+	uint64_t files, new_files, bytes;
+	const db_profile_t *profile;
+
+	static struct option long_options[] = { { "help", no_argument, 0, 'h' },
+		{ "version", no_argument, 0, 'v' }, { "stats-json", required_argument, 0, 'j' },
+		{ "bench", no_argument, 0, 'B' }, { "dry-run", no_argument, 0, 'D' },
+		{ "cold", no_argument, 0, 'C' }, { "rebuild", no_argument, 0, 'R' },
+		{ "db-explain", no_argument, 0, 'E' }, { "rebuild-names", no_argument, 0, 'N' },
+		{ 0, 0, 0, 0 } };
 
-	while ((arg = getopt(argc, argv, "hvwfs")) > -1) {
+	while ((arg = getopt_long(argc, argv, "hvwfs", long_options, NULL)) > -1) {
 		switch (arg) {
 		case 'w':
 			opt_generate_allmp3db = true;
@@ -880,14 +1077,52 @@ int main(int argc, char *argv[]) {
 		case 's':
 			opt_skip_file_info = true;
 			break;
+		case 'j':
+			opt_stats_json = optarg;
+			break;
+		case 'B':
+			opt_bench = true;
+			break;
+		case 'D':
+			opt_dry_run = true;
+			break;
+		case 'C':
+			opt_cold = true;
+			break;
+		case 'R':
+			opt_rebuild = true;
+			break;
+		case 'E':
+			opt_db_explain = true;
+			break;
+		case 'N':
+			opt_rebuild_names = true;
+			break;
 		case 'h':
 		case '?':
 			print_version();
-			printf("usage: glaciera-indexer [-h] [-w] [-f] [-s]\n");
+			printf("usage: glaciera-indexer [-h] [-w] [-f] [-s] [--stats-json FILE]\n"
+			       "                        [--bench | --dry-run | --rebuild]\n"
+			       "                        [--cold] [--db-explain]\n"
+			       "                        [--rebuild-names]\n");
 			printf("options:\n");
 			printf("        -w      Generate allmp3.db for the Windows client\n");
 			printf("        -f      Force parsing (disable TurboScan)\n");
 			printf("        -s      Skip song length calculations\n");
+			printf("        --stats-json FILE\n");
+			printf("                Write throughput and stage latencies to FILE\n");
+			printf("        --bench Scan and parse into an in-memory database\n");
+			printf("        --dry-run\n");
+			printf("                Scan and parse without any database\n");
+			printf("        --cold  Drop cached file data before reading it\n");
+			printf("        --rebuild\n");
+			printf("                Index into a new database, then replace the\n"
+			       "                live one with it in a single transaction\n");
+			printf("        --db-explain\n");
+			printf("                Print the query plans of the hot statements\n");
+			printf("        --rebuild-names\n");
+			printf("                Make the display names again from the tags in\n"
+			       "                the database, without reading any file\n");
 			exit(0);
 			break;
 		case 'v':
@@ -904,36 +1139,90 @@ int main(int argc, char *argv[]) {
 		exit(EXIT_FAILURE);
 	}
 
+	profile = config_get_db_indexer_profile();
+
 	/* Validate that player binaries exist (informational for indexer) */
 	config_validate_players();
 
 	music_register_all_modules();
 	build_fastarrays();
 
-	const char *data_dir = config_get_data_dir();
-	if (!can_create_database(data_dir)) {
-		fprintf(stderr, "Error: The path '%s' must be writeable.\n", data_dir);
-		exit(EXIT_FAILURE);
+	if (opt_db_explain) {
+		if (!db_init(config_get_db_path(), profile)) {
+			fprintf(stderr, "Failed to initialize database\n");
+			exit(EXIT_FAILURE);
+		}
+		db_explain(stdout);
+		db_close();
+		exit(0);
 	}
 
-	fprintf(stderr, "Initializing database...");
-	if (!db_init(config_get_db_path())) {
-		fprintf(stderr, "Failed to initialize database\n");
-		exit(EXIT_FAILURE);
+	if (opt_rebuild_names)
+		exit(rebuild_names(profile) ? 0 : EXIT_FAILURE);
+
+	/*
+	 * --bench and --dry-run never touch the real database, so they
+	 * can be run against a live library as often as needed.
+	 */
+	if (opt_dry_run || opt_bench)
+		opt_rebuild = false;
+	if (opt_dry_run) {
+		fprintf(stderr, "Dry run, nothing is written.\n");
+	} else if (opt_bench) {
+		fprintf(stderr, "Benchmark, writing to an in-memory database...");
+		if (!db_init(DB_IN_MEMORY, profile)) {
+			fprintf(stderr, "Failed to initialize database\n");
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		const char *data_dir = config_get_data_dir();
+		if (!can_create_database(data_dir)) {
+			fprintf(stderr, "Error: The path '%s' must be writeable.\n", data_dir);
+			exit(EXIT_FAILURE);
+		}
+
+		if (opt_rebuild && config_get_db_shards()) {
+			fprintf(stderr, "Error: --rebuild builds one database, not shards.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (opt_rebuild) {
+			fprintf(stderr, "Rebuilding into a new database...");
+			if (!db_rebuild_begin(config_get_db_path(), profile)) {
+				fprintf(stderr, "Failed to create the new database\n");
+				exit(EXIT_FAILURE);
+			}
+		} else {
+			fprintf(stderr, "Initializing database...");
+			if (!db_init(config_get_db_path(), profile)) {
+				fprintf(stderr, "Failed to initialize database\n");
+				exit(EXIT_FAILURE);
+			}
+			/* A library that is in shards stays in them */
+			opt_shards = config_get_db_shards() || db_shard_total() > 0;
+			if (opt_shards)
+				fprintf(stderr, "\nOne database per path, %d shard(s) so far\n",
+				    db_shard_total());
+		}
 	}
 
 	fprintf(stderr, "Loading rippers database...");
-	load_rippers(config_get_rippers_path());
+	rippers = rippers_load(config_get_rippers_path());
 
 	/* Get existing track count for statistics */
-	allcount = db_get_track_count();
-	fprintf(stderr, "\nExisting database has %d tracks.\n", allcount);
+	if (!opt_dry_run) {
+		allcount = db_get_track_count();
+		fprintf(stderr, "\nExisting database has %d tracks.\n", allcount);
+	}
 
-	/*
-	 * Setup a "report progress" alarm
-	 */
-	signal(SIGALRM, &report_scanning_progress);
-	alarm(1);
+	if (opt_cold)
+		drop_caches();
+
+	/* Stay out of the way of playback */
+	throttle_init(config_get_db_path());
+
+	/* Report progress once a second */
+	stats_start_reporter();
 
 	/* Index paths from command line */
 	for (i = optind; i < argc; i++)
@@ -960,13 +1249,36 @@ int main(int argc, char *argv[]) {
 		pthread_join(threads[i], NULL);
 	}
 
-	/*
-	 * No more alarms
-	 */
-	alarm(0);
+	stats_stop_reporter();
+
+	pthread_mutex_lock(&shared_writes.lock);
+	commit_pending_writes(&shared_writes, NULL);
+	pthread_mutex_unlock(&shared_writes.lock);
+
+	/* Shards were counted and maintained by their threads */
+	if (!opt_dry_run && !opt_shards)
+		db_count_tags();
+	if (!opt_dry_run && !opt_rebuild && !opt_shards)
+		db_maintain(shared_writes.changed_tracks);
+	if (!opt_dry_run && !opt_bench)
+		write_snapshot();
+
+	if (opt_rebuild) {
+		fprintf(stderr, "\nReplacing the live database...");
+		if (!db_rebuild_finish(config_get_db_path()))
+			exit(EXIT_FAILURE);
+		fprintf(stderr, " done");
+	}
+
+	stats_totals(&files, &new_files, &bytes);
+	fprintf(stderr, "\nglaciera-indexer: total files: %llu  new files: %llu  moved files: %d\n",
+	    (unsigned long long)files, (unsigned long long)new_files, atomic_load(&moved_files));
 
-	fprintf(
-	    stderr, "\nglaciera-indexer: total files: %d  new files: %d\n", total_files, new_files);
+	if (opt_bench || opt_dry_run)
+		stats_print_report(stderr);
+	if (opt_stats_json)
+		stats_write_json(opt_stats_json);
+	stats_free();
 
 	db_close();
 	exit(0);
@@ -6,6 +6,9 @@
 // Kristian Wiklund, Dept. of Computer Engineering,
 // Chalmers University of Technology, S-412 96 GOTHENBURG, SWEDEN
 
+/* sigset_t and pthread_sigmask() */
+#define _DEFAULT_SOURCE
+
 // System headers
 #include <ctype.h>
 #include <dirent.h>
@@ -42,7 +45,9 @@
 #include "db.h"
 #include "git_version.h"
 #include "music.h"
+#include "snapshot.h"
 #include "theme_preview.h"
+#include "writer.h"
 
 #ifdef USE_GETTEXT
 #define _(String) gettext(String)
@@ -119,6 +124,10 @@ static bool time_add_safe(time_t a, time_t b, time_t *out) {
 struct tune *alltunes = NULL;
 int allcount = 0;
 
+/* Directory paths by database id, NULL where there is none */
+const char **tune_dirs = NULL;
+int tune_dir_count = 0;
+
 struct tune **displaytunes = NULL;
 int displaycount = 0;
 #ifdef USE_FINISH
@@ -178,6 +187,19 @@ int same_key_twice_in_a_row(int *last_key_count) {
 
 /* -------------------------------------------------------------------------- */
 
+/*
+ * The path of a tune's file, put together in buf when the tune is in a
+ * directory. Only needed to open the file or to show the path.
+ */
+static char *tune_path(const struct tune *tune, char *buf, size_t size) {
+	if (tune->dir <= 0 || tune->dir >= tune_dir_count || !tune_dirs[tune->dir])
+		return tune->file;
+	snprintf(buf, size, "%s/%s", tune_dirs[tune->dir], tune->file);
+	return buf;
+}
+
+/* -------------------------------------------------------------------------- */
+
 /*
  * The alltunes array is already sorted (by mp3build) on the "display" field.
  * We can use that fact to do speedy searches/sorts by comparing just
@@ -230,8 +252,8 @@ void clear_displaytunes_prim(bool dosave) {
 	for (i = 0; i < displaycount; i++) {
 		tune = displaytunes[i];
 		if (EMPTY_SEARCH == tune->search) {
-			if (tune->path == tune->display) {
-				free(tune->path);
+			if (tune->file == tune->display) {
+				free(tune->file);
 				free(tune);
 			}
 		}
@@ -331,7 +353,7 @@ static bool addtunetodisplay(struct tune *tune) {
 	return true;
 }
 
-void addtexttodisplay(char *text, int duration, int filesize, time_t filedate) {
+void addtexttodisplay(const char *text, int duration, int filesize, time_t filedate) {
 	struct tune *tune = malloc(sizeof(*tune));
 	if (!tune)
 		return;
@@ -342,7 +364,8 @@ void addtexttodisplay(char *text, int duration, int filesize, time_t filedate) {
 		return;
 	}
 	tune->display = path_copy;
-	tune->path = path_copy;
+	tune->file = path_copy;
+	tune->dir = 0;
 	tune->search = EMPTY_SEARCH;
 	tune->ti = malloc(sizeof(*tune->ti));
 	if (!tune->ti) {
@@ -370,7 +393,7 @@ int tune_in_playlist(struct tune *tune) {
 
 	if (tune) {
 		for (i = 0; i < playlistcount; i++)
-			if (tune->path == playlist[i]->path)
+			if (tune->file == playlist[i]->file)
 				return true;
 	}
 	return false;
@@ -381,7 +404,7 @@ int tune_in_displaylist(struct tune *tune) {
 
 	if (tune) {
 		for (i = 0; i < displaycount; i++)
-			if (tune->path == displaytunes[i]->path)
+			if (tune->file == displaytunes[i]->file)
 				return true;
 	}
 	return false;
@@ -396,7 +419,7 @@ struct tune *find_next_song(struct tune *tune) {
 	 * Is the current playing song in the now loaded playlist?
 	 */
 	for (i = 0; i < playlistcount - 1; i++) {
-		if (tune->path == playlist[i]->path)
+		if (tune->file == playlist[i]->file)
 			for (j = i + 1; j < playlistcount - 1; j++)
 				if (playlist[j]->search)
 					return playlist[j];
@@ -406,7 +429,7 @@ struct tune *find_next_song(struct tune *tune) {
 	 * Is the current playing song on the screen?
 	 */
 	for (i = 0; i < displaycount - 1; i++) {
-		if (tune->path == displaytunes[i]->path)
+		if (tune->file == displaytunes[i]->file)
 			for (j = i + 1; j < displaycount - 1; j++)
 				if (displaytunes[j]->search)
 					return displaytunes[j];
@@ -416,7 +439,7 @@ struct tune *find_next_song(struct tune *tune) {
 	 * Nope, try to find it in the biglist
 	 */
 	for (i = 0; i < allcount - 1; i++) {
-		if (tune->path == alltunes[i].path)
+		if (tune->file == alltunes[i].file)
 			for (j = i + 1; j < allcount - 1; j++)
 				if (alltunes[j].search)
 					return &alltunes[j];
@@ -430,122 +453,88 @@ struct tune *find_next_song(struct tune *tune) {
 
 /* -------------------------------------------------------------------------- */
 
-size_t filesize(const char *filename) {
-	struct stat ss;
-	int error;
-
-	error = stat(filename, &ss);
-	return error ? -1 : ss.st_size;
-}
+/*
+ * With [database] replica set, the player reads a copy of the database
+ * in the cache directory, see db_replica_copy(). It is refreshed by
+ * replica_thread() when the indexer has changed the library.
+ */
+#define REPLICA_STEP_PAGES 256
+#define REPLICA_POLL_SECONDS 30
 
-struct stat st;
+static void replica_progress(int done, int total) {
+	static time_t timeprogress;
+	time_t now = time(NULL);
+	char progress[61];
+	const size_t progress_len = sizeof(progress) - 1;
+	size_t filled = 0;
 
-void make_local_copy_of_database(int showprogress) {
-#define COPY_SIZE 0x4000
-	int i;
-	char srcfilename[255];
-	char dstfilename[255];
-	bool mustcopy = false;
-	int read_fd;
-	int write_fd;
-	char *buf;
-	size_t bytes;
-	double bytes_total = 0.0;
-	double bytes_written = 0.0;
-	time_t timeprogress = 0;
-	time_t now;
-	const char *data_dir = config_get_data_dir();
-
-	if (stat(data_dir, &st) != 0) {
-		printf("Error: Could not read path \"%s\"\n", data_dir);
-		exit(-1);
-	}
-
-	for (i = 0; i < 5; i++) {
-		snprintf(srcfilename, sizeof(srcfilename), "%s%d.db", data_dir, i);
-		snprintf(dstfilename, sizeof(dstfilename), "%s%d.db", playlist_dir, i);
-		bytes = filesize(srcfilename);
-		if (bytes != (size_t)-1)
-			bytes_total += (double)bytes;
-		if (bytes != filesize(dstfilename))
-			mustcopy = true;
-	}
-	if (!mustcopy)
+	if (now <= timeprogress && done < total)
 		return;
+	timeprogress = now;
+	if (total > 0)
+		filled = (size_t)done * progress_len / (size_t)total;
+	if (filled > progress_len)
+		filled = progress_len;
+
+	for (size_t idx = 0; idx < filled; idx++)
+		progress[idx] = '#';
+	for (size_t idx = filled; idx < progress_len; idx++)
+		progress[idx] = ' ';
+	progress[progress_len] = '\0';
+
+	fprintf(stderr, "[%s]\r", progress);
+}
 
-	for (i = 0; i < 5; i++) {
-		snprintf(srcfilename, sizeof(srcfilename), "%s%d.db", data_dir, i);
-		snprintf(dstfilename, sizeof(dstfilename), "%s%d.db.tmp", playlist_dir, i);
+pthread_t replica_thread_id = 0;
 
-		read_fd = open(srcfilename, O_RDONLY);
-		if (read_fd < 0)
-			continue;
+void *replica_thread(void *arg) {
+	const char *source = config_get_db_path();
+	const char *replica = config_get_replica_path();
+	sigset_t set;
 
-		write_fd = open(dstfilename, O_WRONLY | O_CREAT | O_TRUNC, 0664);
-		if (write_fd != -1) {
-			buf = malloc(COPY_SIZE);
-			if (!buf) {
-				close(write_fd);
-				close(read_fd);
-				continue;
-			}
-			ssize_t chunk_read;
-			while ((chunk_read = read(read_fd, buf, COPY_SIZE)) > 0) {
-				ssize_t written_total = 0;
-				while (written_total < chunk_read) {
-					size_t remaining = (size_t)(chunk_read - written_total);
-					ssize_t chunk_written
-					    = write(write_fd, buf + written_total, remaining);
-					if (chunk_written <= 0) {
-						written_total = -1;
-						break;
-					}
-					written_total += chunk_written;
-					bytes_written += (double)chunk_written;
-				}
-				if (written_total < 0)
-					break;
-				if (showprogress) {
-					now = time(NULL);
-					if (now > timeprogress) {
-						char progress[61];
-						size_t filled = 0;
-
-						if (bytes_total > 0.0) {
-							double ratio = bytes_written / bytes_total;
-							if (ratio < 0.0)
-								ratio = 0.0;
-							if (ratio > 1.0)
-								ratio = 1.0;
-							filled = (size_t)(ratio * 60.0);
-						}
-						const size_t progress_len = sizeof(progress) - 1;
-						if (filled > progress_len)
-							filled = progress_len;
-
-						for (size_t idx = 0; idx < filled; idx++)
-							progress[idx] = '#';
-						for (size_t idx = filled; idx < progress_len; idx++)
-							progress[idx] = ' ';
-						progress[progress_len] = '\0';
-
-						fprintf(stderr, "[%s]\r", progress);
-						timeprogress = now;
-					}
-				}
-			}
-			free(buf);
-			close(write_fd);
-		}
+	(void)arg;
+	/* The song progress alarm would cut every sleep short */
+	sigemptyset(&set);
+	sigaddset(&set, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-		close(read_fd);
+	for (;;) {
+		sleep(REPLICA_POLL_SECONDS);
+		/* Only the mtimes until something was written */
+		if (db_file_changed(source)
+		    && db_file_generation(source) != db_file_generation(replica))
+			db_replica_copy(source, replica, REPLICA_STEP_PAGES, NULL);
 	}
+	return NULL;
+}
 
-	for (i = 0; i < 5; i++) {
-		snprintf(srcfilename, sizeof(srcfilename), "%s%d.db.tmp", playlist_dir, i);
-		snprintf(dstfilename, sizeof(dstfilename), "%s%d.db", playlist_dir, i);
-		rename(srcfilename, dstfilename);
+/*
+ * Returns the path of the database the player should open. A copy from
+ * an earlier run is used right away even if it is behind, the thread
+ * catches it up. Without one, it is made now.
+ */
+const char *make_local_copy_of_database(int showprogress) {
+	const char *source = config_get_db_path();
+	const char *replica = config_get_replica_path();
+
+	if (!config_get_db_replica() || access(source, F_OK) != 0)
+		return source;
+
+	/* Bring the schema up to date, plays are also written to the database */
+	if (!db_init(source, config_get_db_player_profile()))
+		return source;
+	db_close();
+
+	if (!db_file_generation(replica)) {
+		printf(_("Copying the database to %s\n"), replica);
+		if (!db_replica_copy(source, replica, REPLICA_STEP_PAGES,
+			showprogress ? replica_progress : NULL))
+			return source;
+		if (showprogress)
+			fprintf(stderr, "\n");
 	}
+	pthread_create(&replica_thread_id, &detachedattr, &replica_thread, NULL);
+	return replica;
 }
 
 /* -------------------------------------------------------------------------- */
@@ -557,9 +546,76 @@ void make_local_copy_of_database(int showprogress) {
  * munmap(memblock, len);
  */
 
+/*
+ * Point alltunes into the snapshot the indexer wrote, if it is for the
+ * library in the database. Nothing is copied, the strings and tuneinfo
+ * stay in the shared read-only mapping. A mapping from an earlier load
+ * is kept, the playlist may still point into it. So are the directories
+ * of an earlier load, directory ids do not change.
+ */
+static bool load_songs_from_snapshot(void) {
+	struct snapshot snap;
+	struct tune *tunes;
+	const char **dirs;
+
+	if (!snapshot_open(config_get_snapshot_path(), db_get_generation(), &snap))
+		return false;
+	tunes = snap.count ? malloc(sizeof(struct tune) * snap.count) : NULL;
+	dirs = malloc(sizeof(*dirs) * snap.dir_count);
+	if (!tunes || !dirs) {
+		free(tunes);
+		free(dirs);
+		snapshot_close(&snap);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < snap.dir_count; i++)
+		dirs[i] = snap.dirs[i] == SNAPSHOT_NO_DIR ? NULL : snap.pool + snap.dirs[i];
+	for (uint32_t i = 0; i < snap.count; i++) {
+		tunes[i].file = (char *)snap.pool + snap.entries[i].file;
+		tunes[i].dir = (int)snap.entries[i].dir;
+		tunes[i].display = (char *)snap.pool + snap.entries[i].display;
+		tunes[i].search = (char *)snap.pool + snap.entries[i].search;
+		tunes[i].ti = (struct tuneinfo *)&snap.info[i];
+	}
+	alltunes = tunes;
+	allcount = snap.count;
+	tune_dirs = dirs;
+	tune_dir_count = snap.dir_count;
+
+	for (int i = 0; i < 256; i++) {
+		qsearch[i].lo = snap.qsearch[i].lo;
+		qsearch[i].hi = snap.qsearch[i].hi;
+	}
+	return true;
+}
+
+/* Directory and file of a track from the database, see tune_path() */
+static void tune_set_file(struct tune *tune, const struct db_track *track) {
+	if (track->dir_id > 0 && track->dir_id < tune_dir_count && tune_dirs[track->dir_id]) {
+		tune->dir = track->dir_id;
+		tune->file = strdup(track->filename);
+	} else {
+		tune->dir = 0;
+		tune->file = strdup(track->filepath);
+	}
+}
+
 void load_all_songs(void) {
 	int count = 0;
-	struct db_track **tracks = db_get_all_tracks(&count);
+	int dir_count = 0;
+	char **dirs;
+	struct db_track **tracks;
+
+	if (load_songs_from_snapshot())
+		return;
+
+	dirs = db_get_dir_paths(&dir_count);
+	if (dirs) {
+		tune_dirs = (const char **)dirs;
+		tune_dir_count = dir_count;
+	}
+	tracks = db_get_all_tracks(&count);
 
 	if (!tracks) {
 		return;
@@ -584,7 +640,7 @@ void load_all_songs(void) {
 	for (int i = 0; i < count; i++) {
 		struct db_track *db_track = tracks[i];
 
-		alltunes[i].path = strdup(db_track->filepath);
+		tune_set_file(&alltunes[i], db_track);
 		alltunes[i].display = strdup(db_track->display_name);
 		alltunes[i].search = strdup(db_track->search_text);
 		alltunes[i].ti = malloc(sizeof(struct tuneinfo));
@@ -612,39 +668,11 @@ void load_all_songs(void) {
 
 /* -------------------------------------------------------------------------- */
 
-char *genre_names[256] = {
-	/*
-	 * NOTE: The spelling of these genre names is identical to those found in
-	 * Winamp and mp3info.
-	 */
-	"Blues", "Classic Rock", "Country", "Dance", "Disco", "Funk", "Grunge", "Hip-Hop", "Jazz",
-	"Metal", "New Age", "Oldies", "Other", "Pop", "R&B", "Rap", "Reggae", "Rock", "Techno",
-	"Industrial", "Alternative", "Ska", "Death Metal", "Pranks", "Soundtrack", "Euro-Techno",
-	"Ambient", "Trip-Hop", "Vocal", "Jazz+Funk", "Fusion", "Trance", "Classical",
-	"Instrumental", "Acid", "House", "Game", "Sound Clip", "Gospel", "Noise", "Alt. Rock",
-	"Bass", "Soul", "Punk", "Space", "Meditative", "Instrumental Pop", "Instrumental Rock",
-	"Ethnic", "Gothic", "Darkwave", "Techno-Industrial", "Electronic", "Pop-Folk", "Eurodance",
-	"Dream", "Southern Rock", "Comedy", "Cult", "Gangsta Rap", "Top 40", "Christian Rap",
-	"Pop/Funk", "Jungle", "Native American", "Cabaret", "New Wave", "Psychedelic", "Rave",
-	"Showtunes", "Trailer", "Lo-Fi", "Tribal", "Acid Punk", "Acid Jazz", "Polka", "Retro",
-	"Musical", "Rock & Roll", "Hard Rock", "Folk", "Folk/Rock", "National Folk", "Swing",
-	"Fast-Fusion", "Bebob", "Latin", "Revival", "Celtic", "Bluegrass", "Avantgarde",
-	"Gothic Rock", "Progressive Rock", "Psychedelic Rock", "Symphonic Rock", "Slow Rock",
-	"Big Band", "Chorus", "Easy Listening", "Acoustic", "Humour", "Speech", "Chanson", "Opera",
-	"Chamber Music", "Sonata", "Symphony", "Booty Bass", "Primus", "Porn Groove", "Satire",
-	"Slow Jam", "Club", "Tango", "Samba", "Folklore", "Ballad", "Power Ballad", "Rhythmic Soul",
-	"Freestyle", "Duet", "Punk Rock", "Drum Solo", "A Cappella", "Euro-House", "Dance Hall",
-	"Goa", "Drum & Bass", "Club-House", "Hardcore", "Terror", "Indie", "BritPop", "Negerpunk",
-	"Polsk Punk", "Beat", "Christian Gangsta Rap", "Heavy Metal", "Black Metal", "Crossover",
-	"Contemporary Christian", "Christian Rock", "Merengue", "Salsa", "Thrash Metal", "Anime",
-	"JPop", "Synthpop"
-};
-
 /*
  * Return the name of the genre. O(1)
  */
-char *genrename(int genre) {
-	char *p = genre_names[genre & 0xff];
+const char *genrename(int genre) {
+	const char *p = id3_genre_name(genre);
 	return p ? p : _("(unknown)");
 }
 
@@ -1061,7 +1089,7 @@ void draw_one_song(int row, int item, int highlight) {
 	int colorpair;
 	int hours;
 	struct tm tm;
-	char *p;
+	const char *p;
 
 	tune = displaytunes[item];
 
@@ -1125,14 +1153,16 @@ void draw_one_song(int row, int item, int highlight) {
 
 	const int step = col_step;
 	if (ARG_PATH == sort_arg) {
-		const size_t path_len = strlen(tune->path);
+		char pathbuf[4096];
+		const char *path = tune_path(tune, pathbuf, sizeof(pathbuf));
+		const size_t path_len = strlen(path);
 		/* Use UTF-8 safe offset for horizontal scrolling */
 		size_t safe_step = (step < 0 || (size_t)step > path_len)
 		    ? 0
-		    : utf8_safe_offset(tune->path, step);
+		    : utf8_safe_offset(path, step);
 		if (safe_step > path_len)
 			safe_step = path_len;
-		p = tune->path + safe_step;
+		p = path + safe_step;
 
 		/* UTF-8 safe copy - copy up to COLS characters, not bytes */
 		size_t copied = 0;
@@ -1179,7 +1209,7 @@ void draw_one_song(int row, int item, int highlight) {
 	/*
 	 * Find the color of the string
 	 */
-	if (tune && now_playing_tune && tune->path == now_playing_tune->path)
+	if (tune && now_playing_tune && tune->file == now_playing_tune->file)
 		colorpair = highlight ? COLOR_PAIR(4) : COLOR_PAIR(3);
 	else if (tune_in_playlist(tune))
 		colorpair = highlight ? COLOR_PAIR(7) : COLOR_PAIR(6);
@@ -1423,28 +1453,36 @@ void append_tune_to_history(struct tune *tune, time_t timestarted) {
 	time_t t;
 	struct tm tm;
 	char historyfilename[512];
-	FILE *f;
+	char line[1024];
+	struct db_play play;
 
 	t = time(NULL);
 	if (!timestarted)
 		timestarted = t;
+
+	/* The toplist counts these, the dated playlists are kept for loading */
+	play = (struct db_play) {
+		.dir_id = tune->dir,
+		.filename = tune->file,
+		.started_at = timestarted,
+		.seconds_played = (int)(t - timestarted),
+	};
+	writer_play(&play);
+
 	localtime_r(&t, &tm);
 	snprintf(historyfilename, sizeof(historyfilename), "%s%4d_%02d_%02d.list", playlist_dir,
 	    1900 + tm.tm_year, 1 + tm.tm_mon, tm.tm_mday);
-	f = fopen(historyfilename, "a");
-	if (f) {
-		fprintf(f, "%s\n", tune->display);
-		fprintf(f, "%d\n", (int)timestarted);
-		fclose(f);
-	}
+	snprintf(line, sizeof(line), "%s\n%d\n", tune->display, (int)timestarted);
+	writer_append(historyfilename, line);
 }
 
 /* -------------------------------------------------------------------------- */
 
 void save_playlist(const char *playlistname) {
-	FILE *f;
 	int i;
 	char filename[512];
+	char *text;
+	size_t len = 0;
 
 	safe_strcpy(latest_playlist_name, playlistname, sizeof(latest_playlist_name));
 
@@ -1454,12 +1492,21 @@ void save_playlist(const char *playlistname) {
 	}
 	if (!strstr(filename, ".list"))
 		safe_strcat(filename, ".list", sizeof(filename));
-	f = fopen(filename, "w");
-	if (f) {
-		for (i = 0; i < playlistcount; i++)
-			fprintf(f, "%s\n", playlist[i]->display);
-		fclose(f);
+
+	for (i = 0; i < playlistcount; i++)
+		len += strlen(playlist[i]->display) + 1;
+	text = malloc(len + 1);
+	if (!text)
+		return;
+	len = 0;
+	for (i = 0; i < playlistcount; i++) {
+		strcpy(text + len, playlist[i]->display);
+		len += strlen(playlist[i]->display);
+		text[len++] = '\n';
 	}
+	text[len] = '\0';
+	writer_replace(filename, text);
+	free(text);
 }
 
 /* -------------------------------------------------------------------------- */
@@ -1470,16 +1517,12 @@ int alltunes_sort(const void *a, const void *b) {
 
 void store_to_cache(const char *badname, const char *goodname) {
 	char cachefilename[512];
-	FILE *f;
+	char lines[2048];
 
 	snprintf(
 	    cachefilename, sizeof(cachefilename), "%sbad-name-to-good-name.cache", playlist_dir);
-	f = fopen(cachefilename, "a");
-	if (f) {
-		fprintf(f, "%s\n", badname);
-		fprintf(f, "%s\n", goodname);
-		fclose(f);
-	}
+	snprintf(lines, sizeof(lines), "%s\n%s\n", badname, goodname);
+	writer_append(cachefilename, lines);
 }
 
 struct tune *get_from_cache(const char *badname) {
@@ -1629,7 +1672,8 @@ void do_load_playlist(const char *playlistname) {
 			safe_strcat(buf2, buf, sizeof(buf2));
 
 			tune = malloc(sizeof(struct tune));
-			tune->path = strdup(buf2);
+			tune->file = strdup(buf2);
+			tune->dir = 0;
 			tune->display = strdup(buf2);
 			tune->search = EMPTY_SEARCH;
 			tune->ti = malloc(sizeof(struct tuneinfo));
@@ -1660,7 +1704,7 @@ void precache_a_song(struct tune *tune) {
 	 * Read the first two 4K pages of the file.
 	 * This helps avoid disk I/O latency during playback transitions.
 	 */
-	fd = open(tune->path, O_RDONLY);
+	fd = open(tune_path(tune, buf, sizeof(buf)), O_RDONLY);
 	if (-1 != fd) {
 		for (i = 0; i < 2; i++) {
 			if (read(fd, buf, sizeof(buf)) < 0)
@@ -1677,14 +1721,6 @@ void *cache_next_song_in_advance_thread(void *arg) {
 	return NULL;
 }
 
-pthread_t append_tune_to_history_thread_id = 0;
-void *append_tune_to_history_thread(void *arg) {
-	append_tune_to_history(arg, started_playing_time);
-	tune_to_save_to_history = NULL;
-	append_tune_to_history_thread_id = 0;
-	return NULL;
-}
-
 pthread_t readahead_thread_id = 0;
 int g_percentplayed = 0;
 void *readahead_thread(void *arg) {
@@ -1696,7 +1732,7 @@ void *readahead_thread(void *arg) {
 	int i;
 
 	if (percentplayed < 100 && tune && tune->ti && tune->ti->filesize) {
-		fd = open(tune->path, O_RDONLY);
+		fd = open(tune_path(tune, buf, sizeof(buf)), O_RDONLY);
 		if (fd != -1) {
 			off_t chunk = (off_t)(tune->ti->filesize / 100L);
 			if (chunk < 0)
@@ -1848,9 +1884,9 @@ void update_song_progress_handler(int sig) {
 	 * or for at least 240 seconds (4minutes)
 	 */
 	if (percentplayed >= 50 || secondsplayed >= 240) {
-		if (tune_to_save_to_history && !append_tune_to_history_thread_id) {
-			pthread_create(&append_tune_to_history_thread_id, &detachedattr,
-			    &append_tune_to_history_thread, tune_to_save_to_history);
+		if (tune_to_save_to_history) {
+			append_tune_to_history(tune_to_save_to_history, started_playing_time);
+			tune_to_save_to_history = NULL;
 		}
 	}
 
@@ -1885,10 +1921,30 @@ void stop_playing(pid_t pid) {
 }
 
 void start_play(int userpressed_enter, struct tune *tune) {
+	char pathbuf[4096];
+	char *path;
+
 	/* TODO: display only the n last characters if the string is long */
 	if (userpressed_enter)
 		show_info(_("Loading '%s'..."), tune->display);
 
+	/*
+	 * The current song stops before it was saved to the history,
+	 * it was skipped.
+	 */
+	if (tune_to_save_to_history) {
+		struct db_play play = {
+			.dir_id = tune_to_save_to_history->dir,
+			.filename = tune_to_save_to_history->file,
+			.started_at = started_playing_time,
+			.seconds_played = (int)(time(NULL) - started_playing_time),
+			.skipped = true,
+		};
+
+		writer_play(&play);
+		tune_to_save_to_history = NULL;
+	}
+
 	/*
 	 * Cache (preload) the intro of the new song before we stop the
 	 * current one to avoid embarrassing silences in the music flow.
@@ -1906,7 +1962,8 @@ void start_play(int userpressed_enter, struct tune *tune) {
 	now_playing_tune = find_in_alltunes_by_display_pointer(tune->display);
 
 	/* Use the path directly - UTF-8 is now handled properly throughout */
-	if (!can_open(now_playing_tune->path)) {
+	path = tune_path(now_playing_tune, pathbuf, sizeof(pathbuf));
+	if (!can_open(path)) {
 		/*
 		 * Yes, finally got rid of the ugly "execl-$JUST$PLAY$NEXT$SONG" hack.
 		 */
@@ -1946,7 +2003,11 @@ void start_play(int userpressed_enter, struct tune *tune) {
 			}
 			close(err_fd);
 
-			music_play(now_playing_tune->path);
+			/* Rows indexed before the format id was stored have format 0 */
+			int format = now_playing_tune->ti->format;
+			if (!format)
+				format = music_format(path);
+			music_play(music_handler(format), path);
 
 			/*
 			 * Only reached if, for some reason, the call to execl() fails
@@ -2020,7 +2081,11 @@ int sort_ARG_RATING(struct tune *a, struct tune *b) {
 	return a->ti->rating - b->ti->rating;
 }
 int sort_ARG_PATH(struct tune *a, struct tune *b) {
-	return strcmp(a->path, b->path);
+	char abuf[4096], bbuf[4096];
+
+	if (a->dir && a->dir == b->dir)
+		return strcmp(a->file, b->file);
+	return strcmp(tune_path(a, abuf, sizeof(abuf)), tune_path(b, bbuf, sizeof(bbuf)));
 }
 int sort_ARG_FINISH(struct tune *a, struct tune *b) {
 	return sort_ARG_NORMAL(a, b);
@@ -2156,11 +2221,57 @@ void do_show_available_playlists(int all) {
 
 /* -------------------------------------------------------------------------- */
 
+/*
+ * The tune of a track from the database. alltunes is in the display
+ * name order of the database, so the tune is looked up by its name,
+ * then by its file among the tunes of the same name.
+ */
+static struct tune *find_tune_of_track(const struct db_track *track) {
+	int lo = 0;
+	int hi = allcount;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (strcmp(alltunes[mid].display, track->display_name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < allcount && 0 == strcmp(alltunes[lo].display, track->display_name); lo++) {
+		if (alltunes[lo].dir == track->dir_id
+		    && 0 == strcmp(alltunes[lo].file, alltunes[lo].dir ? track->filename
+								   : track->filepath))
+			return &alltunes[lo];
+	}
+	return NULL;
+}
+
+/* The tunes of an artist or genre, as the indexer found them in the tags */
+static void show_tag_tunes(enum db_tag_table table, const char *name) {
+	struct db_track **tracks;
+	struct tune *tune;
+	int count = 0;
+	int i;
+
+	tracks = db_get_tag_tracks(table, name, &count);
+	clear_displaytunes();
+	for (i = 0; i < count; i++) {
+		tune = find_tune_of_track(tracks[i]);
+		if (tune)
+			addtunetodisplay(tune);
+	}
+	db_free_track_list(tracks, count);
+	refresh_screen();
+}
+
 void do_view_artists(void) {
 	char buf[1024];
 	int i;
 	char *s, *p;
 	struct hashnode *wp;
+	struct db_tag_value *artists;
+	int count;
 	int cmd;
 	int ch;
 	int lo_ch;
@@ -2173,6 +2284,22 @@ void do_view_artists(void) {
 		return;
 	}
 
+	/* The artists of the tags, counted by the indexer */
+	if (db_have_tags(DB_ARTISTS)) {
+		buf[0] = (char)cmd;
+		buf[1] = '\0';
+		artists = db_get_tag_values(DB_ARTISTS, ' ' == cmd ? NULL : buf, 1, &count);
+		clear_displaytunes();
+		for (i = 0; i < count; i++)
+			addtexttodisplay(artists[i].name, artists[i].duration,
+			    artists[i].track_count, 0);
+		db_free_tag_values(artists, count);
+		do_sort_work(ARG_NORMAL, 1);
+		refresh_screen();
+		return;
+	}
+
+	/* A library not indexed since, the artist is what the display names start with */
 	if (' ' == cmd) {
 		lo_ch = '0';
 		hi_ch = 'Z';
@@ -2219,98 +2346,160 @@ void do_view_artists(void) {
 /* -------------------------------------------------------------------------- */
 
 /*
- * Scan all .list-files, count the number of times a song has been played,
- * display
+ * The most played songs, from the play counts in the database. The
+ * count is shown in the size column.
  */
+#define TOPLIST_MIN_PLAYS 10
+#define TOPLIST_MAX_TUNES 1000
 
 void do_view_toplist(void) {
+	struct db_track **tracks;
+	struct tune *tune;
+	int count = 0;
+	int i;
+
+	show_info(_("Generating list..."));
+
+	tracks = db_get_top_tracks(TOPLIST_MIN_PLAYS, TOPLIST_MAX_TUNES, &count);
+	clear_displaytunes();
+	for (i = 0; i < count; i++) {
+		struct db_track *db_track = tracks[i];
+
+		tune = malloc(sizeof(struct tune));
+		if (!tune) {
+			db_free_track(db_track);
+			continue;
+		}
+
+		tune_set_file(tune, db_track);
+		tune->display = strdup(db_track->display_name);
+		tune->search = strdup(db_track->search_text);
+		tune->ti = malloc(sizeof(struct tuneinfo));
+		memcpy(tune->ti, &db_track->ti, sizeof(struct tuneinfo));
+		tune->ti->filesize = db_track->play_count;
+		addtunetodisplay(tune); /* TODO malloc/free */
+		db_free_track(db_track);
+	}
+	free(tracks);
+
+	/*
+	 * Sort the names of the bands in reverse playcount-alpha-order.
+	 */
+	do_sort_work(ARG_SIZE, -1);
+	refresh_screen();
+}
+
+/*
+ * Plays from before the database kept them, read once from the dated
+ * playlists that append_tune_to_history() writes. A play there is a
+ * display name followed by the time it started.
+ */
+static void import_history(void) {
 	DIR *pdir;
 	struct dirent *pde;
 	char fullname[1024];
-	int i;
-	struct tune *findtune;
-	struct tune *tune;
-	struct hashnode *wp;
-	FILE *f;
 	char buf[1024];
+	struct db_play *plays = NULL;
+	int count = 0;
+	int allocated = 0;
 
+	if (db_history_imported())
+		return;
 	pdir = opendir(playlist_dir);
-	if (!pdir) {
-		show_info(_("Can't open playlist directory!"));
+	if (!pdir)
 		return;
-	}
 
-	show_info(_("Generating list, step 1..."));
-
-	hash_init();
 	while (NULL != (pde = readdir(pdir))) {
-		if (!isdigit(pde->d_name[0]) || !strstr(pde->d_name, ".list"))
+		struct tm tm = { 0 };
+		struct tune *tune;
+		int last = -1;
+		FILE *f;
+
+		/* Only the autogenerated .list's (2003_12_14) */
+		if (strlen(pde->d_name) != 4 + 1 + 2 + 1 + 2 + 5
+		    || sscanf(pde->d_name, "%4d_%2d_%2d.list", &tm.tm_year, &tm.tm_mon,
+			   &tm.tm_mday)
+			!= 3)
 			continue;
-
 		if (!safe_path_join(fullname, sizeof(fullname), playlist_dir, pde->d_name))
 			continue;
-
 		f = fopen(fullname, "r");
 		if (!f)
 			continue;
 
-		while (fgets(buf, sizeof(buf), f)) {
-			/*
-			 * Ignore the "this-song-was-played-on-this-date" line
-			 */
-			if (is_all_digits(buf))
-				continue;
+		/* Noon of the day, for plays without a time */
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		tm.tm_hour = 12;
+		tm.tm_isdst = -1;
 
+		while (fgets(buf, sizeof(buf), f)) {
 			chop(buf);
-			hash_incword(buf, 0);
-		}
-		fclose(f);
-	}
-	closedir(pdir);
-
-	show_info(_("Generating list, step 2..."));
+			if (is_all_digits(buf)) {
+				if (last >= 0)
+					plays[last].started_at = (time_t)atoll(buf);
+				last = -1;
+				continue;
+			}
 
-	clear_displaytunes();
-	for (i = 0; i < NHASH; i++) {
-		for (wp = hashnodebin[i]; wp; wp = wp->next) {
-			if (wp->count < 10)
+			last = -1;
+			tune = find_tune_by_displayname(buf, 0);
+			if (!tune)
 				continue;
+			if (count >= allocated) {
+				struct db_play *p;
 
-			findtune = find_tune_by_displayname(wp->word, 0);
-			if (findtune && !tune_in_displaylist(findtune)) {
-				tune = malloc(sizeof(struct tune));
-				tune->display = findtune->display;
-				tune->path = findtune->path;
-				tune->search = findtune->search;
-				tune->ti = malloc(sizeof(struct tuneinfo));
-				tune->ti->filesize = wp->count;
-				tune->ti->filedate = findtune->ti->filedate;
-				tune->ti->duration = findtune->ti->duration;
-				tune->ti->bitrate = findtune->ti->bitrate;
-				tune->ti->genre = findtune->ti->genre;
-				tune->ti->rating = findtune->ti->rating;
-				addtunetodisplay(tune); /* TODO malloc/free */
+				allocated = allocated ? allocated * 2 : 256;
+				p = realloc(plays, allocated * sizeof(*plays));
+				if (!p)
+					break;
+				plays = p;
 			}
+			plays[count] = (struct db_play) {
+				.dir_id = tune->dir,
+				.filename = tune->file,
+				.started_at = mktime(&tm),
+				.seconds_played = tune->ti->duration,
+			};
+			last = count++;
 		}
+		fclose(f);
 	}
-	hash_done();
-
-	show_info(_("Generating list 3..."));
+	closedir(pdir);
 
-	/*
-	 * Sort the names of the bands in reverse playcount-alpha-order.
-	 */
-	do_sort_work(ARG_SIZE, -1);
-	refresh_screen();
+	db_import_history(plays, count);
+	free(plays);
 }
 
 /* -------------------------------------------------------------------------- */
 
+/*
+ * A genre in the list has a negative date: -1 - its ID3v1 number, or
+ * GENRE_BY_NAME for one from the tags, which is looked up by its name.
+ */
+#define GENRE_BY_NAME (-257)
+#define GENRE_MIN_TUNES 11
+
 void do_view_available_genres(void) {
 	int genre_count[256];
 	int genre_duration[256];
+	struct db_tag_value *genres;
+	int count;
 	int i;
 
+	if (db_have_tags(DB_GENRES)) {
+		genres = db_get_tag_values(DB_GENRES, NULL, GENRE_MIN_TUNES, &count);
+		clear_displaytunes();
+		for (i = 0; i < count; i++)
+			addtexttodisplay(genres[i].name, genres[i].duration, genres[i].track_count,
+			    GENRE_BY_NAME);
+		db_free_tag_values(genres, count);
+		do_sort_work(ARG_SIZE, -1);
+		refresh_screen();
+		show_info(_("Available genres."));
+		return;
+	}
+
 	memset(genre_count, 0, sizeof(genre_count));
 	memset(genre_duration, 0, sizeof(genre_duration));
 	for (i = 0; i < allcount; i++) {
@@ -2320,7 +2509,7 @@ void do_view_available_genres(void) {
 
 	clear_displaytunes();
 	for (i = 0; i < 256; i++) {
-		if (genre_count[i] > 10) {
+		if (genre_count[i] >= GENRE_MIN_TUNES) {
 			addtexttodisplay(
 			    genrename(i), genre_duration[i], genre_count[i], (i + 1) * -1);
 		}
@@ -2334,10 +2523,16 @@ void do_view_available_genres(void) {
 	show_info(_("Available genres."));
 }
 
-void do_show_one_genre(int genre) {
+void do_show_one_genre(const struct tune *entry) {
+	int genre;
 	int i;
 
-	genre = abs(genre) - 1;
+	if (GENRE_BY_NAME == entry->ti->filedate) {
+		show_tag_tunes(DB_GENRES, entry->display);
+		return;
+	}
+
+	genre = (int)-entry->ti->filedate - 1;
 
 	clear_displaytunes();
 	for (i = 0; i < allcount; i++) {
@@ -2575,6 +2770,7 @@ void do_show_infofiles(void) {
 	struct dirent *pde;
 	char fullname[1024];
 	char workdir[1024];
+	char pathbuf[4096];
 	char text[255];
 	char *p;
 	bool hasinfo = false;
@@ -2590,7 +2786,8 @@ void do_show_infofiles(void) {
 	 * Find the path to the song we're playing now.
 	 * Construct "/mp3/thepath/" from "/mp3/thepath/thesong.mp3"
 	 */
-	safe_strcpy(workdir, now_playing_tune->path, sizeof(workdir));
+	safe_strcpy(
+	    workdir, tune_path(now_playing_tune, pathbuf, sizeof(pathbuf)), sizeof(workdir));
 	p = strrchr(workdir, '/');
 	if (p)
 		*++p = 0;
@@ -2667,6 +2864,7 @@ void do_context(void) {
 	int cmd;
 	char buf[1024];
 	char *s;
+	char *tag;
 	time_t lolimit;
 	time_t hilimit;
 	struct tm lotm;
@@ -2723,6 +2921,14 @@ void do_context(void) {
 
 	case 'G':
 	case 'g':
+		tag = db_get_track_tag(DB_GENRES, now_playing_tune->dir, now_playing_tune->file);
+		if (tag) {
+			show_tag_tunes(DB_GENRES, tag);
+			show_info(_("Showing genre context (%s)."), tag);
+			free(tag);
+			break;
+		}
+
 		clear_displaytunes();
 		for (i = 0; i < allcount; i++) {
 			if (now_playing_tune->ti->genre == alltunes[i].ti->genre)
@@ -2735,6 +2941,14 @@ void do_context(void) {
 
 	case 'A':
 	case 'a':
+		tag = db_get_track_tag(DB_ARTISTS, now_playing_tune->dir, now_playing_tune->file);
+		if (tag) {
+			show_tag_tunes(DB_ARTISTS, tag);
+			show_info(_("Showing artist context (%s)."), tag);
+			free(tag);
+			break;
+		}
+
 		clear_displaytunes();
 
 		safe_strcpy(buf, now_playing_tune->display, sizeof(buf));
@@ -2809,6 +3023,8 @@ void do_context(void) {
 void do_burn_playlist(void) {
 	int i;
 	char symname[1024];
+	char pathbuf[4096];
+	const char *path;
 	int burned = 0;
 	int error;
 	char *p;
@@ -2833,8 +3049,9 @@ void do_burn_playlist(void) {
 				*p = '-';
 		}
 
-		if (can_open(playlist[i]->path)) {
-			error = symlink(playlist[i]->path, symname);
+		path = tune_path(playlist[i], pathbuf, sizeof(pathbuf));
+		if (can_open(path)) {
+			error = symlink(path, symname);
 			if (!error)
 				burned++;
 		}
@@ -2969,6 +3186,10 @@ void do_show_playlist(void) {
 
 /* -------------------------------------------------------------------------- */
 
+/* A "%" search shows the best tracks scoring at least what a playlist lookup needs */
+#define FUZZY_MIN_SCORE 50
+#define FUZZY_MAX_RESULTS 500
+
 void do_search(void) {
 	int matchfirstchar;
 	int matchdirectory;
@@ -3057,13 +3278,13 @@ void do_search(void) {
 	clear_displaytunes();
 
 	if (fuzzysearch) {
-		/* Fuzzy search - for now, just do a simple search */
-		safe_strcpy(lookfor, search_string, sizeof(lookfor));
-		only_searchables(lookfor);
-
-		/* Use SQLite search */
+		/*
+		 * Scored and ranked by SQLite, best match first. Only the
+		 * tracks that are shown are copied out of the database.
+		 */
 		int count = 0;
-		struct db_track **tracks = db_search_tracks(lookfor, &count);
+		struct db_track **tracks = db_fuzzy_search_tracks(
+		    search_string + 1, FUZZY_MIN_SCORE, FUZZY_MAX_RESULTS, &count);
 
 		for (i = 0; i < count; i++) {
 			struct db_track *db_track = tracks[i];
@@ -3075,7 +3296,7 @@ void do_search(void) {
 				continue;
 			}
 
-			tune->path = strdup(db_track->filepath);
+			tune_set_file(tune, db_track);
 			tune->display = strdup(db_track->display_name);
 			tune->search = strdup(db_track->search_text);
 			tune->ti = malloc(sizeof(struct tuneinfo));
@@ -3173,7 +3394,7 @@ void do_search(void) {
 					continue;
 				}
 
-				tune->path = strdup(db_track->filepath);
+				tune_set_file(tune, db_track);
 				tune->display = strdup(db_track->display_name);
 				tune->search = strdup(db_track->search_text);
 				tune->ti = malloc(sizeof(struct tuneinfo));
@@ -3211,7 +3432,7 @@ void do_enter(void) {
 			start_play(true, displaytunes[tunenr]);
 		} else if (displaytunes[tunenr]->ti->filedate < 0) {
 			/* Show genre listing */
-			do_show_one_genre(displaytunes[tunenr]->ti->filedate);
+			do_show_one_genre(displaytunes[tunenr]);
 		} else if (strstr(displaytunes[tunenr]->display, ".list")) {
 			/* Load and show playlist */
 			do_load_playlist(displaytunes[tunenr]->display);
@@ -3263,6 +3484,7 @@ void do_query_info(void) {
 	static bool show_path = false;
 	struct tune *tune;
 	struct tm tm;
+	char pathbuf[4096];
 
 	if (same_key_twice_in_a_row(&last_key_count))
 		show_path = !show_path;
@@ -3273,7 +3495,7 @@ void do_query_info(void) {
 
 	if (tune && tune->ti) {
 		if (show_path) {
-			show_info(tune->path);
+			show_info("%s", tune_path(tune, pathbuf, sizeof(pathbuf)));
 		} else {
 			localtime_r(&tune->ti->filedate, &tm);
 			show_info(_("%4d-%02d-%02d %9d bytes, %02d:%02d minutes, %d kbps, '%s'"),
@@ -3291,6 +3513,7 @@ void do_query_info(void) {
  */
 
 void do_info(void) {
+	char pathbuf[4096];
 	int cmd;
 
 	show_info(
@@ -3345,7 +3568,7 @@ void do_info(void) {
 		return;
 	}
 
-	show_info(displaytunes[tunenr]->path);
+	show_info("%s", tune_path(displaytunes[tunenr], pathbuf, sizeof(pathbuf)));
 	refresh_screen();
 }
 
@@ -3986,6 +4209,7 @@ void print_version(void) {
 
 int main(int argc, char **argv) {
 	int arg;
+	const char *db_path;
 
 	/*
 	 * CRITICAL: Set locale before any curses initialization
@@ -4080,12 +4304,19 @@ int main(int argc, char **argv) {
 	mkdir(playlist_dir, 0700);
 
 	/*
-	 * Initialize SQLite database (using XDG_DATA_HOME)
+	 * Initialize SQLite database (using XDG_DATA_HOME, or its copy in
+	 * XDG_CACHE_HOME)
 	 */
-	if (!db_init(config_get_db_path())) {
+	db_path = make_local_copy_of_database(true);
+	if (!db_init(db_path, config_get_db_player_profile())) {
 		printf(_("Failed to initialize database!\n"));
 		exit(0);
 	}
+	/* Plays have to outlast the next refresh of a replica */
+	if (strcmp(db_path, config_get_db_path()) != 0)
+		db_set_primary(config_get_db_path());
+	/* Lets glaciera-indexer know it should keep its I/O down */
+	db_hold_player_lock(config_get_db_path());
 
 	build_fastarrays();
 	load_all_songs();
@@ -4093,6 +4324,8 @@ int main(int argc, char **argv) {
 		printf(_("No songs in song database!\n"));
 		exit(0);
 	}
+	import_history();
+	writer_start();
 
 	/*
 	 * make random() generate random numbers...
@@ -4124,6 +4357,8 @@ int main(int argc, char **argv) {
 	if (player_pid)
 		stop_playing(player_pid);
 
+	/* Playlists, plays and history lines that are still queued */
+	writer_stop();
 	endwin();
 	exit(0);
 }
@@ -52,7 +52,8 @@ bool flac_info(char *filename, struct tuneinfo *ti) {
 		ti->bitrate = 0;
 	}
 
-	// Read genre from VORBIS comments
+	// Read genre from VORBIS comments, names and numbers alike
+	ti->genre = 0xff;
 	FLAC__StreamMetadata *tags = NULL;
 	if (FLAC__metadata_get_tags(filename, &tags) && tags
 	    && tags->type == FLAC__METADATA_TYPE_VORBIS_COMMENT) {
@@ -72,15 +73,13 @@ bool flac_info(char *filename, struct tuneinfo *ti) {
 				size_t key_len = (size_t)(sep - comment);
 				const char *value = sep + 1;
 				if (key_len == 5 && strncasecmp(comment, "GENRE", 5) == 0) {
-					ti->genre = (unsigned char)atoi(
-					    value); // Assuming genre is numeric
+					ti->genre = (unsigned char)id3_genre_number(value);
+					free(comment);
 					break;
 				}
 			}
 			free(comment);
 		}
-	} else {
-		ti->genre = 0xff; // Default if not found
 	}
 
 	if (tags)
@@ -158,6 +157,9 @@ bool flac_metadata(char *filename, struct track_metadata *meta) {
 						flac_metadata_try_set_track(meta, value);
 						if (meta->track || meta->track_number >= 0)
 							found = true;
+					} else if (key_len == 5 && !meta->genre
+					    && strncasecmp(comment, "GENRE", 5) == 0) {
+						meta->genre = genre_from_tag(value, strlen(value));
 					}
 				}
 			}
@@ -172,14 +174,6 @@ bool flac_metadata(char *filename, struct track_metadata *meta) {
 
 /* -------------------------------------------------------------------------- */
 
-bool flac_isit(char *s, int len) {
-	if (len < 6)
-		return false;
-
-	const char *ext = s + len - 5;
-	return (strcasecmp(ext, ".flac") == 0);
-}
-
 void flac_play(char *filename) {
 	/*
 	 * Uhm... discovered that ogg123 DOES infact play .flac-files,
@@ -0,0 +1,446 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * mod_m4a.c - MP4/M4A (AAC and ALAC) support
+ *
+ * An MP4 file is a sequence of atoms: a 32-bit big endian size, a
+ * four character type and the payload. The audio itself lives in the
+ * top-level 'mdat' atom, everything we want lives in 'moov':
+ *
+ *   moov/mvhd                    movie timescale and duration
+ *   moov/trak/mdia/mdhd          track timescale and duration
+ *   moov/trak/mdia/hdlr          handler type, 'soun' for audio
+ *   moov/udta/meta/ilst/(c)nam   title (also (c)ART, (c)alb, trkn, gnre)
+ *
+ * Only atom headers and the few small atoms above are read, with
+ * pread() at known offsets. 'mdat' is skipped by its size without
+ * touching the data, so it doesn't matter whether the encoder put
+ * 'moov' before or after it, and a scan costs a few KB of I/O
+ * regardless of the size of the file.
+ */
+
+/* pread() */
+#define _POSIX_C_SOURCE 200809L
+
+// System headers
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Local headers
+#include "common.h"
+#include "config.h"
+
+/*
+ * Limits that keep a broken or hostile file from making us read
+ * more than a few KB: atoms visited per container, nesting depth
+ * and bytes kept per tag value.
+ */
+#define M4A_MAX_ATOMS 64
+#define M4A_MAX_DEPTH 6
+#define M4A_MAX_TEXT 512
+
+#define FOURCC(a, b, c, d)                                                                         \
+	(((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+struct m4a_probe {
+	int fd;
+	off_t filesize;
+
+	/* Filled in by the walk */
+	uint32_t movie_timescale;
+	uint64_t movie_duration;
+	uint32_t track_timescale;
+	uint64_t track_duration;
+	uint64_t mdat_size;
+	bool have_moov;
+	int id3_genre; /* 'gnre' is the ID3v1 genre + 1, -1 if missing */
+
+	/* Tags are only collected when meta is set */
+	struct track_metadata *meta;
+	bool found_tags;
+};
+
+struct m4a_atom {
+	uint32_t type;
+	off_t start; /* first byte of the payload */
+	off_t end; /* first byte after the atom */
+};
+
+/* -------------------------------------------------------------------------- */
+
+static uint32_t m4a_be32(const unsigned char *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8)
+	    | (uint32_t)p[3];
+}
+
+static uint64_t m4a_be64(const unsigned char *p) {
+	return ((uint64_t)m4a_be32(p) << 32) | m4a_be32(p + 4);
+}
+
+static bool m4a_pread(struct m4a_probe *pr, off_t offset, void *buf, size_t len) {
+	ssize_t got;
+
+	if (offset < 0 || offset + (off_t)len > pr->filesize)
+		return false;
+	got = pread(pr->fd, buf, len, offset);
+	return got == (ssize_t)len;
+}
+
+/*
+ * Read the atom header at offset, limited to the parent's end.
+ * Handles 64-bit sizes (size == 1) and "until end of parent" (size == 0).
+ */
+static bool m4a_read_atom(struct m4a_probe *pr, off_t offset, off_t limit, struct m4a_atom *atom) {
+	unsigned char hdr[16];
+	uint64_t size;
+	off_t header_len = 8;
+
+	if (offset + 8 > limit || !m4a_pread(pr, offset, hdr, 8))
+		return false;
+
+	size = m4a_be32(hdr);
+	atom->type = m4a_be32(hdr + 4);
+	if (size == 1) {
+		if (offset + 16 > limit || !m4a_pread(pr, offset + 8, hdr + 8, 8))
+			return false;
+		size = m4a_be64(hdr + 8);
+		header_len = 16;
+	} else if (size == 0) {
+		size = (uint64_t)(limit - offset);
+	}
+
+	if (size < (uint64_t)header_len || size > (uint64_t)(limit - offset))
+		return false;
+
+	atom->start = offset + header_len;
+	atom->end = offset + (off_t)size;
+	return true;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/*
+ * mvhd and mdhd share the layout we need:
+ * version(1) flags(3), then either 32-bit (v0) or 64-bit (v1)
+ * creation/modification times, a 32-bit timescale and the duration.
+ */
+static void m4a_parse_header_times(
+    struct m4a_probe *pr, const struct m4a_atom *atom, uint32_t *timescale, uint64_t *duration) {
+	unsigned char buf[32];
+	size_t len = (size_t)(atom->end - atom->start);
+
+	if (len > sizeof(buf))
+		len = sizeof(buf);
+	if (len < 20 || !m4a_pread(pr, atom->start, buf, len))
+		return;
+
+	if (buf[0] == 1) {
+		if (len < 32)
+			return;
+		*timescale = m4a_be32(buf + 20);
+		*duration = m4a_be64(buf + 24);
+	} else {
+		*timescale = m4a_be32(buf + 12);
+		*duration = m4a_be32(buf + 16);
+	}
+}
+
+/*
+ * Every ilst item holds a 'data' atom:
+ * size(4) 'data'(4) type(4) locale(4) value...
+ */
+static bool m4a_read_data(
+    struct m4a_probe *pr, const struct m4a_atom *item, unsigned char *buf, size_t *len) {
+	struct m4a_atom data;
+	size_t value_len;
+
+	if (!m4a_read_atom(pr, item->start, item->end, &data))
+		return false;
+	if (data.type != FOURCC('d', 'a', 't', 'a'))
+		return false;
+	if (data.end - data.start < 8)
+		return false;
+
+	value_len = (size_t)(data.end - data.start - 8);
+	if (value_len > *len)
+		value_len = *len;
+	if (!m4a_pread(pr, data.start + 8, buf, value_len))
+		return false;
+	*len = value_len;
+	return true;
+}
+
+static void m4a_set_text(
+    struct m4a_probe *pr, char **dest, const unsigned char *value, size_t len) {
+	char *text;
+
+	if (*dest || len == 0)
+		return;
+	text = malloc(len + 1);
+	if (!text)
+		return;
+	memcpy(text, value, len);
+	text[len] = '\0';
+	if (text[0] == '\0') {
+		free(text);
+		return;
+	}
+	*dest = text;
+	pr->found_tags = true;
+}
+
+static void m4a_parse_ilst_item(struct m4a_probe *pr, const struct m4a_atom *item) {
+	unsigned char value[M4A_MAX_TEXT];
+	size_t len = sizeof(value);
+	struct track_metadata *meta = pr->meta;
+
+	switch (item->type) {
+	case FOURCC(0xa9, 'n', 'a', 'm'):
+	case FOURCC(0xa9, 'A', 'R', 'T'):
+	case FOURCC(0xa9, 'a', 'l', 'b'):
+	case FOURCC('t', 'r', 'k', 'n'):
+	case FOURCC(0xa9, 'g', 'e', 'n'):
+	case FOURCC('g', 'n', 'r', 'e'):
+		break;
+	default:
+		return;
+	}
+
+	if (!m4a_read_data(pr, item, value, &len))
+		return;
+
+	switch (item->type) {
+	case FOURCC(0xa9, 'n', 'a', 'm'):
+		if (meta)
+			m4a_set_text(pr, &meta->title, value, len);
+		break;
+	case FOURCC(0xa9, 'A', 'R', 'T'):
+		if (meta)
+			m4a_set_text(pr, &meta->artist, value, len);
+		break;
+	case FOURCC(0xa9, 'a', 'l', 'b'):
+		if (meta)
+			m4a_set_text(pr, &meta->album, value, len);
+		break;
+	case FOURCC('t', 'r', 'k', 'n'):
+		/* reserved(2) track(2) total(2) reserved(2) */
+		if (meta && len >= 4) {
+			int track = (value[2] << 8) | value[3];
+			if (track > 0 && meta->track_number < 0) {
+				char buf[16];
+				meta->track_number = track;
+				snprintf(buf, sizeof(buf), "%d", track);
+				m4a_set_text(
+				    pr, &meta->track, (const unsigned char *)buf, strlen(buf));
+				pr->found_tags = true;
+			}
+		}
+		break;
+	case FOURCC(0xa9, 'g', 'e', 'n'):
+		/* A genre alone does not make a name */
+		if (meta && !meta->genre)
+			meta->genre = genre_from_tag((const char *)value, len);
+		break;
+	case FOURCC('g', 'n', 'r', 'e'):
+		if (len >= 2) {
+			int genre = (value[0] << 8) | value[1];
+			if (genre > 0 && genre <= 256)
+				pr->id3_genre = genre - 1;
+		}
+		break;
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void m4a_walk(struct m4a_probe *pr, off_t offset, off_t limit, uint32_t parent, int depth);
+
+/*
+ * Looks at the handler of a 'trak' before trusting its 'mdhd',
+ * so a cover art or chapter track can't provide the duration.
+ */
+static void m4a_parse_mdia(struct m4a_probe *pr, const struct m4a_atom *mdia) {
+	struct m4a_atom atom;
+	off_t offset = mdia->start;
+	uint32_t timescale = 0;
+	uint64_t duration = 0;
+	bool is_audio = false;
+
+	for (int n = 0; n < M4A_MAX_ATOMS && m4a_read_atom(pr, offset, mdia->end, &atom); n++) {
+		if (atom.type == FOURCC('m', 'd', 'h', 'd')) {
+			m4a_parse_header_times(pr, &atom, &timescale, &duration);
+		} else if (atom.type == FOURCC('h', 'd', 'l', 'r')) {
+			/* version/flags(4) pre_defined(4) handler_type(4) */
+			unsigned char hdlr[12];
+			if (m4a_pread(pr, atom.start, hdlr, sizeof(hdlr))
+			    && m4a_be32(hdlr + 8) == FOURCC('s', 'o', 'u', 'n'))
+				is_audio = true;
+		}
+		offset = atom.end;
+	}
+
+	if (is_audio && timescale && !pr->track_timescale) {
+		pr->track_timescale = timescale;
+		pr->track_duration = duration;
+	}
+}
+
+static void m4a_walk(struct m4a_probe *pr, off_t offset, off_t limit, uint32_t parent, int depth) {
+	struct m4a_atom atom;
+
+	if (depth > M4A_MAX_DEPTH)
+		return;
+
+	for (int n = 0; n < M4A_MAX_ATOMS && m4a_read_atom(pr, offset, limit, &atom); n++) {
+		switch (atom.type) {
+		case FOURCC('m', 'd', 'a', 't'):
+			/* Never read the audio, just remember how big it is */
+			if (!parent)
+				pr->mdat_size += (uint64_t)(atom.end - atom.start);
+			break;
+		case FOURCC('m', 'o', 'o', 'v'):
+			if (!parent) {
+				pr->have_moov = true;
+				m4a_walk(pr, atom.start, atom.end, atom.type, depth + 1);
+			}
+			break;
+		case FOURCC('m', 'v', 'h', 'd'):
+			if (parent == FOURCC('m', 'o', 'o', 'v'))
+				m4a_parse_header_times(
+				    pr, &atom, &pr->movie_timescale, &pr->movie_duration);
+			break;
+		case FOURCC('t', 'r', 'a', 'k'):
+			if (parent == FOURCC('m', 'o', 'o', 'v'))
+				m4a_walk(pr, atom.start, atom.end, atom.type, depth + 1);
+			break;
+		case FOURCC('m', 'd', 'i', 'a'):
+			if (parent == FOURCC('t', 'r', 'a', 'k'))
+				m4a_parse_mdia(pr, &atom);
+			break;
+		case FOURCC('u', 'd', 't', 'a'):
+			if (parent == FOURCC('m', 'o', 'o', 'v'))
+				m4a_walk(pr, atom.start, atom.end, atom.type, depth + 1);
+			break;
+		case FOURCC('m', 'e', 't', 'a'):
+			if (parent == FOURCC('u', 'd', 't', 'a')
+			    || parent == FOURCC('m', 'o', 'o', 'v')) {
+				/*
+				 * A full box, skip version(1) and flags(3). QuickTime
+				 * writes it as a plain one, 'hdlr' right after the header.
+				 */
+				unsigned char head[8];
+				off_t start = atom.start;
+
+				if (!m4a_pread(pr, atom.start, head, sizeof(head))
+				    || m4a_be32(head + 4) != FOURCC('h', 'd', 'l', 'r'))
+					start += 4;
+				m4a_walk(pr, start, atom.end, atom.type, depth + 1);
+			}
+			break;
+		case FOURCC('i', 'l', 's', 't'):
+			if (parent == FOURCC('m', 'e', 't', 'a'))
+				m4a_walk(pr, atom.start, atom.end, atom.type, depth + 1);
+			break;
+		default:
+			if (parent == FOURCC('i', 'l', 's', 't'))
+				m4a_parse_ilst_item(pr, &atom);
+			break;
+		}
+		offset = atom.end;
+	}
+}
+
+/*
+ * Check the 'ftyp' atom that starts every MP4 file, then walk the
+ * top-level atoms. Returns false if this isn't an MP4 file or if
+ * there is no 'moov' in it.
+ */
+static bool m4a_probe_file(
+    const char *filename, struct m4a_probe *pr, struct track_metadata *meta, struct stat *ss) {
+	unsigned char hdr[8];
+	bool ok = false;
+
+	memset(pr, 0, sizeof(*pr));
+	pr->id3_genre = -1;
+	pr->meta = meta;
+
+	pr->fd = open(filename, O_RDONLY);
+	if (pr->fd == -1)
+		return false;
+
+	if (fstat(pr->fd, ss) == 0) {
+		pr->filesize = ss->st_size;
+		if (m4a_pread(pr, 0, hdr, sizeof(hdr))
+		    && m4a_be32(hdr + 4) == FOURCC('f', 't', 'y', 'p')) {
+			m4a_walk(pr, 0, pr->filesize, 0, 0);
+			ok = pr->have_moov;
+		}
+	}
+
+	close(pr->fd);
+	pr->fd = -1;
+	return ok;
+}
+
+/* -------------------------------------------------------------------------- */
+
+bool m4a_info(char *filename, struct tuneinfo *ti) {
+	struct m4a_probe pr;
+	struct stat ss;
+	uint64_t seconds = 0;
+
+	if (!m4a_probe_file(filename, &pr, NULL, &ss)) {
+		fprintf(stderr, "\nm4a_read_info: cannot find m4a-info for '%s'\n", filename);
+		return false;
+	}
+
+	ti->filesize = ss.st_size;
+	ti->filedate = ss.st_mtime;
+
+	/* Prefer the audio track's own clock, fall back to the movie header */
+	if (pr.track_timescale)
+		seconds = pr.track_duration / pr.track_timescale;
+	else if (pr.movie_timescale)
+		seconds = pr.movie_duration / pr.movie_timescale;
+	ti->duration = seconds > SHRT_MAX ? SHRT_MAX : (short)seconds;
+
+	/* Average bitrate of the audio payload in kbps */
+	if (seconds > 0) {
+		uint64_t kbps = pr.mdat_size * 8 / seconds / 1000;
+		ti->bitrate = kbps > SHRT_MAX ? SHRT_MAX : (short)kbps;
+	} else {
+		ti->bitrate = 0;
+	}
+
+	ti->genre = pr.id3_genre >= 0 ? (unsigned char)pr.id3_genre : 0xff;
+	return true;
+}
+
+bool m4a_metadata(char *filename, struct track_metadata *meta) {
+	struct m4a_probe pr;
+	struct stat ss;
+
+	if (!meta)
+		return false;
+
+	if (!m4a_probe_file(filename, &pr, meta, &ss))
+		return false;
+	if (!meta->genre && pr.id3_genre >= 0 && id3_genre_name(pr.id3_genre))
+		meta->genre = strdup(id3_genre_name(pr.id3_genre));
+	return pr.found_tags;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void m4a_play(char *filename) {
+	const char *player = config_get_m4a_player_path();
+	const char *flags = config_get_m4a_player_flags();
+	player_exec(player, flags, NULL, 0, filename);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+bool m4a_info(char *filename, struct tuneinfo *ti);
+bool m4a_metadata(char *filename, struct track_metadata *meta);
+void m4a_play(char *filename);
@@ -323,6 +323,11 @@ static bool parse_id3v2_text_frame(const char *frame_id, const unsigned char *fr
 		metadata_try_set_track_number(meta, value);
 		metadata_set_if_empty(&meta->track, value);
 		handled = (meta->track == value || meta->track_number >= 0);
+	} else if (strcmp(frame_id, "TCON") == 0) {
+		/* Genre, which alone does not make a name */
+		if (!meta->genre)
+			meta->genre = genre_from_tag(value, strlen(value));
+		free(value);
 	} else {
 		/* Unknown frame, discard */
 		free(value);
@@ -486,6 +491,10 @@ static bool mp3_parse_id3v1(const unsigned char *data, size_t size, struct track
 		metadata_set_if_empty(&meta->track, strdup(buf));
 	}
 
+	/* An ID3v2 genre comes first, 0xff is no genre */
+	if (!meta->genre && id3_genre_name(tag->genre))
+		meta->genre = strdup(id3_genre_name(tag->genre));
+
 	return found;
 }
 /* --------------------------------------------------------------------------- */
@@ -623,14 +632,6 @@ bool mp3_metadata(char *filename, struct track_metadata *meta) {
 
 /* -------------------------------------------------------------------------- */
 
-bool mp3_isit(char *s, int len) {
-	if (len < 5)
-		return false;
-
-	const char *ext = s + len - 4;
-	return (strcasecmp(ext, ".mp3") == 0);
-}
-
 void mp3_play(char *filename) {
 	const char *player = config_get_mp3_player_path();
 	const char *flags = config_get_mp3_player_flags();
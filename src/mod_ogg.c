@@ -2,153 +2,102 @@
 // Copyright (c) 2007-2010 Krister Brus <kristerbrus@fastmail.fm>
 
 // System headers
-#include <ctype.h>
-#include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <ogg/ogg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <time.h>
 #include <unistd.h>
-#include <vorbis/codec.h>
-#include <vorbis/vorbisfile.h>
 
 // Local headers
 #include "common.h"
 #include "config.h"
+#include "ogg_page.h"
+
+/*
+ * Ogg Vorbis is probed without decoding, see ogg_page.c.
+ * The first packet is the identification header:
+ *
+ *   type(1) = 1, "vorbis"(6), version(4), channels(1), rate(4),
+ *   bitrate_max(4), bitrate_nominal(4), bitrate_min(4), ...
+ *
+ * and the second one the comment header, type 3 + "vorbis" followed
+ * by the comment block.
+ */
+#define VORBIS_MAX_PACKET (16 * 1024)
 
 /* -------------------------------------------------------------------------- */
 
-static void ogg_metadata_set(char **dest, const char *value) {
-	if (!value || !*value)
-		return;
-	if (*dest)
-		return;
-	*dest = strdup(value);
-}
-
-static void ogg_metadata_try_set_track(struct track_metadata *meta, const char *value) {
-	if (!value || !*value)
-		return;
-	if (!meta->track)
-		meta->track = strdup(value);
-	if (meta->track_number < 0) {
-		char *endptr = NULL;
-		long parsed = strtol(value, &endptr, 10);
-		if (parsed > 0 && parsed < INT_MAX)
-			meta->track_number = (int)parsed;
-	}
-}
-
 bool ogg_metadata(char *filename, struct track_metadata *meta) {
+	struct ogg_packet_data packets[2];
+	uint32_t serial;
+	bool found = false;
+	int fd;
+
 	if (!meta)
 		return false;
 
-	FILE *f = fopen(filename, "r");
-	if (!f)
+	fd = open(filename, O_RDONLY);
+	if (fd == -1)
 		return false;
 
-	OggVorbis_File vf;
-	memset(&vf, 0, sizeof(vf));
-	if (ov_open(f, &vf, NULL, 0) < 0) {
-		fclose(f);
-		return false;
-	}
+	if (ogg_read_header_packets(fd, packets, 2, VORBIS_MAX_PACKET, &serial) == 2
+	    && packets[1].len >= 7 && memcmp(packets[1].data, "\x03vorbis", 7) == 0)
+		found = ogg_comments_metadata(packets[1].data + 7, packets[1].len - 7, meta);
 
-	bool found = false;
-	vorbis_comment *comment = ov_comment(&vf, -1);
-	if (comment) {
-		for (int i = 0; i < comment->comments; i++) {
-			char *entry = comment->user_comments[i];
-			if (!entry)
-				continue;
-			char *sep = strchr(entry, '=');
-			if (!sep)
-				continue;
-			size_t key_len = (size_t)(sep - entry);
-			const char *value = sep + 1;
-			if (!*value)
-				continue;
-
-			if (key_len == 5 && strncasecmp(entry, "TITLE", 5) == 0) {
-				ogg_metadata_set(&meta->title, value);
-				if (meta->title)
-					found = true;
-			} else if (key_len == 6 && strncasecmp(entry, "ARTIST", 6) == 0) {
-				ogg_metadata_set(&meta->artist, value);
-				if (meta->artist)
-					found = true;
-			} else if (key_len == 5 && strncasecmp(entry, "ALBUM", 5) == 0) {
-				ogg_metadata_set(&meta->album, value);
-				if (meta->album)
-					found = true;
-			} else if ((key_len == 11 && strncasecmp(entry, "TRACKNUMBER", 11) == 0)
-			    || (key_len == 5 && strncasecmp(entry, "TRACK", 5) == 0)) {
-				ogg_metadata_try_set_track(meta, value);
-				if (meta->track || meta->track_number >= 0)
-					found = true;
-			}
-		}
-	}
-
-	ov_clear(&vf);
+	ogg_free_header_packets(packets, 2);
+	close(fd);
 	return found;
 }
 
 /* -------------------------------------------------------------------------- */
 
 bool ogg_info(char *filename, struct tuneinfo *ti) {
-	FILE *f;
-	OggVorbis_File vf;
-	int error;
+	struct ogg_packet_data id = { 0 };
 	struct stat ss;
+	uint32_t serial;
+	uint32_t rate;
+	int64_t granule;
+	int fd;
 
-	f = fopen(filename, "r");
-	if (!f) {
+	fd = open(filename, O_RDONLY);
+	if (fd == -1) {
 		fprintf(stderr, "\nogg_read_info: fail in open '%s'\n", filename);
 		return false;
 	}
 
-	memset(&vf, 0, sizeof(OggVorbis_File));
-	error = ov_open(f, &vf, NULL, 0);
-	if (error < 0) {
-		fclose(f);
-		fprintf(stderr, "\nogg_read_info: Unable to understand '%s', errorcode=%d\n",
-		    filename, error);
+	if (fstat(fd, &ss) == -1 || ogg_read_header_packets(fd, &id, 1, 64, &serial) != 1
+	    || id.len < 30 || memcmp(id.data, "\x01vorbis", 7) != 0) {
+		ogg_free_header_packets(&id, 1);
+		close(fd);
+		fprintf(stderr, "\nogg_read_info: Unable to understand '%s'\n", filename);
 		return false;
 	}
 
-	error = stat(filename, &ss);
-	if (!error) {
-		ti->filesize = ss.st_size;
-		ti->filedate = ss.st_mtime;
+	ti->filesize = ss.st_size;
+	ti->filedate = ss.st_mtime;
+
+	rate = (uint32_t)id.data[12] | ((uint32_t)id.data[13] << 8) | ((uint32_t)id.data[14] << 16)
+	    | ((uint32_t)id.data[15] << 24);
+	ti->duration = 0;
+	ti->bitrate = 0;
+	if (rate > 0 && ogg_last_granule(fd, ss.st_size, serial, &granule) && granule > 0) {
+		int64_t seconds = granule / rate;
+		ti->duration = seconds > SHRT_MAX ? SHRT_MAX : (short)seconds;
+		/* Same as ov_bitrate(): average over the whole file */
+		if (granule >= rate) {
+			int64_t kbps = (int64_t)ss.st_size * 8 * rate / granule / 1000;
+			ti->bitrate = kbps > SHRT_MAX ? SHRT_MAX : (short)kbps;
+		}
 	}
 
-	ti->duration = ov_time_total(&vf, -1);
-	ti->bitrate = ov_bitrate(&vf, -1) / 1000;
-
-	/*
-	 * Yes, just call ov_clear()... NOT fclose()
-	 * fclose() is done _inside_ of ov_clear()
-	 */
-	ov_clear(&vf);
+	ogg_free_header_packets(&id, 1);
+	close(fd);
 	return true;
 }
 
-bool ogg_isit(char *s, int len) {
-	if (len < 5)
-		return false;
-
-	const char *ext = s + len - 4;
-	return (strcasecmp(ext, ".ogg") == 0);
-}
-
 void ogg_play(char *filename) {
 	const char *player = config_get_ogg_player_path();
 	const char *flags = config_get_ogg_player_flags();
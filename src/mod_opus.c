@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * mod_opus.c - Ogg Opus support
+ *
+ * Opus is always stored in Ogg and shares the page reader with
+ * mod_ogg (see ogg_page.c). The first packet is OpusHead:
+ *
+ *   "OpusHead"(8), version(1), channels(1), pre_skip(2), input_rate(4), ...
+ *
+ * and the second one OpusTags, "OpusTags"(8) followed by a Vorbis
+ * comment block. Granule positions always count 48 kHz samples,
+ * whatever the input rate was, and include the pre-skip samples
+ * that the decoder drops, so
+ *
+ *   duration = (last granule - pre_skip) / 48000
+ */
+
+// System headers
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Local headers
+#include "common.h"
+#include "config.h"
+#include "ogg_page.h"
+
+#define OPUS_RATE 48000
+#define OPUS_MAX_PACKET (16 * 1024)
+
+/* -------------------------------------------------------------------------- */
+
+bool opus_metadata(char *filename, struct track_metadata *meta) {
+	struct ogg_packet_data packets[2];
+	uint32_t serial;
+	bool found = false;
+	int fd;
+
+	if (!meta)
+		return false;
+
+	fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	if (ogg_read_header_packets(fd, packets, 2, OPUS_MAX_PACKET, &serial) == 2
+	    && packets[1].len >= 8 && memcmp(packets[1].data, "OpusTags", 8) == 0)
+		found = ogg_comments_metadata(packets[1].data + 8, packets[1].len - 8, meta);
+
+	ogg_free_header_packets(packets, 2);
+	close(fd);
+	return found;
+}
+
+/* -------------------------------------------------------------------------- */
+
+bool opus_info(char *filename, struct tuneinfo *ti) {
+	struct ogg_packet_data head = { 0 };
+	struct stat ss;
+	uint32_t serial;
+	int64_t granule;
+	int64_t pre_skip;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "\nopus_read_info: fail in open '%s'\n", filename);
+		return false;
+	}
+
+	if (fstat(fd, &ss) == -1 || ogg_read_header_packets(fd, &head, 1, 64, &serial) != 1
+	    || head.len < 19 || memcmp(head.data, "OpusHead", 8) != 0) {
+		ogg_free_header_packets(&head, 1);
+		close(fd);
+		fprintf(stderr, "\nopus_read_info: Unable to understand '%s'\n", filename);
+		return false;
+	}
+
+	ti->filesize = ss.st_size;
+	ti->filedate = ss.st_mtime;
+
+	pre_skip = head.data[10] | (head.data[11] << 8);
+	ti->duration = 0;
+	ti->bitrate = 0;
+	if (ogg_last_granule(fd, ss.st_size, serial, &granule) && granule > pre_skip) {
+		int64_t samples = granule - pre_skip;
+		int64_t seconds = samples / OPUS_RATE;
+		ti->duration = seconds > SHRT_MAX ? SHRT_MAX : (short)seconds;
+		if (samples >= OPUS_RATE) {
+			int64_t kbps = (int64_t)ss.st_size * 8 * OPUS_RATE / samples / 1000;
+			ti->bitrate = kbps > SHRT_MAX ? SHRT_MAX : (short)kbps;
+		}
+	}
+
+	ogg_free_header_packets(&head, 1);
+	close(fd);
+	return true;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void opus_play(char *filename) {
+	const char *player = config_get_opus_player_path();
+	const char *flags = config_get_opus_player_flags();
+	player_exec(player, flags, NULL, 0, filename);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+bool opus_info(char *filename, struct tuneinfo *ti);
+bool opus_metadata(char *filename, struct track_metadata *meta);
+void opus_play(char *filename);
@@ -34,14 +34,6 @@ bool pls_info(char *filename, struct tuneinfo *ti) {
 	return has_httplines;
 }
 
-bool pls_isit(char *s, int len) {
-	if (len < 5)
-		return false;
-
-	const char *ext = s + len - 4;
-	return (strcasecmp(ext, ".pls") == 0 || strcasecmp(ext, ".m3u") == 0);
-}
-
 void pls_play(char *filename) {
 	/*
 	 * Default command line (as configured): mplayer -quiet -really-quiet -vo null -vc null
@@ -1,5 +1,4 @@
 #pragma once
 
 bool pls_info(char *filename, struct tuneinfo *ti);
-bool pls_isit(char *s, int len);
 void pls_play(char *filename);
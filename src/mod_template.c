@@ -13,6 +13,11 @@
 
 #include "common.h"
 
+/*
+ * Register with (see music.c and music.h):
+ * music_register_filetype(MUSIC_FORMAT_TEMPLATE, "ext1 ext2", &TEMPLATE_info, NULL, &TEMPLATE_play);
+ */
+
 /* --------------------------------------------------------------------------- */
 
 bool TEMPLATE_info(char *filename, struct tuneinfo *ti) {
@@ -21,12 +26,6 @@ bool TEMPLATE_info(char *filename, struct tuneinfo *ti) {
 
 /* -------------------------------------------------------------------------- */
 
-bool TEMPLATE_isit(char *s, int len) {
-	return false;
-}
-
-/* -------------------------------------------------------------------------- */
-
 void TEMPLATE_play(char *filename) {
 	execl("path-to-some-player", "path-to-some-player", filename, NULL);
 }
@@ -6,25 +6,37 @@
  *
  * Three functions must be written for each supported music format:
  *
- * 1. int XXX_isit(char *filename)
- *    returns true if the file has the extension .XXX
- *
- * 2. int XXX_info(char *filename, struct tuneinfo *si)
+ * 1. int XXX_info(char *filename, struct tuneinfo *si)
  *    returns true if information about the file is calculated
  *    and put into the tuneinfo structure.
  *
+ * 2. int XXX_metadata(char *filename, struct track_metadata *meta)
+ *    returns true if any tags (title, artist, ...) were found.
+ *    May be NULL for formats without tags.
+ *
  * 3. void XXX_play(char *filename)
  *    plays the file with an external program
  *
+ * Each module is registered with a format id (see music.h) and the
+ * file extensions it handles. The extension of a file is resolved to
+ * its format id once, with a single lookup in a small hash table, and
+ * the resolved handler is then passed to music_info, music_metadata
+ * and music_play.
+ *
  * The functions named music_* in this file are never meant
  * to be modified when support for a new music format is created.
  * It's just the music_register_all_modules function that needs
- * ONE additional call to setup the pointers to the new functions.
+ * ONE additional call to setup the pointers to the new functions,
+ * plus a new MUSIC_FORMAT_XXX id in music.h.
  *
  * Also, you don't have to change _anything_ in the glaciera-indexer/glaciera programs.
  */
 
+/* strtok_r() */
+#define _POSIX_C_SOURCE 200809L
+
 // System headers
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -41,59 +53,127 @@
  * http://www-128.ibm.com/developerworks/power/library/pa-ctypes1/?ca=dgr-lnxw02CTypesP1
  */
 struct filetype {
-	bool (*isit)(char *, int);
+	int format;
 	bool (*info)(char *, struct tuneinfo *);
 	bool (*metadata)(char *, struct track_metadata *);
 	void (*play)(char *);
-	struct filetype *next;
 };
 
 /* -------------------------------------------------------------------------- */
 
-static struct filetype *fthead = NULL;
+/*
+ * Extensions are at most EXT_MAXLEN characters, so a lowercased
+ * extension packs into a single 64-bit key. The keys live in a small
+ * open-addressed table that is filled once at startup and only read
+ * afterwards, so lookups need no locking.
+ */
+#define EXT_MAXLEN 7
+#define EXT_SLOTS 32
+
+static struct filetype filetypes[MUSIC_FORMAT_COUNT];
+
+static struct {
+	uint64_t key;
+	int format;
+} exttab[EXT_SLOTS];
+
+static inline unsigned int ext_slot(uint64_t key) {
+	return (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 59) & (EXT_SLOTS - 1);
+}
+
+/*
+ * Pack "Mp3" into the key 'm' << 16 | 'p' << 8 | '3'.
+ * Returns 0 for extensions that are empty or too long.
+ */
+static uint64_t ext_key(const char *ext, size_t len) {
+	uint64_t key = 0;
+
+	if (len == 0 || len > EXT_MAXLEN)
+		return 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char ch = ext[i];
+		if (ch >= 'A' && ch <= 'Z')
+			ch += 'a' - 'A';
+		key = (key << 8) | ch;
+	}
+	return key;
+}
+
+static void music_register_extension(const char *ext, int format) {
+	uint64_t key = ext_key(ext, strlen(ext));
+	unsigned int slot;
 
-static void music_register_filetype(bool (*isitproc)(char *, int),
+	if (!key)
+		return;
+	for (slot = ext_slot(key); exttab[slot].key && exttab[slot].key != key;)
+		slot = (slot + 1) & (EXT_SLOTS - 1);
+	exttab[slot].key = key;
+	exttab[slot].format = format;
+}
+
+/*
+ * exts is a space separated list of extensions, e.g. "pls m3u"
+ */
+static void music_register_filetype(int format, const char *exts,
     bool (*infoproc)(char *, struct tuneinfo *), bool (*metaproc)(char *, struct track_metadata *),
     void (*playproc)(char *)) {
-	struct filetype *ft;
-
-	ft = malloc(sizeof(*ft));
-	ft->isit = isitproc;
-	ft->info = infoproc;
-	ft->metadata = metaproc;
-	ft->play = playproc;
-	ft->next = fthead;
-	fthead = ft;
+	char buf[64];
+	char *ext;
+	char *saveptr = NULL;
+
+	if (format <= MUSIC_FORMAT_UNKNOWN || format >= MUSIC_FORMAT_COUNT)
+		return;
+
+	filetypes[format].format = format;
+	filetypes[format].info = infoproc;
+	filetypes[format].metadata = metaproc;
+	filetypes[format].play = playproc;
+
+	safe_strcpy(buf, exts, sizeof(buf));
+	for (ext = strtok_r(buf, " ", &saveptr); ext; ext = strtok_r(NULL, " ", &saveptr))
+		music_register_extension(ext, format);
 }
 
 /* -------------------------------------------------------------------------- */
 
-struct filetype *music_isit(char *filename) {
-	struct filetype *ft;
-	int len = strlen(filename);
+/*
+ * Resolve the format id of a file from its extension.
+ * Returns MUSIC_FORMAT_UNKNOWN if no module handles it.
+ */
+int music_format(const char *filename) {
+	const char *dot = strrchr(filename, '.');
+	uint64_t key;
+	unsigned int slot;
+
+	if (!dot || dot == filename)
+		return MUSIC_FORMAT_UNKNOWN;
 
-	for (ft = fthead; ft; ft = ft->next) {
-		if (ft->isit(filename, len))
-			return ft;
+	key = ext_key(dot + 1, strlen(dot + 1));
+	if (!key)
+		return MUSIC_FORMAT_UNKNOWN;
+
+	for (slot = ext_slot(key); exttab[slot].key; slot = (slot + 1) & (EXT_SLOTS - 1)) {
+		if (exttab[slot].key == key)
+			return exttab[slot].format;
 	}
-	return NULL;
+	return MUSIC_FORMAT_UNKNOWN;
 }
 
-/* -------------------------------------------------------------------------- */
+struct filetype *music_handler(int format) {
+	if (format <= MUSIC_FORMAT_UNKNOWN || format >= MUSIC_FORMAT_COUNT)
+		return NULL;
+	return filetypes[format].info ? &filetypes[format] : NULL;
+}
 
-bool music_info(char *filename, struct tuneinfo *si) {
-	struct filetype *ft;
+/* -------------------------------------------------------------------------- */
 
-	ft = music_isit(filename);
+bool music_info(struct filetype *ft, char *filename, struct tuneinfo *si) {
 	return ft ? ft->info(filename, si) : false;
 }
 
 /* -------------------------------------------------------------------------- */
 
-bool music_metadata(char *filename, struct track_metadata *meta) {
-	struct filetype *ft;
-
-	ft = music_isit(filename);
+bool music_metadata(struct filetype *ft, char *filename, struct track_metadata *meta) {
 	if (!ft || !ft->metadata)
 		return false;
 	return ft->metadata(filename, meta);
@@ -101,10 +181,7 @@ bool music_metadata(char *filename, struct track_metadata *meta) {
 
 /* -------------------------------------------------------------------------- */
 
-void music_play(char *filename) {
-	struct filetype *ft;
-
-	ft = music_isit(filename);
+void music_play(struct filetype *ft, char *filename) {
 	if (ft)
 		ft->play(filename);
 }
@@ -116,8 +193,10 @@ void music_play(char *filename) {
  * ===========================
  */
 #include "mod_flac.h"
+#include "mod_m4a.h"
 #include "mod_mp3.h"
 #include "mod_ogg.h"
+#include "mod_opus.h"
 #include "mod_pls.h"
 
 /*
@@ -127,11 +206,15 @@ void music_play(char *filename) {
 void music_register_all_modules(void) {
 	/*
 	 * INSERT NEW music_register_filetype's HERE
-	 * music_register_filetype(&XXX_isit, &XXX_info, &XXX_metadata, &XXX_play);
+	 * music_register_filetype(MUSIC_FORMAT_XXX, "xxx", &XXX_info, &XXX_metadata, &XXX_play);
 	 * =========================================
 	 */
-	music_register_filetype(&pls_isit, &pls_info, NULL, &pls_play);
-	music_register_filetype(&flac_isit, &flac_info, &flac_metadata, &flac_play);
-	music_register_filetype(&ogg_isit, &ogg_info, &ogg_metadata, &ogg_play);
-	music_register_filetype(&mp3_isit, &mp3_info, &mp3_metadata, &mp3_play);
+	music_register_filetype(MUSIC_FORMAT_PLS, "pls m3u", &pls_info, NULL, &pls_play);
+	music_register_filetype(
+	    MUSIC_FORMAT_FLAC, "flac", &flac_info, &flac_metadata, &flac_play);
+	music_register_filetype(MUSIC_FORMAT_OGG, "ogg", &ogg_info, &ogg_metadata, &ogg_play);
+	music_register_filetype(MUSIC_FORMAT_MP3, "mp3", &mp3_info, &mp3_metadata, &mp3_play);
+	music_register_filetype(MUSIC_FORMAT_M4A, "m4a m4b", &m4a_info, &m4a_metadata, &m4a_play);
+	music_register_filetype(
+	    MUSIC_FORMAT_OPUS, "opus", &opus_info, &opus_metadata, &opus_play);
 }
@@ -9,8 +9,25 @@
  */
 struct filetype;
 
-struct filetype *music_isit(char *filename);
-bool music_info(char *filename, struct tuneinfo *si);
-bool music_metadata(char *filename, struct track_metadata *meta);
-void music_play(char *filename);
+/*
+ * Format ids, resolved once per file from the extension.
+ * They are stored in the database (tracks.format) and in struct tuneinfo,
+ * so never renumber an existing entry - append new formats at the end.
+ */
+enum music_format {
+	MUSIC_FORMAT_UNKNOWN = 0,
+	MUSIC_FORMAT_MP3 = 1,
+	MUSIC_FORMAT_OGG = 2,
+	MUSIC_FORMAT_FLAC = 3,
+	MUSIC_FORMAT_PLS = 4,
+	MUSIC_FORMAT_M4A = 5,
+	MUSIC_FORMAT_OPUS = 6,
+	MUSIC_FORMAT_COUNT
+};
+
+int music_format(const char *filename);
+struct filetype *music_handler(int format);
+bool music_info(struct filetype *ft, char *filename, struct tuneinfo *si);
+bool music_metadata(struct filetype *ft, char *filename, struct track_metadata *meta);
+void music_play(struct filetype *ft, char *filename);
 void music_register_all_modules(void);
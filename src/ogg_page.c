@@ -0,0 +1,326 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * ogg_page.c - Minimal Ogg container reader shared by mod_ogg and mod_opus
+ *
+ * Everything the indexer needs from an Ogg file is in two places:
+ *
+ *   - the first few packets of the stream (codec id header and the
+ *     comment header with the tags), found on the first pages, and
+ *   - the granule position of the last page, which is the total
+ *     number of samples, found within the last OGG_PAGE_MAX bytes.
+ *
+ * So instead of letting a decoder library open (and bisect through)
+ * the whole file, we read the header pages from the start and one
+ * bounded block from the end, and never touch the audio in between.
+ */
+
+/* pread() */
+#define _POSIX_C_SOURCE 200809L
+
+// System headers
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+// Local headers
+#include "common.h"
+#include "ogg_page.h"
+
+/*
+ * Header packets are on the first pages, give up if they aren't.
+ * The tail is read in two steps, most last pages are small.
+ */
+#define OGG_MAX_HEADER_PAGES 64
+#define OGG_TAIL_SMALL 4096
+
+/* -------------------------------------------------------------------------- */
+
+static uint32_t ogg_le32(const unsigned char *p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16)
+	    | ((uint32_t)p[3] << 24);
+}
+
+static int64_t ogg_le64(const unsigned char *p) {
+	return (int64_t)((uint64_t)ogg_le32(p) | ((uint64_t)ogg_le32(p + 4) << 32));
+}
+
+/*
+ * The page CRC: polynomial 0x04c11db7, no reflection, initial value 0,
+ * computed with the CRC field itself set to zero. Only used to validate
+ * pages found by scanning backwards from the end of the file.
+ */
+static uint32_t ogg_page_crc(const unsigned char *page, size_t len) {
+	uint32_t crc = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char byte = (i >= 22 && i < 26) ? 0 : page[i];
+		crc ^= (uint32_t)byte << 24;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80000000U) ? (crc << 1) ^ 0x04c11db7U : crc << 1;
+	}
+	return crc;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Parse a page header. buf must hold the 27 byte fixed header and
+ * the lacing values that follow it.
+ */
+bool ogg_page_parse(const unsigned char *buf, size_t len, struct ogg_page_header *page) {
+	if (len < 27 || memcmp(buf, "OggS", 4) != 0 || buf[4] != 0)
+		return false;
+
+	page->flags = buf[5];
+	page->granule = ogg_le64(buf + 6);
+	page->serial = ogg_le32(buf + 14);
+	page->sequence = ogg_le32(buf + 18);
+	page->crc = ogg_le32(buf + 22);
+	page->segments = buf[26];
+	page->header_len = 27 + (size_t)page->segments;
+	if (len < page->header_len)
+		return false;
+
+	page->body_len = 0;
+	for (int i = 0; i < page->segments; i++)
+		page->body_len += buf[27 + i];
+	return true;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void ogg_free_header_packets(struct ogg_packet_data *packets, int count) {
+	for (int i = 0; i < count; i++) {
+		free(packets[i].data);
+		packets[i].data = NULL;
+		packets[i].len = 0;
+	}
+}
+
+/*
+ * Reassemble the first count packets of the first logical stream in
+ * the file. Each packet keeps at most max_len bytes, the rest is
+ * flagged as truncated - tags come before any embedded cover art, so
+ * a cut-off comment header is still useful.
+ *
+ * Returns the number of packets read (complete or truncated).
+ */
+int ogg_read_header_packets(
+    int fd, struct ogg_packet_data *packets, int count, size_t max_len, uint32_t *serial) {
+	unsigned char hdr[27 + 255];
+	unsigned char *body;
+	struct ogg_page_header page;
+	off_t offset = 0;
+	int packet = 0;
+	bool have_serial = false;
+
+	for (int i = 0; i < count; i++) {
+		packets[i].data = NULL;
+		packets[i].len = 0;
+		packets[i].truncated = false;
+	}
+
+	body = malloc(OGG_PAGE_MAX);
+	if (!body)
+		return 0;
+	for (int i = 0; i < count; i++) {
+		packets[i].data = malloc(max_len);
+		if (!packets[i].data) {
+			ogg_free_header_packets(packets, count);
+			free(body);
+			return 0;
+		}
+	}
+
+	for (int pages = 0; pages < OGG_MAX_HEADER_PAGES && packet < count; pages++) {
+		if (pread(fd, hdr, 27, offset) != 27)
+			break;
+		if (pread(fd, hdr + 27, hdr[26], offset + 27) != hdr[26])
+			break;
+		if (!ogg_page_parse(hdr, 27 + (size_t)hdr[26], &page))
+			break;
+
+		if (!have_serial) {
+			*serial = page.serial;
+			have_serial = true;
+		}
+
+		/* Pages of other multiplexed streams are skipped unread */
+		if (page.serial == *serial) {
+			size_t pos = 0;
+
+			if (pread(fd, body, page.body_len, offset + (off_t)page.header_len)
+			    != (ssize_t)page.body_len)
+				break;
+
+			for (int s = 0; s < page.segments && packet < count; s++) {
+				struct ogg_packet_data *pk = &packets[packet];
+				size_t lace = hdr[27 + s];
+				size_t take = lace;
+
+				if (pk->len + take > max_len) {
+					take = max_len - pk->len;
+					pk->truncated = true;
+				}
+				memcpy(pk->data + pk->len, body + pos, take);
+				pk->len += take;
+				pos += lace;
+
+				/* A lacing value below 255 ends the packet */
+				if (lace < 255 || (pk->truncated && packet == count - 1))
+					packet++;
+			}
+		}
+
+		offset += (off_t)(page.header_len + page.body_len);
+	}
+
+	free(body);
+	return packet;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Scan buf backwards for the last complete, CRC-valid page of the
+ * given stream that has a granule position.
+ */
+static bool ogg_scan_tail(const unsigned char *buf, size_t len, uint32_t serial, int64_t *granule) {
+	struct ogg_page_header page;
+
+	for (size_t i = len >= 27 ? len - 27 + 1 : 0; i-- > 0;) {
+		if (buf[i] != 'O' || !ogg_page_parse(buf + i, len - i, &page))
+			continue;
+		if (page.serial != serial || page.granule == -1)
+			continue;
+		if (page.header_len + page.body_len > len - i)
+			continue;
+		if (ogg_page_crc(buf + i, page.header_len + page.body_len) != page.crc)
+			continue;
+		*granule = page.granule;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Find the granule position of the last page of the stream, reading
+ * at most OGG_PAGE_MAX bytes from the end of the file.
+ */
+bool ogg_last_granule(int fd, off_t filesize, uint32_t serial, int64_t *granule) {
+	unsigned char *buf;
+	size_t want = OGG_TAIL_SMALL;
+	bool found = false;
+
+	buf = malloc(OGG_PAGE_MAX);
+	if (!buf)
+		return false;
+
+	for (;;) {
+		size_t len = filesize < (off_t)want ? (size_t)filesize : want;
+
+		if (pread(fd, buf, len, filesize - (off_t)len) != (ssize_t)len)
+			break;
+		found = ogg_scan_tail(buf, len, serial, granule);
+		if (found || want == OGG_PAGE_MAX || len < want)
+			break;
+		want = OGG_PAGE_MAX;
+	}
+
+	free(buf);
+	return found;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void ogg_comment_set(char **dest, const char *value, size_t len) {
+	if (len == 0 || *dest)
+		return;
+	*dest = strndup(value, len);
+}
+
+static void ogg_comment_set_track(struct track_metadata *meta, const char *value, size_t len) {
+	char buf[32];
+
+	if (len == 0)
+		return;
+	if (!meta->track)
+		meta->track = strndup(value, len);
+	if (meta->track_number < 0) {
+		long parsed;
+		if (len >= sizeof(buf))
+			len = sizeof(buf) - 1;
+		memcpy(buf, value, len);
+		buf[len] = '\0';
+		parsed = strtol(buf, NULL, 10);
+		if (parsed > 0 && parsed < INT_MAX)
+			meta->track_number = (int)parsed;
+	}
+}
+
+/*
+ * Parse a Vorbis comment block, the layout shared by the Vorbis
+ * comment header and OpusTags (p points past the codec's magic):
+ *
+ *   vendor_length(4) vendor, count(4), count * { length(4) "KEY=value" }
+ *
+ * All integers are little endian. A truncated block yields the
+ * comments that are complete. Returns true if any tag was found.
+ */
+bool ogg_comments_metadata(const unsigned char *p, size_t len, struct track_metadata *meta) {
+	const unsigned char *end = p + len;
+	uint32_t vendor_len;
+	uint32_t count;
+	bool found = false;
+
+	if (len < 8)
+		return false;
+	vendor_len = ogg_le32(p);
+	if (vendor_len > len - 8)
+		return false;
+	p += 4 + vendor_len;
+	count = ogg_le32(p);
+	p += 4;
+
+	for (uint32_t i = 0; i < count && end - p >= 4; i++) {
+		uint32_t entry_len = ogg_le32(p);
+		const char *entry = (const char *)p + 4;
+		const char *sep;
+		size_t key_len;
+		size_t value_len;
+
+		if (entry_len > (size_t)(end - p) - 4)
+			break;
+		p += 4 + entry_len;
+
+		sep = memchr(entry, '=', entry_len);
+		if (!sep)
+			continue;
+		key_len = (size_t)(sep - entry);
+		value_len = entry_len - key_len - 1;
+		if (value_len == 0)
+			continue;
+
+		if (key_len == 5 && strncasecmp(entry, "TITLE", 5) == 0) {
+			ogg_comment_set(&meta->title, sep + 1, value_len);
+			found |= meta->title != NULL;
+		} else if (key_len == 6 && strncasecmp(entry, "ARTIST", 6) == 0) {
+			ogg_comment_set(&meta->artist, sep + 1, value_len);
+			found |= meta->artist != NULL;
+		} else if (key_len == 5 && strncasecmp(entry, "ALBUM", 5) == 0) {
+			ogg_comment_set(&meta->album, sep + 1, value_len);
+			found |= meta->album != NULL;
+		} else if ((key_len == 11 && strncasecmp(entry, "TRACKNUMBER", 11) == 0)
+		    || (key_len == 5 && strncasecmp(entry, "TRACK", 5) == 0)) {
+			ogg_comment_set_track(meta, sep + 1, value_len);
+			found |= meta->track || meta->track_number >= 0;
+		} else if (key_len == 5 && !meta->genre && strncasecmp(entry, "GENRE", 5) == 0) {
+			meta->genre = genre_from_tag(sep + 1, value_len);
+		}
+	}
+	return found;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+// System headers
+#include <stdint.h>
+#include <sys/types.h>
+
+// Local headers
+#include "common.h"
+
+/* 27 byte header + 255 lacing values + 255 segments of 255 bytes */
+#define OGG_PAGE_MAX 65307
+
+struct ogg_page_header {
+	unsigned char flags; /* 0x01 continued, 0x02 first page, 0x04 last page */
+	int64_t granule; /* -1 if no packet ends on this page */
+	uint32_t serial;
+	uint32_t sequence;
+	uint32_t crc;
+	int segments;
+	size_t header_len; /* 27 + segments */
+	size_t body_len;
+};
+
+/* One header packet, cut off after max_len bytes */
+struct ogg_packet_data {
+	unsigned char *data;
+	size_t len;
+	bool truncated;
+};
+
+bool ogg_page_parse(const unsigned char *buf, size_t len, struct ogg_page_header *page);
+int ogg_read_header_packets(
+    int fd, struct ogg_packet_data *packets, int count, size_t max_len, uint32_t *serial);
+void ogg_free_header_packets(struct ogg_packet_data *packets, int count);
+bool ogg_last_granule(int fd, off_t filesize, uint32_t serial, int64_t *granule);
+bool ogg_comments_metadata(const unsigned char *p, size_t len, struct track_metadata *meta);
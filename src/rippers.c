@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * rippers.c - Find ripper tags at the end of names
+ *
+ * Every ripper string is inserted reversed and ASCII case folded
+ * into a trie, so a name is matched by walking it backwards from its
+ * last character: each step is one table lookup, and the walk ends
+ * at the first character no ripper continues with. The deepest
+ * accepting state seen is the longest ripper the name ends with.
+ * The cost depends on the length of the match, not on the number
+ * of rippers.
+ *
+ * Transitions are stored as dense rows indexed by character class.
+ * Only bytes that occur in some ripper get a class of their own,
+ * everything else maps to class 0, which has no transitions. With
+ * a few hundred rippers that is a few dozen classes per row.
+ *
+ * The tables are never written after rippers_load(), so lookups
+ * need no locking.
+ */
+
+// System headers
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local headers
+#include "common.h"
+#include "rippers.h"
+
+#define RIPPERS_MAX_STATES 65535
+
+struct rippers {
+	unsigned char class_of[256];
+	int classes;
+	int states;
+	uint16_t *next; /* states * classes, 0 = no transition */
+	unsigned char *accept; /* ripper ends in this state */
+};
+
+/* -------------------------------------------------------------------------- */
+
+static inline unsigned char rippers_fold(unsigned char ch) {
+	return (ch >= 'A' && ch <= 'Z') ? (unsigned char)(ch + 'a' - 'A') : ch;
+}
+
+static void rippers_insert(struct rippers *r, const char *s, size_t len) {
+	int state = 0;
+
+	for (size_t i = len; i-- > 0;) {
+		int c = r->class_of[rippers_fold((unsigned char)s[i])];
+		uint16_t *slot = &r->next[state * r->classes + c];
+		if (!*slot) {
+			if (r->states == RIPPERS_MAX_STATES)
+				return;
+			*slot = (uint16_t)r->states++;
+		}
+		state = *slot;
+	}
+	r->accept[state] = 1;
+}
+
+/*
+ * Compile the rippers file, one ripper per line.
+ * Returns NULL if the file can't be read or has no rippers.
+ */
+struct rippers *rippers_load(const char *filename) {
+	struct rippers *r;
+	char **lines = NULL;
+	size_t count = 0;
+	size_t alloc = 0;
+	size_t total = 0;
+	char buf[255];
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f)
+		return NULL;
+	while (fgets(buf, sizeof(buf), f)) {
+		chop(buf);
+		if (!buf[0])
+			continue;
+		if (count == alloc) {
+			char **grown;
+			alloc = alloc ? alloc * 2 : 256;
+			grown = realloc(lines, alloc * sizeof(*lines));
+			if (!grown)
+				break;
+			lines = grown;
+		}
+		lines[count] = strdup(buf);
+		if (!lines[count])
+			break;
+		total += strlen(buf);
+		count++;
+	}
+	fclose(f);
+
+	r = count ? calloc(1, sizeof(*r)) : NULL;
+	if (r) {
+		/* Class 0 is "not in any ripper" */
+		r->classes = 1;
+		for (size_t i = 0; i < count; i++) {
+			for (const char *p = lines[i]; *p; p++) {
+				unsigned char ch = rippers_fold((unsigned char)*p);
+				if (!r->class_of[ch])
+					r->class_of[ch] = (unsigned char)r->classes++;
+			}
+		}
+		for (int ch = 'A'; ch <= 'Z'; ch++)
+			r->class_of[ch] = r->class_of[ch + 'a' - 'A'];
+
+		/* The trie has at most one state per ripper character, plus the root */
+		if (total + 1 > RIPPERS_MAX_STATES)
+			total = RIPPERS_MAX_STATES - 1;
+		r->next = calloc((total + 1) * (size_t)r->classes, sizeof(*r->next));
+		r->accept = calloc(total + 1, 1);
+		r->states = 1;
+		if (!r->next || !r->accept) {
+			rippers_free(r);
+			r = NULL;
+		} else {
+			for (size_t i = 0; i < count; i++)
+				rippers_insert(r, lines[i], strlen(lines[i]));
+			if (r->states == RIPPERS_MAX_STATES)
+				fprintf(stderr, "\nrippers: '%s' is too large, entries ignored\n",
+				    filename);
+		}
+	}
+
+	for (size_t i = 0; i < count; i++)
+		free(lines[i]);
+	free(lines);
+	return r;
+}
+
+void rippers_free(struct rippers *r) {
+	if (!r)
+		return;
+	free(r->next);
+	free(r->accept);
+	free(r);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Length of the longest ripper that s ends with, 0 if none.
+ * A ripper never matches the whole string, something must be left.
+ *
+ * map translates each byte of s before matching, for callers that
+ * rewrite characters while copying the string elsewhere.
+ */
+size_t rippers_match_mapped(
+    const struct rippers *r, const char *s, size_t len, const unsigned char map[256]) {
+	size_t best = 0;
+	int state = 0;
+
+	if (!r)
+		return 0;
+	for (size_t i = len; i-- > 1;) {
+		int c = r->class_of[map[(unsigned char)s[i]]];
+		if (!c)
+			break;
+		state = r->next[state * r->classes + c];
+		if (!state)
+			break;
+		if (r->accept[state])
+			best = len - i;
+	}
+	return best;
+}
+
+size_t rippers_match(const struct rippers *r, const char *s, size_t len) {
+	static const unsigned char identity[256] = {
+		RIPPERS_MAP_ID16(0x00), RIPPERS_MAP_ID16(0x10), RIPPERS_MAP_ID16(0x20),
+		RIPPERS_MAP_ID16(0x30), RIPPERS_MAP_ID16(0x40), RIPPERS_MAP_ID16(0x50),
+		RIPPERS_MAP_ID16(0x60), RIPPERS_MAP_ID16(0x70), RIPPERS_MAP_ID16(0x80),
+		RIPPERS_MAP_ID16(0x90), RIPPERS_MAP_ID16(0xa0), RIPPERS_MAP_ID16(0xb0),
+		RIPPERS_MAP_ID16(0xc0), RIPPERS_MAP_ID16(0xd0), RIPPERS_MAP_ID16(0xe0),
+		RIPPERS_MAP_ID16(0xf0)
+	};
+
+	return rippers_match_mapped(r, s, len, identity);
+}
+
+/* Strip the trailing XXXX from the string AAAAAXXXX */
+void rippers_strip(const struct rippers *r, char *s) {
+	size_t len = strlen(s);
+	size_t match = rippers_match(r, s, len);
+
+	if (match)
+		s[len - match] = '\0';
+}
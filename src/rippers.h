@@ -0,0 +1,24 @@
+#pragma once
+
+// System headers
+#include <stddef.h>
+
+/*
+ * The rippers file lists tags that rippers append to names, like
+ * "-xmr" or " (320 Kbps)". They are compiled into an immutable
+ * matcher that can be shared by any number of threads.
+ */
+struct rippers;
+
+struct rippers *rippers_load(const char *filename);
+void rippers_free(struct rippers *r);
+size_t rippers_match(const struct rippers *r, const char *s, size_t len);
+size_t rippers_match_mapped(
+    const struct rippers *r, const char *s, size_t len, const unsigned char map[256]);
+void rippers_strip(const struct rippers *r, char *s);
+
+/* Initialisers of a map for rippers_match_mapped(), bytes n to n + 15 as they are */
+#define RIPPERS_MAP_ID4(n) (n), (n) + 1, (n) + 2, (n) + 3
+#define RIPPERS_MAP_ID16(n)                                                                        \
+	RIPPERS_MAP_ID4(n), RIPPERS_MAP_ID4((n) + 4), RIPPERS_MAP_ID4((n) + 8),                    \
+	    RIPPERS_MAP_ID4((n) + 12)
@@ -0,0 +1,332 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * snapshot.c - Memory mappable copy of the library
+ *
+ * glaciera-indexer writes the whole library, in the order glaciera
+ * shows it, to one file in the cache directory:
+ *
+ *   header        magic, format, generation, offsets, qsearch ranges
+ *   directories   pool offset of each directory path, by database id
+ *   entries       directory id, file, display and search offsets
+ *   tuneinfo      struct tuneinfo as the compiler lays it out
+ *   string pool   NUL terminated strings, the directories and then
+ *                 entry after entry
+ *
+ * Every directory path is stored once, an entry only has the file name,
+ * see db_get_dir_paths(). glaciera maps it read-only instead of reading every track out of
+ * SQLite and copying its strings, so sessions running at the same time
+ * share the pages. The file is only used when its generation is the
+ * one stored in the database, see db_get_generation(). A new snapshot
+ * is renamed over the old one, sessions that mapped the old one keep
+ * it until they exit.
+ *
+ * The tuneinfo array and the offsets are in the byte order and layout
+ * of the machine that wrote them. A snapshot from another build is
+ * rejected by the header check and glaciera reads the database.
+ */
+
+// System headers
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Local headers
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "GLACSNAP"
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t version;
+	uint32_t tuneinfo_size;
+	uint32_t count;
+	uint64_t generation;
+	uint64_t file_size;
+	uint64_t dir_count;
+	uint64_t dirs_offset;
+	uint64_t entries_offset;
+	uint64_t info_offset;
+	uint64_t pool_offset;
+	uint64_t pool_size;
+	struct snapshot_range qsearch[256];
+};
+
+/* -------------------------------------------------------------------------- */
+
+static uint64_t snapshot_align(uint64_t v) {
+	return (v + 7) & ~(uint64_t)7;
+}
+
+static bool snapshot_header_ok(const struct snapshot_header *h) {
+	return memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) == 0
+	    && h->byte_order == SNAPSHOT_BYTE_ORDER && h->version == SNAPSHOT_VERSION
+	    && h->tuneinfo_size == sizeof(struct tuneinfo);
+}
+
+static bool snapshot_write_pad(FILE *fp, uint64_t from, uint64_t to) {
+	static const char zeros[8];
+
+	return to == from || fwrite(zeros, 1, to - from, fp) == to - from;
+}
+
+/* Directory id of a track in dirs, 0 when it is not in there */
+static uint32_t snapshot_track_dir(const struct db_track *track, char **dirs, int dir_count) {
+	if (track->dir_id > 0 && track->dir_id < dir_count && dirs[track->dir_id])
+		return (uint32_t)track->dir_id;
+	return 0;
+}
+
+/* The file name when the directory is in the snapshot, otherwise the whole path */
+static const char *snapshot_track_file(const struct db_track *track, uint32_t dir) {
+	return dir ? track->filename : track->filepath;
+}
+
+/*
+ * Write count tracks, in the order given, to a temporary file and
+ * rename it to path. dirs is a db_get_dir_paths() table. Returns
+ * false, and leaves path alone, on error.
+ */
+bool snapshot_write(const char *path, uint64_t generation, char **dirs, int dir_count,
+    struct db_track **tracks, int count) {
+	struct snapshot_header h = { 0 };
+	char tmp[1024];
+	uint64_t pool = 0;
+	FILE *fp;
+	bool ok;
+
+	if (!dirs)
+		dir_count = 0;
+
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.byte_order = SNAPSHOT_BYTE_ORDER;
+	h.version = SNAPSHOT_VERSION;
+	h.tuneinfo_size = sizeof(struct tuneinfo);
+	h.count = (uint32_t)count;
+	h.generation = generation;
+	h.dir_count = dir_count > 0 ? dir_count : 1;
+	h.dirs_offset = sizeof(h);
+	h.entries_offset = snapshot_align(h.dirs_offset + h.dir_count * sizeof(uint32_t));
+	h.info_offset = snapshot_align(h.entries_offset + count * sizeof(struct snapshot_entry));
+	h.pool_offset = snapshot_align(h.info_offset + count * sizeof(struct tuneinfo));
+
+	for (int i = 0; i < 256; i++) {
+		h.qsearch[i].lo = -1;
+		h.qsearch[i].hi = -1;
+	}
+	for (int i = 1; i < dir_count; i++) {
+		if (dirs[i])
+			pool += strlen(dirs[i]) + 1;
+	}
+	for (int i = 0; i < count; i++) {
+		int ch = (unsigned char)tracks[i]->search_text[0];
+		uint32_t dir = snapshot_track_dir(tracks[i], dirs, dir_count);
+
+		if (h.qsearch[ch].lo == -1)
+			h.qsearch[ch].lo = i;
+		h.qsearch[ch].hi = i + 1;
+		pool += strlen(snapshot_track_file(tracks[i], dir))
+		    + strlen(tracks[i]->display_name) + strlen(tracks[i]->search_text) + 3;
+	}
+	if (pool > UINT32_MAX) {
+		fprintf(stderr, "Library too large for a snapshot\n");
+		return false;
+	}
+	h.pool_size = pool;
+	h.file_size = h.pool_offset + pool;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+	fp = fopen(tmp, "wb");
+	if (!fp) {
+		perror(tmp);
+		return false;
+	}
+
+	ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+
+	pool = 0;
+	for (uint64_t i = 0; ok && i < h.dir_count; i++) {
+		uint32_t offset = SNAPSHOT_NO_DIR;
+
+		if (i > 0 && dirs[i]) {
+			offset = (uint32_t)pool;
+			pool += strlen(dirs[i]) + 1;
+		}
+		ok = fwrite(&offset, sizeof(offset), 1, fp) == 1;
+	}
+	ok = ok
+	    && snapshot_write_pad(
+		fp, h.dirs_offset + h.dir_count * sizeof(uint32_t), h.entries_offset);
+
+	for (int i = 0; ok && i < count; i++) {
+		struct snapshot_entry e;
+
+		e.dir = snapshot_track_dir(tracks[i], dirs, dir_count);
+		e.file = (uint32_t)pool;
+		pool += strlen(snapshot_track_file(tracks[i], e.dir)) + 1;
+		e.display = (uint32_t)pool;
+		pool += strlen(tracks[i]->display_name) + 1;
+		e.search = (uint32_t)pool;
+		pool += strlen(tracks[i]->search_text) + 1;
+		ok = fwrite(&e, sizeof(e), 1, fp) == 1;
+	}
+	ok = ok
+	    && snapshot_write_pad(
+		fp, h.entries_offset + count * sizeof(struct snapshot_entry), h.info_offset);
+
+	/* Field by field, so the padding is written as zeros */
+	for (int i = 0; ok && i < count; i++) {
+		struct tuneinfo ti;
+
+		memset(&ti, 0, sizeof(ti));
+		ti.filesize = tracks[i]->ti.filesize;
+		ti.filedate = tracks[i]->ti.filedate;
+		ti.duration = tracks[i]->ti.duration;
+		ti.bitrate = tracks[i]->ti.bitrate;
+		ti.genre = tracks[i]->ti.genre;
+		ti.rating = tracks[i]->ti.rating;
+		ti.format = tracks[i]->ti.format;
+		ok = fwrite(&ti, sizeof(ti), 1, fp) == 1;
+	}
+	ok = ok
+	    && snapshot_write_pad(
+		fp, h.info_offset + count * sizeof(struct tuneinfo), h.pool_offset);
+
+	for (int i = 1; ok && i < dir_count; i++) {
+		if (dirs[i])
+			ok = fwrite(dirs[i], strlen(dirs[i]) + 1, 1, fp) == 1;
+	}
+
+	/* Display strings in ascending addresses, sort_ARG_NORMAL() relies on it */
+	for (int i = 0; ok && i < count; i++) {
+		uint32_t dir = snapshot_track_dir(tracks[i], dirs, dir_count);
+		const char *file = snapshot_track_file(tracks[i], dir);
+
+		ok = fwrite(file, strlen(file) + 1, 1, fp) == 1
+		    && fwrite(tracks[i]->display_name, strlen(tracks[i]->display_name) + 1, 1, fp)
+			== 1
+		    && fwrite(tracks[i]->search_text, strlen(tracks[i]->search_text) + 1, 1, fp)
+			== 1;
+	}
+
+	if (fclose(fp) != 0)
+		ok = false;
+	if (ok && rename(tmp, path) != 0) {
+		perror(path);
+		ok = false;
+	}
+	if (!ok) {
+		fprintf(stderr, "Failed to write snapshot %s\n", path);
+		unlink(tmp);
+	}
+	return ok;
+}
+
+/* Generation of the snapshot at path, 0 if there is none that fits this build */
+uint64_t snapshot_generation(const char *path) {
+	struct snapshot_header h;
+	int fd = open(path, O_RDONLY);
+	bool ok;
+
+	if (fd == -1)
+		return 0;
+	ok = read(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) && snapshot_header_ok(&h);
+	close(fd);
+	return ok ? h.generation : 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static bool snapshot_valid(const struct snapshot_header *h, size_t size) {
+	const char *base = (const char *)h;
+	const struct snapshot_entry *entries;
+	const uint32_t *dirs;
+
+	if (h->file_size != size || h->pool_size == 0 || h->dir_count == 0
+	    || h->dir_count > UINT32_MAX || h->dirs_offset < sizeof(*h)
+	    || h->dirs_offset + h->dir_count * sizeof(uint32_t) > h->entries_offset
+	    || h->entries_offset + (uint64_t)h->count * sizeof(struct snapshot_entry)
+		> h->info_offset
+	    || h->info_offset + (uint64_t)h->count * sizeof(struct tuneinfo) > h->pool_offset
+	    || h->pool_offset + h->pool_size != size || base[size - 1] != '\0')
+		return false;
+
+	for (int i = 0; i < 256; i++) {
+		if (h->qsearch[i].lo < -1 || h->qsearch[i].hi > (int64_t)h->count
+		    || h->qsearch[i].lo > h->qsearch[i].hi)
+			return false;
+	}
+
+	/* Every string ends at the latest with the pool */
+	dirs = (const uint32_t *)(base + h->dirs_offset);
+	if (dirs[0] != SNAPSHOT_NO_DIR)
+		return false;
+	for (uint64_t i = 1; i < h->dir_count; i++) {
+		if (dirs[i] != SNAPSHOT_NO_DIR && dirs[i] >= h->pool_size)
+			return false;
+	}
+	entries = (const struct snapshot_entry *)(base + h->entries_offset);
+	for (uint32_t i = 0; i < h->count; i++) {
+		if (entries[i].dir >= h->dir_count
+		    || (entries[i].dir && dirs[entries[i].dir] == SNAPSHOT_NO_DIR)
+		    || entries[i].file >= h->pool_size || entries[i].display >= h->pool_size
+		    || entries[i].search >= h->pool_size)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Map the snapshot at path if it was written for generation. The
+ * mapping is shared and read-only, so are the strings and tuneinfo.
+ */
+bool snapshot_open(const char *path, uint64_t generation, struct snapshot *snap) {
+	const struct snapshot_header *h;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (generation == 0)
+		return false;
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return false;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*h)) {
+		close(fd);
+		return false;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	h = map;
+	if (!snapshot_header_ok(h) || h->generation != generation
+	    || !snapshot_valid(h, st.st_size)) {
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	snap->map = map;
+	snap->size = st.st_size;
+	snap->count = h->count;
+	snap->dir_count = (uint32_t)h->dir_count;
+	snap->dirs = (const uint32_t *)((const char *)map + h->dirs_offset);
+	snap->entries = (const struct snapshot_entry *)((const char *)map + h->entries_offset);
+	snap->info = (const struct tuneinfo *)((const char *)map + h->info_offset);
+	snap->pool = (const char *)map + h->pool_offset;
+	snap->qsearch = h->qsearch;
+	return true;
+}
+
+void snapshot_close(struct snapshot *snap) {
+	if (snap->map)
+		munmap(snap->map, snap->size);
+	memset(snap, 0, sizeof(*snap));
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+// System headers
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Local headers
+#include "common.h"
+#include "db.h"
+
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_NO_DIR UINT32_MAX /* in the directory table, no directory has the id */
+
+/* A directory id and offsets into the string pool of a snapshot */
+struct snapshot_entry {
+	uint32_t dir; /* 0 when file is the whole path */
+	uint32_t file;
+	uint32_t display;
+	uint32_t search;
+};
+
+/* Tunes whose search text starts with one byte, -1 when there are none */
+struct snapshot_range {
+	int32_t lo;
+	int32_t hi;
+};
+
+/* A mapped snapshot, everything points into the read-only mapping */
+struct snapshot {
+	void *map;
+	size_t size;
+	uint32_t count;
+	uint32_t dir_count;
+	const uint32_t *dirs; /* pool offsets of the directory paths, by id */
+	const struct snapshot_entry *entries; /* display name order */
+	const struct tuneinfo *info; /* one per entry */
+	const char *pool;
+	const struct snapshot_range *qsearch; /* 256 ranges */
+};
+
+bool snapshot_write(const char *path, uint64_t generation, char **dirs, int dir_count,
+    struct db_track **tracks, int count);
+uint64_t snapshot_generation(const char *path);
+bool snapshot_open(const char *path, uint64_t generation, struct snapshot *snap);
+void snapshot_close(struct snapshot *snap);
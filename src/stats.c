@@ -0,0 +1,373 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * stats.c - Indexer counters, latency histograms and reports
+ *
+ * Every scanned root has its own counters and histograms, written only
+ * by the thread that scans it, so recording needs neither locks nor
+ * atomic read-modify-write: a counter is bumped with a relaxed load and
+ * store that the reporter thread can read at any time. The histograms
+ * are summed over all roots once the scan threads have been joined.
+ *
+ * Progress used to be printed from a SIGALRM handler, which called
+ * stdio from signal context and read the counters while other threads
+ * were changing them. It now comes from a reporter thread.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+// System headers
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Local headers
+#include "stats.h"
+
+#define STATS_MAX_ROOTS 100
+
+static struct stats_root *roots[STATS_MAX_ROOTS];
+static _Atomic int root_count;
+
+/* Samples recorded outside of any root, like the final commit */
+static struct stats_root other;
+
+static uint64_t scan_start_ns;
+
+static pthread_t reporter;
+static pthread_mutex_t reporter_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reporter_cond = PTHREAD_COND_INITIALIZER;
+static bool reporter_running;
+static bool reporter_stop;
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t stats_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Single writer, so a plain load and store is enough */
+static void stats_add(_Atomic uint64_t *counter, uint64_t n) {
+	atomic_store_explicit(
+	    counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static uint64_t stats_get(_Atomic uint64_t *counter) {
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int stats_bucket(uint64_t ns) {
+	int msb = 63 - __builtin_clzll(ns | 1);
+
+	if (ns < 8)
+		return (int)ns;
+	return (msb - 2) * 8 + (int)((ns >> (msb - 3)) & 7);
+}
+
+static uint64_t stats_bucket_ns(int bucket) {
+	if (bucket < 8)
+		return (uint64_t)bucket;
+	return (uint64_t)(8 + bucket % 8) << (bucket / 8 - 1);
+}
+
+static void stats_hist_add(struct stats_hist *h, uint64_t ns) {
+	h->count++;
+	h->total_ns += ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->buckets[stats_bucket(ns)]++;
+}
+
+static void stats_hist_merge(struct stats_hist *to, const struct stats_hist *from) {
+	to->count += from->count;
+	to->total_ns += from->total_ns;
+	if (from->max_ns > to->max_ns)
+		to->max_ns = from->max_ns;
+	for (int i = 0; i < STATS_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+}
+
+/* Lower bound of the bucket holding the given fraction of the samples */
+static uint64_t stats_percentile(const struct stats_hist *h, double fraction) {
+	uint64_t want = (uint64_t)((double)h->count * fraction);
+	uint64_t seen = 0;
+
+	if (!h->count)
+		return 0;
+	if (want >= h->count)
+		want = h->count - 1;
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > want)
+			return stats_bucket_ns(i);
+	}
+	return h->max_ns;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Called from the main thread, before the root's scan thread starts.
+ * Returns NULL when there are too many roots or no memory.
+ */
+struct stats_root *stats_add_root(const char *path) {
+	int n = atomic_load(&root_count);
+	struct stats_root *r;
+
+	if (!scan_start_ns)
+		scan_start_ns = stats_now();
+	if (n == STATS_MAX_ROOTS)
+		return NULL;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->path = strdup(path);
+	if (!r->path) {
+		free(r);
+		return NULL;
+	}
+	r->start_ns = stats_now();
+	roots[n] = r;
+	atomic_store(&root_count, n + 1);
+	return r;
+}
+
+void stats_root_done(struct stats_root *r) {
+	atomic_store_explicit(&r->end_ns, stats_now(), memory_order_relaxed);
+}
+
+void stats_record(struct stats_root *r, enum stats_stage stage, uint64_t start_ns) {
+	stats_hist_add(&(r ? r : &other)->stage[stage], stats_now() - start_ns);
+}
+
+void stats_count_file(struct stats_root *r, uint64_t bytes) {
+	stats_add(&r->files, 1);
+	stats_add(&r->bytes, bytes);
+}
+
+void stats_count_new_file(struct stats_root *r) {
+	stats_add(&r->new_files, 1);
+}
+
+void stats_totals(uint64_t *files, uint64_t *new_files, uint64_t *bytes) {
+	int n = atomic_load(&root_count);
+
+	*files = *new_files = *bytes = 0;
+	for (int i = 0; i < n; i++) {
+		*files += stats_get(&roots[i]->files);
+		*new_files += stats_get(&roots[i]->new_files);
+		*bytes += stats_get(&roots[i]->bytes);
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void stats_report_progress(uint64_t *prev_files, uint64_t *prev_bytes) {
+	uint64_t files, new_files, bytes;
+	uint64_t megdiff;
+	const char *suffix = "MB";
+
+	stats_totals(&files, &new_files, &bytes);
+	megdiff = (bytes - *prev_bytes) / 1024 / 1024;
+	if (megdiff > 1024) {
+		megdiff /= 1024;
+		suffix = "GB";
+	}
+
+	fprintf(stderr, "\rTotal files: %8llu  new files: %8llu (%5llu/sec %6llu%s/sec)",
+	    (unsigned long long)files, (unsigned long long)new_files,
+	    (unsigned long long)(files - *prev_files), (unsigned long long)megdiff, suffix);
+	fflush(stderr);
+	*prev_files = files;
+	*prev_bytes = bytes;
+}
+
+static void *stats_reporter(void *arg) {
+	uint64_t prev_files = 0;
+	uint64_t prev_bytes = 0;
+	struct timespec deadline;
+
+	(void)arg;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	pthread_mutex_lock(&reporter_mutex);
+	while (!reporter_stop) {
+		deadline.tv_sec++;
+		while (!reporter_stop
+		    && pthread_cond_timedwait(&reporter_cond, &reporter_mutex, &deadline)
+			!= ETIMEDOUT)
+			;
+		if (!reporter_stop)
+			stats_report_progress(&prev_files, &prev_bytes);
+	}
+	pthread_mutex_unlock(&reporter_mutex);
+	return NULL;
+}
+
+bool stats_start_reporter(void) {
+	reporter_stop = false;
+	reporter_running = pthread_create(&reporter, NULL, &stats_reporter, NULL) == 0;
+	return reporter_running;
+}
+
+void stats_stop_reporter(void) {
+	if (!reporter_running)
+		return;
+	pthread_mutex_lock(&reporter_mutex);
+	reporter_stop = true;
+	pthread_cond_signal(&reporter_cond);
+	pthread_mutex_unlock(&reporter_mutex);
+	pthread_join(reporter, NULL);
+	reporter_running = false;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static const char *stage_names[STATS_STAGE_COUNT] = {
+	[STATS_READDIR] = "readdir",
+	[STATS_STAT] = "stat",
+	[STATS_PROBE] = "probe",
+	[STATS_DISPLAY] = "display",
+	[STATS_DB_WRITE] = "db_write",
+	[STATS_COMMIT] = "commit",
+};
+
+static void json_string(FILE *f, const char *s) {
+	fputc('"', f);
+	for (; *s; s++) {
+		unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+static double per_second(uint64_t n, uint64_t ns) {
+	return ns ? (double)n * 1e9 / (double)ns : 0.0;
+}
+
+static void stats_merge_stages(struct stats_hist all[STATS_STAGE_COUNT]) {
+	int n = atomic_load(&root_count);
+
+	memset(all, 0, sizeof(struct stats_hist) * STATS_STAGE_COUNT);
+	for (int s = 0; s < STATS_STAGE_COUNT; s++) {
+		stats_hist_merge(&all[s], &other.stage[s]);
+		for (int i = 0; i < n; i++)
+			stats_hist_merge(&all[s], &roots[i]->stage[s]);
+	}
+}
+
+/* The final report as a table, for --bench and --dry-run */
+void stats_print_report(FILE *f) {
+	struct stats_hist all[STATS_STAGE_COUNT];
+	uint64_t files, new_files, bytes;
+	uint64_t elapsed = scan_start_ns ? stats_now() - scan_start_ns : 0;
+
+	stats_merge_stages(all);
+	stats_totals(&files, &new_files, &bytes);
+
+	fprintf(f, "\n%-10s %10s %12s %10s %10s %10s\n", "stage", "count", "total ms", "p50 us",
+	    "p99 us", "max us");
+	for (int s = 0; s < STATS_STAGE_COUNT; s++) {
+		const struct stats_hist *h = &all[s];
+		fprintf(f, "%-10s %10llu %12.1f %10.1f %10.1f %10.1f\n", stage_names[s],
+		    (unsigned long long)h->count, (double)h->total_ns / 1e6,
+		    (double)stats_percentile(h, 0.50) / 1e3,
+		    (double)stats_percentile(h, 0.99) / 1e3, (double)h->max_ns / 1e3);
+	}
+	fprintf(f, "%llu files, %.1f MB in %.3f s: %.1f files/s, %.1f MB/s\n",
+	    (unsigned long long)files, (double)bytes / 1048576.0, (double)elapsed / 1e9,
+	    per_second(files, elapsed), per_second(bytes, elapsed) / 1048576.0);
+}
+
+/*
+ * The final report, meant to be read by scripts. Call it after the
+ * scan threads have been joined. Times are in microseconds unless the
+ * key says otherwise.
+ */
+bool stats_write_json(const char *filename) {
+	struct stats_hist all[STATS_STAGE_COUNT];
+	uint64_t files, new_files, bytes;
+	uint64_t elapsed = scan_start_ns ? stats_now() - scan_start_ns : 0;
+	int n = atomic_load(&root_count);
+	FILE *f;
+
+	f = fopen(filename, "w");
+	if (!f) {
+		fprintf(stderr, "Cannot write stats to '%s'\n", filename);
+		return false;
+	}
+
+	stats_merge_stages(all);
+	stats_totals(&files, &new_files, &bytes);
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"elapsed_s\": %.3f,\n", (double)elapsed / 1e9);
+	fprintf(f, "  \"files\": %llu,\n", (unsigned long long)files);
+	fprintf(f, "  \"new_files\": %llu,\n", (unsigned long long)new_files);
+	fprintf(f, "  \"bytes\": %llu,\n", (unsigned long long)bytes);
+	fprintf(f, "  \"files_per_s\": %.1f,\n", per_second(files, elapsed));
+	fprintf(f, "  \"bytes_per_s\": %.1f,\n", per_second(bytes, elapsed));
+
+	fprintf(f, "  \"stages\": {\n");
+	for (int s = 0; s < STATS_STAGE_COUNT; s++) {
+		const struct stats_hist *h = &all[s];
+		fprintf(f,
+		    "    \"%s\": { \"count\": %llu, \"total_ms\": %.3f, \"p50_us\": %.3f, "
+		    "\"p99_us\": %.3f, \"max_us\": %.3f }%s\n",
+		    stage_names[s], (unsigned long long)h->count, (double)h->total_ns / 1e6,
+		    (double)stats_percentile(h, 0.50) / 1e3,
+		    (double)stats_percentile(h, 0.99) / 1e3, (double)h->max_ns / 1e3,
+		    s + 1 < STATS_STAGE_COUNT ? "," : "");
+	}
+	fprintf(f, "  },\n");
+
+	fprintf(f, "  \"roots\": [\n");
+	for (int i = 0; i < n; i++) {
+		struct stats_root *r = roots[i];
+		uint64_t end = stats_get(&r->end_ns);
+		uint64_t root_elapsed = (end ? end : stats_now()) - r->start_ns;
+
+		fprintf(f, "    { \"path\": ");
+		json_string(f, r->path);
+		fprintf(f,
+		    ", \"files\": %llu, \"new_files\": %llu, \"bytes\": %llu, "
+		    "\"elapsed_s\": %.3f, \"files_per_s\": %.1f }%s\n",
+		    (unsigned long long)stats_get(&r->files),
+		    (unsigned long long)stats_get(&r->new_files),
+		    (unsigned long long)stats_get(&r->bytes), (double)root_elapsed / 1e9,
+		    per_second(stats_get(&r->files), root_elapsed), i + 1 < n ? "," : "");
+	}
+	fprintf(f, "  ]\n");
+	fprintf(f, "}\n");
+
+	if (fclose(f) != 0) {
+		fprintf(stderr, "Cannot write stats to '%s'\n", filename);
+		return false;
+	}
+	return true;
+}
+
+void stats_free(void) {
+	int n = atomic_load(&root_count);
+
+	for (int i = 0; i < n; i++) {
+		free(roots[i]->path);
+		free(roots[i]);
+		roots[i] = NULL;
+	}
+	atomic_store(&root_count, 0);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+// System headers
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Indexer stages that get a latency histogram */
+enum stats_stage {
+	STATS_READDIR,
+	STATS_STAT,
+	STATS_PROBE, /* music_info() and music_metadata(), one sample per call */
+	STATS_DISPLAY,
+	STATS_DB_WRITE,
+	STATS_COMMIT,
+	STATS_STAGE_COUNT
+};
+
+/*
+ * Log-linear buckets: 8 per power of two from 8 ns up, so a percentile
+ * read back from a histogram is within 12.5% of the real value.
+ */
+#define STATS_BUCKETS 496
+
+struct stats_hist {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+/*
+ * One per scanned root, written by the one thread that scans it. The
+ * counters are atomics so the reporter can read them while the scan
+ * runs; the histograms are only read after the threads are joined.
+ */
+struct stats_root {
+	char *path;
+	uint64_t start_ns;
+	_Atomic uint64_t end_ns;
+	_Atomic uint64_t files;
+	_Atomic uint64_t new_files;
+	_Atomic uint64_t bytes;
+	struct stats_hist stage[STATS_STAGE_COUNT];
+};
+
+uint64_t stats_now(void);
+struct stats_root *stats_add_root(const char *path);
+void stats_root_done(struct stats_root *r);
+void stats_record(struct stats_root *r, enum stats_stage stage, uint64_t start_ns);
+void stats_count_file(struct stats_root *r, uint64_t bytes);
+void stats_count_new_file(struct stats_root *r);
+void stats_totals(uint64_t *files, uint64_t *new_files, uint64_t *bytes);
+
+bool stats_start_reporter(void);
+void stats_stop_reporter(void);
+void stats_print_report(FILE *f);
+bool stats_write_json(const char *filename);
+void stats_free(void);
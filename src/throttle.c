@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * throttle.c - Playback friendly indexing
+ *
+ * When the indexer runs on the machine that plays the music, it
+ * competes with the player for the disk and playback stutters. So
+ * while a player holds the database (see db_player_running()):
+ *
+ * - each scan thread sets its I/O class with ioprio_set() and may
+ *   switch itself to SCHED_IDLE,
+ * - files and bytes per second are capped per device with token
+ *   buckets shared by all threads scanning that device.
+ *
+ * The player check is repeated every few seconds, so a scan started
+ * with glaciera closed speeds up or slows down as it comes and goes.
+ * Bytes are what the thread actually read from storage during a file
+ * (read_bytes in /proc/thread-self/io), or the file size when that is
+ * not available.
+ */
+
+/* SCHED_IDLE and syscall() */
+#define _GNU_SOURCE
+
+// System headers
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Local headers
+#include "config.h"
+#include "db.h"
+#include "throttle.h"
+
+#define THROTTLE_MAX_DEVICES 32
+#define THROTTLE_CHECK_NS (3 * 1000000000ULL)
+
+/* From linux/ioprio.h */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_NONE 0
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+struct throttle_bucket {
+	dev_t dev;
+	pthread_mutex_t mutex;
+	uint64_t last_ns;
+	double files; /* tokens, may go negative */
+	double bytes;
+};
+
+static struct throttle_bucket buckets[THROTTLE_MAX_DEVICES];
+static int bucket_count;
+static pthread_mutex_t buckets_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *player_db_path;
+static int io_class = IOPRIO_CLASS_BE;
+static int io_priority = 7;
+static bool sched_idle;
+static double max_bytes; /* per second, 0 = no limit */
+static double max_files;
+
+/* Generation of the player state, odd while a player runs */
+static _Atomic unsigned int player_state;
+static _Atomic uint64_t next_check_ns;
+
+/* What this thread last applied, and its read_bytes before the file */
+static _Thread_local unsigned int applied_state = ~0U;
+static _Thread_local bool charging;
+static _Thread_local uint64_t read_start;
+static _Thread_local int io_fd = -2;
+
+/* -------------------------------------------------------------------------- */
+
+static uint64_t throttle_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void throttle_check_player(void) {
+	uint64_t now = throttle_now();
+	uint64_t due = atomic_load_explicit(&next_check_ns, memory_order_relaxed);
+	unsigned int state;
+	bool running;
+
+	/* One thread does the check, the others go on */
+	if (now < due
+	    || !atomic_compare_exchange_strong(&next_check_ns, &due, now + THROTTLE_CHECK_NS))
+		return;
+
+	running = db_player_running(player_db_path);
+	state = atomic_load(&player_state);
+	if (running != (state & 1)) {
+		atomic_store(&player_state, state + 1);
+		fprintf(stderr, "\n%s\n",
+		    running ? "glaciera is running, indexing in the background"
+			    : "glaciera is not running, indexing at full speed");
+	}
+}
+
+/* Set this thread's I/O class and scheduler for the player state */
+static void throttle_apply(bool player) {
+	int prio = IOPRIO_CLASS_NONE << IOPRIO_CLASS_SHIFT;
+	struct sched_param sp = { 0 };
+
+	if (player && io_class == IOPRIO_CLASS_BE)
+		prio = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | io_priority;
+	else if (player && io_class == IOPRIO_CLASS_IDLE)
+		prio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+#ifdef SYS_ioprio_set
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio);
+#endif
+	if (sched_idle)
+		pthread_setschedparam(pthread_self(), player ? SCHED_IDLE : SCHED_OTHER, &sp);
+}
+
+/* Bytes this thread read from storage so far, 0 when unknown */
+static uint64_t throttle_read_bytes(void) {
+	char buf[512];
+	char *p;
+	ssize_t len;
+
+	if (io_fd == -2)
+		io_fd = open("/proc/thread-self/io", O_RDONLY | O_CLOEXEC);
+	if (io_fd == -1)
+		return 0;
+
+	len = pread(io_fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+	p = strstr(buf, "\nread_bytes: ");
+	return p ? strtoull(p + 13, NULL, 10) : 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void throttle_init(const char *db_path) {
+	const char *class = config_get_indexer_io_class();
+
+	player_db_path = db_path;
+	io_priority = config_get_indexer_io_priority();
+	sched_idle = config_get_indexer_sched_idle();
+	max_bytes = (double)config_get_indexer_max_bytes_per_sec();
+	max_files = (double)config_get_indexer_max_files_per_sec();
+
+	if (strcmp(class, "idle") == 0)
+		io_class = IOPRIO_CLASS_IDLE;
+	else if (strcmp(class, "best-effort") == 0)
+		io_class = IOPRIO_CLASS_BE;
+	else if (strcmp(class, "normal") == 0)
+		io_class = IOPRIO_CLASS_NONE;
+	else
+		fprintf(stderr, "Unknown indexer io_class '%s', using best-effort\n", class);
+
+	atomic_store(&player_state, db_player_running(db_path) ? 1 : 0);
+	atomic_store(&next_check_ns, throttle_now() + THROTTLE_CHECK_NS);
+	if (atomic_load(&player_state) & 1)
+		fprintf(stderr, "glaciera is running, indexing in the background\n");
+}
+
+/* The bucket of the device path is on, shared by all threads */
+struct throttle_bucket *throttle_bucket_for(const char *path) {
+	struct throttle_bucket *b = NULL;
+	struct stat ss;
+
+	if (stat(path, &ss) == -1)
+		ss.st_dev = 0;
+
+	pthread_mutex_lock(&buckets_mutex);
+	for (int i = 0; i < bucket_count && !b; i++)
+		if (buckets[i].dev == ss.st_dev)
+			b = &buckets[i];
+	if (!b && bucket_count < THROTTLE_MAX_DEVICES) {
+		b = &buckets[bucket_count++];
+		b->dev = ss.st_dev;
+		pthread_mutex_init(&b->mutex, NULL);
+		b->last_ns = throttle_now();
+		b->files = max_files;
+		b->bytes = max_bytes;
+	}
+	pthread_mutex_unlock(&buckets_mutex);
+	return b; /* NULL: too many devices, not limited */
+}
+
+/*
+ * Wait until the device has budget for another file. Tokens refill at
+ * the configured rate up to one second's worth; a file may overdraw the
+ * byte budget, and the next file then waits for it to be paid back.
+ */
+void throttle_before_file(struct throttle_bucket *b) {
+	unsigned int state;
+	bool player;
+
+	throttle_check_player();
+	state = atomic_load_explicit(&player_state, memory_order_relaxed);
+	player = state & 1;
+	if (state != applied_state) {
+		throttle_apply(player);
+		applied_state = state;
+	}
+
+	if (player && b && (max_files > 0 || max_bytes > 0)) {
+		for (;;) {
+			uint64_t now = throttle_now();
+			double wait = 0;
+
+			pthread_mutex_lock(&b->mutex);
+			double elapsed = (double)(now - b->last_ns) / 1e9;
+			b->last_ns = now;
+			if (max_files > 0) {
+				b->files += elapsed * max_files;
+				if (b->files > max_files)
+					b->files = max_files;
+				if (b->files < 1)
+					wait = (1 - b->files) / max_files;
+			}
+			if (max_bytes > 0) {
+				b->bytes += elapsed * max_bytes;
+				if (b->bytes > max_bytes)
+					b->bytes = max_bytes;
+				if (b->bytes < 0 && -b->bytes / max_bytes > wait)
+					wait = -b->bytes / max_bytes;
+			}
+			if (wait == 0 && max_files > 0)
+				b->files -= 1;
+			pthread_mutex_unlock(&b->mutex);
+
+			if (wait == 0)
+				break;
+			struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	charging = player && b && max_bytes > 0;
+	if (charging)
+		read_start = throttle_read_bytes();
+}
+
+void throttle_after_file(struct throttle_bucket *b, uint64_t filesize) {
+	uint64_t now, used;
+
+	if (!charging)
+		return;
+	now = throttle_read_bytes();
+	used = io_fd >= 0 && now >= read_start ? now - read_start : filesize;
+
+	pthread_mutex_lock(&b->mutex);
+	b->bytes -= (double)used;
+	pthread_mutex_unlock(&b->mutex);
+}
+
+/* Called by each scan thread when it is done */
+void throttle_thread_done(void) {
+	if (io_fd >= 0)
+		close(io_fd);
+	io_fd = -2;
+}
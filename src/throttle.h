@@ -0,0 +1,19 @@
+#pragma once
+
+// System headers
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Keeps the indexer out of the way of playback. While a player is
+ * running the scan threads drop to the configured I/O class (and
+ * SCHED_IDLE), and files are rate limited per device. Without a
+ * player everything runs at full speed.
+ */
+struct throttle_bucket;
+
+void throttle_init(const char *db_path);
+struct throttle_bucket *throttle_bucket_for(const char *path);
+void throttle_before_file(struct throttle_bucket *b);
+void throttle_after_file(struct throttle_bucket *b, uint64_t filesize);
+void throttle_thread_done(void);
@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * writer.c - Background writes of the player
+ *
+ * The player queues its writes (plays, history and cache lines, saved
+ * playlists) instead of doing them on its own thread. Producers copy
+ * their arguments into a job, push it onto a lock-free stack with a
+ * compare-and-swap and post a semaphore. The writer thread wakes on the
+ * first job, waits WRITER_GROUP_MS for more, then takes the whole stack
+ * at once and carries it out in the order the jobs were queued. All
+ * plays of one round go to SQLite in a single transaction, on database
+ * connections of the thread's own, see db_open_writer().
+ *
+ * writer_stop() carries out what is still queued before returning.
+ */
+
+/* sigset_t, pthread_sigmask() and nanosleep() */
+#define _POSIX_C_SOURCE 200809L
+
+// System headers
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Local headers
+#include "db.h"
+#include "writer.h"
+
+#define WRITER_GROUP_MS 200
+
+enum writer_kind {
+	WRITER_PLAY,
+	WRITER_APPEND,
+	WRITER_REPLACE,
+};
+
+struct writer_job {
+	struct writer_job *next;
+	enum writer_kind kind;
+	struct db_play play; /* play.filename is owned by the job */
+	char *path;
+	char *text;
+};
+
+static _Atomic(struct writer_job *) writer_head;
+static atomic_bool writer_quit;
+static sem_t writer_sem;
+static pthread_t writer_thread_id;
+static bool writer_running;
+
+/* -------------------------------------------------------------------------- */
+
+static void writer_free(struct writer_job *job) {
+	free((char *)job->play.filename);
+	free(job->path);
+	free(job->text);
+	free(job);
+}
+
+static void writer_push(struct writer_job *job) {
+	struct writer_job *head = atomic_load(&writer_head);
+
+	do
+		job->next = head;
+	while (!atomic_compare_exchange_weak(&writer_head, &head, job));
+	sem_post(&writer_sem);
+}
+
+/* Without a writer thread, the job is carried out right away */
+static void writer_run_now(struct writer_job *job);
+
+static void writer_queue(struct writer_job *job) {
+	if (writer_running)
+		writer_push(job);
+	else
+		writer_run_now(job);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void writer_file(const struct writer_job *job) {
+	FILE *f = fopen(job->path, job->kind == WRITER_APPEND ? "a" : "w");
+
+	if (f) {
+		fputs(job->text, f);
+		fclose(f);
+	}
+}
+
+/* jobs in the order they were queued */
+static void writer_run(struct writer_job *jobs) {
+	struct db_play *plays = NULL;
+	int count = 0;
+	int allocated = 0;
+
+	for (struct writer_job *job = jobs; job; job = job->next) {
+		if (job->kind != WRITER_PLAY) {
+			writer_file(job);
+			continue;
+		}
+		if (count >= allocated) {
+			struct db_play *p;
+
+			allocated = allocated ? allocated * 2 : 16;
+			p = realloc(plays, allocated * sizeof(*plays));
+			if (!p)
+				break;
+			plays = p;
+		}
+		plays[count++] = job->play;
+	}
+	if (count)
+		db_record_plays(plays, count);
+	free(plays);
+
+	while (jobs) {
+		struct writer_job *next = jobs->next;
+
+		writer_free(jobs);
+		jobs = next;
+	}
+}
+
+static void writer_run_now(struct writer_job *job) {
+	job->next = NULL;
+	writer_run(job);
+}
+
+/* Everything queued so far, oldest first */
+static struct writer_job *writer_take(void) {
+	struct writer_job *job = atomic_exchange(&writer_head, NULL);
+	struct writer_job *jobs = NULL;
+
+	while (job) {
+		struct writer_job *next = job->next;
+
+		job->next = jobs;
+		jobs = job;
+		job = next;
+	}
+	return jobs;
+}
+
+static void *writer_thread(void *arg) {
+	struct timespec group = { 0, WRITER_GROUP_MS * 1000000L };
+	sigset_t set;
+
+	(void)arg;
+	/* The song progress alarm is for the main thread */
+	sigemptyset(&set);
+	sigaddset(&set, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (;;) {
+		while (sem_wait(&writer_sem) == -1 && errno == EINTR)
+			;
+		/* Let the jobs that come with this one join it */
+		if (!atomic_load(&writer_quit)) {
+			while (nanosleep(&group, &group) == -1 && errno == EINTR)
+				;
+			group.tv_nsec = WRITER_GROUP_MS * 1000000L;
+		}
+		/* One post per job, they are all taken now */
+		while (sem_trywait(&writer_sem) == 0)
+			;
+		writer_run(writer_take());
+		if (atomic_load(&writer_quit))
+			break;
+	}
+	return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Without connections for the thread, writes stay on the caller's */
+void writer_start(void) {
+	if (writer_running || !db_open_writer())
+		return;
+	if (sem_init(&writer_sem, 0, 0) != 0) {
+		db_close_writer();
+		return;
+	}
+	writer_running = pthread_create(&writer_thread_id, NULL, &writer_thread, NULL) == 0;
+	if (!writer_running) {
+		sem_destroy(&writer_sem);
+		db_close_writer();
+	}
+}
+
+void writer_play(const struct db_play *play) {
+	struct writer_job *job = calloc(1, sizeof(*job));
+
+	if (!job)
+		return;
+	job->kind = WRITER_PLAY;
+	job->play = *play;
+	job->play.filename = strdup(play->filename);
+	if (!job->play.filename) {
+		free(job);
+		return;
+	}
+	writer_queue(job);
+}
+
+static void writer_file_job(enum writer_kind kind, const char *path, const char *text) {
+	struct writer_job *job = calloc(1, sizeof(*job));
+
+	if (!job)
+		return;
+	job->kind = kind;
+	job->path = strdup(path);
+	job->text = strdup(text);
+	if (!job->path || !job->text) {
+		writer_free(job);
+		return;
+	}
+	writer_queue(job);
+}
+
+/* Add text to the end of the file at path */
+void writer_append(const char *path, const char *text) {
+	writer_file_job(WRITER_APPEND, path, text);
+}
+
+/* Make text the whole content of the file at path */
+void writer_replace(const char *path, const char *text) {
+	writer_file_job(WRITER_REPLACE, path, text);
+}
+
+/* Carry out the queued jobs and stop the thread */
+void writer_stop(void) {
+	if (!writer_running)
+		return;
+	atomic_store(&writer_quit, true);
+	sem_post(&writer_sem);
+	pthread_join(writer_thread_id, NULL);
+	writer_running = false;
+	sem_destroy(&writer_sem);
+	db_close_writer();
+}
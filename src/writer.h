@@ -0,0 +1,18 @@
+#pragma once
+
+// System headers
+#include <stdbool.h>
+
+// Local headers
+#include "db.h"
+
+/*
+ * Writes of the player, done by one background thread so that key
+ * handling never waits on the disk or a database lock. Each call
+ * copies its arguments into a job it allocates and returns at once.
+ */
+void writer_start(void);
+void writer_play(const struct db_play *play);
+void writer_append(const char *path, const char *text);
+void writer_replace(const char *path, const char *text);
+void writer_stop(void);